@@ -0,0 +1,44 @@
+#pragma once
+
+#include <h2o.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Build the admin API responses
+ * @return 0 on success, negative on error
+ */
+int admin_init(void);
+
+/**
+ * Batch ban/unban/whitelist/inspect of IPs.
+ * POST takes a JSON array or NDJSON stream of {"op": "ban|unban|whitelist|inspect", "ip": "...", "duration": N}
+ * objects and answers with one NDJSON result line per operation; GET ?ip=ADDR inspects a single IP
+ */
+int admin_ips_handler(h2o_handler_t *self, h2o_req_t *req);
+
+/**
+ * Stream a consistent snapshot of the IP tracker as NDJSON
+ */
+int admin_export_handler(h2o_handler_t *self, h2o_req_t *req);
+
+/**
+ * POST: re-read the configured TLS certificates, keys and OCSP responses
+ */
+int admin_certs_reload_handler(h2o_handler_t *self, h2o_req_t *req);
+
+/**
+ * POST: rescan the versioned asset directory
+ */
+int admin_assets_reload_handler(h2o_handler_t *self, h2o_req_t *req);
+
+/**
+ * POST: map the GeoIP databases again and swap them in
+ */
+int admin_geoip_reload_handler(h2o_handler_t *self, h2o_req_t *req);
+
+#ifdef __cplusplus
+}
+#endif
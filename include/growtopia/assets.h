@@ -0,0 +1,50 @@
+#pragma once
+
+#include "growtopia/config/server.h"
+#include <h2o.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Map the newest versions of every asset under config->root and hash them.
+ * Layout: <root>/<asset>/<version> for full files (version is a decimal number) and
+ * <root>/<asset>/<from>-<to>.delta for precomputed patches; only patches to the newest
+ * version are served. A missing root is not an error; files and assets that cannot be loaded are
+ * logged and skipped. Files are mapped, so they must be replaced by rename (a new inode), never
+ * rewritten or truncated in place.
+ * @param config Asset configuration (NULL for defaults); the root string must outlive the server
+ * @return 0 on success, negative on error
+ */
+int assets_init(const assets_config_t *config);
+
+/**
+ * Rescan the asset root. Unchanged files keep their mapping and checksum; requests in flight
+ * keep the files they started with.
+ * @return Number of assets served on success, negative on error
+ */
+int assets_reload(void);
+
+/**
+ * Serve an asset.
+ * GET <prefix>/<asset> returns the newest version, or the patch from the client's version with
+ * ?from=N when one exists (an empty patch when N is the newest); GET <prefix>/<asset>/<version>
+ * returns a retained version.
+ * Responses carry a SHA-256 ETag and honour If-None-Match, single byte ranges and If-Range.
+ */
+int assets_handler(h2o_handler_t *self, h2o_req_t *req);
+
+/**
+ * Get asset statistics
+ * @param full Output: complete files sent
+ * @param ranges Output: partial (206) responses
+ * @param deltas Output: patches sent instead of a full file
+ * @param not_modified Output: 304 responses
+ * @param bytes Output: body bytes queued for sending
+ */
+void assets_get_stats(uint64_t *full, uint64_t *ranges, uint64_t *deltas, uint64_t *not_modified, uint64_t *bytes);
+
+#ifdef __cplusplus
+}
+#endif
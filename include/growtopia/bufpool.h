@@ -0,0 +1,55 @@
+#pragma once
+
+#include "growtopia/config/server.h"
+#include <h2o.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Set the cache limit. Must be called once at startup.
+ * @param config Buffer pool configuration (NULL for defaults)
+ * @return 0 on success, negative on error
+ */
+int bufpool_init(const bufpool_config_t *config);
+
+/**
+ * Account the memory of a route's requests and recycle their buffers.
+ *
+ * Registers an h2o logger on the path. h2o runs loggers when a request is disposed, just before its
+ * pool is cleared. The logger records how much of the pool the request used. It also returns buffers
+ * from bufpool_alloc() to the per-thread freelists. No allocation is needed per request.
+ * @param route Name shown in the statistics (must outlive the server)
+ * @return 0 on success, negative on error
+ */
+int bufpool_register_route(h2o_pathconf_t *pathconf, const char *route);
+
+/**
+ * Allocate a buffer that lives as long as the request, like h2o_mem_alloc_pool().
+ *
+ * On registered routes, buffers of 1 KiB to 256 KiB come from per-thread freelists in power-of-two
+ * size classes. After the request they go back to the freelists, so steady traffic does no malloc
+ * or free for them. Smaller sizes, and any size on other routes, come from the request's pool.
+ * @return Buffer of at least size bytes
+ */
+void *bufpool_alloc(h2o_req_t *req, size_t size);
+
+/**
+ * Append one line per registered route: requests, average and largest pool use, and recycled buffer use
+ * @return Bytes written
+ */
+size_t bufpool_format_stats(char *buf, size_t cap);
+
+/**
+ * Get buffer pool statistics
+ * @param hits Output: buffers taken from a freelist
+ * @param misses Output: buffers that had to be allocated (including ones too large to recycle)
+ * @param trimmed Output: returned buffers freed because the cache was full
+ * @param cached_bytes Output: bytes held by the calling thread's freelists
+ */
+void bufpool_get_stats(uint64_t *hits, uint64_t *misses, uint64_t *trimmed, uint64_t *cached_bytes);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,49 @@
+#pragma once
+
+#include "growtopia/config/server.h"
+#include "growtopia/middleware.h"
+#include <h2o.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Set up traffic capture. Nothing is captured until a capture is started through capture_handler.
+ * @param config Capture configuration (NULL for defaults)
+ * @return 0 on success, negative on error
+ */
+int capture_init(const capture_config_t *config);
+
+/**
+ * Record sampled requests into the running capture, if any (see capture_log.h for the format).
+ *
+ * Whole connections are sampled, one in sample_connections, so that replay sees the same connection
+ * reuse. Each record keeps the arrival time, connection id, TLS and resumption flags, method,
+ * authority, path, headers and up to max_body_bytes of the body. Cookie and Authorization headers
+ * are left out. Add first, so requests later stages reject are captured too.
+ *
+ * Records are copied into a queue of queue_bytes that a writer thread drains into the file, so the
+ * loop never waits for the disk. Records that do not fit while the disk is behind are dropped and counted.
+ */
+int middleware_add_capture(middleware_pipeline_t *pipeline);
+
+/**
+ * POST ?seconds=N: start a capture into a new file in the capture directory; DELETE: stop it early.
+ * Files are named capture-<unix time>.gtcap, with -<n> added if that name is taken
+ */
+int capture_handler(h2o_handler_t *self, h2o_req_t *req);
+
+/**
+ * Get capture statistics
+ * @param captures Output: captures started
+ * @param requests Output: requests recorded
+ * @param bytes Output: bytes written
+ * @param dropped Output: sampled requests dropped because the writer was behind
+ * @param active Output: 1 while a capture is running
+ */
+void capture_get_stats(uint64_t *captures, uint64_t *requests, uint64_t *bytes, uint64_t *dropped, int *active);
+
+#ifdef __cplusplus
+}
+#endif
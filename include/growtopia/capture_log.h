@@ -0,0 +1,94 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Capture file layout (all integers little-endian):
+ *
+ *   file header   magic[8] "GTCAP\x01\0\0", u64 start time (ns since the Unix epoch)
+ *   record        u32 length of the rest of the record
+ *                 u64 arrival (ns since the start), u64 connection id
+ *                 u8 flags, u8 reserved, u16 HTTP version
+ *                 u16 method, authority and path lengths, u16 header count
+ *                 u32 captured and original body lengths
+ *                 method, authority, path
+ *                 per header: u16 name length, u16 value length, name, value
+ *                 body
+ */
+
+#define CAPTURE_MAGIC "GTCAP\x01\0\0"
+#define CAPTURE_MAGIC_SIZE 8
+#define CAPTURE_FILE_HEADER_SIZE 16
+#define CAPTURE_MAX_HEADERS 64
+
+#define CAPTURE_FLAG_TLS 0x1             // Connection used TLS
+#define CAPTURE_FLAG_TLS_RESUMED 0x2     // TLS session was resumed
+
+/**
+ * A string inside a record; not NUL-terminated
+ */
+typedef struct {
+    const char *base;
+    size_t len;
+} capture_str_t;
+
+/**
+ * One captured request
+ */
+typedef struct {
+    uint64_t offset_ns;                  // Arrival time since the start of the capture
+    uint64_t connection;                 // Requests with the same id arrived on the same connection
+    uint8_t flags;                       // CAPTURE_FLAG_*
+    uint16_t version;                    // HTTP version (0x100, 0x101, 0x200, 0x300)
+    capture_str_t method;
+    capture_str_t authority;
+    capture_str_t path;                  // Path and query
+    size_t num_headers;
+    capture_str_t header_names[CAPTURE_MAX_HEADERS];
+    capture_str_t header_values[CAPTURE_MAX_HEADERS];
+    capture_str_t body;                  // Captured prefix of the body
+    uint32_t body_total_len;             // Length of the whole body
+} capture_record_t;
+
+/**
+ * Write the file header
+ * @param out At least CAPTURE_FILE_HEADER_SIZE bytes
+ * @param start_ns Start of the capture, in ns since the Unix epoch
+ */
+void capture_encode_file_header(uint8_t *out, uint64_t start_ns);
+
+/**
+ * Read the file header
+ * @param start_ns Output: start of the capture
+ * @return 0 if the header is valid, -1 otherwise
+ */
+int capture_decode_file_header(const uint8_t *in, size_t len, uint64_t *start_ns);
+
+/**
+ * @return Encoded size of a record (strings longer than 65535 bytes are cut)
+ */
+size_t capture_record_size(const capture_record_t *record);
+
+/**
+ * Encode a record
+ * @param out At least capture_record_size(record) bytes
+ * @return Bytes written
+ */
+size_t capture_encode_record(const capture_record_t *record, uint8_t *out);
+
+/**
+ * Decode the record at the start of a buffer. Strings point into the buffer.
+ * @param record Output
+ * @return Bytes consumed, 0 if the buffer ends before the record does, -1 if the record is corrupt
+ */
+ssize_t capture_decode_record(const uint8_t *in, size_t len, capture_record_t *record);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,41 @@
+#pragma once
+
+#include "growtopia/config/server.h"
+#include <openssl/ssl.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Serve per-hostname certificates from config->certs.
+ * Each ClientHello is matched on its SNI name; a host with both an ECDSA and an RSA certificate
+ * gets the ECDSA one when the client's signature algorithms allow it and the RSA one otherwise.
+ * Must be called after crypto_pool_init so RSA keys are offloaded. The certs array is kept
+ * (not copied) for reloads and must outlive the server.
+ * @param ssl_ctx Server SSL context
+ * @param config TLS configuration (NULL or no certs keeps the default certificate only)
+ * @return 0 on success, negative on error
+ */
+int certstore_init(SSL_CTX *ssl_ctx, const tls_config_t *config);
+
+#define CERTSTORE_NOT_CONFIGURED -2     // No certificate store was set up, so there is nothing to reload
+
+/**
+ * Re-read every configured certificate, key and OCSP response.
+ * The new set replaces the old one atomically; on any error the old set stays in use.
+ * @return Number of hosts served on success, CERTSTORE_NOT_CONFIGURED without a store, -1 on error
+ */
+int certstore_reload(void);
+
+/**
+ * Get certificate store statistics
+ * @param hosts Output: hostnames currently served
+ * @param ocsp_staples Output: handshakes that carried a stapled OCSP response
+ * @param reloads Output: successful reloads since startup
+ */
+void certstore_get_stats(uint32_t *hosts, uint64_t *ocsp_staples, uint64_t *reloads);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,51 @@
+#pragma once
+
+#include "growtopia/config/server.h"
+#include "growtopia/middleware.h"
+#include <h2o.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Generate the signing key and build the challenge response. Must be called once at startup.
+ * @param config Challenge configuration (NULL for defaults)
+ * @return 0 on success, negative on error
+ */
+int challenge_init(const challenge_config_t *config);
+
+/**
+ * Turn away unverified clients while the server is flooded, without keeping any per-client state.
+ *
+ * The stage counts requests server-wide. Once activate_requests_per_second is reached, challenge
+ * mode turns on. It stays on until the rate has stayed below half the threshold for hold_seconds.
+ * While it is on, a request passes only if it carries a valid cookie. The cookie holds an expiry
+ * time and a keyed SipHash of that time and the client address (/32 for IPv4, /64 for IPv6).
+ * Other requests get a small 307 back to the same URL that sets a fresh cookie. Checking a cookie
+ * needs no table lookup. The security module is told to stop creating tracker entries on accept,
+ * so only clients that come back with a cookie get tracker state.
+ *
+ * Add first, before the admission and rate-limit stages.
+ */
+int middleware_add_challenge(middleware_pipeline_t *pipeline);
+
+/**
+ * @return 1 while challenge mode is on, 0 otherwise
+ */
+int challenge_active(void);
+
+/**
+ * Get challenge statistics
+ * @param issued Output: challenges sent
+ * @param verified Output: requests let through on a valid cookie
+ * @param invalid Output: cookies that were forged, expired or issued to another address
+ * @param activations Output: times challenge mode turned on
+ * @param verify_ns Output: total time spent checking cookies
+ */
+void challenge_get_stats(uint64_t *issued, uint64_t *verified, uint64_t *invalid, uint64_t *activations,
+                         uint64_t *verify_ns);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,41 @@
+#pragma once
+
+#include "growtopia/config/server.h"
+#include <h2o.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Attach a single-flight layer in front of the handlers of a path.
+ *
+ * Requests are keyed by method, normalized path, query and the headers / body
+ * fields listed in the configuration. While one request (the leader) is being
+ * processed by the handlers that follow, identical requests wait and receive a
+ * copy of the leader's response. Works for register_handler() handlers as well
+ * as proxied paths, since the response is captured by an output filter.
+ *
+ * Requests carrying Cookie, Authorization, Range, If-Range, If-None-Match or
+ * If-Modified-Since are passed through. Only 200 responses are shared, and not
+ * those with Set-Cookie or Cache-Control private / no-store; waiters of any
+ * other response are processed on their own. Expired micro-cache entries are
+ * swept one bucket per request.
+ *
+ * Must be called after the handlers of the path have been registered.
+ * @param pathconf Path to coalesce
+ * @param config Coalescing configuration (NULL for defaults)
+ */
+void register_coalescer(h2o_pathconf_t *pathconf, const coalesce_config_t *config);
+
+/**
+ * Get request coalescing statistics (summed over all coalesced paths)
+ * @param leaders Output: requests that were processed by the handlers
+ * @param followers Output: requests that received a leader's response
+ * @param cache_hits Output: requests served from the micro-cache
+ */
+void coalesce_get_stats(uint64_t *leaders, uint64_t *followers, uint64_t *cache_hits);
+
+#ifdef __cplusplus
+}
+#endif
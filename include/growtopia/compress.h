@@ -0,0 +1,42 @@
+#pragma once
+
+#include "growtopia/config/server.h"
+#include <h2o.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Gzip the responses of a path for clients that accept it.
+ *
+ * Meant for dynamic text responses (JSON, NDJSON, plain text); other content types, responses that are
+ * already encoded and ones known to be smaller than config->min_size pass through. Streams are
+ * flushed at every chunk the handler sends, so streaming responses keep flowing. zlib streams are
+ * kept in a per-thread pool and reset between responses instead of being allocated for each one.
+ * While a thread has max_contexts responses in flight or has used up its cpu_budget_ms for the
+ * current second, new responses are sent uncompressed.
+ *
+ * Do not combine with register_coalescer on the same path: followers would receive the leader's
+ * encoding regardless of their Accept-Encoding.
+ * @param pathconf Path to compress
+ * @param config Compression configuration (NULL for defaults)
+ */
+void register_compressor(h2o_pathconf_t *pathconf, const compress_config_t *config);
+
+/**
+ * Get response compression statistics (summed over all compressed paths)
+ * @param responses Output: responses sent compressed
+ * @param bytes_in Output: body bytes before compression
+ * @param bytes_out Output: body bytes after compression
+ * @param compress_ns Output: time spent in zlib
+ * @param skipped_small Output: responses below min_size
+ * @param skipped_overload Output: responses sent uncompressed because of max_contexts or cpu_budget_ms
+ * @param contexts_created Output: zlib streams allocated (the rest were reused from the pool)
+ */
+void compress_get_stats(uint64_t *responses, uint64_t *bytes_in, uint64_t *bytes_out, uint64_t *compress_ns,
+                        uint64_t *skipped_small, uint64_t *skipped_overload, uint64_t *contexts_created);
+
+#ifdef __cplusplus
+}
+#endif
@@ -1,11 +1,22 @@
 #pragma once
 
+#include <stddef.h>
 #include <stdint.h>
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+/**
+ * Limits applied to all clients of one autonomous system or country together
+ */
+typedef struct {
+    uint32_t asn;                        // Autonomous system number (0 to match by country instead)
+    const char *country;                 // ISO 3166-1 alpha-2 code, e.g. "US" (used when asn is 0)
+    uint32_t max_connections;            // Concurrent connections from the whole ASN/country (0 for no limit)
+    uint32_t max_requests_per_second;    // Requests per rate window from the whole ASN/country (0 for no limit)
+} geo_policy_t;
+
 /**
  * Security Configuration
  */
@@ -15,11 +26,141 @@ typedef struct {
     uint32_t ban_duration_seconds;       // Duration to ban an IP after threshold exceeded
     uint32_t request_window_seconds;     // Time window for request rate calculation
     uint32_t strike_threshold;           // Number of violations before auto-ban
+    uint32_t ip_table_size;              // Initial hash buckets for tracked IPs (0 for the default); doubles as needed
+    uint32_t sketch_source_threshold;    // Events per window before a source gets a tracker entry (0 tracks all)
+    uint32_t sketch_prefix_threshold;    // Events per window from one /24 or /48 before its sources are tracked
+    const geo_policy_t *geo_policies;    // Per-ASN and per-country limits (enforced once a GeoIP database is loaded)
+    size_t num_geo_policies;
     uint8_t enable_rate_limiting;        // Enable/disable rate limiting
     uint8_t enable_auto_ban;             // Enable/disable automatic IP banning
     uint8_t enable_connection_limit;     // Enable/disable connection limiting
 } security_config_t;
 
+/**
+ * Request Coalescing Configuration
+ */
+typedef struct {
+    const char **key_headers;            // Request headers (lowercase) that become part of the key
+    size_t num_key_headers;
+    const char **key_body_fields;        // Form fields of an urlencoded body that become part of the key
+    size_t num_key_body_fields;
+    uint32_t cache_ttl_ms;               // Keep completed 200 responses for this long (0 disables the micro-cache)
+    uint32_t max_cached_entries;         // Micro-cached responses kept per path; further ones are not cached
+    size_t max_response_size;            // Responses larger than this are not shared
+} coalesce_config_t;
+
+/**
+ * Response Compression Configuration
+ */
+typedef struct {
+    size_t min_size;                     // Responses with a known length below this go out uncompressed
+    int level;                           // zlib level (1 fastest .. 9 smallest)
+    uint32_t max_contexts;               // Concurrent compressed responses per thread; more are sent uncompressed
+    uint32_t cpu_budget_ms;              // Compression time allowed per second per thread (0 for no limit)
+} compress_config_t;
+
+/**
+ * Fair-Queuing Scheduler Configuration
+ */
+typedef struct {
+    uint32_t max_in_flight;              // Requests handled at once before new ones queue (0 disables queuing)
+    uint32_t prefix_in_flight;           // Requests of one /24 or /48 handled at once (0 for max_in_flight)
+    uint32_t queue_depth;                // Requests queued per /24 or /48; more are refused with 503
+    uint32_t max_queued;                 // Requests queued across all prefixes
+    uint32_t quantum_us;                 // Slot time credited to each prefix per round
+} fair_queue_config_t;
+
+/**
+ * Challenge Mode Configuration
+ */
+typedef struct {
+    uint32_t activate_requests_per_second; // Server-wide request rate that turns challenge mode on (0 never does)
+    uint32_t hold_seconds;               // Time spent below half that rate before it turns off again
+    uint32_t token_lifetime_seconds;     // How long an issued cookie stays valid
+} challenge_config_t;
+
+/**
+ * Traffic Capture Configuration
+ */
+typedef struct {
+    const char *directory;               // Where capture files are written
+    uint32_t sample_connections;         // Capture one connection in this many (1 captures every connection)
+    uint32_t max_body_bytes;             // Request body bytes kept per request
+    uint32_t max_seconds;                // Longest capture a request may ask for
+    uint64_t max_file_bytes;             // A capture stops once its file reaches this size
+    uint64_t queue_bytes;                // Records waiting for the writer thread; records that do not fit are dropped
+} capture_config_t;
+
+/**
+ * Certificate served for an SNI hostname
+ */
+typedef struct {
+    const char *hostname;                // SNI name, "*.example.com" for one-label wildcards or "*" for any
+    const char *cert_file;               // PEM certificate chain, leaf first (ECDSA or RSA)
+    const char *key_file;                // PEM private key
+    const char *ocsp_file;               // DER OCSP response to staple (NULL for none)
+} tls_cert_config_t;
+
+/**
+ * TLS Configuration
+ */
+typedef struct {
+    const tls_cert_config_t *certs;      // Per-host ECDSA/RSA certificates (none serves the default certificate)
+    size_t num_certs;
+    uint8_t enable_ktls;                 // Set SSL_OP_ENABLE_KTLS; no effect under h2o's own TLS BIO for now
+    uint32_t crypto_threads;             // Worker threads for RSA private-key operations (0 keeps them on the loop)
+    uint32_t crypto_queue_max;           // Pending private-key operations before new ones run on the loop
+} tls_config_t;
+
+/**
+ * PROXY Protocol Configuration
+ */
+typedef struct {
+    const char **trusted_cidrs;          // Load balancers that send a PROXY header (none disables it)
+    size_t num_trusted_cidrs;
+    uint32_t header_timeout_ms;          // Close trusted connections that do not send a complete header in time
+} proxy_protocol_config_t;
+
+/**
+ * Versioned Asset Configuration
+ */
+typedef struct {
+    const char *root;                    // Directory holding <asset>/<version> files and <from>-<to>.delta patches
+    uint32_t max_versions;               // Newest versions of each asset kept mapped and downloadable
+} assets_config_t;
+
+/**
+ * GeoIP Database Configuration
+ */
+typedef struct {
+    const char *asn_database;            // MMDB file with autonomous_system_number (NULL to skip)
+    const char *country_database;        // MMDB file with country.iso_code (NULL to skip)
+    uint32_t check_interval_seconds;     // How often the files are checked for updates (0 to only reload on request)
+} geoip_config_t;
+
+/**
+ * Sampling Profiler Configuration
+ */
+typedef struct {
+    uint32_t max_seconds;                // Longest profile a request may ask for
+    uint32_t max_hz;                     // Highest sampling rate per thread (samples per CPU-second)
+    uint32_t max_samples;                // Sample buffer size, about 520 bytes each; later samples are dropped
+} profiler_config_t;
+
+/**
+ * Buffer Pool Configuration
+ */
+typedef struct {
+    uint64_t max_cached_bytes;           // Recycled buffers kept per thread; buffers returned beyond this are freed
+} bufpool_config_t;
+
+/**
+ * Streamed Response Configuration
+ */
+typedef struct {
+    uint32_t chunk_size;                 // Bytes produced per send; also the most a streamed response holds
+} stream_config_t;
+
 /**
  * Server Configuration
  */
@@ -28,6 +169,17 @@ typedef struct {
     uint16_t port;                       // Server port (e.g., 8000)
     uint32_t max_connections;            // Maximum total connections
     uint32_t timeout_seconds;            // Connection timeout
+    uint8_t enable_io_uring;             // Accept via io_uring when built with GROWTOPIA_WITH_IO_URING
+    tls_config_t tls;                    // TLS configuration
+    proxy_protocol_config_t proxy_protocol; // PROXY protocol configuration
+    assets_config_t assets;              // Versioned asset distribution
+    profiler_config_t profiler;          // On-demand CPU profiler
+    fair_queue_config_t fair_queue;      // Per-prefix request scheduling under load
+    challenge_config_t challenge;        // Stateless cookie challenge during floods
+    capture_config_t capture;            // Sampled request capture for replay
+    bufpool_config_t bufpool;            // Recycled response buffers
+    stream_config_t stream;              // Streamed response bodies
+    geoip_config_t geoip;                // ASN and country databases for the security policies
     security_config_t security;          // Security configuration
 } server_config_t;
 
@@ -40,12 +192,70 @@ static inline server_config_t server_get_default_config(void) {
         .port = 8000,
         .max_connections = 10000,
         .timeout_seconds = 30,
+        .enable_io_uring = 1,
+        .tls = {
+            .certs = NULL,
+            .num_certs = 0,
+            .enable_ktls = 0,
+            .crypto_threads = 2,
+            .crypto_queue_max = 256
+        },
+        .proxy_protocol = {
+            .trusted_cidrs = NULL,
+            .num_trusted_cidrs = 0,
+            .header_timeout_ms = 3000
+        },
+        .assets = {
+            .root = "assets",
+            .max_versions = 4
+        },
+        .profiler = {
+            .max_seconds = 60,
+            .max_hz = 999,
+            .max_samples = 20000
+        },
+        .fair_queue = {
+            .max_in_flight = 256,
+            .prefix_in_flight = 64,
+            .queue_depth = 32,
+            .max_queued = 4096,
+            .quantum_us = 500
+        },
+        .challenge = {
+            .activate_requests_per_second = 5000,
+            .hold_seconds = 30,
+            .token_lifetime_seconds = 3600
+        },
+        .capture = {
+            .directory = "capture",
+            .sample_connections = 16,
+            .max_body_bytes = 4096,
+            .max_seconds = 3600,
+            .max_file_bytes = 1ULL << 30,
+            .queue_bytes = 8ULL << 20
+        },
+        .bufpool = {
+            .max_cached_bytes = 8ULL << 20
+        },
+        .stream = {
+            .chunk_size = 16384
+        },
+        .geoip = {
+            .asn_database = "geoip/GeoLite2-ASN.mmdb",
+            .country_database = "geoip/GeoLite2-Country.mmdb",
+            .check_interval_seconds = 60
+        },
         .security = {
             .max_connections_per_ip = 100,
             .max_requests_per_second = 100,
             .ban_duration_seconds = 300,
             .request_window_seconds = 1,
             .strike_threshold = 3,
+            .ip_table_size = 0,
+            .sketch_source_threshold = 20,
+            .sketch_prefix_threshold = 500,
+            .geo_policies = NULL,
+            .num_geo_policies = 0,
             .enable_rate_limiting = 0,
             .enable_auto_ban = 0,
             .enable_connection_limit = 0
@@ -64,6 +274,11 @@ static inline security_config_t security_get_default_config(void) {
         .ban_duration_seconds = 300,
         .request_window_seconds = 1,
         .strike_threshold = 3,
+        .ip_table_size = 0,
+        .sketch_source_threshold = 20,
+        .sketch_prefix_threshold = 500,
+        .geo_policies = NULL,
+        .num_geo_policies = 0,
         .enable_rate_limiting = 0,
         .enable_auto_ban = 0,
         .enable_connection_limit = 0
@@ -71,6 +286,145 @@ static inline security_config_t security_get_default_config(void) {
     return config;
 }
 
+/**
+ * Get default TLS configuration
+ */
+static inline tls_config_t tls_get_default_config(void) {
+    tls_config_t config = {
+        .certs = NULL,
+        .num_certs = 0,
+        .enable_ktls = 0,
+        .crypto_threads = 2,
+        .crypto_queue_max = 256
+    };
+    return config;
+}
+
+/**
+ * Get default request coalescing configuration
+ */
+static inline coalesce_config_t coalesce_get_default_config(void) {
+    coalesce_config_t config = {
+        .key_headers = NULL,
+        .num_key_headers = 0,
+        .key_body_fields = NULL,
+        .num_key_body_fields = 0,
+        .cache_ttl_ms = 0,
+        .max_cached_entries = 1024,
+        .max_response_size = 1024 * 1024
+    };
+    return config;
+}
+
+/**
+ * Get default response compression configuration
+ */
+static inline compress_config_t compress_get_default_config(void) {
+    compress_config_t config = {
+        .min_size = 1024,
+        .level = 5,
+        .max_contexts = 64,
+        .cpu_budget_ms = 250
+    };
+    return config;
+}
+
+/**
+ * Get default versioned asset configuration
+ */
+static inline assets_config_t assets_get_default_config(void) {
+    assets_config_t config = {
+        .root = "assets",
+        .max_versions = 4
+    };
+    return config;
+}
+
+/**
+ * Get default profiler configuration
+ */
+static inline profiler_config_t profiler_get_default_config(void) {
+    profiler_config_t config = {
+        .max_seconds = 60,
+        .max_hz = 999,
+        .max_samples = 20000
+    };
+    return config;
+}
+
+/**
+ * Get default GeoIP database configuration
+ */
+static inline geoip_config_t geoip_get_default_config(void) {
+    geoip_config_t config = {
+        .asn_database = "geoip/GeoLite2-ASN.mmdb",
+        .country_database = "geoip/GeoLite2-Country.mmdb",
+        .check_interval_seconds = 60
+    };
+    return config;
+}
+
+/**
+ * Get default fair-queuing scheduler configuration
+ */
+static inline fair_queue_config_t fair_queue_get_default_config(void) {
+    fair_queue_config_t config = {
+        .max_in_flight = 256,
+        .prefix_in_flight = 64,
+        .queue_depth = 32,
+        .max_queued = 4096,
+        .quantum_us = 500
+    };
+    return config;
+}
+
+/**
+ * Get default challenge mode configuration
+ */
+static inline challenge_config_t challenge_get_default_config(void) {
+    challenge_config_t config = {
+        .activate_requests_per_second = 5000,
+        .hold_seconds = 30,
+        .token_lifetime_seconds = 3600
+    };
+    return config;
+}
+
+/**
+ * Get default traffic capture configuration
+ */
+static inline capture_config_t capture_get_default_config(void) {
+    capture_config_t config = {
+        .directory = "capture",
+        .sample_connections = 16,
+        .max_body_bytes = 4096,
+        .max_seconds = 3600,
+        .max_file_bytes = 1ULL << 30,
+        .queue_bytes = 8ULL << 20
+    };
+    return config;
+}
+
+/**
+ * Get default buffer pool configuration
+ */
+static inline bufpool_config_t bufpool_get_default_config(void) {
+    bufpool_config_t config = {
+        .max_cached_bytes = 8ULL << 20
+    };
+    return config;
+}
+
+/**
+ * Get default streamed response configuration
+ */
+static inline stream_config_t stream_get_default_config(void) {
+    stream_config_t config = {
+        .chunk_size = 16384
+    };
+    return config;
+}
+
 #ifdef __cplusplus
 }
 #endif
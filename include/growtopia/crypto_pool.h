@@ -0,0 +1,42 @@
+#pragma once
+
+#include "growtopia/config/server.h"
+#include <openssl/ssl.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Move RSA private-key operations of a server context onto a pool of crypto threads.
+ * Handshakes pause as OpenSSL async jobs while a worker signs, so the event loop keeps
+ * serving other connections. Must be called after the default private key has been loaded.
+ * Non-RSA keys, a zero thread count, an OpenSSL without async support or one other than
+ * 3.x with engines (the interception uses the ENGINE API) leave the operations on the loop.
+ * @param ssl_ctx Server SSL context
+ * @param config TLS configuration (NULL for defaults)
+ * @return 0 on success (including when offload is unavailable), negative on error
+ */
+int crypto_pool_init(SSL_CTX *ssl_ctx, const tls_config_t *config);
+
+/**
+ * Return a key whose RSA private operations run on the crypto pool.
+ * Keys that cannot be offloaded (non-RSA, pool disabled) are returned as they are.
+ * @param pkey Private key
+ * @return New reference the caller must free with EVP_PKEY_free, NULL on error
+ */
+EVP_PKEY *crypto_pool_wrap_key(EVP_PKEY *pkey);
+
+/**
+ * Get crypto pool statistics
+ * @param queue_depth Output: private-key operations waiting for or running on a worker
+ * @param max_queue_depth Output: highest queue depth seen
+ * @param offloaded Output: operations completed by a worker
+ * @param inline_ops Output: operations run on the calling thread (no async job or queue full)
+ */
+void crypto_pool_get_stats(uint32_t *queue_depth, uint32_t *max_queue_depth, uint64_t *offloaded,
+                           uint64_t *inline_ops);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,53 @@
+#pragma once
+
+#include "growtopia/config/server.h"
+#include "growtopia/middleware.h"
+#include <h2o.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Set up the fair-queuing scheduler shared by all fair-queue stages. Must be called before the
+ * first request, after the context has been initialized.
+ * @param ctx Context whose loop runs the scheduler
+ * @param config Scheduler configuration (NULL for defaults)
+ * @return 0 on success, negative on error
+ */
+int fair_queue_init(h2o_context_t *ctx, const fair_queue_config_t *config);
+
+/**
+ * Share handler time fairly between client prefixes (/24 for IPv4, /48 for IPv6) once the server
+ * is busy.
+ *
+ * A request holds an in-flight slot until its response is done. While fewer than max_in_flight
+ * requests hold one, nothing is queued and the request's prefix holds fewer than prefix_in_flight,
+ * requests pass straight through. Otherwise each request waits in the queue of its prefix and the
+ * queues are served by deficit round robin: every round a prefix is credited quantum_us of slot
+ * time and is charged, per request, how long the request held its slot, divided by the route's
+ * weight. A prefix flooding the server, or holding slots with slow downloads, therefore only
+ * delays its own requests. A full queue is answered with 503.
+ *
+ * Add after the admission and rate-limit stages so rejected requests never wait in line. Leave it out
+ * of routes that stream large responses, whose slots would be held for the whole transfer.
+ * @param weight Relative priority of the route (1 for normal; 4 makes its requests cost a quarter)
+ */
+int middleware_add_fair_queue(middleware_pipeline_t *pipeline, uint32_t weight);
+
+/**
+ * Get scheduler statistics
+ * @param admitted Output: requests passed straight through
+ * @param queued Output: requests that had to wait
+ * @param rejected Output: requests refused because their queue was full
+ * @param abandoned Output: requests whose client went away while queued
+ * @param wait_ns Output: total time queued requests spent waiting
+ * @param in_flight Output: requests currently being handled
+ * @param waiting Output: requests currently queued
+ */
+void fair_queue_get_stats(uint64_t *admitted, uint64_t *queued, uint64_t *rejected, uint64_t *abandoned,
+                          uint64_t *wait_ns, uint32_t *in_flight, uint32_t *waiting);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,59 @@
+#pragma once
+
+#include "growtopia/config/server.h"
+#include <h2o.h>
+#include <sys/socket.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * What the databases know about an address
+ */
+typedef struct {
+    uint32_t asn;                        // Autonomous system number (0 if unknown)
+    char country[3];                     // ISO 3166-1 alpha-2 code ("" if unknown)
+} geoip_info_t;
+
+/**
+ * Map the configured MaxMind DB files and start watching them for updates.
+ * A missing file is not an error: lookups report nothing until it appears.
+ * @param ctx Context whose loop runs the update checks
+ * @param config Database paths (NULL for defaults); the strings must outlive the server
+ * @return 0 on success, negative on error
+ */
+int geoip_init(h2o_context_t *ctx, const geoip_config_t *config);
+
+/**
+ * Look up an address. The search tree and records are read straight from the mapping, without
+ * allocating or deserializing; the last answer of each thread is cached, since the accept path
+ * asks about the same peer twice in a row. Safe to call from any thread.
+ * @param addr IPv4 or IPv6 socket address
+ * @param info Output: ASN and country, zeroed for what is unknown
+ * @return 1 if the ASN or the country is known, 0 otherwise
+ */
+int geoip_lookup(const struct sockaddr *addr, geoip_info_t *info);
+
+/**
+ * Map the database files again and swap them in atomically. Lookups running concurrently finish
+ * on the old mapping, which is released afterwards. A file that fails to load keeps its old mapping.
+ * @return Number of databases loaded on success, negative if one of them failed to load
+ */
+int geoip_reload(void);
+
+/**
+ * Get GeoIP statistics
+ * @param lookups Output: lookups that searched a database
+ * @param cache_hits Output: lookups answered by the per-thread cache
+ * @param lookup_ns Output: total time spent searching
+ * @param reloads Output: database swaps
+ * @param asn_epoch Output: build time of the ASN database (0 if none is loaded)
+ * @param country_epoch Output: build time of the country database (0 if none is loaded)
+ */
+void geoip_get_stats(uint64_t *lookups, uint64_t *cache_hits, uint64_t *lookup_ns, uint64_t *reloads,
+                     uint64_t *asn_epoch, uint64_t *country_epoch);
+
+#ifdef __cplusplus
+}
+#endif
@@ -6,8 +6,9 @@
 extern "C" {
 #endif
 
+int handlers_init(void);
 h2o_pathconf_t *register_handler(h2o_hostconf_t *hostconf, const char *path, int (*on_req)(h2o_handler_t *, h2o_req_t *));
-h2o_handler_t *register_security_filter(h2o_pathconf_t *pathconf);
+h2o_handler_t *create_prepended_handler(h2o_pathconf_t *pathconf, size_t sz);
 int security_stats_handler(h2o_handler_t *self, h2o_req_t *req);
 int chunked_test(h2o_handler_t *self, h2o_req_t *req);
 int reproxy_test(h2o_handler_t *self, h2o_req_t *req);
@@ -1,7 +1,7 @@
 #pragma once
 
 #include <h2o.h>
-#ifdef H2O_USE_LIBUV
+#if H2O_USE_LIBUV
 #include <uv.h>
 #endif
 
@@ -26,6 +26,25 @@ int listener_start(void);
  */
 void listener_stop(void);
 
+/**
+ * Accept connections through io_uring multishot accept when the build and the
+ * kernel support it, falling back to the event loop otherwise (default: on).
+ * Must be called before listener_start().
+ */
+void listener_set_io_uring(int use_io_uring);
+
+/**
+ * Name of the accept backend in use ("io_uring", "libuv" or "evloop").
+ */
+const char *listener_backend_name(void);
+
+/**
+ * Get io_uring accept statistics
+ * @param ring_accepts Output: connections accepted through io_uring
+ * @param ring_wakeups Output: completion batches reaped (one eventfd wakeup each)
+ */
+void listener_get_stats(uint64_t *ring_accepts, uint64_t *ring_wakeups);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,110 @@
+#pragma once
+
+#include <h2o.h>
+#include <sys/socket.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define MIDDLEWARE_CONTINUE 0            // Stage let the request through
+#define MIDDLEWARE_DONE 1                // Stage has responded (or taken ownership of the request)
+#define MIDDLEWARE_DEFERRED 2            // Stage holds the request and will call middleware_resume later
+
+typedef struct middleware_stage middleware_stage_t;
+
+/**
+ * Stage callback
+ * @param stage The stage being run
+ * @param req The request
+ * @param peer Client address, or NULL if the connection has none
+ * @return MIDDLEWARE_CONTINUE, MIDDLEWARE_DONE or MIDDLEWARE_DEFERRED
+ */
+typedef int (*middleware_cb)(middleware_stage_t *stage, h2o_req_t *req, const struct sockaddr *peer);
+
+/**
+ * Pipeline stage
+ */
+struct middleware_stage {
+    const char *name;                    // Name shown in statistics
+    middleware_cb on_req;
+    void *data;                          // Stage-specific configuration
+    h2o_handler_t *handler;              // Pipeline the stage runs in (set by middleware_attach)
+    uint64_t calls;                      // Number of requests seen
+    uint64_t rejected;                   // Number of requests answered by the stage
+    uint64_t total_ns;                   // Time spent in the stage
+};
+
+typedef struct middleware_pipeline middleware_pipeline_t;
+
+/**
+ * Build the responses used by the built-in stages. Must be called once at startup.
+ * @return 0 on success, negative on error
+ */
+int middleware_init(void);
+
+/**
+ * Start building a pipeline
+ * @param route Route name used in statistics (must outlive the pipeline)
+ * @return Pipeline builder, or NULL on allocation failure
+ */
+middleware_pipeline_t *middleware_pipeline_create(const char *route);
+
+/**
+ * Append a stage; stages run in the order they are added
+ * @return 0 on success, negative on error
+ */
+int middleware_add_stage(middleware_pipeline_t *pipeline, const char *name, middleware_cb on_req, void *data);
+
+/**
+ * Reject requests from banned IPs with 403
+ */
+int middleware_add_ip_admission(middleware_pipeline_t *pipeline);
+
+/**
+ * Apply the per-IP request rate limit, rejecting with 429
+ */
+int middleware_add_rate_limit(middleware_pipeline_t *pipeline);
+
+/**
+ * Reject request bodies larger than max_bytes with 413, by declared Content-Length or received length.
+ * h2o buffers a body before the pipeline runs, so the server's max_request_entity_size must cap memory
+ */
+int middleware_add_body_limit(middleware_pipeline_t *pipeline, size_t max_bytes);
+
+/**
+ * Count requests and request body bytes of the route
+ */
+int middleware_add_metrics(middleware_pipeline_t *pipeline);
+
+/**
+ * Only admit clients connecting from a loopback address, rejecting others with 403
+ */
+int middleware_add_loopback_only(middleware_pipeline_t *pipeline);
+
+/**
+ * Freeze the pipeline into a flat stage array and put it in front of the
+ * handlers of a path. The builder is consumed. Call after every other handler
+ * of the path (including coalescers) has been registered.
+ * @return The pipeline handler, or NULL on allocation failure
+ */
+h2o_handler_t *middleware_attach(middleware_pipeline_t *pipeline, h2o_pathconf_t *pathconf);
+
+/**
+ * Continue a request a stage answered with MIDDLEWARE_DEFERRED: run the stages after it and, if
+ * they all let the request through, the next handler of the path. Call from outside the request's
+ * own handler chain (e.g. a timer), never from within the stage callback itself.
+ * @param stage The stage that deferred the request
+ * @param req The request
+ */
+void middleware_resume(middleware_stage_t *stage, h2o_req_t *req);
+
+/**
+ * Append per-route, per-stage statistics of all attached pipelines to buf
+ * @return Number of bytes written (excluding the terminating NUL)
+ */
+size_t middleware_format_stats(char *buf, size_t cap);
+
+#ifdef __cplusplus
+}
+#endif
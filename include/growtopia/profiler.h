@@ -0,0 +1,44 @@
+#pragma once
+
+#include "growtopia/config/server.h"
+#include <h2o.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Install the SIGPROF handler used by the sampling profiler.
+ * Nothing is sampled until a profile is requested through profiler_handler.
+ * @param config Profiler limits (NULL for defaults)
+ * @return 0 on success, negative on error
+ */
+int profiler_init(const profiler_config_t *config);
+
+/**
+ * Make the calling thread eligible for sampling; call once from every event loop and worker thread.
+ * @param name Label used as the root frame of the thread's stacks (must outlive the server)
+ * @return 0 on success, negative when the thread table is full
+ */
+int profiler_register_thread(const char *name);
+
+/**
+ * GET ?seconds=N&hz=H: sample the on-CPU stacks of every registered thread for N seconds (default 10)
+ * at H samples per second of CPU time (default 99), then answer with folded stacks, one
+ * "thread;outer;...;leaf count" line per distinct stack, ready for flamegraph.pl or speedscope.
+ * The request does not block the loop while sampling; only one profile runs at a time (409 otherwise).
+ */
+int profiler_handler(h2o_handler_t *self, h2o_req_t *req);
+
+/**
+ * Get profiler statistics
+ * @param profiles Output: completed profiles
+ * @param samples Output: stacks recorded
+ * @param dropped Output: samples lost to a full buffer
+ * @param sample_ns Output: average time spent in the signal handler per sample
+ */
+void profiler_get_stats(uint64_t *profiles, uint64_t *samples, uint64_t *dropped, uint64_t *sample_ns);
+
+#ifdef __cplusplus
+}
+#endif
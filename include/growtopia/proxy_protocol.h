@@ -0,0 +1,60 @@
+#pragma once
+
+#include "growtopia/config/server.h"
+#include <h2o.h>
+#include <netinet/in.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define PROXY_PROTOCOL_INCOMPLETE -2     // More bytes are needed
+#define PROXY_PROTOCOL_INVALID -1        // Not a valid PROXY header
+
+/**
+ * Initialize PROXY protocol support
+ * @param ctx h2o context for header timeouts
+ * @param config Trusted load balancer networks and header timeout
+ * @return 0 on success, negative on error (e.g. a malformed CIDR)
+ */
+int proxy_protocol_init(h2o_context_t *ctx, const proxy_protocol_config_t *config);
+
+/**
+ * Check whether connections from a peer are expected to start with a PROXY header
+ * @param peer Socket address of the directly connected peer
+ * @return 1 if the peer is a trusted load balancer, 0 otherwise
+ */
+int proxy_protocol_is_trusted(const struct sockaddr *peer);
+
+/**
+ * Parse a PROXY protocol v1 (text) or v2 (binary) header in place
+ * @param buf Received bytes
+ * @param len Number of bytes in buf
+ * @param addr Output: client address, or AF_UNSPEC for LOCAL / UNKNOWN headers
+ * @param addr_len Output: length of addr
+ * @return Header length, PROXY_PROTOCOL_INCOMPLETE or PROXY_PROTOCOL_INVALID
+ */
+ssize_t proxy_protocol_parse(const char *buf, size_t len, struct sockaddr_storage *addr, socklen_t *addr_len);
+
+/**
+ * Read the PROXY header of a connection from a trusted peer, apply the client address to the socket
+ * and pass it on. The socket is closed if the header is invalid or does not arrive in time.
+ * LOCAL and UNKNOWN headers leave the socket with an AF_UNSPEC peer name (unproxied): the balancer's
+ * own address is never exposed, so such connections fail loopback-only checks and skip per-IP limits
+ * @param sock Accepted socket
+ * @param on_ready Called with the socket once its peer name is the real client address
+ */
+void proxy_protocol_accept(h2o_socket_t *sock, void (*on_ready)(h2o_socket_t *sock));
+
+/**
+ * Get PROXY protocol statistics
+ * @param accepted Output: headers parsed successfully
+ * @param rejected Output: connections closed for an invalid or missing header
+ * @param parse_ns Output: total time spent parsing headers, in nanoseconds
+ */
+void proxy_protocol_get_stats(uint64_t *accepted, uint64_t *rejected, uint64_t *parse_ns);
+
+#ifdef __cplusplus
+}
+#endif
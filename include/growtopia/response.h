@@ -0,0 +1,65 @@
+#pragma once
+
+#include <h2o.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Prebuilt response
+ *
+ * Built once at startup and never modified afterwards. Header names are h2o
+ * tokens and header values / body are interned in the template, so sending it
+ * neither allocates nor copies strings per request.
+ */
+typedef struct response_template {
+    int status;                          // HTTP status code
+    const char *reason;                  // Reason phrase
+    h2o_header_t *headers;               // Fixed response headers
+    size_t num_headers;
+    size_t capacity;
+    h2o_iovec_t body;                    // Fixed body (empty for headers-only templates)
+} response_template_t;
+
+/**
+ * Create an empty response template
+ * @param status HTTP status code
+ * @param reason Reason phrase (must outlive the template, usually a literal)
+ * @return Template, or NULL on allocation failure
+ */
+response_template_t *response_template_create(int status, const char *reason);
+
+/**
+ * Append a header to a template; the value is copied into the template
+ * @return 0 on success, negative on error
+ */
+int response_template_add_header(response_template_t *tmpl, const h2o_token_t *token, const char *value, size_t value_len);
+
+/**
+ * Set the body of a template; the body is copied into the template
+ * @return 0 on success, negative on error
+ */
+int response_template_set_body(response_template_t *tmpl, const char *body, size_t len);
+
+/**
+ * Start a response with the status and headers of a template; the caller sends the body
+ * @param tmpl Template
+ * @param req Request to respond to
+ * @param generator Generator of the response
+ */
+void response_template_start(const response_template_t *tmpl, h2o_req_t *req, h2o_generator_t *generator);
+
+/**
+ * Send a complete template response (status, headers and body)
+ */
+void response_template_send(const response_template_t *tmpl, h2o_req_t *req);
+
+/**
+ * Free a template
+ */
+void response_template_free(response_template_t *tmpl);
+
+#ifdef __cplusplus
+}
+#endif
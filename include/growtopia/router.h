@@ -0,0 +1,63 @@
+#pragma once
+
+#include <h2o.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Immutable dispatch structure compiled from a list of paths
+ */
+typedef struct route_table route_table_t;
+
+/**
+ * Match a path only exactly, not the paths below it (h2o matches every path as a prefix).
+ * Must be called before router_install().
+ * @return 0 on success, negative on error
+ */
+int router_set_exact(h2o_pathconf_t *pathconf);
+
+/**
+ * Replace h2o's path matching for a host with a compiled route table.
+ *
+ * h2o tries the paths of a host one by one, so matching slows down with every route added. This
+ * compiles the registered paths into a perfect hash of whole paths and a radix trie of prefixes. It
+ * then registers a dispatcher as the first path, which stops h2o's scan there. The dispatcher looks
+ * up the request in O(path length), whatever the number of routes. It then binds the request to the
+ * path it found, so that path's handlers, filters and loggers run as before. Prefixes match on
+ * segment boundaries and the longest one wins, as in h2o. A request that matches nothing uses the
+ * host's fallback path.
+ *
+ * Call after the host's paths are registered and before h2o_context_init(). Calling it again
+ * recompiles the table, picking up paths added since (call from the event loop thread).
+ * @return 0 on success, negative on error
+ */
+int router_install(h2o_hostconf_t *hostconf);
+
+/**
+ * Compile a route table; the paths must outlive it
+ * @param pathconfs Paths to route to; when one path is listed twice, the first entry is used
+ * @return Table, or NULL on allocation failure
+ */
+route_table_t *route_table_build(h2o_pathconf_t *const *pathconfs, size_t count);
+
+/**
+ * @return Path whose route matches, or NULL if none does
+ */
+h2o_pathconf_t *route_table_lookup(const route_table_t *table, const char *path, size_t len);
+
+void route_table_free(route_table_t *table);
+
+/**
+ * Get routing statistics (summed over all hosts)
+ * @param routes Output: routes in the installed tables
+ * @param exact_hits Output: lookups answered by the perfect hash
+ * @param prefix_hits Output: lookups answered by the trie
+ * @param fallbacks Output: lookups that matched no route
+ */
+void router_get_stats(uint32_t *routes, uint64_t *exact_hits, uint64_t *prefix_hits, uint64_t *fallbacks);
+
+#ifdef __cplusplus
+}
+#endif
@@ -1,6 +1,8 @@
 #pragma once
 
 #include "growtopia/config/server.h"
+#include "growtopia/geoip.h"
+#include "growtopia/sketch.h"
 #include <h2o.h>
 #include <netinet/in.h>
 #include <time.h>
@@ -19,25 +21,135 @@ typedef struct ip_tracker_entry {
     time_t window_start;                 // Start of current rate limit window
     time_t ban_until;                    // Timestamp when ban expires (0 if not banned)
     uint32_t strike_count;               // Number of violations
+    uint32_t bucket;                     // Hash bucket the entry lives in
+    uint32_t created_epoch;              // Snapshot epoch the entry was created in
+    uint32_t cow_epoch;                  // Last snapshot epoch the entry was preserved for
+    uint8_t connection_only;             // Counts the connections of a source the sketch has not promoted
     struct ip_tracker_entry *next;       // Next entry in linked list
 } ip_tracker_entry_t;
 
+typedef struct security_snapshot security_snapshot_t;
+
+/**
+ * Aggregate counters of one autonomous system or country
+ */
+typedef struct geo_counter {
+    struct geo_counter *next;            // Next counter in the ASN bucket chain
+    uint32_t asn;                        // Autonomous system number (0 for country counters)
+    const geo_policy_t *policy;          // Limits that apply (NULL if only counted)
+    uint32_t connection_count;           // Current active connections
+    uint32_t request_count;              // Requests in current window
+    time_t window_start;                 // Start of current rate limit window
+    uint64_t total_requests;             // Requests seen since the counter was created
+    uint64_t blocked;                    // Connections and requests refused by the policy
+} geo_counter_t;
+
 /**
  * Security context
  */
 typedef struct {
     security_config_t config;
     ip_tracker_entry_t **ip_table;       // Hash table of IP entries
-    uint32_t table_size;                 // Size of hash table
-    h2o_timer_t cleanup_timer;           // Timer for periodic cleanup
+    uint32_t table_size;                 // Size of hash table (doubles as entries are added)
+    ip_tracker_entry_t **old_table;      // Table being emptied into ip_table after a growth (NULL otherwise)
+    uint32_t old_table_size;
+    uint32_t migrate_cursor;             // Next bucket of old_table to move
+    h2o_timer_t cleanup_timer;           // Timer for incremental cleanup steps
+    uint32_t sweep_cursor;               // Next bucket to visit
+    uint32_t sweep_position;             // Entries of the cursor bucket already visited (budget ran out mid-chain)
+    uint32_t sweep_buckets_per_step;     // Buckets visited per cleanup step
+    uint32_t sweep_removed;              // Entries removed during the current pass
     h2o_context_t *h2o_ctx;              // h2o context for timer
+    count_min_t source_sketch;           // Per-source event estimates for the current window
+    count_min_t prefix_sketch;           // Per-prefix event estimates for the current window
+    space_saving_t top_sources;          // Top talkers by source address
+    space_saving_t top_prefixes;         // Top talkers by prefix
+    time_t sketch_window_start;          // Start of the current sketch window
+    uint32_t tracked_entries;            // Entries in the exact table
+    uint64_t untracked_decisions;        // Checks answered by the sketch alone
+    uint32_t epoch;                      // Current snapshot epoch
+    security_snapshot_t *snapshot;       // Export in progress, if any
+    geo_counter_t **asn_table;           // Hash table of per-ASN counters
+    uint32_t asn_entries;                // Counters in the ASN table
+    uint32_t asn_sweep_cursor;           // Next ASN bucket to visit
+    geo_counter_t *countries;            // Per-country counters, indexed by the two letters of the code
+    uint64_t geo_blocked;                // Statistics counter
+    uint8_t challenge_mode;              // Set while unverified clients are being challenged
     uint64_t total_blocked_requests;     // Statistics counter
     uint64_t total_banned_ips;           // Statistics counter
 } security_context_t;
 
+/**
+ * A top talker reported by the sketch layer
+ */
+typedef struct {
+    struct sockaddr_storage addr;        // Source address, or the network address of a prefix
+    uint8_t prefix_len;                  // 32/128 for single sources, 24/48 for prefixes
+    uint32_t count;                      // Estimated events (decayed by half every window)
+    uint32_t error;                      // Maximum overestimate of count
+} security_talker_t;
+
+/**
+ * An open connection as it was counted, kept by the caller until the connection closes
+ */
+typedef struct {
+    struct sockaddr_storage addr;        // Client address
+    geoip_info_t geo;                    // ASN and country the connection was counted against (zeroed if none)
+} security_connection_t;
+
+/**
+ * Point-in-time view of a tracked IP
+ */
+typedef struct {
+    struct sockaddr_storage addr;        // IP address
+    uint32_t connection_count;           // Current active connections
+    uint32_t request_count;              // Requests in current window
+    uint32_t strike_count;               // Number of violations
+    time_t ban_until;                    // Timestamp when ban expires (0 if not banned)
+    uint32_t estimate;                   // Sketch estimate of requests in the current window (inspect only)
+} security_entry_info_t;
+
+/**
+ * Point-in-time view of an autonomous system
+ */
+typedef struct {
+    uint32_t asn;                        // Autonomous system number
+    uint32_t connection_count;           // Current active connections
+    uint32_t request_count;              // Requests in current window
+    uint64_t total_requests;             // Requests seen since the ASN was last active
+    uint64_t blocked;                    // Connections and requests refused by its policy
+    uint8_t limited;                     // 1 if a policy applies to the ASN
+} security_asn_info_t;
+
+/**
+ * Batch operation types
+ */
+typedef enum {
+    SECURITY_OP_BAN,
+    SECURITY_OP_UNBAN,
+    SECURITY_OP_WHITELIST,
+    SECURITY_OP_INSPECT
+} security_op_type_t;
+
+/**
+ * One operation of a batch
+ */
+typedef struct {
+    security_op_type_t type;
+    struct sockaddr_storage addr;        // Target IP
+    uint32_t duration_seconds;           // Ban duration (0 for permanent)
+    int result;                          // Output: 0 on success, negative on error; 1/0 tracked or not for inspect
+    security_entry_info_t info;          // Output of SECURITY_OP_INSPECT
+} security_op_t;
+
+/**
+ * Callback for each entry of a snapshot, invoked with the security lock held
+ */
+typedef void (*security_entry_cb)(const security_entry_info_t *info, void *data);
+
 /**
  * Initialize the security module with configuration
- * @param ctx h2o context for timer integration
+ * @param ctx h2o context for timer integration (NULL to drive the cleanup with security_tick() instead)
  * @param config Security configuration
  * @return 0 on success, negative on error
  */
@@ -48,6 +160,19 @@ int security_init(h2o_context_t *ctx, const security_config_t *config);
  */
 void security_cleanup(void);
 
+/**
+ * Run one incremental cleanup step: lift expired bans, drop idle entries and roll the sketch window.
+ * The timer of the context passed to security_init() does this every 100 ms.
+ */
+void security_tick(void);
+
+/**
+ * Replace the wall clock used for windows, bans and expiry (NULL restores time(NULL))
+ *
+ * Lets a simulation run hours of traffic in seconds. Set it before security_init().
+ */
+void security_set_clock(time_t (*clock)(void));
+
 /**
  * Check if a connection from an IP should be allowed
  * @param addr Socket address of the client
@@ -57,16 +182,21 @@ int security_check_connection(const struct sockaddr *addr);
 
 /**
  * Register a new connection from an IP
+ * With enable_connection_limit set, every connected source is counted, so max_connections_per_ip applies
+ * whether or not the sketch layer has promoted it (except to unverified sources while challenge mode is on).
+ * Otherwise only sources that already have an entry are counted
  * @param addr Socket address of the client
+ * @param conn Output: what the connection was counted against, to be passed to security_unregister_connection()
  * @return 0 on success, -1 if connection should be rejected
  */
-int security_register_connection(const struct sockaddr *addr);
+int security_register_connection(const struct sockaddr *addr, security_connection_t *conn);
 
 /**
- * Unregister a connection from an IP (called on disconnect)
- * @param addr Socket address of the client
+ * Unregister a connection (called on disconnect). The ASN and country recorded at registration are
+ * released, so the counters stay balanced when the GeoIP databases are reloaded in between
+ * @param conn Filled in by security_register_connection()
  */
-void security_unregister_connection(const struct sockaddr *addr);
+void security_unregister_connection(const security_connection_t *conn);
 
 /**
  * Check if a request from an IP should be allowed (rate limiting)
@@ -98,12 +228,57 @@ int security_unban_ip(const struct sockaddr *addr);
 int security_is_banned(const struct sockaddr *addr);
 
 /**
- * Add an IP to whitelist (exempt from rate limiting)
+ * Add an IP to whitelist (currently clears any ban and strikes)
  * @param addr Socket address to whitelist
  * @return 0 on success, negative on error
  */
 int security_whitelist_ip(const struct sockaddr *addr);
 
+/**
+ * Inspect the state of an IP without creating a tracker entry
+ * @param addr Socket address to inspect
+ * @param info Output: current state
+ * @return 1 if the IP is tracked, 0 if not
+ */
+int security_inspect_ip(const struct sockaddr *addr, security_entry_info_t *info);
+
+/**
+ * Apply a batch of operations under a single lock acquisition
+ * @param ops Operations; result (and info for inspects) is filled in for each
+ * @param count Number of operations
+ * @return Number of operations that succeeded
+ */
+size_t security_apply_batch(security_op_t *ops, size_t count);
+
+/**
+ * Start a consistent export of the tracker table. Entries are copied on write while the export
+ * runs, so request and connection checks are never blocked by it. Only one export runs at a time
+ * @return Snapshot handle, or NULL if an export is already running or on error
+ */
+security_snapshot_t *security_snapshot_begin(void);
+
+/**
+ * Emit the next part of a snapshot (whole hash buckets, stopping once max_entries is reached)
+ * @param snapshot Snapshot handle
+ * @param max_entries Soft limit on entries emitted by this call
+ * @param cb Called for each entry
+ * @param data Passed to cb
+ * @return 1 when the snapshot has been fully emitted, 0 otherwise
+ */
+int security_snapshot_next(security_snapshot_t *snapshot, size_t max_entries, security_entry_cb cb, void *data);
+
+/**
+ * Finish (or abandon) a snapshot and release it
+ */
+void security_snapshot_end(security_snapshot_t *snapshot);
+
+/**
+ * Turn stateless mode on or off. While it is on, the accept path only consults existing tracker
+ * entries and never creates one; clients get state once a request of theirs reaches the rate limit.
+ * @param enabled Non-zero while challenge mode is on
+ */
+void security_set_challenge_mode(int enabled);
+
 /**
  * Get security statistics
  * @param blocked_requests Output: total blocked requests
@@ -111,6 +286,37 @@ int security_whitelist_ip(const struct sockaddr *addr);
  */
 void security_get_stats(uint64_t *blocked_requests, uint64_t *banned_ips);
 
+/**
+ * Get sketch layer statistics
+ * @param tracked_entries Output: entries in the exact table
+ * @param untracked_decisions Output: checks answered without a tracker entry
+ */
+void security_get_sketch_stats(uint32_t *tracked_entries, uint64_t *untracked_decisions);
+
+/**
+ * Get the current top talkers, most active first
+ * @param prefixes Non-zero for /24 and /48 prefixes, zero for single sources
+ * @param out Output array
+ * @param max Capacity of out
+ * @return Number of talkers written
+ */
+size_t security_get_top_talkers(int prefixes, security_talker_t *out, size_t max);
+
+/**
+ * Get the busiest autonomous systems, most requests first
+ * @param out Output array
+ * @param max Capacity of out
+ * @return Number of ASNs written
+ */
+size_t security_get_top_asns(security_asn_info_t *out, size_t max);
+
+/**
+ * Get ASN and country policy statistics
+ * @param tracked_asns Output: ASNs with counters
+ * @param blocked Output: connections and requests refused by a policy
+ */
+void security_get_geo_stats(uint32_t *tracked_asns, uint64_t *blocked);
+
 #ifdef __cplusplus
 }
 #endif
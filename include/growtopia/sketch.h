@@ -0,0 +1,95 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SKETCH_MAX_KEY 17                // Family byte + IPv6 address
+
+/**
+ * Count-Min sketch: fixed-memory frequency estimates that never undercount
+ */
+typedef struct {
+    uint32_t depth;                      // Number of hash rows
+    uint32_t width;                      // Counters per row (power of two)
+    uint32_t *counters;                  // depth * width counters
+} count_min_t;
+
+/**
+ * Space-Saving summary item
+ */
+typedef struct {
+    uint64_t hash;                       // Hash of the key, compared before the key bytes
+    uint8_t key[SKETCH_MAX_KEY];
+    uint8_t key_len;
+    uint32_t count;                      // Estimated count (overestimates by at most error)
+    uint32_t error;                      // Count inherited from the evicted item
+} space_saving_item_t;
+
+/**
+ * Space-Saving summary: the top-N most frequent keys in fixed memory
+ */
+typedef struct {
+    space_saving_item_t *items;
+    uint32_t capacity;
+    uint32_t size;
+} space_saving_t;
+
+/**
+ * Hash a key for use with the sketches
+ */
+uint64_t sketch_hash(const void *key, size_t len);
+
+/**
+ * Initialize a Count-Min sketch
+ * @param width Counters per row, rounded up to a power of two
+ * @return 0 on success, negative on error
+ */
+int count_min_init(count_min_t *cms, uint32_t depth, uint32_t width);
+void count_min_free(count_min_t *cms);
+
+/**
+ * Add n occurrences of a key (conservative update)
+ * @return The new estimate for the key
+ */
+uint32_t count_min_add(count_min_t *cms, uint64_t hash, uint32_t n);
+
+/**
+ * Estimate the count of a key
+ */
+uint32_t count_min_estimate(const count_min_t *cms, uint64_t hash);
+
+/**
+ * Forget all counts (start of a new window)
+ */
+void count_min_clear(count_min_t *cms);
+
+/**
+ * Initialize a Space-Saving summary tracking up to capacity keys
+ * @return 0 on success, negative on error
+ */
+int space_saving_init(space_saving_t *ss, uint32_t capacity);
+void space_saving_free(space_saving_t *ss);
+
+/**
+ * Add n occurrences of a key, evicting the least frequent key when full
+ */
+void space_saving_add(space_saving_t *ss, uint64_t hash, const void *key, size_t len, uint32_t n);
+
+/**
+ * Halve all counts so that the summary follows the recent rate
+ */
+void space_saving_decay(space_saving_t *ss);
+
+/**
+ * Copy the most frequent keys, most frequent first
+ * @return Number of items written
+ */
+size_t space_saving_top(const space_saving_t *ss, space_saving_item_t *out, size_t max);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,120 @@
+#pragma once
+
+#include "growtopia/config/server.h"
+#include "growtopia/response.h"
+#include <h2o.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Response body being streamed from a producer
+ */
+typedef struct stream stream_t;
+
+/**
+ * Source of a streamed body
+ *
+ * Embed it at the start of the producer's own struct, usually allocated from the request's pool.
+ */
+typedef struct stream_producer {
+    /**
+     * Fill buf with the next part of the body
+     * @param cap Size of buf (the configured chunk size)
+     * @param eos Output: set to 1 when these bytes end the body
+     * @return Bytes written; 0 with eos unset when nothing is ready yet (call stream_resume() once there is);
+     *         negative on error, which aborts the response
+     */
+    ssize_t (*read)(struct stream_producer *self, char *buf, size_t cap, int *eos);
+    /**
+     * Called once when the response ends, however it ends (may be NULL)
+     * @param completed 1 if the whole body was handed to h2o, 0 if it failed or the client went away
+     */
+    void (*close)(struct stream_producer *self, int completed);
+} stream_producer_t;
+
+/**
+ * Writer side of a ring-buffer producer
+ */
+typedef struct stream_ring stream_ring_t;
+
+/**
+ * Set the chunk size. Must be called once at startup.
+ * @param config Streaming configuration (NULL for defaults)
+ * @return 0 on success, negative on error
+ */
+int stream_init(const stream_config_t *config);
+
+/**
+ * Start a response and stream its body from a producer.
+ *
+ * The body is read one chunk at a time into a single buffer of the configured size. The next chunk is
+ * only read when h2o calls proceed, that is, once the previous one has been written out and the peer's
+ * flow control allows more. A slow client therefore slows the producer down instead of making the
+ * response grow in memory. If the client goes away, h2o calls stop and the producer is closed; it is
+ * never read again.
+ * @param tmpl Status and headers; set req->res.content_length first if the length is known, otherwise
+ *             the body is sent chunked
+ * @param producer Body source; closed when the response ends
+ * @return Stream, valid until the producer is closed
+ */
+stream_t *stream_start(h2o_req_t *req, const response_template_t *tmpl, stream_producer_t *producer);
+
+/**
+ * Read the producer again after it returned 0 without eos; does nothing otherwise. Must not be called
+ * once the producer has been closed.
+ */
+void stream_resume(stream_t *stream);
+
+/**
+ * Producer reading len bytes of a file from offset off; it takes ownership of fd
+ */
+stream_producer_t *stream_file_producer(h2o_req_t *req, int fd, off_t off, size_t len);
+
+/**
+ * Producer packing items from an iterator into chunks
+ * @param next Stores the next item and returns 1, returns 0 at the end, or negative on error. An item
+ *             only needs to stay valid until the next call.
+ * @param ctx Passed to next; free it from a pool dispose callback, since next is not called after a cancel
+ */
+stream_producer_t *stream_iterator_producer(h2o_req_t *req, int (*next)(void *ctx, h2o_iovec_t *item), void *ctx);
+
+/**
+ * Start a response whose body is written into a ring buffer, by code that runs on the event loop
+ * after the handler has returned.
+ * @param capacity Ring size; writes beyond what the client has taken are refused
+ * @param on_writable Called when a refused write may now succeed, and once when the response ends early
+ *                    so the writer notices (may be NULL)
+ * @return Ring, owned by the writer until stream_ring_close(); NULL on allocation failure (nothing is sent)
+ */
+stream_ring_t *stream_start_ring(h2o_req_t *req, const response_template_t *tmpl, size_t capacity,
+                                 void (*on_writable)(void *ctx), void *ctx);
+
+/**
+ * Append to the body
+ * @return Bytes accepted, possibly fewer than len (0 when the ring is full); negative once the response
+ *         has ended, after which the writer should close the ring
+ */
+ssize_t stream_ring_write(stream_ring_t *ring, const void *data, size_t len);
+
+/**
+ * End the body once the ring is drained, and release the writer's reference
+ * @param error Non-zero to abort the response instead
+ */
+void stream_ring_close(stream_ring_t *ring, int error);
+
+/**
+ * Get streaming statistics
+ * @param started Output: streamed responses started
+ * @param completed Output: responses whose whole body was sent
+ * @param canceled Output: responses stopped because the client went away
+ * @param failed Output: responses aborted by a producer error
+ * @param bytes Output: body bytes produced
+ */
+void stream_get_stats(uint64_t *started, uint64_t *completed, uint64_t *canceled, uint64_t *failed, uint64_t *bytes);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,31 @@
+#pragma once
+
+#include "growtopia/config/server.h"
+#include <openssl/ssl.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Apply the TLS configuration to a server context and start counting handshakes.
+ * The cipher list is left as configured.
+ * @param ssl_ctx Server SSL context
+ * @param config TLS configuration (NULL for defaults)
+ * @return 0 on success, negative on error
+ */
+int tls_init(SSL_CTX *ssl_ctx, const tls_config_t *config);
+
+/**
+ * Get TLS statistics
+ * @param ktls_connections Output: handshakes whose records are encrypted by the kernel
+ * @param userspace_connections Output: handshakes whose records are encrypted by OpenSSL
+ * @param ecdsa_handshakes Output: full handshakes authenticated with an ECDSA certificate
+ * @param rsa_handshakes Output: full handshakes authenticated with an RSA certificate
+ */
+void tls_get_stats(uint64_t *ktls_connections, uint64_t *userspace_connections, uint64_t *ecdsa_handshakes,
+                   uint64_t *rsa_handshakes);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,78 @@
+#pragma once
+
+/*
+ * USDT tracepoints, provider "growtopia" (see scripts/trace/ for bpftrace scripts).
+ *
+ * With GROWTOPIA_USE_USDT each probe site is a single nop plus an ELF note, and each probe has a
+ * semaphore that bpftrace/perf raise while attached. Work done only to feed a probe (timestamps,
+ * lookups) goes under GROWTOPIA_TRACE_ENABLED so a detached probe costs one predictable branch.
+ * Without GROWTOPIA_USE_USDT everything compiles away.
+ *
+ * Probes and arguments:
+ *   accept(const struct sockaddr *peer, int via_proxy)
+ *   connection_check(const struct sockaddr *peer, int allowed, uint64_t duration_ns)
+ *   request_check(const struct sockaddr *peer, int allowed, uint64_t duration_ns)
+ *   ban(const struct sockaddr *addr, uint32_t duration_seconds, int manual)
+ *   handler_entry(const char *route, h2o_req_t *req)
+ *   handler_return(const char *route, h2o_req_t *req, int result, uint64_t duration_ns)
+ *   request_done(const char *route, int status, uint64_t bytes_sent, uint64_t duration_ns)
+ *   handshake_done(SSL *ssl, int cert_type, int ktls, int resumed, uint64_t duration_ns)
+ */
+
+#include <stdint.h>
+#include <time.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define GROWTOPIA_PROBES(X)                                                                                            \
+    X(accept)                                                                                                          \
+    X(connection_check)                                                                                                \
+    X(request_check)                                                                                                   \
+    X(ban)                                                                                                             \
+    X(handler_entry)                                                                                                   \
+    X(handler_return)                                                                                                  \
+    X(request_done)                                                                                                    \
+    X(handshake_done)
+
+/* cert_type argument of handshake_done */
+#define GROWTOPIA_TRACE_CERT_OTHER 0
+#define GROWTOPIA_TRACE_CERT_ECDSA 1
+#define GROWTOPIA_TRACE_CERT_RSA 2
+
+#if GROWTOPIA_USE_USDT
+
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+
+#define GROWTOPIA_DECLARE_SEMAPHORE(name) extern unsigned short growtopia_##name##_semaphore;
+GROWTOPIA_PROBES(GROWTOPIA_DECLARE_SEMAPHORE)
+#undef GROWTOPIA_DECLARE_SEMAPHORE
+
+#define GROWTOPIA_TRACE_ENABLED(name) __builtin_expect(*(volatile unsigned short *)&growtopia_##name##_semaphore != 0, 0)
+#define GROWTOPIA_TRACE(name, ...) STAP_PROBEV(growtopia, name, __VA_ARGS__)
+
+#else
+
+/* arguments stay inside an unevaluated sizeof so values computed only for a probe don't warn */
+int growtopia_trace_args(int unused, ...);
+
+#define GROWTOPIA_TRACE_ENABLED(name) 0
+#define GROWTOPIA_TRACE(name, ...) ((void)sizeof(growtopia_trace_args(0, __VA_ARGS__)))
+
+#endif
+
+/**
+ * Monotonic clock for probe durations; call only under GROWTOPIA_TRACE_ENABLED
+ */
+static inline uint64_t growtopia_trace_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,538 @@
+#include "growtopia/admin.h"
+#include "growtopia/assets.h"
+#include "growtopia/bufpool.h"
+#include "growtopia/certstore.h"
+#include "growtopia/geoip.h"
+#include "growtopia/response.h"
+#include "growtopia/security.h"
+#include "growtopia/stream.h"
+#include <arpa/inet.h>
+#include <ctype.h>
+#include <h2o.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BATCH_SLICE 1024           // Operations applied per lock acquisition
+#define RESULT_LINE_MAX 256        // Upper bound on one NDJSON result line
+
+static response_template_t *json_response;
+static response_template_t *ndjson_response;
+
+typedef struct {
+    const char *p;
+    const char *end;
+} json_cursor_t;
+
+typedef struct {
+    stream_producer_t super;
+    security_snapshot_t *snapshot;
+    char *out;                           // Chunk being filled
+    size_t len;
+    size_t cap;
+    char *spill;                         // Lines of the last bucket that did not fit the chunk
+    size_t spill_len;
+    size_t spill_off;
+    size_t spill_cap;
+    int failed;                          // A line could not be kept; the export is aborted, not truncated
+} export_producer_t;
+
+int admin_init(void)
+{
+    if ((json_response = response_template_create(200, "OK")) == NULL ||
+        response_template_add_header(json_response, H2O_TOKEN_CONTENT_TYPE, H2O_STRLIT("application/json")) != 0)
+        goto Error;
+
+    if ((ndjson_response = response_template_create(200, "OK")) == NULL ||
+        response_template_add_header(ndjson_response, H2O_TOKEN_CONTENT_TYPE, H2O_STRLIT("application/x-ndjson")) != 0)
+        goto Error;
+
+    return 0;
+Error:
+    fprintf(stderr, "Failed to build admin responses\n");
+    return -1;
+}
+
+/* minimal JSON reader for flat objects with string, number and literal values */
+
+static void skip_ws(json_cursor_t *c)
+{
+    while (c->p < c->end && (*c->p == ' ' || *c->p == '\t' || *c->p == '\r' || *c->p == '\n'))
+        c->p++;
+}
+
+static int parse_string(json_cursor_t *c, h2o_iovec_t *out)
+{
+    if (c->p == c->end || *c->p != '"')
+        return -1;
+    const char *start = ++c->p;
+    while (c->p < c->end && *c->p != '"') {
+        if (*c->p == '\\')
+            return -1;  /* none of the accepted keys or values need escapes */
+        c->p++;
+    }
+    if (c->p == c->end)
+        return -1;
+    *out = h2o_iovec_init(start, c->p - start);
+    c->p++;
+    return 0;
+}
+
+static int parse_value(json_cursor_t *c, h2o_iovec_t *out, int *is_string)
+{
+    if (c->p < c->end && *c->p == '"') {
+        *is_string = 1;
+        return parse_string(c, out);
+    }
+
+    /* number, true, false or null */
+    const char *start = c->p;
+    while (c->p < c->end && (isalnum((unsigned char)*c->p) || *c->p == '-' || *c->p == '+' || *c->p == '.'))
+        c->p++;
+    if (c->p == start)
+        return -1;
+    *is_string = 0;
+    *out = h2o_iovec_init(start, c->p - start);
+    return 0;
+}
+
+static int parse_ip(h2o_iovec_t value, struct sockaddr_storage *addr)
+{
+    char str[INET6_ADDRSTRLEN];
+
+    if (value.len == 0 || value.len >= sizeof(str))
+        return -1;
+    memcpy(str, value.base, value.len);
+    str[value.len] = '\0';
+
+    memset(addr, 0, sizeof(*addr));
+    if (inet_pton(AF_INET, str, &((struct sockaddr_in *)addr)->sin_addr) == 1) {
+        addr->ss_family = AF_INET;
+        return 0;
+    }
+    if (inet_pton(AF_INET6, str, &((struct sockaddr_in6 *)addr)->sin6_addr) == 1) {
+        addr->ss_family = AF_INET6;
+        return 0;
+    }
+    return -1;
+}
+
+static int parse_op_type(h2o_iovec_t value, security_op_type_t *type)
+{
+    if (h2o_memis(value.base, value.len, H2O_STRLIT("ban")))
+        *type = SECURITY_OP_BAN;
+    else if (h2o_memis(value.base, value.len, H2O_STRLIT("unban")))
+        *type = SECURITY_OP_UNBAN;
+    else if (h2o_memis(value.base, value.len, H2O_STRLIT("whitelist")))
+        *type = SECURITY_OP_WHITELIST;
+    else if (h2o_memis(value.base, value.len, H2O_STRLIT("inspect")))
+        *type = SECURITY_OP_INSPECT;
+    else
+        return -1;
+    return 0;
+}
+
+static int parse_object(json_cursor_t *c, security_op_t *op, const char **err)
+{
+    int has_op = 0, has_ip = 0;
+
+    memset(op, 0, sizeof(*op));
+    if (c->p == c->end || *c->p != '{') {
+        *err = "expected an object";
+        return -1;
+    }
+    c->p++;
+    skip_ws(c);
+
+    while (c->p < c->end && *c->p != '}') {
+        h2o_iovec_t key, value;
+        int is_string;
+
+        if (parse_string(c, &key) != 0) {
+            *err = "expected a key";
+            return -1;
+        }
+        skip_ws(c);
+        if (c->p == c->end || *c->p != ':') {
+            *err = "expected ':'";
+            return -1;
+        }
+        c->p++;
+        skip_ws(c);
+        if (parse_value(c, &value, &is_string) != 0) {
+            *err = "unsupported value";
+            return -1;
+        }
+
+        if (h2o_memis(key.base, key.len, H2O_STRLIT("op"))) {
+            if (!is_string || parse_op_type(value, &op->type) != 0) {
+                *err = "unknown op";
+                return -1;
+            }
+            has_op = 1;
+        } else if (h2o_memis(key.base, key.len, H2O_STRLIT("ip"))) {
+            if (!is_string || parse_ip(value, &op->addr) != 0) {
+                *err = "invalid ip";
+                return -1;
+            }
+            has_ip = 1;
+        } else if (h2o_memis(key.base, key.len, H2O_STRLIT("duration"))) {
+            size_t duration = is_string ? SIZE_MAX : h2o_strtosize(value.base, value.len);
+            if (duration == SIZE_MAX || duration > UINT32_MAX) {
+                *err = "invalid duration";
+                return -1;
+            }
+            op->duration_seconds = (uint32_t)duration;
+        }
+        /* other keys are ignored */
+
+        skip_ws(c);
+        if (c->p < c->end && *c->p == ',') {
+            c->p++;
+            skip_ws(c);
+        }
+    }
+    if (c->p == c->end) {
+        *err = "unterminated object";
+        return -1;
+    }
+    c->p++;
+
+    if (!has_op || !has_ip) {
+        *err = "\"op\" and \"ip\" are required";
+        return -1;
+    }
+    return 0;
+}
+
+/* reads the next operation of a JSON array or NDJSON stream; returns 1 on success, 0 at the end, -1 on error */
+static int next_op(json_cursor_t *c, int in_array, security_op_t *op, const char **err)
+{
+    skip_ws(c);
+    if (in_array) {
+        if (c->p < c->end && *c->p == ',') {
+            c->p++;
+            skip_ws(c);
+        }
+        if (c->p < c->end && *c->p == ']') {
+            c->p++;
+            skip_ws(c);
+            if (c->p != c->end) {
+                *err = "trailing data after array";
+                return -1;
+            }
+            return 0;
+        }
+        if (c->p == c->end) {
+            *err = "unterminated array";
+            return -1;
+        }
+    } else if (c->p == c->end) {
+        return 0;
+    }
+
+    return parse_object(c, op, err) == 0 ? 1 : -1;
+}
+
+static json_cursor_t open_body(h2o_iovec_t body, int *in_array)
+{
+    json_cursor_t c = {body.base, body.base + body.len};
+
+    skip_ws(&c);
+    *in_array = c.p < c.end && *c.p == '[';
+    if (*in_array)
+        c.p++;
+    return c;
+}
+
+static const char *op_name(security_op_type_t type)
+{
+    switch (type) {
+    case SECURITY_OP_BAN:
+        return "ban";
+    case SECURITY_OP_UNBAN:
+        return "unban";
+    case SECURITY_OP_WHITELIST:
+        return "whitelist";
+    case SECURITY_OP_INSPECT:
+        return "inspect";
+    }
+    return "unknown";
+}
+
+static void format_ip(const struct sockaddr_storage *addr, char *buf, size_t len)
+{
+    if (addr->ss_family == AF_INET)
+        inet_ntop(AF_INET, &((const struct sockaddr_in *)addr)->sin_addr, buf, len);
+    else
+        inet_ntop(AF_INET6, &((const struct sockaddr_in6 *)addr)->sin6_addr, buf, len);
+}
+
+static int format_info(char *buf, size_t cap, const security_entry_info_t *info)
+{
+    char ip_str[INET6_ADDRSTRLEN];
+
+    format_ip(&info->addr, ip_str, sizeof(ip_str));
+    return snprintf(buf, cap, "\"ip\":\"%s\",\"connections\":%u,\"requests\":%u,\"strikes\":%u,\"ban_until\":%lld", ip_str,
+                    info->connection_count, info->request_count, info->strike_count, (long long)info->ban_until);
+}
+
+static int format_result(char *buf, size_t cap, const security_op_t *op)
+{
+    char ip_str[INET6_ADDRSTRLEN];
+    int len;
+
+    if (op->type == SECURITY_OP_INSPECT) {
+        len = snprintf(buf, cap, "{\"op\":\"inspect\",\"tracked\":%s,\"estimate\":%u,",
+                       op->result == 1 ? "true" : "false", op->info.estimate);
+        len += format_info(buf + len, cap - len, &op->info);
+        len += snprintf(buf + len, cap - len, "}\n");
+        return len;
+    }
+
+    format_ip(&op->addr, ip_str, sizeof(ip_str));
+    return snprintf(buf, cap, "{\"op\":\"%s\",\"ip\":\"%s\",\"ok\":%s}\n", op_name(op->type), ip_str,
+                    op->result >= 0 ? "true" : "false");
+}
+
+static int inspect_one(h2o_req_t *req)
+{
+    static h2o_generator_t generator = {NULL, NULL};
+    security_entry_info_t info;
+    struct sockaddr_storage addr;
+    h2o_iovec_t query = h2o_iovec_init(NULL, 0);
+
+    if (req->query_at != SIZE_MAX)
+        query = h2o_iovec_init(req->path.base + req->query_at + 1, req->path.len - req->query_at - 1);
+    if (query.len < 3 || memcmp(query.base, "ip=", 3) != 0 ||
+        parse_ip(h2o_iovec_init(query.base + 3, query.len - 3), &addr) != 0) {
+        h2o_send_error_400(req, "Bad Request", "expected ?ip=ADDR\n", 0);
+        return 0;
+    }
+
+    int tracked = security_inspect_ip((struct sockaddr *)&addr, &info);
+    char *body = h2o_mem_alloc_pool(&req->pool, char, RESULT_LINE_MAX);
+    int len = snprintf(body, RESULT_LINE_MAX, "{\"tracked\":%s,\"estimate\":%u,", tracked ? "true" : "false",
+                       info.estimate);
+    len += format_info(body + len, RESULT_LINE_MAX - len, &info);
+    len += snprintf(body + len, RESULT_LINE_MAX - len, "}\n");
+
+    h2o_iovec_t buf = h2o_iovec_init(body, len);
+    req->res.content_length = buf.len;
+    response_template_start(json_response, req, &generator);
+    h2o_send(req, &buf, 1, H2O_SEND_STATE_FINAL);
+    return 0;
+}
+
+int admin_ips_handler(h2o_handler_t *self, h2o_req_t *req)
+{
+    static h2o_generator_t generator = {NULL, NULL};
+    security_op_t *ops;
+    json_cursor_t c;
+    const char *err = NULL;
+    size_t count = 0, n;
+    int in_array, r;
+
+    if (h2o_memis(req->method.base, req->method.len, H2O_STRLIT("GET")))
+        return inspect_one(req);
+    if (!h2o_memis(req->method.base, req->method.len, H2O_STRLIT("POST")))
+        return -1;
+
+    /* validate the whole batch first, so a malformed request changes nothing */
+    ops = h2o_mem_alloc_pool(&req->pool, security_op_t, BATCH_SLICE);
+    c = open_body(req->entity, &in_array);
+    while ((r = next_op(&c, in_array, ops, &err)) == 1)
+        count++;
+    if (r < 0) {
+        char *msg = h2o_mem_alloc_pool(&req->pool, char, 128);
+        snprintf(msg, 128, "operation %zu: %s\n", count, err);
+        h2o_send_error_400(req, "Bad Request", msg, 0);
+        return 0;
+    }
+
+    char *body = bufpool_alloc(req, count * RESULT_LINE_MAX + 1);
+    size_t len = 0;
+
+    /* then apply it slice by slice, one lock acquisition per slice */
+    c = open_body(req->entity, &in_array);
+    do {
+        for (n = 0; n < BATCH_SLICE && next_op(&c, in_array, ops + n, &err) == 1; n++)
+            ;
+        security_apply_batch(ops, n);
+        for (size_t i = 0; i < n; i++)
+            len += format_result(body + len, RESULT_LINE_MAX, ops + i);
+    } while (n == BATCH_SLICE);
+
+    h2o_iovec_t buf = h2o_iovec_init(body, len);
+    req->res.content_length = buf.len;
+    response_template_start(ndjson_response, req, &generator);
+    h2o_send(req, &buf, 1, H2O_SEND_STATE_FINAL);
+    return 0;
+}
+
+static void append_entry(const security_entry_info_t *info, void *data)
+{
+    export_producer_t *self = data;
+    char line[RESULT_LINE_MAX];
+    size_t len = 1;
+
+    if (self->failed)
+        return;
+    line[0] = '{';
+    len += format_info(line + len, sizeof(line) - len, info);
+    len += snprintf(line + len, sizeof(line) - len, "}\n");
+
+    if (self->spill_len == 0 && self->cap - self->len >= len) {
+        memcpy(self->out + self->len, line, len);
+        self->len += len;
+        return;
+    }
+    if (self->spill_cap - self->spill_len < len) {
+        size_t capacity = self->spill_cap * 2 + RESULT_LINE_MAX;
+        char *spill = realloc(self->spill, capacity);
+        if (spill == NULL) {
+            self->failed = 1;
+            return;
+        }
+        self->spill = spill;
+        self->spill_cap = capacity;
+    }
+    memcpy(self->spill + self->spill_len, line, len);
+    self->spill_len += len;
+}
+
+/* snapshots emit whole hash buckets, so a chunk is filled until a line might not fit and any overflow
+ * waits in the spill buffer for the next one */
+static ssize_t read_export(stream_producer_t *_self, char *buf, size_t cap, int *eos)
+{
+    export_producer_t *self = (export_producer_t *)_self;
+
+    self->out = buf;
+    self->len = 0;
+    self->cap = cap;
+    for (;;) {
+        if (self->spill_off < self->spill_len) {
+            size_t n = self->spill_len - self->spill_off < cap - self->len ? self->spill_len - self->spill_off
+                                                                           : cap - self->len;
+            memcpy(buf + self->len, self->spill + self->spill_off, n);
+            self->spill_off += n;
+            self->len += n;
+            if (self->spill_off < self->spill_len)
+                break;
+            self->spill_off = self->spill_len = 0;
+        }
+        if (self->snapshot == NULL || cap - self->len < RESULT_LINE_MAX)
+            break;
+        if (security_snapshot_next(self->snapshot, (cap - self->len) / RESULT_LINE_MAX, append_entry, self)) {
+            /* stop copy-on-write as soon as the last entry is out */
+            security_snapshot_end(self->snapshot);
+            self->snapshot = NULL;
+        }
+        if (self->failed) {
+            fprintf(stderr, "export aborted: out of memory for the spill buffer\n");
+            return -1;
+        }
+    }
+
+    *eos = self->snapshot == NULL && self->spill_len == 0;
+    return self->len;
+}
+
+static void close_export(stream_producer_t *_self, int completed)
+{
+    export_producer_t *self = (export_producer_t *)_self;
+
+    if (self->snapshot != NULL)
+        security_snapshot_end(self->snapshot);
+    free(self->spill);
+}
+
+int admin_export_handler(h2o_handler_t *self, h2o_req_t *req)
+{
+    if (!h2o_memis(req->method.base, req->method.len, H2O_STRLIT("GET")))
+        return -1;
+
+    security_snapshot_t *snapshot = security_snapshot_begin();
+    if (snapshot == NULL) {
+        h2o_send_error_503(req, "Service Unavailable", "an export is already running\n", 0);
+        return 0;
+    }
+
+    export_producer_t *producer = h2o_mem_alloc_pool(&req->pool, export_producer_t, 1);
+    *producer = (export_producer_t){{read_export, close_export}, snapshot};
+    stream_start(req, ndjson_response, &producer->super);
+    return 0;
+}
+
+int admin_certs_reload_handler(h2o_handler_t *self, h2o_req_t *req)
+{
+    static h2o_generator_t generator = {NULL, NULL};
+    int hosts;
+
+    if (!h2o_memis(req->method.base, req->method.len, H2O_STRLIT("POST")))
+        return -1;
+
+    /* failures are detailed on stderr; the previous certificates stay in use */
+    if ((hosts = certstore_reload()) == CERTSTORE_NOT_CONFIGURED) {
+        h2o_send_error_generic(req, 409, "Conflict", "no certificate store is configured; nothing to reload\n", 0);
+        return 0;
+    }
+    if (hosts < 0) {
+        h2o_send_error_500(req, "Internal Server Error", "certificate reload failed; see server log\n", 0);
+        return 0;
+    }
+
+    char *body = h2o_mem_alloc_pool(&req->pool, char, RESULT_LINE_MAX);
+    int len = snprintf(body, RESULT_LINE_MAX, "{\"reloaded\":true,\"hosts\":%d}\n", hosts);
+    h2o_iovec_t buf = h2o_iovec_init(body, len);
+    req->res.content_length = buf.len;
+    response_template_start(json_response, req, &generator);
+    h2o_send(req, &buf, 1, H2O_SEND_STATE_FINAL);
+    return 0;
+}
+
+int admin_assets_reload_handler(h2o_handler_t *self, h2o_req_t *req)
+{
+    static h2o_generator_t generator = {NULL, NULL};
+    int assets;
+
+    if (!h2o_memis(req->method.base, req->method.len, H2O_STRLIT("POST")))
+        return -1;
+
+    /* unchanged files keep their mapping; downloads in flight finish on the files they started with */
+    if ((assets = assets_reload()) < 0) {
+        h2o_send_error_500(req, "Internal Server Error", "asset rescan failed; see server log\n", 0);
+        return 0;
+    }
+
+    char *body = h2o_mem_alloc_pool(&req->pool, char, RESULT_LINE_MAX);
+    int len = snprintf(body, RESULT_LINE_MAX, "{\"reloaded\":true,\"assets\":%d}\n", assets);
+    h2o_iovec_t buf = h2o_iovec_init(body, len);
+    req->res.content_length = buf.len;
+    response_template_start(json_response, req, &generator);
+    h2o_send(req, &buf, 1, H2O_SEND_STATE_FINAL);
+    return 0;
+}
+
+int admin_geoip_reload_handler(h2o_handler_t *self, h2o_req_t *req)
+{
+    static h2o_generator_t generator = {NULL, NULL};
+    int databases;
+
+    if (!h2o_memis(req->method.base, req->method.len, H2O_STRLIT("POST")))
+        return -1;
+
+    /* a database that fails to load keeps its previous mapping */
+    if ((databases = geoip_reload()) < 0) {
+        h2o_send_error_500(req, "Internal Server Error", "GeoIP reload failed; see server log\n", 0);
+        return 0;
+    }
+
+    char *body = h2o_mem_alloc_pool(&req->pool, char, RESULT_LINE_MAX);
+    int len = snprintf(body, RESULT_LINE_MAX, "{\"reloaded\":true,\"databases\":%d}\n", databases);
+    h2o_iovec_t buf = h2o_iovec_init(body, len);
+    req->res.content_length = buf.len;
+    response_template_start(json_response, req, &generator);
+    h2o_send(req, &buf, 1, H2O_SEND_STATE_FINAL);
+    return 0;
+}
@@ -0,0 +1,668 @@
+#include "growtopia/assets.h"
+#include "growtopia/response.h"
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <h2o.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <openssl/evp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define SEND_CHUNK_SIZE (256 * 1024)     // Bytes handed to h2o per proceed; bounds page-fault work per loop turn
+#define MAX_NAME_LEN 128                 // Longest asset name accepted in a path
+#define HASH_HEX_LEN 64                  // SHA-256 in hex
+
+/* a mapped file with its strong validator; shared by the catalog and in-flight responses */
+typedef struct {
+    uint32_t refcnt;
+    char *path;
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    const char *map;
+    size_t size;
+    char etag[HASH_HEX_LEN + 3];         // quoted hex digest
+} asset_blob_t;
+
+typedef struct {
+    uint64_t version;
+    asset_blob_t *blob;
+} asset_version_t;
+
+typedef struct {
+    uint64_t from;
+    asset_blob_t *blob;
+} asset_delta_t;
+
+typedef struct {
+    char *name;
+    asset_version_t *versions;           // newest first
+    size_t num_versions;
+    asset_delta_t *deltas;               // patches to versions[0]
+    size_t num_deltas;
+} asset_t;
+
+typedef struct {
+    asset_t *assets;
+    size_t num_assets;
+} asset_catalog_t;
+
+typedef struct {
+    h2o_generator_t super;
+    asset_blob_t *blob;
+    size_t off;
+    size_t end;
+} asset_generator_t;
+
+static assets_config_t g_config;
+static asset_catalog_t *g_catalog = NULL;
+static asset_blob_t g_empty_delta = {.refcnt = 1, .map = ""};  // Patch from the newest version to itself
+static response_template_t *ok_response;
+static response_template_t *partial_response;
+static response_template_t *not_modified_response;
+
+static uint64_t g_full = 0;
+static uint64_t g_ranges = 0;
+static uint64_t g_deltas = 0;
+static uint64_t g_not_modified = 0;
+static uint64_t g_bytes = 0;
+
+static void blob_release(asset_blob_t *blob)
+{
+    if (blob == NULL || --blob->refcnt != 0)
+        return;
+    if (blob->map != NULL)
+        munmap((void *)blob->map, blob->size);
+    free(blob->path);
+    free(blob);
+}
+
+static void free_asset(asset_t *asset)
+{
+    for (size_t j = 0; j < asset->num_versions; j++)
+        blob_release(asset->versions[j].blob);
+    for (size_t j = 0; j < asset->num_deltas; j++)
+        blob_release(asset->deltas[j].blob);
+    free(asset->versions);
+    free(asset->deltas);
+    free(asset->name);
+}
+
+static void free_catalog(asset_catalog_t *catalog)
+{
+    if (catalog == NULL)
+        return;
+    for (size_t i = 0; i < catalog->num_assets; i++)
+        free_asset(catalog->assets + i);
+    free(catalog->assets);
+    free(catalog);
+}
+
+static int parse_version(const char *s, size_t len, uint64_t *version)
+{
+    uint64_t v = 0;
+
+    if (len == 0 || len > 19)
+        return -1;
+    for (size_t i = 0; i < len; i++) {
+        if (!isdigit((unsigned char)s[i]))
+            return -1;
+        v = v * 10 + (s[i] - '0');
+    }
+    *version = v;
+    return 0;
+}
+
+/* an unchanged file from the previous scan keeps its mapping and checksum */
+static asset_blob_t *find_unchanged(const asset_catalog_t *old, const char *path, const struct stat *st)
+{
+    for (size_t i = 0; old != NULL && i < old->num_assets; i++) {
+        const asset_t *asset = old->assets + i;
+        for (size_t j = 0; j < asset->num_versions + asset->num_deltas; j++) {
+            asset_blob_t *blob = j < asset->num_versions ? asset->versions[j].blob
+                                                         : asset->deltas[j - asset->num_versions].blob;
+            if (strcmp(blob->path, path) != 0 || blob->dev != st->st_dev || blob->ino != st->st_ino)
+                continue;
+            if (blob->size == (size_t)st->st_size && blob->mtime.tv_sec == st->st_mtim.tv_sec &&
+                blob->mtime.tv_nsec == st->st_mtim.tv_nsec)
+                return blob;
+            /* the old mapping sees the new bytes, and a shrunk file faults (SIGBUS) on its tail */
+            fprintf(stderr, "assets: %s was modified in place; replace asset files by rename\n", path);
+        }
+    }
+    return NULL;
+}
+
+/* <file>.sha256 written by the release pipeline (sha256sum format) saves hashing the file here */
+static int read_checksum_file(const char *path, char *hex)
+{
+    char sidecar[PATH_MAX];
+    FILE *fp;
+    size_t n;
+
+    if (snprintf(sidecar, sizeof(sidecar), "%s.sha256", path) >= (int)sizeof(sidecar) ||
+        (fp = fopen(sidecar, "r")) == NULL)
+        return -1;
+    n = fread(hex, 1, HASH_HEX_LEN, fp);
+    fclose(fp);
+    if (n != HASH_HEX_LEN)
+        return -1;
+    for (size_t i = 0; i < HASH_HEX_LEN; i++) {
+        if (!isxdigit((unsigned char)hex[i]))
+            return -1;
+        hex[i] = tolower((unsigned char)hex[i]);
+    }
+    return 0;
+}
+
+static int hash_blob(const asset_blob_t *blob, char *hex)
+{
+    unsigned char md[EVP_MAX_MD_SIZE];
+    unsigned int md_len;
+
+    if (EVP_Digest(blob->map != NULL ? blob->map : "", blob->size, md, &md_len, EVP_sha256(), NULL) != 1)
+        return -1;
+    for (unsigned int i = 0; i < md_len; i++)
+        sprintf(hex + i * 2, "%02x", md[i]);
+    return 0;
+}
+
+static asset_blob_t *load_blob(const char *path, const asset_catalog_t *old)
+{
+    char hex[HASH_HEX_LEN + 1];
+    asset_blob_t *blob;
+    struct stat st;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1) {
+        fprintf(stderr, "assets: cannot open %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return NULL;
+    }
+    if ((blob = find_unchanged(old, path, &st)) != NULL) {
+        close(fd);
+        blob->refcnt++;
+        return blob;
+    }
+
+    if ((blob = calloc(1, sizeof(*blob))) == NULL || (blob->path = strdup(path)) == NULL) {
+        free(blob);
+        close(fd);
+        return NULL;
+    }
+    blob->refcnt = 1;
+    blob->dev = st.st_dev;
+    blob->ino = st.st_ino;
+    blob->mtime = st.st_mtim;
+    blob->size = st.st_size;
+    /* the mapping follows the file: files must be replaced by rename, never rewritten or truncated in place */
+    if (blob->size != 0) {
+        void *map = mmap(NULL, blob->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) {
+            fprintf(stderr, "assets: cannot map %s: %s\n", path, strerror(errno));
+            close(fd);
+            blob->size = 0;
+            blob_release(blob);
+            return NULL;
+        }
+        blob->map = map;
+    }
+    close(fd);
+
+    if (read_checksum_file(path, hex) != 0 && hash_blob(blob, hex) != 0) {
+        blob_release(blob);
+        return NULL;
+    }
+    hex[HASH_HEX_LEN] = '\0';
+    snprintf(blob->etag, sizeof(blob->etag), "\"%s\"", hex);
+    return blob;
+}
+
+static int compare_versions_desc(const void *a, const void *b)
+{
+    uint64_t x = ((const asset_version_t *)a)->version, y = ((const asset_version_t *)b)->version;
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+static int scan_asset(asset_t *asset, const char *dir, const asset_catalog_t *old)
+{
+    char path[PATH_MAX];
+    struct dirent *ent;
+    size_t cap = 0, num_patches = 0;
+    struct {
+        uint64_t from;
+        uint64_t to;
+    } *patches = NULL;
+    DIR *d;
+
+    if ((d = opendir(dir)) == NULL)
+        return -1;
+
+    /* list first: only the newest versions, and patches to the newest, get mapped */
+    while ((ent = readdir(d)) != NULL) {
+        const char *name = ent->d_name, *dash, *suffix;
+        size_t len = strlen(name);
+        uint64_t from, to;
+
+        if (parse_version(name, len, &to) == 0) {
+            if (asset->num_versions == cap) {
+                cap = cap != 0 ? cap * 2 : 8;
+                asset_version_t *grown = realloc(asset->versions, cap * sizeof(*grown));
+                if (grown == NULL)
+                    goto Error;
+                asset->versions = grown;
+            }
+            asset->versions[asset->num_versions++] = (asset_version_t){to, NULL};
+        } else if (len > 6 && strcmp(suffix = name + len - 6, ".delta") == 0 && (dash = strchr(name, '-')) != NULL &&
+                   parse_version(name, dash - name, &from) == 0 &&
+                   parse_version(dash + 1, suffix - dash - 1, &to) == 0 && from < to) {
+            void *grown = realloc(patches, (num_patches + 1) * sizeof(*patches));
+            if (grown == NULL)
+                goto Error;
+            patches = grown;
+            patches[num_patches].from = from;
+            patches[num_patches++].to = to;
+        }
+    }
+    closedir(d);
+    d = NULL;
+
+    /* a file that cannot be loaded is skipped; the next older version takes its place */
+    qsort(asset->versions, asset->num_versions, sizeof(*asset->versions), compare_versions_desc);
+    size_t num_listed = asset->num_versions;
+    asset->num_versions = 0;
+    for (size_t i = 0; i < num_listed && asset->num_versions < g_config.max_versions; i++) {
+        asset_version_t *slot = asset->versions + asset->num_versions;
+        snprintf(path, sizeof(path), "%s/%" PRIu64, dir, asset->versions[i].version);
+        if ((slot->blob = load_blob(path, old)) == NULL) {
+            fprintf(stderr, "assets: skipping %s\n", path);
+            continue;
+        }
+        slot->version = asset->versions[i].version;
+        asset->num_versions++;
+    }
+
+    if (num_patches != 0 && (asset->deltas = calloc(num_patches, sizeof(*asset->deltas))) == NULL)
+        goto Error;
+    for (size_t i = 0; i < num_patches && asset->num_versions != 0; i++) {
+        if (patches[i].to != asset->versions[0].version)
+            continue;
+        snprintf(path, sizeof(path), "%s/%" PRIu64 "-%" PRIu64 ".delta", dir, patches[i].from, patches[i].to);
+        if ((asset->deltas[asset->num_deltas].blob = load_blob(path, old)) == NULL) {
+            fprintf(stderr, "assets: skipping %s\n", path);
+            continue;
+        }
+        asset->deltas[asset->num_deltas++].from = patches[i].from;
+    }
+    free(patches);
+    return 0;
+
+Error:
+    /* whatever was loaded is released with the catalog */
+    if (d != NULL)
+        closedir(d);
+    free(patches);
+    return -1;
+}
+
+static asset_catalog_t *load_catalog(const asset_catalog_t *old)
+{
+    asset_catalog_t *catalog = calloc(1, sizeof(*catalog));
+    char dir[PATH_MAX];
+    struct dirent *ent;
+    struct stat st;
+    size_t cap = 0;
+    DIR *d;
+
+    if (catalog == NULL)
+        return NULL;
+    if ((d = opendir(g_config.root)) == NULL) {
+        if (errno == ENOENT)
+            return catalog;
+        fprintf(stderr, "assets: cannot open %s: %s\n", g_config.root, strerror(errno));
+        free(catalog);
+        return NULL;
+    }
+
+    while ((ent = readdir(d)) != NULL) {
+        if (ent->d_name[0] == '.' || strlen(ent->d_name) > MAX_NAME_LEN ||
+            snprintf(dir, sizeof(dir), "%s/%s", g_config.root, ent->d_name) >= (int)sizeof(dir) ||
+            stat(dir, &st) != 0 || !S_ISDIR(st.st_mode))
+            continue;
+
+        if (catalog->num_assets == cap) {
+            cap = cap != 0 ? cap * 2 : 8;
+            asset_t *grown = realloc(catalog->assets, cap * sizeof(*grown));
+            if (grown == NULL)
+                goto Error;
+            catalog->assets = grown;
+        }
+        /* one unreadable asset must not take the others down with it */
+        asset_t *asset = catalog->assets + catalog->num_assets++;
+        memset(asset, 0, sizeof(*asset));
+        if ((asset->name = strdup(ent->d_name)) == NULL || scan_asset(asset, dir, old) != 0) {
+            fprintf(stderr, "assets: skipping %s\n", dir);
+            asset->num_versions = 0;
+        }
+        if (asset->num_versions == 0) {
+            free_asset(asset);
+            catalog->num_assets--;
+        }
+    }
+    closedir(d);
+    return catalog;
+
+Error:
+    closedir(d);
+    free_catalog(catalog);
+    return NULL;
+}
+
+int assets_init(const assets_config_t *config)
+{
+    g_config = config ? *config : assets_get_default_config();
+    if (g_config.max_versions == 0)
+        g_config.max_versions = 1;
+
+    if ((ok_response = response_template_create(200, "OK")) == NULL ||
+        response_template_add_header(ok_response, H2O_TOKEN_CONTENT_TYPE, H2O_STRLIT("application/octet-stream")) != 0 ||
+        response_template_add_header(ok_response, H2O_TOKEN_ACCEPT_RANGES, H2O_STRLIT("bytes")) != 0)
+        goto Error;
+    if ((partial_response = response_template_create(206, "Partial Content")) == NULL ||
+        response_template_add_header(partial_response, H2O_TOKEN_CONTENT_TYPE, H2O_STRLIT("application/octet-stream")) !=
+            0 ||
+        response_template_add_header(partial_response, H2O_TOKEN_ACCEPT_RANGES, H2O_STRLIT("bytes")) != 0)
+        goto Error;
+    if ((not_modified_response = response_template_create(304, "Not Modified")) == NULL)
+        goto Error;
+    char hex[HASH_HEX_LEN + 1];
+    if (hash_blob(&g_empty_delta, hex) != 0)
+        goto Error;
+    hex[HASH_HEX_LEN] = '\0';
+    snprintf(g_empty_delta.etag, sizeof(g_empty_delta.etag), "\"%s\"", hex);
+
+    if ((g_catalog = load_catalog(NULL)) == NULL)
+        return -1;
+    printf("Serving %zu versioned assets from %s/\n", g_catalog->num_assets, g_config.root);
+    return 0;
+
+Error:
+    fprintf(stderr, "Failed to build asset responses\n");
+    return -1;
+}
+
+int assets_reload(void)
+{
+    asset_catalog_t *catalog;
+
+    if (g_catalog == NULL || (catalog = load_catalog(g_catalog)) == NULL)
+        return -1;
+    free_catalog(g_catalog);
+    g_catalog = catalog;
+    return (int)catalog->num_assets;
+}
+
+static const asset_t *find_asset(const char *name, size_t len)
+{
+    for (size_t i = 0; i < g_catalog->num_assets; i++) {
+        if (h2o_memis(g_catalog->assets[i].name, strlen(g_catalog->assets[i].name), name, len))
+            return g_catalog->assets + i;
+    }
+    return NULL;
+}
+
+/* 1 for a satisfiable single range, 0 to send the whole body, -1 when nothing of the body is in range */
+static int parse_range(h2o_iovec_t value, size_t size, size_t *off, size_t *end)
+{
+    const char *dash;
+    size_t first, last;
+
+    if (value.len < 6 || !h2o_lcstris(value.base, 6, H2O_STRLIT("bytes=")))
+        return 0;
+    value.base += 6;
+    value.len -= 6;
+    /* a multipart/byteranges reply is not worth it for resumable downloads; send everything */
+    if (memchr(value.base, ',', value.len) != NULL || (dash = memchr(value.base, '-', value.len)) == NULL)
+        return 0;
+    first = h2o_strtosize(value.base, dash - value.base);
+    last = h2o_strtosize(dash + 1, value.base + value.len - dash - 1);
+
+    if (dash == value.base) {
+        /* suffix range: the last N bytes */
+        if (last == SIZE_MAX)
+            return 0;
+        if (last == 0 || size == 0)
+            return -1;
+        *off = last < size ? size - last : 0;
+        *end = size;
+        return 1;
+    }
+    if (first == SIZE_MAX || (dash + 1 != value.base + value.len && (last == SIZE_MAX || last < first)))
+        return 0;
+    if (first >= size)
+        return -1;
+    *off = first;
+    *end = dash + 1 == value.base + value.len || last >= size ? size : last + 1;
+    return 1;
+}
+
+static int has_etag(h2o_req_t *req, const h2o_token_t *token, const asset_blob_t *blob, int exact)
+{
+    ssize_t i = h2o_find_header(&req->headers, token, -1);
+    size_t etag_len = strlen(blob->etag);
+
+    if (i == -1)
+        return 0;
+    h2o_iovec_t value = req->headers.entries[i].value;
+    if (exact)
+        return h2o_memis(value.base, value.len, blob->etag, etag_len);
+    /* If-None-Match may list several tags or be "*" */
+    if (h2o_memis(value.base, value.len, H2O_STRLIT("*")))
+        return 1;
+    for (size_t j = 0; j + etag_len <= value.len; j++) {
+        if (memcmp(value.base + j, blob->etag, etag_len) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+static void send_chunk(asset_generator_t *gen, h2o_req_t *req)
+{
+    size_t len = gen->end - gen->off;
+
+    if (len > SEND_CHUNK_SIZE)
+        len = SEND_CHUNK_SIZE;
+    h2o_iovec_t buf = h2o_iovec_init(gen->blob->map + gen->off, len);
+    gen->off += len;
+    h2o_send(req, &buf, len != 0, gen->off == gen->end ? H2O_SEND_STATE_FINAL : H2O_SEND_STATE_IN_PROGRESS);
+}
+
+static void on_proceed(h2o_generator_t *self, h2o_req_t *req)
+{
+    send_chunk((asset_generator_t *)self, req);
+}
+
+static void on_generator_dispose(void *_gen)
+{
+    asset_generator_t *gen = _gen;
+    blob_release(gen->blob);
+}
+
+/* value of name=... anywhere in the query string; base is NULL when absent */
+static h2o_iovec_t find_param(h2o_req_t *req, const char *name)
+{
+    size_t name_len = strlen(name);
+    const char *p, *end = req->path.base + req->path.len;
+
+    if (req->query_at == SIZE_MAX)
+        return h2o_iovec_init(NULL, 0);
+    for (p = req->path.base + req->query_at + 1; p < end;) {
+        const char *amp = memchr(p, '&', end - p), *param_end = amp ? amp : end;
+        if ((size_t)(param_end - p) > name_len && memcmp(p, name, name_len) == 0 && p[name_len] == '=')
+            return h2o_iovec_init(p + name_len + 1, param_end - p - name_len - 1);
+        p = param_end + 1;
+    }
+    return h2o_iovec_init(NULL, 0);
+}
+
+static void add_header(h2o_req_t *req, const char *name, const char *value, size_t len)
+{
+    h2o_add_header_by_str(&req->pool, &req->res.headers, name, strlen(name), 0, NULL, value, len);
+}
+
+static void add_version_header(h2o_req_t *req, const char *name, uint64_t version)
+{
+    char *buf = h2o_mem_alloc_pool(&req->pool, char, 24);
+    add_header(req, name, buf, snprintf(buf, 24, "%" PRIu64, version));
+}
+
+int assets_handler(h2o_handler_t *self, h2o_req_t *req)
+{
+    static h2o_generator_t generator = {NULL, NULL};
+    int is_head = h2o_memis(req->method.base, req->method.len, H2O_STRLIT("HEAD"));
+    const asset_t *asset;
+    const asset_blob_t *blob;
+    uint64_t version = 0, from = 0;
+    h2o_iovec_t from_param;
+    int pinned = 0, is_delta = 0, range = 0;
+    size_t off, end;
+
+    if (!is_head && !h2o_memis(req->method.base, req->method.len, H2O_STRLIT("GET")))
+        return -1;
+
+    /* <prefix>/<asset>[/<version>] */
+    h2o_iovec_t rest = req->path_normalized;
+    size_t prefix_len = req->pathconf->path.len;
+    if (rest.len <= prefix_len + 1)
+        return -1;
+    rest.base += prefix_len + 1;
+    rest.len -= prefix_len + 1;
+    const char *slash = memchr(rest.base, '/', rest.len);
+    size_t name_len = slash != NULL ? (size_t)(slash - rest.base) : rest.len;
+    if ((asset = find_asset(rest.base, name_len)) == NULL) {
+        h2o_send_error_404(req, "Not Found", "no such asset\n", 0);
+        return 0;
+    }
+
+    blob = asset->versions[0].blob;
+    version = asset->versions[0].version;
+    if (slash != NULL) {
+        if (parse_version(slash + 1, rest.base + rest.len - slash - 1, &version) != 0)
+            goto NotFound;
+        blob = NULL;
+        for (size_t i = 0; i < asset->num_versions; i++) {
+            if (asset->versions[i].version == version)
+                blob = asset->versions[i].blob;
+        }
+        if (blob == NULL)
+            goto NotFound;
+        pinned = 1;
+    } else if ((from_param = find_param(req, "from")).base != NULL &&
+               parse_version(from_param.base, from_param.len, &from) == 0) {
+        /* an up-to-date client gets an empty patch; one with a patch gets the patch */
+        if (from == version) {
+            blob = &g_empty_delta;
+            is_delta = 1;
+        }
+        for (size_t i = 0; i < asset->num_deltas; i++) {
+            if (asset->deltas[i].from == from) {
+                blob = asset->deltas[i].blob;
+                is_delta = 1;
+            }
+        }
+    }
+
+    h2o_add_header(&req->pool, &req->res.headers, H2O_TOKEN_ETAG, NULL, blob->etag, strlen(blob->etag));
+    add_version_header(req, "x-asset-version", version);
+    if (is_delta)
+        add_version_header(req, "x-asset-delta-from", from);
+    /* a pinned version never changes; the newest one must be revalidated (a 304 is cheap) */
+    if (pinned)
+        h2o_add_header(&req->pool, &req->res.headers, H2O_TOKEN_CACHE_CONTROL, NULL,
+                       H2O_STRLIT("public, max-age=31536000, immutable"));
+    else
+        h2o_add_header(&req->pool, &req->res.headers, H2O_TOKEN_CACHE_CONTROL, NULL, H2O_STRLIT("no-cache"));
+
+    if (has_etag(req, H2O_TOKEN_IF_NONE_MATCH, blob, 0))
+        goto NotModified;
+
+    off = 0;
+    end = blob->size;
+    ssize_t range_at = h2o_find_header(&req->headers, H2O_TOKEN_RANGE, -1);
+    if (range_at != -1 && (h2o_find_header(&req->headers, H2O_TOKEN_IF_RANGE, -1) == -1 ||
+                           has_etag(req, H2O_TOKEN_IF_RANGE, blob, 1))) {
+        if ((range = parse_range(req->headers.entries[range_at].value, blob->size, &off, &end)) < 0) {
+            char *buf = h2o_mem_alloc_pool(&req->pool, char, 32);
+            h2o_add_header(&req->pool, &req->res.headers, H2O_TOKEN_CONTENT_RANGE, NULL, buf,
+                           snprintf(buf, 32, "bytes */%zu", blob->size));
+            h2o_send_error_416(req, "Range Not Satisfiable", "requested range not satisfiable\n", 0);
+            return 0;
+        }
+    }
+
+    if (range) {
+        char *buf = h2o_mem_alloc_pool(&req->pool, char, 64);
+        h2o_add_header(&req->pool, &req->res.headers, H2O_TOKEN_CONTENT_RANGE, NULL, buf,
+                       snprintf(buf, 64, "bytes %zu-%zu/%zu", off, end - 1, blob->size));
+        g_ranges++;
+    } else if (!is_delta) {
+        g_full++;
+    }
+    if (is_delta)
+        g_deltas++;
+
+    req->res.content_length = end - off;
+    if (is_head) {
+        response_template_start(range ? partial_response : ok_response, req, &generator);
+        h2o_send(req, NULL, 0, H2O_SEND_STATE_FINAL);
+        return 0;
+    }
+    g_bytes += end - off;
+
+    /* the mapping stays alive until the response is done, even across a reload */
+    asset_generator_t *gen = h2o_mem_alloc_shared(&req->pool, sizeof(*gen), on_generator_dispose);
+    memset(gen, 0, sizeof(*gen));
+    gen->super.proceed = on_proceed;
+    gen->blob = (asset_blob_t *)blob;
+    gen->blob->refcnt++;
+    gen->off = off;
+    gen->end = end;
+
+    response_template_start(range ? partial_response : ok_response, req, &gen->super);
+    send_chunk(gen, req);
+    return 0;
+
+NotModified:
+    g_not_modified++;
+    response_template_start(not_modified_response, req, &generator);
+    h2o_send(req, NULL, 0, H2O_SEND_STATE_FINAL);
+    return 0;
+
+NotFound:
+    h2o_send_error_404(req, "Not Found", "no such asset version\n", 0);
+    return 0;
+}
+
+void assets_get_stats(uint64_t *full, uint64_t *ranges, uint64_t *deltas, uint64_t *not_modified, uint64_t *bytes)
+{
+    if (full)
+        *full = g_full;
+    if (ranges)
+        *ranges = g_ranges;
+    if (deltas)
+        *deltas = g_deltas;
+    if (not_modified)
+        *not_modified = g_not_modified;
+    if (bytes)
+        *bytes = g_bytes;
+}
@@ -0,0 +1,268 @@
+#include "growtopia/bufpool.h"
+#include <h2o.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MIN_CLASS_SHIFT 10               // 1 KiB; h2o serves smaller allocations from pool chunks it recycles itself
+#define MAX_CLASS_SHIFT 18               // 256 KiB; larger buffers are allocated and freed every time
+#define NUM_CLASSES (MAX_CLASS_SHIFT - MIN_CLASS_SHIFT + 1)
+#define INITIAL_LEASE_BITS 10
+
+typedef struct bufpool_buf {
+    _Alignas(max_align_t) struct bufpool_buf *next; // Next buffer of the same request, or of the freelist
+    size_t size_class;                   // NUM_CLASSES for a buffer too large to recycle
+} bufpool_buf_t;
+
+/* the buffers one request holds; slots are found by request address */
+typedef struct {
+    h2o_req_t *req;                      // NULL for an empty slot
+    bufpool_buf_t *bufs;
+    size_t bytes;
+} lease_t;
+
+typedef struct bufpool_route {
+    h2o_logger_t super;
+    const char *route;
+    h2o_pathconf_t *pathconf;
+    struct bufpool_route *next;
+    uint64_t requests;
+    uint64_t pool_bytes;                 // Sum over requests of the pool used when the request ended
+    uint64_t max_pool_bytes;
+    uint64_t direct_allocations;         // Pool allocations too large for a chunk (one malloc each)
+    uint64_t buffer_bytes;               // Sum over requests of recycled buffer bytes held
+    uint64_t max_buffer_bytes;
+} bufpool_route_t;
+
+static bufpool_config_t g_config;
+static bufpool_route_t *g_routes = NULL;
+
+/* per-thread state: event loops never share a request, so none of this needs locking */
+static _Thread_local struct {
+    bufpool_buf_t *free_lists[NUM_CLASSES];
+    uint64_t cached_bytes;
+    lease_t *leases;                     // Open addressing, linear probing
+    unsigned lease_bits;
+    size_t num_leases;
+} g_local;
+
+/* statistics */
+static uint64_t g_hits = 0;
+static uint64_t g_misses = 0;
+static uint64_t g_trimmed = 0;
+
+int bufpool_init(const bufpool_config_t *config)
+{
+    g_config = config ? *config : bufpool_get_default_config();
+
+    printf("Buffer pool: %u size classes up to %u KiB, %llu KiB cached per thread\n", NUM_CLASSES,
+           (1u << MAX_CLASS_SHIFT) / 1024, (unsigned long long)(g_config.max_cached_bytes / 1024));
+    return 0;
+}
+
+static size_t class_bytes(size_t size_class)
+{
+    return (size_t)1 << (MIN_CLASS_SHIFT + size_class);
+}
+
+static size_t class_of(size_t size)
+{
+    size_t shift = size <= ((size_t)1 << MIN_CLASS_SHIFT) ? MIN_CLASS_SHIFT : 64 - __builtin_clzll(size - 1);
+    return shift > MAX_CLASS_SHIFT ? NUM_CLASSES : shift - MIN_CLASS_SHIFT;
+}
+
+static size_t lease_slot(const h2o_req_t *req, unsigned bits)
+{
+    return (size_t)(((uint64_t)(uintptr_t)req * 0x9e3779b97f4a7c15ULL) >> (64 - bits));
+}
+
+static lease_t *find_lease(const h2o_req_t *req)
+{
+    size_t mask = ((size_t)1 << g_local.lease_bits) - 1;
+
+    for (size_t i = lease_slot(req, g_local.lease_bits);; i = (i + 1) & mask) {
+        if (g_local.leases[i].req == req || g_local.leases[i].req == NULL)
+            return g_local.leases + i;
+    }
+}
+
+/* doubles the table once it is half full; steady traffic stops growing it */
+static int reserve_lease(void)
+{
+    if (g_local.leases != NULL && (g_local.num_leases + 1) * 2 <= ((size_t)1 << g_local.lease_bits))
+        return 0;
+
+    lease_t *old = g_local.leases;
+    size_t old_slots = old != NULL ? (size_t)1 << g_local.lease_bits : 0;
+    unsigned bits = old != NULL ? g_local.lease_bits + 1 : INITIAL_LEASE_BITS;
+    lease_t *leases = calloc((size_t)1 << bits, sizeof(*leases));
+    if (leases == NULL)
+        return -1;
+
+    g_local.leases = leases;
+    g_local.lease_bits = bits;
+    for (size_t i = 0; i < old_slots; i++) {
+        if (old[i].req != NULL)
+            *find_lease(old[i].req) = old[i];
+    }
+    free(old);
+    return 0;
+}
+
+/* backward-shift deletion keeps every probe chain unbroken without tombstones */
+static void remove_lease(lease_t *lease)
+{
+    size_t mask = ((size_t)1 << g_local.lease_bits) - 1, hole = (size_t)(lease - g_local.leases);
+
+    for (size_t i = (hole + 1) & mask; g_local.leases[i].req != NULL; i = (i + 1) & mask) {
+        size_t home = lease_slot(g_local.leases[i].req, g_local.lease_bits);
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            g_local.leases[hole] = g_local.leases[i];
+            hole = i;
+        }
+    }
+    g_local.leases[hole].req = NULL;
+    g_local.num_leases--;
+}
+
+static bufpool_route_t *find_route(const h2o_pathconf_t *pathconf)
+{
+    for (bufpool_route_t *route = g_routes; route != NULL; route = route->next) {
+        if (route->pathconf == pathconf)
+            return route;
+    }
+    return NULL;
+}
+
+void *bufpool_alloc(h2o_req_t *req, size_t size)
+{
+    size_t size_class = class_of(size);
+    bufpool_buf_t *buf;
+
+    if (size < ((size_t)1 << MIN_CLASS_SHIFT) || find_route(req->pathconf) == NULL || reserve_lease() != 0)
+        return h2o_mem_alloc_pool(&req->pool, char, size);
+
+    if (size_class < NUM_CLASSES && (buf = g_local.free_lists[size_class]) != NULL) {
+        g_local.free_lists[size_class] = buf->next;
+        g_local.cached_bytes -= class_bytes(size_class);
+        g_hits++;
+    } else {
+        buf = h2o_mem_alloc(sizeof(*buf) + (size_class < NUM_CLASSES ? class_bytes(size_class) : size));
+        buf->size_class = size_class;
+        g_misses++;
+    }
+
+    lease_t *lease = find_lease(req);
+    if (lease->req == NULL) {
+        lease->req = req;
+        lease->bufs = NULL;
+        lease->bytes = 0;
+        g_local.num_leases++;
+    }
+    buf->next = lease->bufs;
+    lease->bufs = buf;
+    lease->bytes += size_class < NUM_CLASSES ? class_bytes(size_class) : size;
+    return buf + 1;
+}
+
+static void release_buffers(bufpool_buf_t *buf)
+{
+    while (buf != NULL) {
+        bufpool_buf_t *next = buf->next;
+        if (buf->size_class < NUM_CLASSES &&
+            g_local.cached_bytes + class_bytes(buf->size_class) <= g_config.max_cached_bytes) {
+            buf->next = g_local.free_lists[buf->size_class];
+            g_local.free_lists[buf->size_class] = buf;
+            g_local.cached_bytes += class_bytes(buf->size_class);
+        } else {
+            free(buf);
+            g_trimmed++;
+        }
+        buf = next;
+    }
+}
+
+/* bytes the request took from its pool chunks; the head chunk is filled up to chunk_offset */
+static size_t pool_bytes_used(const h2o_mem_pool_t *pool, uint64_t *directs)
+{
+    size_t bytes = 0;
+
+    for (const union un_h2o_mem_pool_chunk_t *chunk = pool->chunks; chunk != NULL; chunk = chunk->next)
+        bytes += sizeof(chunk->bytes);
+    if (pool->chunks != NULL)
+        bytes -= sizeof(pool->chunks->bytes) - pool->chunk_offset;
+    for (const struct st_h2o_mem_pool_direct_t *direct = pool->directs; direct != NULL; direct = direct->next)
+        (*directs)++;
+    return bytes;
+}
+
+/* called by h2o as the request is disposed, before its pool is cleared */
+static void on_request_done(h2o_logger_t *_self, h2o_req_t *req)
+{
+    bufpool_route_t *route = (bufpool_route_t *)_self;
+    size_t bytes = pool_bytes_used(&req->pool, &route->direct_allocations), buffer_bytes = 0;
+
+    route->requests++;
+    route->pool_bytes += bytes;
+    if (bytes > route->max_pool_bytes)
+        route->max_pool_bytes = bytes;
+
+    if (g_local.num_leases != 0) {
+        lease_t *lease = find_lease(req);
+        if (lease->req != NULL) {
+            buffer_bytes = lease->bytes;
+            release_buffers(lease->bufs);
+            remove_lease(lease);
+        }
+    }
+    route->buffer_bytes += buffer_bytes;
+    if (buffer_bytes > route->max_buffer_bytes)
+        route->max_buffer_bytes = buffer_bytes;
+}
+
+int bufpool_register_route(h2o_pathconf_t *pathconf, const char *route_name)
+{
+    bufpool_route_t *route = (bufpool_route_t *)h2o_create_logger(pathconf, sizeof(*route));
+
+    if (route == NULL)
+        return -1;
+    route->super.log_access = on_request_done;
+    route->route = route_name;
+    route->pathconf = pathconf;
+    route->next = g_routes;
+    g_routes = route;
+    return 0;
+}
+
+size_t bufpool_format_stats(char *buf, size_t cap)
+{
+    size_t len = 0;
+
+    for (bufpool_route_t *route = g_routes; route != NULL && len + 1 < cap; route = route->next) {
+        int n = snprintf(buf + len, cap - len,
+                         "%s: %llu requests, pool avg %llu max %llu bytes, %llu direct allocations, "
+                         "buffers avg %llu max %llu bytes\n",
+                         route->route, (unsigned long long)route->requests,
+                         (unsigned long long)(route->requests ? route->pool_bytes / route->requests : 0),
+                         (unsigned long long)route->max_pool_bytes, (unsigned long long)route->direct_allocations,
+                         (unsigned long long)(route->requests ? route->buffer_bytes / route->requests : 0),
+                         (unsigned long long)route->max_buffer_bytes);
+        if (n < 0)
+            break;
+        len += (size_t)n < cap - len ? (size_t)n : cap - len - 1;
+    }
+    return len;
+}
+
+void bufpool_get_stats(uint64_t *hits, uint64_t *misses, uint64_t *trimmed, uint64_t *cached_bytes)
+{
+    if (hits)
+        *hits = g_hits;
+    if (misses)
+        *misses = g_misses;
+    if (trimmed)
+        *trimmed = g_trimmed;
+    if (cached_bytes)
+        *cached_bytes = g_local.cached_bytes;
+}
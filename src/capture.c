@@ -0,0 +1,429 @@
+#include "growtopia/capture.h"
+#include "growtopia/bufpool.h"
+#include "growtopia/capture_log.h"
+#include "growtopia/response.h"
+#include "growtopia/sketch.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <h2o.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define WRITE_BUFFER_SIZE (256 * 1024)
+#define RESULT_LINE_MAX (PATH_MAX + 128)
+#define MAX_NAME_ATTEMPTS 100            // Files tried per second before giving up
+
+/* one capture file and the queue its writer thread drains; the thread frees it once the file is closed */
+typedef struct {
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    FILE *file;
+    char path[PATH_MAX];
+    uint8_t *queue;                      // Ring of encoded records
+    size_t capacity;
+    uint64_t head;                       // Bytes queued so far (the ring position is modulo capacity)
+    uint64_t tail;                       // Bytes written so far
+    int stopping;                        // No more records; close the file once the queue is empty
+    int failed;                          // A write failed; the rest of the queue is discarded
+    uint64_t requests;                   // Set when stopping, for the finish message
+    uint64_t dropped;
+} capture_file_t;
+
+static capture_config_t g_config;
+static response_template_t *json_response;
+static h2o_timer_t g_stop_timer;
+
+/* the running capture; requests and the admin handler all run on the loop thread */
+static capture_file_t *g_file = NULL;
+static char g_path[PATH_MAX];
+static uint64_t g_start_ns;              // Monotonic time the capture started
+static uint64_t g_file_requests;
+static uint64_t g_file_bytes;
+static uint64_t g_file_dropped;
+
+/* statistics */
+static uint64_t g_captures = 0;
+static uint64_t g_requests = 0;
+static uint64_t g_bytes = 0;
+static uint64_t g_dropped = 0;
+
+static void on_stop_timer(h2o_timer_t *timer);
+
+int capture_init(const capture_config_t *config)
+{
+    g_config = config ? *config : capture_get_default_config();
+    if (g_config.sample_connections == 0)
+        g_config.sample_connections = 1;
+    if (g_config.queue_bytes < CAPTURE_FILE_HEADER_SIZE)
+        g_config.queue_bytes = CAPTURE_FILE_HEADER_SIZE;
+
+    if ((json_response = response_template_create(200, "OK")) == NULL ||
+        response_template_add_header(json_response, H2O_TOKEN_CONTENT_TYPE, H2O_STRLIT("application/json")) != 0) {
+        fprintf(stderr, "Failed to build capture responses\n");
+        return -1;
+    }
+    h2o_timer_init(&g_stop_timer, on_stop_timer);
+
+    printf("Traffic capture available: 1 in %u connections into %s/, up to %us\n", g_config.sample_connections,
+           g_config.directory, g_config.max_seconds);
+    return 0;
+}
+
+static uint64_t now_ns(clockid_t clock)
+{
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* copy an encoded record into the queue; 1 if queued, 0 if the writer is too far behind, -1 after a write error */
+static int queue_record(capture_file_t *file, const uint8_t *buf, size_t size)
+{
+    pthread_mutex_lock(&file->mutex);
+    if (file->failed || file->capacity - (file->head - file->tail) < size) {
+        int failed = file->failed;
+        pthread_mutex_unlock(&file->mutex);
+        return failed ? -1 : 0;
+    }
+
+    size_t offset = file->head % file->capacity, first = size < file->capacity - offset ? size : file->capacity - offset;
+    memcpy(file->queue + offset, buf, first);
+    memcpy(file->queue, buf + first, size - first);
+    /* the writer only sleeps on an empty queue */
+    if (file->head == file->tail)
+        pthread_cond_signal(&file->cond);
+    file->head += size;
+    pthread_mutex_unlock(&file->mutex);
+    return 1;
+}
+
+static void free_file(capture_file_t *file)
+{
+    pthread_cond_destroy(&file->cond);
+    pthread_mutex_destroy(&file->mutex);
+    free(file->queue);
+    free(file);
+}
+
+/* writes queued records off the loop thread until the capture stops and the queue is empty */
+static void *writer_main(void *arg)
+{
+    capture_file_t *file = arg;
+
+    pthread_mutex_lock(&file->mutex);
+    for (;;) {
+        while (file->head == file->tail && !file->stopping)
+            pthread_cond_wait(&file->cond, &file->mutex);
+        if (file->head == file->tail)
+            break;
+        size_t offset = file->tail % file->capacity, len = file->head - file->tail;
+        if (len > file->capacity - offset)
+            len = file->capacity - offset;
+        int discard = file->failed;
+        pthread_mutex_unlock(&file->mutex);
+
+        int ok = discard || fwrite(file->queue + offset, 1, len, file->file) == len;
+        if (!ok)
+            fprintf(stderr, "failed to write capture file %s: %s\n", file->path, strerror(errno));
+
+        pthread_mutex_lock(&file->mutex);
+        if (!ok)
+            file->failed = 1;
+        file->tail += len;
+    }
+    pthread_mutex_unlock(&file->mutex);
+
+    if (fclose(file->file) != 0)
+        fprintf(stderr, "failed to finish capture file %s: %s\n", file->path, strerror(errno));
+    else if (!file->failed)
+        printf("Capture finished: %s (%llu requests, %llu bytes, %llu dropped)\n", file->path,
+               (unsigned long long)file->requests, (unsigned long long)file->tail, (unsigned long long)file->dropped);
+    free_file(file);
+    return NULL;
+}
+
+/* capture-<unix time>.gtcap, or capture-<unix time>-<n>.gtcap if captures start within the same second */
+static FILE *create_file(char *path, size_t size, uint64_t started)
+{
+    unsigned long long seconds = (unsigned long long)(started / 1000000000);
+    int fd = -1;
+
+    for (unsigned n = 0; fd < 0 && n < MAX_NAME_ATTEMPTS; n++) {
+        if (n == 0)
+            snprintf(path, size, "%s/capture-%llu.gtcap", g_config.directory, seconds);
+        else
+            snprintf(path, size, "%s/capture-%llu-%u.gtcap", g_config.directory, seconds, n);
+        if ((fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644)) < 0 && errno != EEXIST)
+            break;
+    }
+    if (fd < 0) {
+        fprintf(stderr, "failed to create capture file %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+
+    FILE *fp = fdopen(fd, "wb");
+    if (fp == NULL) {
+        fprintf(stderr, "failed to open capture file %s: %s\n", path, strerror(errno));
+        close(fd);
+    }
+    return fp;
+}
+
+static int start_capture(h2o_loop_t *loop, uint32_t seconds)
+{
+    uint64_t started = now_ns(CLOCK_REALTIME);
+    capture_file_t *file;
+
+    if (mkdir(g_config.directory, 0755) != 0 && errno != EEXIST) {
+        fprintf(stderr, "failed to create capture directory %s: %s\n", g_config.directory, strerror(errno));
+        return -1;
+    }
+    if ((file = calloc(1, sizeof(*file))) == NULL || (file->queue = malloc(g_config.queue_bytes)) == NULL) {
+        fprintf(stderr, "no memory for a capture queue of %llu bytes\n", (unsigned long long)g_config.queue_bytes);
+        free(file);
+        return -1;
+    }
+    file->capacity = g_config.queue_bytes;
+    pthread_mutex_init(&file->mutex, NULL);
+    pthread_cond_init(&file->cond, NULL);
+    if ((file->file = create_file(file->path, sizeof(file->path), started)) == NULL) {
+        free_file(file);
+        return -1;
+    }
+    setvbuf(file->file, NULL, _IOFBF, WRITE_BUFFER_SIZE);
+    capture_encode_file_header(file->queue, started);
+    file->head = CAPTURE_FILE_HEADER_SIZE;
+
+    if (pthread_create(&file->thread, NULL, writer_main, file) != 0) {
+        fprintf(stderr, "failed to start the capture writer for %s\n", file->path);
+        fclose(file->file);
+        unlink(file->path);
+        free_file(file);
+        return -1;
+    }
+    pthread_detach(file->thread);
+
+    g_file = file;
+    memcpy(g_path, file->path, sizeof(g_path));
+    g_start_ns = now_ns(CLOCK_MONOTONIC);
+    g_file_requests = 0;
+    g_file_bytes = CAPTURE_FILE_HEADER_SIZE;
+    g_file_dropped = 0;
+    g_captures++;
+    h2o_timer_link(loop, (uint64_t)seconds * 1000, &g_stop_timer);
+    printf("Capture started: %s for %us\n", g_path, seconds);
+    return 0;
+}
+
+/* hand the file to its writer to finish; the loop never waits for the disk */
+static void stop_capture(void)
+{
+    capture_file_t *file = g_file;
+
+    if (h2o_timer_is_linked(&g_stop_timer))
+        h2o_timer_unlink(&g_stop_timer);
+    g_file = NULL;
+
+    pthread_mutex_lock(&file->mutex);
+    file->stopping = 1;
+    file->requests = g_file_requests;
+    file->dropped = g_file_dropped;
+    pthread_cond_signal(&file->cond);
+    pthread_mutex_unlock(&file->mutex);
+}
+
+static void on_stop_timer(h2o_timer_t *timer)
+{
+    if (g_file != NULL)
+        stop_capture();
+}
+
+static uint8_t connection_flags(h2o_conn_t *conn)
+{
+    h2o_socket_t *sock;
+
+    if (conn->callbacks->get_socket == NULL || (sock = conn->callbacks->get_socket(conn)) == NULL ||
+        h2o_socket_get_ssl(sock) == NULL)
+        return 0;
+    return CAPTURE_FLAG_TLS | (h2o_socket_get_ssl_session_reused(sock) ? CAPTURE_FLAG_TLS_RESUMED : 0);
+}
+
+static int is_private_header(const h2o_iovec_t *name)
+{
+    return h2o_lcstris(name->base, name->len, H2O_STRLIT("cookie")) ||
+           h2o_lcstris(name->base, name->len, H2O_STRLIT("authorization")) ||
+           h2o_lcstris(name->base, name->len, H2O_STRLIT("proxy-authorization"));
+}
+
+static capture_str_t to_str(h2o_iovec_t v)
+{
+    return (capture_str_t){v.base, v.len};
+}
+
+static void record_request(h2o_req_t *req)
+{
+    capture_record_t record;
+
+    record.offset_ns = now_ns(CLOCK_MONOTONIC) - g_start_ns;
+    record.connection = req->conn->id;
+    record.flags = connection_flags(req->conn);
+    record.version = (uint16_t)req->version;
+    record.method = to_str(req->method);
+    record.authority = to_str(req->authority);
+    record.path = to_str(req->path);
+
+    record.num_headers = 0;
+    for (size_t i = 0; i < req->headers.size && record.num_headers < CAPTURE_MAX_HEADERS; i++) {
+        const h2o_header_t *header = req->headers.entries + i;
+        if (is_private_header(header->name))
+            continue;
+        record.header_names[record.num_headers] = to_str(*header->name);
+        record.header_values[record.num_headers] = to_str(header->value);
+        record.num_headers++;
+    }
+
+    record.body = (capture_str_t){req->entity.base, 0};
+    record.body_total_len = 0;
+    if (req->entity.base != NULL) {
+        record.body.len = req->entity.len < g_config.max_body_bytes ? req->entity.len : g_config.max_body_bytes;
+        record.body_total_len = req->entity.len < UINT32_MAX ? (uint32_t)req->entity.len : UINT32_MAX;
+    }
+
+    /* encoded outside the queue lock, then copied in whole so the writer never sees part of a record */
+    size_t size = capture_record_size(&record);
+    uint8_t *buf = bufpool_alloc(req, size);
+    capture_encode_record(&record, buf);
+    switch (queue_record(g_file, buf, size)) {
+    case 1:
+        g_file_requests++;
+        g_file_bytes += size;
+        g_requests++;
+        g_bytes += size;
+        break;
+    case 0:
+        g_file_dropped++;
+        g_dropped++;
+        break;
+    default:
+        fprintf(stderr, "capture %s stopped after a write error\n", g_path);
+        stop_capture();
+        return;
+    }
+    if (g_file_bytes >= g_config.max_file_bytes)
+        stop_capture();
+}
+
+static int capture_stage(middleware_stage_t *stage, h2o_req_t *req, const struct sockaddr *peer)
+{
+    if (g_file == NULL)
+        return MIDDLEWARE_CONTINUE;
+
+    /* sample whole connections so that replay keeps their reuse */
+    if (g_config.sample_connections > 1 &&
+        sketch_hash(&req->conn->id, sizeof(req->conn->id)) % g_config.sample_connections != 0)
+        return MIDDLEWARE_CONTINUE;
+
+    record_request(req);
+    return MIDDLEWARE_CONTINUE;
+}
+
+int middleware_add_capture(middleware_pipeline_t *pipeline)
+{
+    return middleware_add_stage(pipeline, "capture", capture_stage, NULL);
+}
+
+static int parse_seconds(h2o_req_t *req, uint32_t *seconds)
+{
+    const char *p, *end;
+    uint64_t v = 0;
+
+    if (req->query_at == SIZE_MAX)
+        return -1;
+    p = req->path.base + req->query_at + 1;
+    end = req->path.base + req->path.len;
+    for (; p < end; p++) {
+        const char *amp = memchr(p, '&', end - p), *param_end = amp ? amp : end;
+        if (param_end - p > 8 && memcmp(p, "seconds=", 8) == 0) {
+            for (p += 8; p < param_end; p++) {
+                if (*p < '0' || *p > '9' || (v = v * 10 + (*p - '0')) > UINT32_MAX)
+                    return -1;
+            }
+            *seconds = (uint32_t)v;
+            return 0;
+        }
+        p = param_end;
+    }
+    return -1;
+}
+
+static void send_json(h2o_req_t *req, const char *body, int len)
+{
+    static h2o_generator_t generator = {NULL, NULL};
+    h2o_iovec_t buf = h2o_iovec_init(body, len);
+
+    req->res.content_length = buf.len;
+    response_template_start(json_response, req, &generator);
+    h2o_send(req, &buf, 1, H2O_SEND_STATE_FINAL);
+}
+
+int capture_handler(h2o_handler_t *self, h2o_req_t *req)
+{
+    char *body = h2o_mem_alloc_pool(&req->pool, char, RESULT_LINE_MAX);
+    uint32_t seconds;
+
+    if (h2o_memis(req->method.base, req->method.len, H2O_STRLIT("POST"))) {
+        if (parse_seconds(req, &seconds) != 0 || seconds == 0 || seconds > g_config.max_seconds) {
+            snprintf(body, RESULT_LINE_MAX, "seconds must be 1-%u\n", g_config.max_seconds);
+            h2o_send_error_400(req, "Bad Request", body, 0);
+            return 0;
+        }
+        if (g_file != NULL) {
+            h2o_send_error_generic(req, 409, "Conflict", "a capture is already running\n", 0);
+            return 0;
+        }
+        if (start_capture(req->conn->ctx->loop, seconds) != 0) {
+            h2o_send_error_500(req, "Internal Server Error", "capture could not start; see server log\n", 0);
+            return 0;
+        }
+        send_json(req, body,
+                  snprintf(body, RESULT_LINE_MAX, "{\"file\":\"%s\",\"seconds\":%u}\n", g_path, seconds));
+        return 0;
+    }
+
+    if (h2o_memis(req->method.base, req->method.len, H2O_STRLIT("DELETE"))) {
+        if (g_file == NULL) {
+            h2o_send_error_generic(req, 409, "Conflict", "no capture is running\n", 0);
+            return 0;
+        }
+        stop_capture();
+        send_json(req, body,
+                  snprintf(body, RESULT_LINE_MAX,
+                           "{\"file\":\"%s\",\"requests\":%llu,\"bytes\":%llu,\"dropped\":%llu}\n", g_path,
+                           (unsigned long long)g_file_requests, (unsigned long long)g_file_bytes,
+                           (unsigned long long)g_file_dropped));
+        return 0;
+    }
+
+    return -1;
+}
+
+void capture_get_stats(uint64_t *captures, uint64_t *requests, uint64_t *bytes, uint64_t *dropped, int *active)
+{
+    if (captures)
+        *captures = g_captures;
+    if (requests)
+        *requests = g_requests;
+    if (bytes)
+        *bytes = g_bytes;
+    if (dropped)
+        *dropped = g_dropped;
+    if (active)
+        *active = g_file != NULL;
+}
@@ -0,0 +1,173 @@
+#include "growtopia/capture_log.h"
+#include <string.h>
+
+#define RECORD_FIXED_SIZE 36             // Fields after the length prefix, before the strings
+#define MAX_STRING 0xffff
+
+static void put16(uint8_t *p, uint16_t v)
+{
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+}
+
+static void put32(uint8_t *p, uint32_t v)
+{
+    for (int i = 0; i < 4; i++)
+        p[i] = (uint8_t)(v >> (8 * i));
+}
+
+static void put64(uint8_t *p, uint64_t v)
+{
+    for (int i = 0; i < 8; i++)
+        p[i] = (uint8_t)(v >> (8 * i));
+}
+
+static uint16_t get16(const uint8_t *p)
+{
+    return (uint16_t)(p[0] | p[1] << 8);
+}
+
+static uint32_t get32(const uint8_t *p)
+{
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint64_t get64(const uint8_t *p)
+{
+    return (uint64_t)get32(p) | (uint64_t)get32(p + 4) << 32;
+}
+
+static size_t clamp16(size_t len)
+{
+    return len < MAX_STRING ? len : MAX_STRING;
+}
+
+void capture_encode_file_header(uint8_t *out, uint64_t start_ns)
+{
+    memcpy(out, CAPTURE_MAGIC, CAPTURE_MAGIC_SIZE);
+    put64(out + CAPTURE_MAGIC_SIZE, start_ns);
+}
+
+int capture_decode_file_header(const uint8_t *in, size_t len, uint64_t *start_ns)
+{
+    if (len < CAPTURE_FILE_HEADER_SIZE || memcmp(in, CAPTURE_MAGIC, CAPTURE_MAGIC_SIZE) != 0)
+        return -1;
+    *start_ns = get64(in + CAPTURE_MAGIC_SIZE);
+    return 0;
+}
+
+size_t capture_record_size(const capture_record_t *record)
+{
+    size_t size = 4 + RECORD_FIXED_SIZE + clamp16(record->method.len) + clamp16(record->authority.len) +
+                  clamp16(record->path.len) + record->body.len;
+
+    for (size_t i = 0; i < record->num_headers; i++)
+        size += 4 + clamp16(record->header_names[i].len) + clamp16(record->header_values[i].len);
+    return size;
+}
+
+static uint8_t *put_str(uint8_t *p, capture_str_t s)
+{
+    memcpy(p, s.base, clamp16(s.len));
+    return p + clamp16(s.len);
+}
+
+size_t capture_encode_record(const capture_record_t *record, uint8_t *out)
+{
+    size_t size = capture_record_size(record);
+    uint8_t *p = out;
+
+    put32(p, (uint32_t)(size - 4));
+    put64(p + 4, record->offset_ns);
+    put64(p + 12, record->connection);
+    p[20] = record->flags;
+    p[21] = 0;
+    put16(p + 22, record->version);
+    put16(p + 24, (uint16_t)clamp16(record->method.len));
+    put16(p + 26, (uint16_t)clamp16(record->authority.len));
+    put16(p + 28, (uint16_t)clamp16(record->path.len));
+    put16(p + 30, (uint16_t)record->num_headers);
+    put32(p + 32, (uint32_t)record->body.len);
+    put32(p + 36, record->body_total_len);
+    p += 4 + RECORD_FIXED_SIZE;
+
+    p = put_str(p, record->method);
+    p = put_str(p, record->authority);
+    p = put_str(p, record->path);
+    for (size_t i = 0; i < record->num_headers; i++) {
+        put16(p, (uint16_t)clamp16(record->header_names[i].len));
+        put16(p + 2, (uint16_t)clamp16(record->header_values[i].len));
+        p = put_str(p + 4, record->header_names[i]);
+        p = put_str(p, record->header_values[i]);
+    }
+    memcpy(p, record->body.base, record->body.len);
+
+    return size;
+}
+
+// Takes len bytes from the cursor; NULL if they run past the end of the record
+static const uint8_t *take(const uint8_t **p, const uint8_t *end, size_t len)
+{
+    const uint8_t *start = *p;
+
+    if ((size_t)(end - start) < len)
+        return NULL;
+    *p = start + len;
+    return start;
+}
+
+ssize_t capture_decode_record(const uint8_t *in, size_t len, capture_record_t *record)
+{
+    const uint8_t *p, *end, *s;
+    size_t method_len, authority_len, path_len;
+
+    if (len < 4)
+        return 0;
+    uint32_t record_len = get32(in);
+    if (record_len < RECORD_FIXED_SIZE)
+        return -1;
+    if (len - 4 < record_len)
+        return 0;
+    p = in + 4;
+    end = p + record_len;
+
+    record->offset_ns = get64(p);
+    record->connection = get64(p + 8);
+    record->flags = p[16];
+    record->version = get16(p + 18);
+    method_len = get16(p + 20);
+    authority_len = get16(p + 22);
+    path_len = get16(p + 24);
+    record->num_headers = get16(p + 26);
+    record->body.len = get32(p + 28);
+    record->body_total_len = get32(p + 32);
+    p += RECORD_FIXED_SIZE;
+    if (record->num_headers > CAPTURE_MAX_HEADERS)
+        return -1;
+
+    if ((s = take(&p, end, method_len)) == NULL)
+        return -1;
+    record->method = (capture_str_t){(const char *)s, method_len};
+    if ((s = take(&p, end, authority_len)) == NULL)
+        return -1;
+    record->authority = (capture_str_t){(const char *)s, authority_len};
+    if ((s = take(&p, end, path_len)) == NULL)
+        return -1;
+    record->path = (capture_str_t){(const char *)s, path_len};
+
+    for (size_t i = 0; i < record->num_headers; i++) {
+        const uint8_t *lens;
+        if ((lens = take(&p, end, 4)) == NULL || (s = take(&p, end, get16(lens))) == NULL)
+            return -1;
+        record->header_names[i] = (capture_str_t){(const char *)s, get16(lens)};
+        if ((s = take(&p, end, get16(lens + 2))) == NULL)
+            return -1;
+        record->header_values[i] = (capture_str_t){(const char *)s, get16(lens + 2)};
+    }
+
+    if ((s = take(&p, end, record->body.len)) == NULL || p != end)
+        return -1;
+    record->body.base = (const char *)s;
+
+    return (ssize_t)(4 + record_len);
+}
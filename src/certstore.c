@@ -0,0 +1,354 @@
+#include "growtopia/certstore.h"
+#include "growtopia/crypto_pool.h"
+#include <openssl/err.h>
+#include <openssl/pem.h>
+#include <openssl/tls1.h>
+#include <openssl/x509.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#define MAX_OCSP_SIZE (64 * 1024)
+
+typedef struct {
+    X509 *cert;
+    STACK_OF(X509) *chain;               // intermediates, leaf excluded
+    EVP_PKEY *key;                       // wrapped by the crypto pool when RSA
+    uint16_t sigalg;                     // TLS SignatureScheme the client must offer (ECDSA only)
+    unsigned char *ocsp;
+    size_t ocsp_len;
+} cert_slot_t;
+
+typedef struct {
+    const char *hostname;                // points into the configuration
+    cert_slot_t ecdsa;
+    cert_slot_t rsa;
+} cert_host_t;
+
+typedef struct {
+    cert_host_t *hosts;
+    size_t num_hosts;
+} cert_store_t;
+
+static const tls_cert_config_t *g_certs = NULL;
+static size_t g_num_certs = 0;
+static cert_store_t *g_store = NULL;
+static uint64_t g_ocsp_staples = 0;
+static uint64_t g_reloads = 0;
+
+static void free_slot(cert_slot_t *slot)
+{
+    X509_free(slot->cert);
+    sk_X509_pop_free(slot->chain, X509_free);
+    EVP_PKEY_free(slot->key);
+    free(slot->ocsp);
+}
+
+static void free_store(cert_store_t *store)
+{
+    if (store == NULL)
+        return;
+    for (size_t i = 0; i < store->num_hosts; i++) {
+        free_slot(&store->hosts[i].ecdsa);
+        free_slot(&store->hosts[i].rsa);
+    }
+    free(store->hosts);
+    free(store);
+}
+
+static int read_ocsp(cert_slot_t *slot, const char *path)
+{
+    FILE *fp = fopen(path, "rb");
+    unsigned char *buf;
+    size_t len;
+
+    if (fp == NULL)
+        return -1;
+    if ((buf = malloc(MAX_OCSP_SIZE)) == NULL) {
+        fclose(fp);
+        return -1;
+    }
+    len = fread(buf, 1, MAX_OCSP_SIZE, fp);
+    if (ferror(fp) || len == 0 || len == MAX_OCSP_SIZE) {
+        fclose(fp);
+        free(buf);
+        return -1;
+    }
+    fclose(fp);
+    slot->ocsp = buf;
+    slot->ocsp_len = len;
+    return 0;
+}
+
+/* TLS 1.3 binds ECDSA signature schemes to a curve, so the client must offer the one matching the key */
+static uint16_t ecdsa_sigalg(EVP_PKEY *key)
+{
+    char group[64];
+
+    if (EVP_PKEY_get_group_name(key, group, sizeof(group), NULL) != 1)
+        return 0;
+    if (strcmp(group, "prime256v1") == 0 || strcmp(group, "P-256") == 0)
+        return 0x0403;
+    if (strcmp(group, "secp384r1") == 0 || strcmp(group, "P-384") == 0)
+        return 0x0503;
+    if (strcmp(group, "secp521r1") == 0 || strcmp(group, "P-521") == 0)
+        return 0x0603;
+    return 0;
+}
+
+static int load_cert(cert_host_t *host, const tls_cert_config_t *conf)
+{
+    cert_slot_t loaded = {0}, *slot;
+    EVP_PKEY *key = NULL;
+    X509 *extra;
+    BIO *bio;
+
+    if ((bio = BIO_new_file(conf->cert_file, "r")) == NULL) {
+        fprintf(stderr, "certstore: cannot open certificate file:%s\n", conf->cert_file);
+        return -1;
+    }
+    loaded.cert = PEM_read_bio_X509_AUX(bio, NULL, NULL, NULL);
+    loaded.chain = sk_X509_new_null();
+    while (loaded.cert != NULL && loaded.chain != NULL && (extra = PEM_read_bio_X509(bio, NULL, NULL, NULL)) != NULL)
+        sk_X509_push(loaded.chain, extra);
+    BIO_free(bio);
+    ERR_clear_error();
+    if (loaded.cert == NULL || loaded.chain == NULL) {
+        fprintf(stderr, "certstore: no certificate in file:%s\n", conf->cert_file);
+        goto Error;
+    }
+
+    if ((bio = BIO_new_file(conf->key_file, "r")) == NULL ||
+        (key = PEM_read_bio_PrivateKey(bio, NULL, NULL, NULL)) == NULL) {
+        BIO_free(bio);
+        fprintf(stderr, "certstore: cannot load private key file:%s\n", conf->key_file);
+        goto Error;
+    }
+    BIO_free(bio);
+    if (X509_check_private_key(loaded.cert, key) != 1) {
+        fprintf(stderr, "certstore: %s does not match %s\n", conf->key_file, conf->cert_file);
+        goto Error;
+    }
+
+    switch (EVP_PKEY_get_base_id(key)) {
+    case EVP_PKEY_EC:
+        if ((loaded.sigalg = ecdsa_sigalg(key)) == 0) {
+            fprintf(stderr, "certstore: unsupported ECDSA curve in %s\n", conf->key_file);
+            goto Error;
+        }
+        slot = &host->ecdsa;
+        break;
+    case EVP_PKEY_RSA:
+        slot = &host->rsa;
+        break;
+    default:
+        fprintf(stderr, "certstore: %s is neither an ECDSA nor an RSA key\n", conf->key_file);
+        goto Error;
+    }
+    if (slot->cert != NULL) {
+        fprintf(stderr, "certstore: %s already has a certificate of the type in %s\n", conf->hostname, conf->cert_file);
+        goto Error;
+    }
+
+    if ((loaded.key = crypto_pool_wrap_key(key)) == NULL) {
+        fprintf(stderr, "certstore: cannot prepare private key:%s\n", conf->key_file);
+        goto Error;
+    }
+    if (conf->ocsp_file != NULL && read_ocsp(&loaded, conf->ocsp_file) != 0) {
+        fprintf(stderr, "certstore: cannot read OCSP response file:%s\n", conf->ocsp_file);
+        goto Error;
+    }
+
+    EVP_PKEY_free(key);
+    *slot = loaded;
+    return 0;
+
+Error:
+    EVP_PKEY_free(key);
+    free_slot(&loaded);
+    return -1;
+}
+
+static cert_store_t *load_store(void)
+{
+    cert_store_t *store = calloc(1, sizeof(*store));
+
+    if (store == NULL || (store->hosts = calloc(g_num_certs, sizeof(*store->hosts))) == NULL) {
+        free(store);
+        return NULL;
+    }
+
+    /* entries naming the same host fill its ECDSA and RSA slots */
+    for (size_t i = 0; i < g_num_certs; i++) {
+        cert_host_t *host = NULL;
+        for (size_t j = 0; j < store->num_hosts; j++) {
+            if (strcasecmp(store->hosts[j].hostname, g_certs[i].hostname) == 0)
+                host = &store->hosts[j];
+        }
+        if (host == NULL) {
+            host = &store->hosts[store->num_hosts++];
+            host->hostname = g_certs[i].hostname;
+        }
+        if (load_cert(host, &g_certs[i]) != 0) {
+            free_store(store);
+            return NULL;
+        }
+    }
+    return store;
+}
+
+/* exact name first, then a one-label wildcard, then the catch-all */
+static const cert_host_t *find_host(const cert_store_t *store, const char *name)
+{
+    const cert_host_t *wildcard = NULL, *any = NULL;
+    const char *parent = strchr(name, '.');
+
+    for (size_t i = 0; i < store->num_hosts; i++) {
+        const char *hostname = store->hosts[i].hostname;
+        if (strcasecmp(hostname, name) == 0)
+            return &store->hosts[i];
+        if (hostname[0] == '*' && hostname[1] == '\0')
+            any = &store->hosts[i];
+        else if (hostname[0] == '*' && parent != NULL && parent != name && strcasecmp(hostname + 1, parent) == 0)
+            wildcard = &store->hosts[i];
+    }
+    return wildcard != NULL ? wildcard : any;
+}
+
+static void get_server_name(SSL *ssl, char *name, size_t size)
+{
+    const unsigned char *p;
+    size_t len, name_len;
+
+    name[0] = '\0';
+    /* ServerNameList: list length, then entries of type(1) length(2) name; only host_name (0) is defined */
+    if (!SSL_client_hello_get0_ext(ssl, TLSEXT_TYPE_server_name, &p, &len) || len < 5 || p[2] != 0)
+        return;
+    name_len = (p[3] << 8) | p[4];
+    if (name_len == 0 || name_len >= size || name_len > len - 5)
+        return;
+    memcpy(name, p + 5, name_len);
+    name[name_len] = '\0';
+}
+
+static int client_offers_sigalg(SSL *ssl, uint16_t sigalg)
+{
+    const unsigned char *p;
+    size_t len;
+
+    /* clients before TLS 1.2 send no signature_algorithms and get RSA */
+    if (!SSL_client_hello_get0_ext(ssl, TLSEXT_TYPE_signature_algorithms, &p, &len) || len < 2)
+        return 0;
+    for (size_t i = 2; i + 1 < len; i += 2) {
+        if (((p[i] << 8) | p[i + 1]) == sigalg)
+            return 1;
+    }
+    return 0;
+}
+
+/* ECDSA also needs a usable cipher suite: any TLS 1.3 suite, or an ECDHE-ECDSA one for TLS 1.2 */
+static int client_offers_ecdsa_suite(SSL *ssl)
+{
+    const unsigned char *p;
+    size_t len = SSL_client_hello_get0_ciphers(ssl, &p);
+
+    for (size_t i = 0; i + 1 < len; i += 2) {
+        uint16_t suite = (p[i] << 8) | p[i + 1];
+        if ((suite >= 0x1301 && suite <= 0x1305) || suite == 0xc009 || suite == 0xc00a || suite == 0xc023 ||
+            suite == 0xc024 || suite == 0xc02b || suite == 0xc02c || suite == 0xcca9)
+            return 1;
+    }
+    return 0;
+}
+
+static int on_client_hello(SSL *ssl, int *al, void *arg)
+{
+    const cert_host_t *host;
+    const cert_slot_t *slot;
+    char name[256];
+
+    get_server_name(ssl, name, sizeof(name));
+    if (g_store == NULL || (host = find_host(g_store, name)) == NULL)
+        return SSL_CLIENT_HELLO_SUCCESS;
+
+    slot = &host->rsa;
+    if (host->ecdsa.cert != NULL &&
+        (host->rsa.cert == NULL || (client_offers_sigalg(ssl, host->ecdsa.sigalg) && client_offers_ecdsa_suite(ssl))))
+        slot = &host->ecdsa;
+
+    /* drop the default certificate so only the chosen one can be negotiated */
+    SSL_certs_clear(ssl);
+    if (SSL_use_cert_and_key(ssl, slot->cert, slot->key, slot->chain, 1) != 1) {
+        *al = SSL_AD_INTERNAL_ERROR;
+        return SSL_CLIENT_HELLO_ERROR;
+    }
+    return SSL_CLIENT_HELLO_SUCCESS;
+}
+
+static int on_status_request(SSL *ssl, void *arg)
+{
+    X509 *cert = SSL_get_certificate(ssl);
+    const cert_slot_t *slot = NULL;
+    unsigned char *resp;
+
+    /* a reload between ClientHello and here leaves the old certificate unmatched; it just goes unstapled */
+    for (size_t i = 0; g_store != NULL && i < g_store->num_hosts && slot == NULL; i++) {
+        if (g_store->hosts[i].ecdsa.cert == cert)
+            slot = &g_store->hosts[i].ecdsa;
+        else if (g_store->hosts[i].rsa.cert == cert)
+            slot = &g_store->hosts[i].rsa;
+    }
+    if (slot == NULL || slot->ocsp == NULL || (resp = OPENSSL_malloc(slot->ocsp_len)) == NULL)
+        return SSL_TLSEXT_ERR_NOACK;
+
+    memcpy(resp, slot->ocsp, slot->ocsp_len);
+    SSL_set_tlsext_status_ocsp_resp(ssl, resp, (long)slot->ocsp_len);
+    g_ocsp_staples++;
+    return SSL_TLSEXT_ERR_OK;
+}
+
+int certstore_init(SSL_CTX *ssl_ctx, const tls_config_t *config)
+{
+    if (config == NULL || config->num_certs == 0)
+        return 0;
+
+    g_certs = config->certs;
+    g_num_certs = config->num_certs;
+    if ((g_store = load_store()) == NULL) {
+        fprintf(stderr, "Failed to load certificate store\n");
+        return -1;
+    }
+
+    SSL_CTX_set_client_hello_cb(ssl_ctx, on_client_hello, NULL);
+    SSL_CTX_set_tlsext_status_cb(ssl_ctx, on_status_request);
+
+    printf("Certificate store: %zu hosts\n", g_store->num_hosts);
+    return 0;
+}
+
+int certstore_reload(void)
+{
+    cert_store_t *store;
+
+    if (g_store == NULL)
+        return CERTSTORE_NOT_CONFIGURED;
+    if ((store = load_store()) == NULL)
+        return -1;
+
+    /* connections keep references to the certificates and keys they were given */
+    free_store(g_store);
+    g_store = store;
+    g_reloads++;
+    return (int)store->num_hosts;
+}
+
+void certstore_get_stats(uint32_t *hosts, uint64_t *ocsp_staples, uint64_t *reloads)
+{
+    if (hosts)
+        *hosts = g_store != NULL ? (uint32_t)g_store->num_hosts : 0;
+    if (ocsp_staples)
+        *ocsp_staples = g_ocsp_staples;
+    if (reloads)
+        *reloads = g_reloads;
+}
@@ -0,0 +1,289 @@
+#include "growtopia/challenge.h"
+#include "growtopia/response.h"
+#include "growtopia/security.h"
+#include <h2o.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/random.h>
+#include <time.h>
+
+#define COOKIE_NAME "gt_challenge"
+#define TOKEN_LEN 24                     // 8 hex digits of expiry, 16 of MAC
+#define MAX_COOKIE_SUFFIX 96
+
+static challenge_config_t g_config;
+static uint64_t g_key[2];
+static response_template_t *g_challenge_response;
+static char g_cookie_suffix[MAX_COOKIE_SUFFIX];
+static size_t g_cookie_suffix_len;
+
+/* load tracking; every pipeline runs on the loop thread */
+static int g_active = 0;
+static time_t g_second = 0;              // Second being counted
+static uint32_t g_second_requests = 0;
+static time_t g_last_busy = 0;           // Last second with at least half the activation rate
+
+/* statistics */
+static uint64_t g_issued = 0;
+static uint64_t g_verified = 0;
+static uint64_t g_invalid = 0;
+static uint64_t g_activations = 0;
+static uint64_t g_verify_ns = 0;
+
+int challenge_init(const challenge_config_t *config)
+{
+    static const char body[] = "Checking your connection, please retry.\n";
+    int len;
+
+    g_config = config ? *config : challenge_get_default_config();
+
+    if (getrandom(g_key, sizeof(g_key), 0) != sizeof(g_key)) {
+        perror("failed to generate the challenge key");
+        return -1;
+    }
+
+    len = snprintf(g_cookie_suffix, sizeof(g_cookie_suffix), "; Max-Age=%u; Path=/; HttpOnly; SameSite=Lax",
+                   g_config.token_lifetime_seconds);
+    g_cookie_suffix_len = (size_t)len;
+
+    if ((g_challenge_response = response_template_create(307, "Temporary Redirect")) == NULL ||
+        response_template_add_header(g_challenge_response, H2O_TOKEN_CONTENT_TYPE, H2O_STRLIT("text/plain")) != 0 ||
+        response_template_add_header(g_challenge_response, H2O_TOKEN_CACHE_CONTROL, H2O_STRLIT("no-store")) != 0 ||
+        response_template_set_body(g_challenge_response, body, sizeof(body) - 1) != 0) {
+        fprintf(stderr, "Failed to build challenge response\n");
+        return -1;
+    }
+
+    if (g_config.activate_requests_per_second != 0)
+        printf("Challenge mode: above %u requests/s, cookies valid for %u seconds\n",
+               g_config.activate_requests_per_second, g_config.token_lifetime_seconds);
+    return 0;
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+#define ROTL(x, b) (uint64_t)(((x) << (b)) | ((x) >> (64 - (b))))
+#define SIPROUND                                                                                                       \
+    do {                                                                                                               \
+        v0 += v1; v1 = ROTL(v1, 13); v1 ^= v0; v0 = ROTL(v0, 32);                                                     \
+        v2 += v3; v3 = ROTL(v3, 16); v3 ^= v2;                                                                         \
+        v0 += v3; v3 = ROTL(v3, 21); v3 ^= v0;                                                                         \
+        v2 += v1; v1 = ROTL(v1, 17); v1 ^= v2; v2 = ROTL(v2, 32);                                                     \
+    } while (0)
+
+// SipHash-2-4 of a 16-byte message given as two little-endian words
+static uint64_t siphash(uint64_t m0, uint64_t m1)
+{
+    uint64_t v0 = g_key[0] ^ 0x736f6d6570736575ULL, v1 = g_key[1] ^ 0x646f72616e646f6dULL;
+    uint64_t v2 = g_key[0] ^ 0x6c7967656e657261ULL, v3 = g_key[1] ^ 0x7465646279746573ULL;
+    uint64_t words[3] = {m0, m1, (uint64_t)16 << 56};
+
+    for (int i = 0; i < 3; i++) {
+        v3 ^= words[i];
+        SIPROUND;
+        SIPROUND;
+        v0 ^= words[i];
+    }
+    v2 ^= 0xff;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
+// MAC over the client's /32 or /64 and the expiry; v4-mapped clients are bound to their IPv4 address
+static int token_mac(const struct sockaddr *peer, uint32_t expiry, uint64_t *mac)
+{
+    uint64_t prefix = 0;
+    uint32_t family;
+
+    if (peer->sa_family == AF_INET) {
+        prefix = ((const struct sockaddr_in *)peer)->sin_addr.s_addr;
+        family = AF_INET;
+    } else if (peer->sa_family == AF_INET6) {
+        const struct in6_addr *addr = &((const struct sockaddr_in6 *)peer)->sin6_addr;
+        if (IN6_IS_ADDR_V4MAPPED(addr)) {
+            memcpy(&prefix, addr->s6_addr + 12, 4);
+            family = AF_INET;
+        } else {
+            memcpy(&prefix, addr->s6_addr, 8);
+            family = AF_INET6;
+        }
+    } else {
+        return -1;
+    }
+
+    *mac = siphash(prefix, expiry | (uint64_t)family << 32);
+    return 0;
+}
+
+static void put_hex(char *out, uint64_t value, int digits)
+{
+    static const char hex[] = "0123456789abcdef";
+
+    for (int i = digits - 1; i >= 0; i--, value >>= 4)
+        out[i] = hex[value & 0xf];
+}
+
+static int get_hex(const char *in, int digits, uint64_t *value)
+{
+    *value = 0;
+    for (int i = 0; i < digits; i++) {
+        char c = in[i];
+        unsigned digit;
+        if (c >= '0' && c <= '9')
+            digit = c - '0';
+        else if (c >= 'a' && c <= 'f')
+            digit = c - 'a' + 10;
+        else
+            return -1;
+        *value = *value << 4 | digit;
+    }
+    return 0;
+}
+
+// Finds our cookie among the pairs of a Cookie header
+static const char *find_token(h2o_iovec_t value)
+{
+    const char *p = value.base, *end = value.base + value.len;
+
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == ';'))
+            p++;
+        if ((size_t)(end - p) >= sizeof(COOKIE_NAME "=") - 1 + TOKEN_LEN &&
+            memcmp(p, COOKIE_NAME "=", sizeof(COOKIE_NAME "=") - 1) == 0) {
+            const char *token = p + sizeof(COOKIE_NAME "=") - 1;
+            if (token + TOKEN_LEN == end || token[TOKEN_LEN] == ';' || token[TOKEN_LEN] == ' ')
+                return token;
+        }
+        if ((p = memchr(p, ';', end - p)) == NULL)
+            break;
+    }
+    return NULL;
+}
+
+/* 1 if valid, 0 if there is no cookie, -1 if the cookie is bad */
+static int verify(h2o_req_t *req, const struct sockaddr *peer, time_t now)
+{
+    ssize_t cursor = -1;
+    int result = 0;
+
+    while ((cursor = h2o_find_header(&req->headers, H2O_TOKEN_COOKIE, cursor)) != -1) {
+        const char *token = find_token(req->headers.entries[cursor].value);
+        uint64_t expiry, mac, expected;
+        if (token == NULL)
+            continue;
+        result = -1;
+        if (get_hex(token, 8, &expiry) != 0 || get_hex(token + 8, 16, &mac) != 0)
+            continue;
+        if ((time_t)expiry <= now || token_mac(peer, (uint32_t)expiry, &expected) != 0 || mac != expected)
+            continue;
+        return 1;
+    }
+    return result;
+}
+
+static void send_challenge(h2o_req_t *req, const struct sockaddr *peer, time_t now)
+{
+    uint32_t expiry = (uint32_t)(now + g_config.token_lifetime_seconds);
+    size_t prefix_len = sizeof(COOKIE_NAME "=") - 1;
+    char *cookie = h2o_mem_alloc_pool(&req->pool, char, prefix_len + TOKEN_LEN + g_cookie_suffix_len);
+    uint64_t mac;
+
+    if (token_mac(peer, expiry, &mac) == 0) {
+        memcpy(cookie, COOKIE_NAME "=", prefix_len);
+        put_hex(cookie + prefix_len, expiry, 8);
+        put_hex(cookie + prefix_len + 8, mac, 16);
+        memcpy(cookie + prefix_len + TOKEN_LEN, g_cookie_suffix, g_cookie_suffix_len);
+        h2o_add_header(&req->pool, &req->res.headers, H2O_TOKEN_SET_COOKIE, NULL, cookie,
+                       prefix_len + TOKEN_LEN + g_cookie_suffix_len);
+    }
+    h2o_add_header(&req->pool, &req->res.headers, H2O_TOKEN_LOCATION, NULL, req->path.base, req->path.len);
+    response_template_send(g_challenge_response, req);
+    g_issued++;
+}
+
+static void set_active(int active, time_t now)
+{
+    g_active = active;
+    if (active) {
+        g_activations++;
+        g_last_busy = now;
+    }
+    security_set_challenge_mode(active);
+    printf("Challenge mode %s\n", active ? "on: unverified clients get a cookie challenge" : "off");
+}
+
+static void count_request(time_t now)
+{
+    uint32_t threshold = g_config.activate_requests_per_second;
+
+    if (now != g_second) {
+        if (g_second_requests >= threshold / 2)
+            g_last_busy = g_second;
+        g_second = now;
+        g_second_requests = 0;
+        if (g_active && now - g_last_busy > (time_t)g_config.hold_seconds)
+            set_active(0, now);
+    }
+    if (++g_second_requests >= threshold && !g_active)
+        set_active(1, now);
+}
+
+static int challenge_stage(middleware_stage_t *stage, h2o_req_t *req, const struct sockaddr *peer)
+{
+    time_t now;
+
+    if (g_config.activate_requests_per_second == 0)
+        return MIDDLEWARE_CONTINUE;
+
+    now = time(NULL);
+    count_request(now);
+    if (!g_active || peer == NULL)
+        return MIDDLEWARE_CONTINUE;
+
+    uint64_t start = now_ns();
+    int valid = verify(req, peer, now);
+    g_verify_ns += now_ns() - start;
+
+    if (valid > 0) {
+        g_verified++;
+        return MIDDLEWARE_CONTINUE;
+    }
+    if (valid < 0)
+        g_invalid++;
+    send_challenge(req, peer, now);
+    return MIDDLEWARE_DONE;
+}
+
+int middleware_add_challenge(middleware_pipeline_t *pipeline)
+{
+    return middleware_add_stage(pipeline, "challenge", challenge_stage, NULL);
+}
+
+int challenge_active(void)
+{
+    return g_active;
+}
+
+void challenge_get_stats(uint64_t *issued, uint64_t *verified, uint64_t *invalid, uint64_t *activations,
+                         uint64_t *verify_ns)
+{
+    if (issued)
+        *issued = g_issued;
+    if (verified)
+        *verified = g_verified;
+    if (invalid)
+        *invalid = g_invalid;
+    if (activations)
+        *activations = g_activations;
+    if (verify_ns)
+        *verify_ns = g_verify_ns;
+}
@@ -0,0 +1,522 @@
+#include "growtopia/coalesce.h"
+#include "growtopia/handlers.h"
+#include <h2o.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define COALESCE_TABLE_SIZE 256
+#define COALESCE_MAX_KEY_SIZE 2048
+
+typedef struct st_coalesce_handler_t coalesce_handler_t;
+typedef struct st_coalesce_flight_t coalesce_flight_t;
+
+typedef struct {
+    const h2o_token_t *token;            // Token of the header name (NULL for non-token headers)
+    h2o_iovec_t name;
+    h2o_iovec_t value;
+} coalesce_header_t;
+
+/**
+ * Lives in the leader's memory pool; notices when the leader goes away before completing
+ */
+typedef struct {
+    coalesce_flight_t *flight;           // Cleared once the flight no longer depends on the leader
+} coalesce_leader_ref_t;
+
+struct st_coalesce_flight_t {
+    coalesce_flight_t *next;             // Next flight in the bucket chain
+    coalesce_handler_t *handler;
+    uint64_t hash;
+    char *key;
+    size_t key_len;
+    h2o_req_t *leader;                   // Request being processed by the handlers (NULL once completed)
+    coalesce_leader_ref_t *leader_ref;
+    h2o_linklist_t pending;              // Link in handler->pending until the leader starts its response
+    h2o_linklist_t waiters;              // Requests waiting for the leader's response
+    int status;
+    char *reason;
+    coalesce_header_t *headers;          // Single allocation holding the header array and its strings
+    size_t num_headers;
+    char *body;
+    size_t body_len;
+    size_t body_capacity;
+    uint64_t expire_at;                  // Micro-cache expiry in loop milliseconds, valid once completed
+};
+
+typedef struct {
+    h2o_linklist_t link;                 // Link in flight->waiters
+    h2o_req_t *req;
+} coalesce_waiter_t;
+
+struct st_coalesce_handler_t {
+    h2o_handler_t super;
+    coalesce_config_t config;
+    h2o_linklist_t pending;
+    coalesce_flight_t *table[COALESCE_TABLE_SIZE];
+    size_t num_cached;                   // Completed flights kept for the micro-cache
+    size_t sweep_bucket;                 // Next bucket swept for expired entries
+};
+
+typedef struct {
+    h2o_filter_t super;
+    coalesce_handler_t *handler;
+} coalesce_filter_t;
+
+typedef struct {
+    h2o_ostream_t super;
+    coalesce_flight_t *flight;           // Cleared once the flight is completed or aborted
+} coalesce_ostream_t;
+
+static uint64_t g_leaders = 0;
+static uint64_t g_followers = 0;
+static uint64_t g_cache_hits = 0;
+
+static uint64_t hash_key(const char *key, size_t len)
+{
+    uint64_t hash = 14695981039346656037ULL;  // FNV-1a
+
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char)key[i];
+        hash *= 1099511628211ULL;
+    }
+
+    return hash;
+}
+
+static size_t append_key(char *buf, size_t cap, size_t off, const char *s, size_t len)
+{
+    if (off == SIZE_MAX || len >= cap - off)
+        return SIZE_MAX;
+
+    memcpy(buf + off, s, len);
+    buf[off + len] = '\0';
+    return off + len + 1;
+}
+
+static h2o_iovec_t find_form_field(h2o_iovec_t body, const char *name, size_t name_len)
+{
+    const char *p = body.base, *end = body.base + body.len;
+
+    while (p < end) {
+        const char *pair_end = memchr(p, '&', end - p);
+        if (pair_end == NULL)
+            pair_end = end;
+        if ((size_t)(pair_end - p) > name_len && p[name_len] == '=' && memcmp(p, name, name_len) == 0)
+            return h2o_iovec_init(p + name_len + 1, pair_end - p - name_len - 1);
+        p = pair_end + 1;
+    }
+
+    return h2o_iovec_init(NULL, 0);
+}
+
+/**
+ * Serializes the coalescing key of a request into buf.
+ * Returns SIZE_MAX if the request is not eligible or the key does not fit.
+ */
+static size_t build_key(coalesce_handler_t *self, h2o_req_t *req, char *buf, size_t cap)
+{
+    size_t off = 0;
+
+    if (!h2o_memis(req->method.base, req->method.len, H2O_STRLIT("GET")) &&
+        !h2o_memis(req->method.base, req->method.len, H2O_STRLIT("HEAD")) &&
+        !(self->config.num_key_body_fields > 0 && h2o_memis(req->method.base, req->method.len, H2O_STRLIT("POST"))))
+        return SIZE_MAX;
+    // The response may be personalised; another user must never receive it
+    if (h2o_find_header(&req->headers, H2O_TOKEN_COOKIE, -1) != -1 ||
+        h2o_find_header(&req->headers, H2O_TOKEN_AUTHORIZATION, -1) != -1)
+        return SIZE_MAX;
+    // Partial and conditional responses answer this request only; a waiter that asked for the whole body must get it
+    if (h2o_find_header(&req->headers, H2O_TOKEN_RANGE, -1) != -1 ||
+        h2o_find_header(&req->headers, H2O_TOKEN_IF_RANGE, -1) != -1 ||
+        h2o_find_header(&req->headers, H2O_TOKEN_IF_NONE_MATCH, -1) != -1 ||
+        h2o_find_header(&req->headers, H2O_TOKEN_IF_MODIFIED_SINCE, -1) != -1)
+        return SIZE_MAX;
+
+    off = append_key(buf, cap, off, req->method.base, req->method.len);
+    off = append_key(buf, cap, off, req->path_normalized.base, req->path_normalized.len);
+    if (req->query_at != SIZE_MAX)
+        off = append_key(buf, cap, off, req->path.base + req->query_at, req->path.len - req->query_at);
+    else
+        off = append_key(buf, cap, off, "", 0);
+
+    for (size_t i = 0; i < self->config.num_key_headers; i++) {
+        const char *name = self->config.key_headers[i];
+        ssize_t cursor = h2o_find_header_by_str(&req->headers, name, strlen(name), -1);
+        if (cursor != -1)
+            off = append_key(buf, cap, off, req->headers.entries[cursor].value.base, req->headers.entries[cursor].value.len);
+        else
+            off = append_key(buf, cap, off, "", 0);
+    }
+
+    for (size_t i = 0; i < self->config.num_key_body_fields; i++) {
+        const char *name = self->config.key_body_fields[i];
+        h2o_iovec_t value = find_form_field(req->entity, name, strlen(name));
+        off = append_key(buf, cap, off, value.base, value.len);
+    }
+
+    return off;
+}
+
+static void free_flight(coalesce_flight_t *flight)
+{
+    free(flight->key);
+    free(flight->reason);
+    free(flight->headers);
+    free(flight->body);
+    free(flight);
+}
+
+/**
+ * Frees the micro-cache entry at *slot if it has expired; returns 1 if it did
+ */
+static int drop_if_expired(coalesce_handler_t *self, coalesce_flight_t **slot, uint64_t now)
+{
+    coalesce_flight_t *flight = *slot;
+
+    if (flight->leader != NULL || flight->expire_at > now)
+        return 0;
+
+    *slot = flight->next;
+    free_flight(flight);
+    self->num_cached--;
+    return 1;
+}
+
+/**
+ * Frees the expired entries of one bucket per call, so that keys never requested again do not stay forever
+ */
+static void sweep_bucket(coalesce_handler_t *self, uint64_t now)
+{
+    coalesce_flight_t **slot = &self->table[self->sweep_bucket];
+
+    self->sweep_bucket = (self->sweep_bucket + 1) % COALESCE_TABLE_SIZE;
+    while (*slot != NULL) {
+        if (!drop_if_expired(self, slot, now))
+            slot = &(*slot)->next;
+    }
+}
+
+static coalesce_flight_t *find_flight(coalesce_handler_t *self, uint64_t hash, const char *key, size_t key_len, uint64_t now)
+{
+    coalesce_flight_t **slot = &self->table[hash % COALESCE_TABLE_SIZE];
+
+    while (*slot != NULL) {
+        coalesce_flight_t *flight = *slot;
+
+        // Drop expired micro-cache entries as they are encountered
+        if (drop_if_expired(self, slot, now))
+            continue;
+
+        if (flight->hash == hash && flight->key_len == key_len && memcmp(flight->key, key, key_len) == 0)
+            return flight;
+        slot = &flight->next;
+    }
+
+    return NULL;
+}
+
+static void unlink_flight(coalesce_flight_t *flight)
+{
+    coalesce_flight_t **slot = &flight->handler->table[flight->hash % COALESCE_TABLE_SIZE];
+
+    while (*slot != NULL) {
+        if (*slot == flight) {
+            *slot = flight->next;
+            return;
+        }
+        slot = &(*slot)->next;
+    }
+}
+
+static void detach_leader(coalesce_flight_t *flight)
+{
+    if (flight->leader_ref != NULL)
+        flight->leader_ref->flight = NULL;
+    flight->leader_ref = NULL;
+    flight->leader = NULL;
+    if (h2o_linklist_is_linked(&flight->pending))
+        h2o_linklist_unlink(&flight->pending);
+}
+
+/**
+ * Gives up on sharing the leader's response; waiters are processed independently
+ */
+static void abort_flight(coalesce_flight_t *flight)
+{
+    detach_leader(flight);
+    unlink_flight(flight);
+
+    while (!h2o_linklist_is_empty(&flight->waiters)) {
+        coalesce_waiter_t *waiter = H2O_STRUCT_FROM_MEMBER(coalesce_waiter_t, link, flight->waiters.next);
+        h2o_linklist_unlink(&waiter->link);
+        h2o_delegate_request_deferred(waiter->req);
+    }
+
+    free_flight(flight);
+}
+
+static void send_flight_response(coalesce_flight_t *flight, h2o_req_t *req)
+{
+    req->res.status = flight->status;
+    req->res.reason = h2o_strdup(&req->pool, flight->reason, SIZE_MAX).base;
+
+    for (size_t i = 0; i < flight->num_headers; i++) {
+        coalesce_header_t *header = flight->headers + i;
+        h2o_iovec_t value = h2o_strdup(&req->pool, header->value.base, header->value.len);
+        if (header->token != NULL) {
+            h2o_add_header(&req->pool, &req->res.headers, header->token, NULL, value.base, value.len);
+        } else {
+            h2o_iovec_t name = h2o_strdup(&req->pool, header->name.base, header->name.len);
+            h2o_add_header_by_str(&req->pool, &req->res.headers, name.base, name.len, 0, NULL, value.base, value.len);
+        }
+    }
+
+    req->res.content_length = flight->body_len;
+    h2o_send_inline(req, flight->body, flight->body_len);
+}
+
+static void complete_flight(coalesce_flight_t *flight, h2o_req_t *leader)
+{
+    coalesce_handler_t *handler = flight->handler;
+
+    detach_leader(flight);
+
+    while (!h2o_linklist_is_empty(&flight->waiters)) {
+        coalesce_waiter_t *waiter = H2O_STRUCT_FROM_MEMBER(coalesce_waiter_t, link, flight->waiters.next);
+        h2o_linklist_unlink(&waiter->link);
+        send_flight_response(flight, waiter->req);
+    }
+
+    if (handler->config.cache_ttl_ms != 0 && flight->status == 200 &&
+        handler->num_cached < handler->config.max_cached_entries) {
+        flight->expire_at = h2o_now(leader->conn->ctx->loop) + handler->config.cache_ttl_ms;
+        handler->num_cached++;
+    } else {
+        unlink_flight(flight);
+        free_flight(flight);
+    }
+}
+
+/**
+ * Only complete 200 responses are shared; ones that set a cookie or are marked private / no-store belong to the
+ * leader alone
+ */
+static int is_shareable(h2o_req_t *req)
+{
+    ssize_t cursor;
+
+    if (req->res.status != 200)
+        return 0;
+    if (h2o_find_header(&req->res.headers, H2O_TOKEN_SET_COOKIE, -1) != -1)
+        return 0;
+    for (cursor = -1; (cursor = h2o_find_header(&req->res.headers, H2O_TOKEN_CACHE_CONTROL, cursor)) != -1;) {
+        h2o_iovec_t value = req->res.headers.entries[cursor].value;
+        if (h2o_contains_token(value.base, value.len, H2O_STRLIT("private"), ',') ||
+            h2o_contains_token(value.base, value.len, H2O_STRLIT("no-store"), ','))
+            return 0;
+    }
+
+    return 1;
+}
+
+static int capture_head(coalesce_flight_t *flight, h2o_req_t *req)
+{
+    size_t size = flight->num_headers = req->res.headers.size;
+
+    size *= sizeof(coalesce_header_t);
+    for (size_t i = 0; i < req->res.headers.size; i++)
+        size += req->res.headers.entries[i].name->len + req->res.headers.entries[i].value.len;
+
+    if ((flight->headers = malloc(size != 0 ? size : 1)) == NULL)
+        return -1;
+    if ((flight->reason = strdup(req->res.reason != NULL ? req->res.reason : "")) == NULL)
+        return -1;
+    flight->status = req->res.status;
+
+    char *dst = (char *)(flight->headers + flight->num_headers);
+    for (size_t i = 0; i < req->res.headers.size; i++) {
+        h2o_header_t *src = req->res.headers.entries + i;
+        coalesce_header_t *header = flight->headers + i;
+        header->token = h2o_iovec_is_token(src->name) ? H2O_STRUCT_FROM_MEMBER(h2o_token_t, buf, src->name) : NULL;
+        header->name = h2o_iovec_init(dst, src->name->len);
+        memcpy(dst, src->name->base, src->name->len);
+        dst += src->name->len;
+        header->value = h2o_iovec_init(dst, src->value.len);
+        memcpy(dst, src->value.base, src->value.len);
+        dst += src->value.len;
+    }
+
+    return 0;
+}
+
+static int capture_body(coalesce_flight_t *flight, h2o_sendvec_t *bufs, size_t bufcnt)
+{
+    size_t max_size = flight->handler->config.max_response_size;
+
+    for (size_t i = 0; i < bufcnt; i++) {
+        if (bufs[i].len > max_size - flight->body_len)
+            return -1;
+        if (flight->body_len + bufs[i].len > flight->body_capacity) {
+            size_t new_capacity = flight->body_capacity != 0 ? flight->body_capacity : 4096;
+            while (new_capacity < flight->body_len + bufs[i].len)
+                new_capacity *= 2;
+            char *new_body = realloc(flight->body, new_capacity);
+            if (new_body == NULL)
+                return -1;
+            flight->body = new_body;
+            flight->body_capacity = new_capacity;
+        }
+        if (!bufs[i].callbacks->read_(bufs + i, flight->body + flight->body_len, bufs[i].len))
+            return -1;
+        flight->body_len += bufs[i].len;
+    }
+
+    return 0;
+}
+
+static void on_leader_dispose(void *_ref)
+{
+    coalesce_leader_ref_t *ref = _ref;
+
+    // The leader went away before producing a complete response
+    if (ref->flight != NULL)
+        abort_flight(ref->flight);
+}
+
+static void on_waiter_dispose(void *_waiter)
+{
+    coalesce_waiter_t *waiter = _waiter;
+
+    if (h2o_linklist_is_linked(&waiter->link))
+        h2o_linklist_unlink(&waiter->link);
+}
+
+static int on_req(h2o_handler_t *_self, h2o_req_t *req)
+{
+    coalesce_handler_t *self = (coalesce_handler_t *)_self;
+    char key[COALESCE_MAX_KEY_SIZE];
+    size_t key_len;
+
+    if ((key_len = build_key(self, req, key, sizeof(key))) == SIZE_MAX)
+        return -1;
+
+    uint64_t now = h2o_now(req->conn->ctx->loop), hash = hash_key(key, key_len);
+    sweep_bucket(self, now);
+    coalesce_flight_t *flight = find_flight(self, hash, key, key_len, now);
+
+    if (flight == NULL) {
+        // Become the leader; the handlers that follow produce the response
+        if ((flight = calloc(1, sizeof(*flight))) == NULL)
+            return -1;
+        if ((flight->key = malloc(key_len)) == NULL) {
+            free(flight);
+            return -1;
+        }
+        memcpy(flight->key, key, key_len);
+        flight->key_len = key_len;
+        flight->hash = hash;
+        flight->handler = self;
+        flight->leader = req;
+        h2o_linklist_init_anchor(&flight->waiters);
+        h2o_linklist_insert(&self->pending, &flight->pending);
+        flight->leader_ref = h2o_mem_alloc_shared(&req->pool, sizeof(*flight->leader_ref), on_leader_dispose);
+        flight->leader_ref->flight = flight;
+        flight->next = self->table[hash % COALESCE_TABLE_SIZE];
+        self->table[hash % COALESCE_TABLE_SIZE] = flight;
+        g_leaders++;
+        return -1;
+    }
+
+    if (flight->leader == NULL) {
+        g_cache_hits++;
+        send_flight_response(flight, req);
+        return 0;
+    }
+
+    coalesce_waiter_t *waiter = h2o_mem_alloc_shared(&req->pool, sizeof(*waiter), on_waiter_dispose);
+    memset(&waiter->link, 0, sizeof(waiter->link));
+    waiter->req = req;
+    h2o_linklist_insert(&flight->waiters, &waiter->link);
+    g_followers++;
+    return 0;
+}
+
+static void on_send(h2o_ostream_t *_self, h2o_req_t *req, h2o_sendvec_t *bufs, size_t bufcnt, h2o_send_state_t state)
+{
+    coalesce_ostream_t *self = (coalesce_ostream_t *)_self;
+
+    if (self->flight != NULL) {
+        if (state == H2O_SEND_STATE_ERROR || capture_body(self->flight, bufs, bufcnt) != 0) {
+            abort_flight(self->flight);
+            self->flight = NULL;
+        } else if (state == H2O_SEND_STATE_FINAL) {
+            complete_flight(self->flight, req);
+            self->flight = NULL;
+        }
+    }
+
+    h2o_ostream_send_next(&self->super, req, bufs, bufcnt, state);
+}
+
+static void on_stop(h2o_ostream_t *_self, h2o_req_t *req)
+{
+    coalesce_ostream_t *self = (coalesce_ostream_t *)_self;
+
+    if (self->flight != NULL) {
+        abort_flight(self->flight);
+        self->flight = NULL;
+    }
+}
+
+static void on_setup_ostream(h2o_filter_t *_self, h2o_req_t *req, h2o_ostream_t **slot)
+{
+    coalesce_filter_t *self = (coalesce_filter_t *)_self;
+    coalesce_flight_t *flight = NULL;
+
+    for (h2o_linklist_t *node = self->handler->pending.next; node != &self->handler->pending; node = node->next) {
+        coalesce_flight_t *candidate = H2O_STRUCT_FROM_MEMBER(coalesce_flight_t, pending, node);
+        if (candidate->leader == req) {
+            flight = candidate;
+            break;
+        }
+    }
+
+    if (flight != NULL) {
+        h2o_linklist_unlink(&flight->pending);
+        // Waiters of an unshareable response are processed on their own
+        if (is_shareable(req) && capture_head(flight, req) == 0) {
+            coalesce_ostream_t *ostr =
+                (coalesce_ostream_t *)h2o_add_ostream(req, H2O_ALIGNOF(*ostr), sizeof(*ostr), slot);
+            ostr->super.do_send = on_send;
+            ostr->super.stop = on_stop;
+            ostr->flight = flight;
+            slot = &ostr->super.next;
+        } else {
+            abort_flight(flight);
+        }
+    }
+
+    h2o_setup_next_ostream(req, slot);
+}
+
+void register_coalescer(h2o_pathconf_t *pathconf, const coalesce_config_t *config)
+{
+    coalesce_handler_t *handler = (coalesce_handler_t *)create_prepended_handler(pathconf, sizeof(*handler));
+    handler->super.on_req = on_req;
+    handler->config = config ? *config : coalesce_get_default_config();
+    h2o_linklist_init_anchor(&handler->pending);
+
+    coalesce_filter_t *filter = (coalesce_filter_t *)h2o_create_filter(pathconf, sizeof(*filter));
+    filter->super.on_setup_ostream = on_setup_ostream;
+    filter->handler = handler;
+}
+
+void coalesce_get_stats(uint64_t *leaders, uint64_t *followers, uint64_t *cache_hits)
+{
+    if (leaders)
+        *leaders = g_leaders;
+    if (followers)
+        *followers = g_followers;
+    if (cache_hits)
+        *cache_hits = g_cache_hits;
+}
@@ -0,0 +1,340 @@
+#include "growtopia/compress.h"
+#include "growtopia/bufpool.h"
+#include <h2o.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <zlib.h>
+
+#define GZIP_WINDOW_BITS (15 + 16)  // Max window, gzip wrapper
+#define GZIP_MEM_LEVEL 8
+#define MAX_OUTPUT_CHUNKS 8
+
+typedef struct st_compress_context_t {
+    struct st_compress_context_t *next;  // Link in the per-thread free list
+    z_stream zs;
+    int level;
+} compress_context_t;
+
+/**
+ * Lives in the request's memory pool; returns the context however the response ends
+ */
+typedef struct {
+    compress_context_t *context;         // NULL once returned to the pool
+} compress_lease_t;
+
+typedef struct {
+    h2o_filter_t super;
+    compress_config_t config;
+} compress_filter_t;
+
+/**
+ * h2o is done with what a send passed on once it asks for the next one, so the same buffers serve every send
+ */
+typedef struct {
+    h2o_ostream_t super;
+    compress_lease_t *lease;
+    h2o_iovec_t outbufs[MAX_OUTPUT_CHUNKS];  // Output buffers, grown when a send needs more
+    h2o_iovec_t inbuf;                   // Copy of input that is not in memory (e.g. file-backed vectors)
+} compress_ostream_t;
+
+/* per-thread state: event loops never share a context, so none of this needs locking */
+static _Thread_local struct {
+    compress_context_t *free_list;
+    uint32_t in_use;
+    uint64_t budget_second;              // Monotonic second the budget below applies to
+    uint64_t budget_used_ns;
+} g_local;
+
+/* statistics */
+static uint64_t g_responses = 0;
+static uint64_t g_bytes_in = 0;
+static uint64_t g_bytes_out = 0;
+static uint64_t g_compress_ns = 0;
+static uint64_t g_skipped_small = 0;
+static uint64_t g_skipped_overload = 0;
+static uint64_t g_contexts_created = 0;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static compress_context_t *acquire_context(const compress_config_t *config)
+{
+    compress_context_t *context = g_local.free_list;
+
+    if (context != NULL) {
+        g_local.free_list = context->next;
+        /* reset contexts are in their initial state, where changing the level is free */
+        if (context->level != config->level && deflateParams(&context->zs, config->level, Z_DEFAULT_STRATEGY) == Z_OK)
+            context->level = config->level;
+    } else {
+        if ((context = malloc(sizeof(*context))) == NULL)
+            return NULL;
+        memset(&context->zs, 0, sizeof(context->zs));
+        if (deflateInit2(&context->zs, config->level, Z_DEFLATED, GZIP_WINDOW_BITS, GZIP_MEM_LEVEL,
+                         Z_DEFAULT_STRATEGY) != Z_OK) {
+            free(context);
+            return NULL;
+        }
+        context->level = config->level;
+        g_contexts_created++;
+    }
+
+    g_local.in_use++;
+    return context;
+}
+
+/* a buffer of at least size bytes, reusing the previous one if it is big enough */
+static h2o_iovec_t *reserve_buffer(h2o_req_t *req, h2o_iovec_t *buf, size_t size)
+{
+    if (buf->len < size)
+        *buf = h2o_iovec_init(bufpool_alloc(req, size), size);
+    return buf;
+}
+
+/* the free list needs no cap: contexts are only created while fewer than max_contexts are in use */
+static void release_context(compress_context_t *context)
+{
+    g_local.in_use--;
+    if (deflateReset(&context->zs) != Z_OK) {
+        deflateEnd(&context->zs);
+        free(context);
+        return;
+    }
+    context->next = g_local.free_list;
+    g_local.free_list = context;
+}
+
+static void end_lease(compress_lease_t *lease)
+{
+    if (lease->context != NULL) {
+        release_context(lease->context);
+        lease->context = NULL;
+    }
+}
+
+static void on_lease_dispose(void *p)
+{
+    end_lease(p);
+}
+
+static void on_send(h2o_ostream_t *_self, h2o_req_t *req, h2o_sendvec_t *bufs, size_t bufcnt, h2o_send_state_t state)
+{
+    compress_ostream_t *self = (compress_ostream_t *)_self;
+    h2o_sendvec_t outbufs[MAX_OUTPUT_CHUNKS];
+    size_t outcnt = 0, in_len = 0;
+    int flush = state == H2O_SEND_STATE_FINAL ? Z_FINISH : Z_SYNC_FLUSH;
+
+    if (self->lease->context == NULL || state == H2O_SEND_STATE_ERROR) {
+        end_lease(self->lease);
+        h2o_ostream_send_next(&self->super, req, NULL, 0, state);
+        return;
+    }
+
+    z_stream *zs = &self->lease->context->zs;
+    for (size_t i = 0; i < bufcnt; i++)
+        in_len += bufs[i].len;
+
+    uint64_t start = now_ns();
+    /* sized so that everything fits in one chunk; more chunks are only a safety net */
+    size_t chunk_size = deflateBound(zs, in_len) + 64;
+    for (size_t i = 0; i <= bufcnt; i++) {
+        int last = i == bufcnt;
+        if (!last) {
+            if (bufs[i].len == 0)
+                continue;
+            if (bufs[i].callbacks->read_ == h2o_sendvec_read_raw) {
+                zs->next_in = (Bytef *)bufs[i].raw;
+            } else {
+                char *copy = reserve_buffer(req, &self->inbuf, bufs[i].len)->base;
+                if (bufs[i].callbacks->read_(bufs + i, copy, bufs[i].len) != 0)
+                    goto Error;
+                zs->next_in = (Bytef *)copy;
+            }
+            zs->avail_in = (uInt)bufs[i].len;
+        }
+        do {
+            if (outcnt == 0 || zs->avail_out == 0) {
+                if (outcnt == MAX_OUTPUT_CHUNKS)
+                    goto Error;
+                h2o_iovec_t *chunk = reserve_buffer(req, self->outbufs + outcnt, chunk_size);
+                h2o_sendvec_init_raw(outbufs + outcnt++, chunk->base, 0);
+                zs->next_out = (Bytef *)chunk->base;
+                zs->avail_out = (uInt)chunk->len;
+            }
+            uInt before = zs->avail_out;
+            int ret = deflate(zs, last ? flush : Z_NO_FLUSH);
+            if (ret == Z_STREAM_ERROR)
+                goto Error;
+            outbufs[outcnt - 1].len += before - zs->avail_out;
+        } while (zs->avail_in != 0 || (last && zs->avail_out == 0));
+    }
+
+    uint64_t elapsed = now_ns() - start;
+    g_compress_ns += elapsed;
+    g_local.budget_used_ns += elapsed;
+    g_bytes_in += in_len;
+    for (size_t i = 0; i < outcnt; i++)
+        g_bytes_out += outbufs[i].len;
+
+    if (state == H2O_SEND_STATE_FINAL) {
+        end_lease(self->lease);
+        g_responses++;
+    }
+    h2o_ostream_send_next(&self->super, req, outbufs, outcnt, state);
+    return;
+
+Error:
+    end_lease(self->lease);
+    h2o_ostream_send_next(&self->super, req, NULL, 0, H2O_SEND_STATE_ERROR);
+}
+
+static void on_stop(h2o_ostream_t *_self, h2o_req_t *req)
+{
+    compress_ostream_t *self = (compress_ostream_t *)_self;
+
+    end_lease(self->lease);
+}
+
+static int is_compressible(h2o_iovec_t type)
+{
+    static const h2o_iovec_t prefixes[] = {{H2O_STRLIT("text/")},
+                                           {H2O_STRLIT("application/json")},
+                                           {H2O_STRLIT("application/x-ndjson")},
+                                           {H2O_STRLIT("application/javascript")},
+                                           {H2O_STRLIT("application/xml")}};
+
+    for (size_t i = 0; i < sizeof(prefixes) / sizeof(prefixes[0]); i++) {
+        if (type.len >= prefixes[i].len && h2o_memis(type.base, prefixes[i].len, prefixes[i].base, prefixes[i].len))
+            return 1;
+    }
+    return 0;
+}
+
+/* true if "gzip" is listed without q=0 */
+static int accepts_gzip(h2o_iovec_t value)
+{
+    const char *p = value.base, *end = value.base + value.len;
+
+    while (p < end) {
+        const char *item_end = memchr(p, ',', end - p);
+        if (item_end == NULL)
+            item_end = end;
+        while (p < item_end && (*p == ' ' || *p == '\t'))
+            p++;
+        const char *name_end = p;
+        while (name_end < item_end && *name_end != ';' && *name_end != ' ' && *name_end != '\t')
+            name_end++;
+        if (h2o_lcstris(p, name_end - p, H2O_STRLIT("gzip"))) {
+            const char *q = memchr(name_end, '=', item_end - name_end);
+            if (q == NULL)
+                return 1;
+            for (q++; q < item_end && (*q == '0' || *q == '.'); q++)
+                ;
+            /* q=0, q=0.0 and the like reject; anything with a non-zero digit accepts */
+            return q < item_end && *q >= '1' && *q <= '9';
+        }
+        p = item_end + 1;
+    }
+    return 0;
+}
+
+static int within_budget(const compress_config_t *config)
+{
+    if (g_local.in_use >= config->max_contexts)
+        return 0;
+    if (config->cpu_budget_ms == 0)
+        return 1;
+
+    uint64_t second = now_ns() / 1000000000;
+    if (second != g_local.budget_second) {
+        g_local.budget_second = second;
+        g_local.budget_used_ns = 0;
+    }
+    return g_local.budget_used_ns < (uint64_t)config->cpu_budget_ms * 1000000;
+}
+
+static void on_setup_ostream(h2o_filter_t *_self, h2o_req_t *req, h2o_ostream_t **slot)
+{
+    compress_filter_t *self = (compress_filter_t *)_self;
+    ssize_t cursor;
+
+    if (req->res.status != 200 || h2o_memis(req->method.base, req->method.len, H2O_STRLIT("HEAD")))
+        goto Next;
+    if (h2o_find_header(&req->res.headers, H2O_TOKEN_CONTENT_ENCODING, -1) != -1)
+        goto Next;
+    if ((cursor = h2o_find_header(&req->res.headers, H2O_TOKEN_CONTENT_TYPE, -1)) == -1 ||
+        !is_compressible(req->res.headers.entries[cursor].value))
+        goto Next;
+    /* the choice below depends on the request, so caches must key every compressible response on it */
+    h2o_set_header_token(&req->pool, &req->res.headers, H2O_TOKEN_VARY, H2O_STRLIT("accept-encoding"));
+    if ((cursor = h2o_find_header(&req->headers, H2O_TOKEN_ACCEPT_ENCODING, -1)) == -1 ||
+        !accepts_gzip(req->headers.entries[cursor].value))
+        goto Next;
+    if (req->res.content_length != SIZE_MAX && req->res.content_length < self->config.min_size) {
+        g_skipped_small++;
+        goto Next;
+    }
+    if (!within_budget(&self->config)) {
+        g_skipped_overload++;
+        goto Next;
+    }
+
+    compress_lease_t *lease = h2o_mem_alloc_shared(&req->pool, sizeof(*lease), on_lease_dispose);
+    if ((lease->context = acquire_context(&self->config)) == NULL)
+        goto Next;
+
+    /* the body changes, so the length is unknown and a strong validator no longer applies */
+    req->res.content_length = SIZE_MAX;
+    h2o_add_header(&req->pool, &req->res.headers, H2O_TOKEN_CONTENT_ENCODING, NULL, H2O_STRLIT("gzip"));
+    if ((cursor = h2o_find_header(&req->res.headers, H2O_TOKEN_ETAG, -1)) != -1) {
+        h2o_iovec_t *etag = &req->res.headers.entries[cursor].value;
+        if (!(etag->len >= 2 && etag->base[0] == 'W' && etag->base[1] == '/')) {
+            char *weak = h2o_mem_alloc_pool(&req->pool, char, etag->len + 2);
+            memcpy(weak, "W/", 2);
+            memcpy(weak + 2, etag->base, etag->len);
+            *etag = h2o_iovec_init(weak, etag->len + 2);
+        }
+    }
+
+    compress_ostream_t *ostr = (compress_ostream_t *)h2o_add_ostream(req, H2O_ALIGNOF(*ostr), sizeof(*ostr), slot);
+    ostr->super.do_send = on_send;
+    ostr->super.stop = on_stop;
+    ostr->lease = lease;
+    memset(ostr->outbufs, 0, sizeof(ostr->outbufs));
+    ostr->inbuf = h2o_iovec_init(NULL, 0);
+    slot = &ostr->super.next;
+
+Next:
+    h2o_setup_next_ostream(req, slot);
+}
+
+void register_compressor(h2o_pathconf_t *pathconf, const compress_config_t *config)
+{
+    compress_filter_t *filter = (compress_filter_t *)h2o_create_filter(pathconf, sizeof(*filter));
+    filter->super.on_setup_ostream = on_setup_ostream;
+    filter->config = config ? *config : compress_get_default_config();
+}
+
+void compress_get_stats(uint64_t *responses, uint64_t *bytes_in, uint64_t *bytes_out, uint64_t *compress_ns,
+                        uint64_t *skipped_small, uint64_t *skipped_overload, uint64_t *contexts_created)
+{
+    if (responses)
+        *responses = g_responses;
+    if (bytes_in)
+        *bytes_in = g_bytes_in;
+    if (bytes_out)
+        *bytes_out = g_bytes_out;
+    if (compress_ns)
+        *compress_ns = g_compress_ns;
+    if (skipped_small)
+        *skipped_small = g_skipped_small;
+    if (skipped_overload)
+        *skipped_overload = g_skipped_overload;
+    if (contexts_created)
+        *contexts_created = g_contexts_created;
+}
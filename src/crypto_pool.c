@@ -0,0 +1,328 @@
+/*
+ * Keys are intercepted with an RSA_METHOD bound to an ENGINE. Both are deprecated in OpenSSL 3 and the ENGINE API
+ * is gone from OpenSSL 4, so offload is built for OpenSSL 3.x with engine support only; elsewhere the pool compiles
+ * to a no-op and private-key operations stay on the loop. crypto-pool-bench measures what the offload buys.
+ */
+#define OPENSSL_SUPPRESS_DEPRECATED
+
+#include "growtopia/crypto_pool.h"
+#include "growtopia/profiler.h"
+#include <h2o.h>
+#include <openssl/opensslconf.h>
+#include <openssl/opensslv.h>
+
+#if defined(H2O_CAN_OSSL_ASYNC) && !defined(OPENSSL_NO_ENGINE) && OPENSSL_VERSION_MAJOR == 3
+#define CRYPTO_POOL_OFFLOAD 1
+#include <openssl/async.h>
+#include <openssl/engine.h>
+#endif
+
+#include <openssl/rsa.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+/* 16384-bit modulus, OpenSSL's upper bound for RSA keys */
+#define SLOT_BUF_SIZE 2048
+
+/*
+ * One slot per connection, owned by the connection's ASYNC_WAIT_CTX. The operands are copied in and the
+ * result copied out so a worker never touches memory on the paused job's stack; if the connection goes
+ * away while a worker holds the slot, the worker frees it instead of signalling.
+ */
+typedef struct crypto_slot {
+    struct crypto_slot *next;
+    int fd;                              // eventfd the loop polls while the job is paused
+    int queued;                          // a worker owns the slot; guarded by g_mutex
+    int abandoned;                       // wait context was freed while queued; guarded by g_mutex
+    int decrypt;
+    int flen;
+    int padding;
+    int result;
+    RSA *rsa;
+    unsigned char in[SLOT_BUF_SIZE];
+    unsigned char out[SLOT_BUF_SIZE];
+} crypto_slot_t;
+
+static pthread_mutex_t g_mutex = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t g_queue_depth = 0;
+static uint32_t g_max_queue_depth = 0;
+static uint64_t g_offloaded = 0;
+static uint64_t g_inline_ops = 0;
+
+#ifdef CRYPTO_POOL_OFFLOAD
+
+static pthread_cond_t g_cond = PTHREAD_COND_INITIALIZER;
+static crypto_slot_t *g_head = NULL;
+static crypto_slot_t **g_tail = &g_head;
+static uint32_t g_num_threads = 0;
+static uint32_t g_queue_max = 0;
+static const RSA_METHOD *g_default_method = NULL;
+static RSA_METHOD *g_method = NULL;
+static ENGINE *g_engine = NULL;
+static const char g_wait_key = 0;        // address identifies our fd in the wait context
+
+static int run_op(int decrypt, int flen, const unsigned char *from, unsigned char *to, RSA *rsa, int padding)
+{
+    if (decrypt)
+        return RSA_meth_get_priv_dec(g_default_method)(flen, from, to, rsa, padding);
+    return RSA_meth_get_priv_enc(g_default_method)(flen, from, to, rsa, padding);
+}
+
+static int run_inline(int decrypt, int flen, const unsigned char *from, unsigned char *to, RSA *rsa, int padding)
+{
+    pthread_mutex_lock(&g_mutex);
+    g_inline_ops++;
+    pthread_mutex_unlock(&g_mutex);
+    return run_op(decrypt, flen, from, to, rsa, padding);
+}
+
+static void release_slot(ASYNC_WAIT_CTX *ctx, const void *key, OSSL_ASYNC_FD fd, void *data)
+{
+    crypto_slot_t *slot = data;
+
+    pthread_mutex_lock(&g_mutex);
+    if (slot->queued) {
+        slot->abandoned = 1;
+        slot = NULL;
+    }
+    pthread_mutex_unlock(&g_mutex);
+
+    if (slot != NULL) {
+        close(fd);
+        free(slot);
+    }
+}
+
+static crypto_slot_t *get_slot(ASYNC_WAIT_CTX *ctx)
+{
+    OSSL_ASYNC_FD fd;
+    void *data;
+    crypto_slot_t *slot;
+
+    if (ASYNC_WAIT_CTX_get_fd(ctx, &g_wait_key, &fd, &data))
+        return data;
+
+    if ((slot = calloc(1, sizeof(*slot))) == NULL)
+        return NULL;
+    if ((slot->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1) {
+        free(slot);
+        return NULL;
+    }
+    if (!ASYNC_WAIT_CTX_set_wait_fd(ctx, &g_wait_key, slot->fd, slot, release_slot)) {
+        close(slot->fd);
+        free(slot);
+        return NULL;
+    }
+    return slot;
+}
+
+static int offload(int decrypt, int flen, const unsigned char *from, unsigned char *to, RSA *rsa, int padding)
+{
+    ASYNC_JOB *job = ASYNC_get_current_job();
+    crypto_slot_t *slot;
+    uint64_t counter;
+    int queued;
+
+    /* outside an async job (or with nowhere to park it) the caller expects a synchronous answer */
+    if (job == NULL || flen > SLOT_BUF_SIZE || RSA_size(rsa) > SLOT_BUF_SIZE ||
+        (slot = get_slot(ASYNC_get_wait_ctx(job))) == NULL)
+        return run_inline(decrypt, flen, from, to, rsa, padding);
+
+    pthread_mutex_lock(&g_mutex);
+    if (g_queue_depth >= g_queue_max) {
+        /* a saturated pool would only add latency; sign on the loop as before */
+        g_inline_ops++;
+        pthread_mutex_unlock(&g_mutex);
+        return run_op(decrypt, flen, from, to, rsa, padding);
+    }
+    slot->decrypt = decrypt;
+    slot->flen = flen;
+    slot->padding = padding;
+    slot->rsa = rsa;
+    memcpy(slot->in, from, flen);
+    slot->queued = 1;
+    slot->next = NULL;
+    *g_tail = slot;
+    g_tail = &slot->next;
+    if (++g_queue_depth > g_max_queue_depth)
+        g_max_queue_depth = g_queue_depth;
+    pthread_cond_signal(&g_cond);
+    pthread_mutex_unlock(&g_mutex);
+
+    /* the loop resumes the job whenever the eventfd turns readable; keep pausing until the worker is done */
+    do {
+        if (ASYNC_pause_job() == 0) {
+            /* cannot happen inside a job; the worker still owns the slot, so wait for it synchronously */
+            fprintf(stderr, "crypto pool: failed to pause async job\n");
+        }
+        pthread_mutex_lock(&g_mutex);
+        queued = slot->queued;
+        pthread_mutex_unlock(&g_mutex);
+    } while (queued);
+
+    while (read(slot->fd, &counter, sizeof(counter)) == sizeof(counter))
+        ;
+    if (slot->result > 0)
+        memcpy(to, slot->out, slot->result);
+    return slot->result;
+}
+
+static int offload_priv_enc(int flen, const unsigned char *from, unsigned char *to, RSA *rsa, int padding)
+{
+    return offload(0, flen, from, to, rsa, padding);
+}
+
+static int offload_priv_dec(int flen, const unsigned char *from, unsigned char *to, RSA *rsa, int padding)
+{
+    return offload(1, flen, from, to, rsa, padding);
+}
+
+static void *worker_main(void *arg)
+{
+    static const uint64_t one = 1;
+    crypto_slot_t *slot;
+
+    profiler_register_thread("crypto");
+
+    for (;;) {
+        pthread_mutex_lock(&g_mutex);
+        while (g_head == NULL)
+            pthread_cond_wait(&g_cond, &g_mutex);
+        slot = g_head;
+        if ((g_head = slot->next) == NULL)
+            g_tail = &g_head;
+        pthread_mutex_unlock(&g_mutex);
+
+        slot->result = run_op(slot->decrypt, slot->flen, slot->in, slot->out, slot->rsa, slot->padding);
+
+        /* signal under the lock: once queued is clear the loop may free the slot and its fd */
+        pthread_mutex_lock(&g_mutex);
+        g_queue_depth--;
+        g_offloaded++;
+        slot->queued = 0;
+        if (slot->abandoned) {
+            close(slot->fd);
+            free(slot);
+        } else if (write(slot->fd, &one, sizeof(one)) != sizeof(one)) {
+            perror("crypto pool: eventfd write");
+        }
+        pthread_mutex_unlock(&g_mutex);
+    }
+    return NULL;
+}
+
+static int setup_method(void)
+{
+    g_default_method = RSA_PKCS1_OpenSSL();
+    if ((g_method = RSA_meth_dup(g_default_method)) == NULL ||
+        RSA_meth_set1_name(g_method, "growtopia crypto pool") != 1 ||
+        RSA_meth_set_priv_enc(g_method, offload_priv_enc) != 1 ||
+        RSA_meth_set_priv_dec(g_method, offload_priv_dec) != 1)
+        return -1;
+
+    /* OpenSSL 3 only honours a custom RSA_METHOD on keys bound to an engine; it then keeps them on the legacy path */
+    if ((g_engine = ENGINE_new()) == NULL || ENGINE_set_id(g_engine, "growtopia-crypto-pool") != 1 ||
+        ENGINE_set_name(g_engine, "growtopia crypto pool") != 1 || ENGINE_set_RSA(g_engine, g_method) != 1)
+        return -1;
+    return 0;
+}
+
+/* Rebuild an RSA key on our engine so its private operations go through offload(). */
+static EVP_PKEY *wrap_rsa_key(EVP_PKEY *pkey)
+{
+    EVP_PKEY *wrapped = NULL;
+    RSA *src = NULL, *dst = NULL;
+    const BIGNUM *n, *e, *d, *p, *q, *dmp1, *dmq1, *iqmp;
+
+    if ((src = EVP_PKEY_get1_RSA(pkey)) == NULL || (dst = RSA_new_method(g_engine)) == NULL)
+        goto Error;
+    RSA_get0_key(src, &n, &e, &d);
+    RSA_get0_factors(src, &p, &q);
+    RSA_get0_crt_params(src, &dmp1, &dmq1, &iqmp);
+    if (RSA_set0_key(dst, BN_dup(n), BN_dup(e), BN_dup(d)) != 1 || RSA_set0_factors(dst, BN_dup(p), BN_dup(q)) != 1 ||
+        RSA_set0_crt_params(dst, BN_dup(dmp1), BN_dup(dmq1), BN_dup(iqmp)) != 1)
+        goto Error;
+
+    if ((wrapped = EVP_PKEY_new()) == NULL || EVP_PKEY_assign_RSA(wrapped, dst) != 1)
+        goto Error;
+    RSA_free(src);
+    return wrapped;
+
+Error:
+    EVP_PKEY_free(wrapped);
+    RSA_free(dst);
+    RSA_free(src);
+    return NULL;
+}
+
+#endif
+
+EVP_PKEY *crypto_pool_wrap_key(EVP_PKEY *pkey)
+{
+#ifdef CRYPTO_POOL_OFFLOAD
+    if (g_num_threads != 0 && EVP_PKEY_get_base_id(pkey) == EVP_PKEY_RSA)
+        return wrap_rsa_key(pkey);
+#endif
+    return EVP_PKEY_up_ref(pkey) == 1 ? pkey : NULL;
+}
+
+int crypto_pool_init(SSL_CTX *ssl_ctx, const tls_config_t *config)
+{
+    tls_config_t conf = config ? *config : tls_get_default_config();
+
+    if (conf.crypto_threads == 0)
+        return 0;
+
+#ifdef CRYPTO_POOL_OFFLOAD
+    if (g_engine == NULL && setup_method() != 0) {
+        fprintf(stderr, "Failed to set up the crypto pool RSA method\n");
+        return -1;
+    }
+
+    g_queue_max = conf.crypto_queue_max;
+    for (; g_num_threads < conf.crypto_threads; g_num_threads++) {
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, worker_main, NULL) != 0) {
+            fprintf(stderr, "Failed to start crypto pool thread\n");
+            return -1;
+        }
+        pthread_detach(tid);
+    }
+
+    /* non-RSA default keys stay as they are; certificates loaded later are wrapped by their loader */
+    EVP_PKEY *pkey = SSL_CTX_get0_privatekey(ssl_ctx), *wrapped = NULL;
+    if (pkey != NULL && ((wrapped = crypto_pool_wrap_key(pkey)) == NULL ||
+                         (wrapped != pkey && SSL_CTX_use_PrivateKey(ssl_ctx, wrapped) != 1))) {
+        EVP_PKEY_free(wrapped);
+        fprintf(stderr, "Failed to move the private key onto the crypto pool\n");
+        return -1;
+    }
+    EVP_PKEY_free(wrapped);
+    SSL_CTX_set_mode(ssl_ctx, SSL_MODE_ASYNC);
+
+    printf("Crypto pool: %u threads, queue limit %u\n", g_num_threads, g_queue_max);
+    return 0;
+#else
+    printf("Crypto pool disabled: needs h2o with OpenSSL async support and OpenSSL 3.x with engines\n");
+    return 0;
+#endif
+}
+
+void crypto_pool_get_stats(uint32_t *queue_depth, uint32_t *max_queue_depth, uint64_t *offloaded,
+                           uint64_t *inline_ops)
+{
+    pthread_mutex_lock(&g_mutex);
+    if (queue_depth)
+        *queue_depth = g_queue_depth;
+    if (max_queue_depth)
+        *max_queue_depth = g_max_queue_depth;
+    if (offloaded)
+        *offloaded = g_offloaded;
+    if (inline_ops)
+        *inline_ops = g_inline_ops;
+    pthread_mutex_unlock(&g_mutex);
+}
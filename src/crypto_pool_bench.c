@@ -0,0 +1,249 @@
+/*
+ * Measures what the crypto pool buys during a handshake storm.
+ *
+ *   crypto-pool-bench [signatures] [threads]
+ *
+ * Makes RSA-2048 PSS signatures the way a TLS handshake does, first on the calling thread (the loop without the
+ * pool) and then as OpenSSL async jobs handed to the pool, up to 64 at a time. For each it prints signatures per
+ * second and how long the calling thread was stuck per call (99th percentile and worst), which is the latency every
+ * other connection on the loop sees. Every signature is verified, so a wrong answer fails the run.
+ *
+ * Throughput only grows with spare cores. On a single core the workers compete with the loop, so the worst stall
+ * can grow even though the typical one drops.
+ */
+#include "growtopia/crypto_pool.h"
+#include <h2o.h>
+#include <openssl/async.h>
+#include <openssl/evp.h>
+#include <openssl/rsa.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define MAX_IN_FLIGHT 64
+
+typedef struct {
+    ASYNC_JOB *job;                      // Paused job, NULL when the slot is free
+    ASYNC_WAIT_CTX *wait_ctx;            // Kept across jobs, like a connection's
+    EVP_PKEY *pkey;
+    unsigned char digest[32];
+    unsigned char sig[512];
+    size_t sig_len;
+    int busy;
+} bench_slot_t;
+
+/* time spent in each call on the loop thread */
+typedef struct {
+    uint64_t *ns;
+    size_t count;
+    size_t capacity;
+} stalls_t;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void make_digest(unsigned char *digest, size_t i)
+{
+    for (size_t j = 0; j < 32; j++)
+        digest[j] = (unsigned char)(i * 31 + j);
+}
+
+static EVP_PKEY_CTX *new_pss_ctx(EVP_PKEY *pkey, int verify)
+{
+    EVP_PKEY_CTX *ctx = EVP_PKEY_CTX_new(pkey, NULL);
+
+    if (ctx == NULL || (verify ? EVP_PKEY_verify_init(ctx) : EVP_PKEY_sign_init(ctx)) != 1 ||
+        EVP_PKEY_CTX_set_rsa_padding(ctx, RSA_PKCS1_PSS_PADDING) != 1 ||
+        EVP_PKEY_CTX_set_signature_md(ctx, EVP_sha256()) != 1) {
+        EVP_PKEY_CTX_free(ctx);
+        return NULL;
+    }
+    return ctx;
+}
+
+static int sign(EVP_PKEY *pkey, const unsigned char *digest, unsigned char *sig, size_t *sig_len)
+{
+    EVP_PKEY_CTX *ctx = new_pss_ctx(pkey, 0);
+    int ok = ctx != NULL && EVP_PKEY_sign(ctx, sig, sig_len, digest, 32) == 1;
+
+    EVP_PKEY_CTX_free(ctx);
+    return ok ? 0 : -1;
+}
+
+static int verify(EVP_PKEY *pkey, const unsigned char *digest, const unsigned char *sig, size_t sig_len)
+{
+    EVP_PKEY_CTX *ctx = new_pss_ctx(pkey, 1);
+    int ok = ctx != NULL && EVP_PKEY_verify(ctx, sig, sig_len, digest, 32) == 1;
+
+    EVP_PKEY_CTX_free(ctx);
+    return ok ? 0 : -1;
+}
+
+static void add_stall(stalls_t *stalls, uint64_t start)
+{
+    if (stalls->count < stalls->capacity)
+        stalls->ns[stalls->count++] = now_ns() - start;
+}
+
+static int compare_ns(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void report(const char *name, size_t count, uint64_t total_ns, stalls_t *stalls)
+{
+    qsort(stalls->ns, stalls->count, sizeof(*stalls->ns), compare_ns);
+    printf("%-18s %6zu signatures  %8.0f /s  loop stall p99 %8.1f us  max %8.1f us\n", name, count,
+           count * 1e9 / total_ns, stalls->ns[stalls->count * 99 / 100] / 1000.0,
+           stalls->ns[stalls->count - 1] / 1000.0);
+    stalls->count = 0;
+}
+
+static int run_inline(EVP_PKEY *pkey, size_t count, stalls_t *stalls)
+{
+    unsigned char digest[32], sig[512];
+    size_t sig_len;
+    uint64_t start = now_ns();
+
+    for (size_t i = 0; i < count; i++) {
+        uint64_t t = now_ns();
+        make_digest(digest, i);
+        sig_len = sizeof(sig);
+        if (sign(pkey, digest, sig, &sig_len) != 0) {
+            fprintf(stderr, "inline signature %zu failed\n", i);
+            return -1;
+        }
+        add_stall(stalls, t);
+        if (verify(pkey, digest, sig, sig_len) != 0) {
+            fprintf(stderr, "inline signature %zu does not verify\n", i);
+            return -1;
+        }
+    }
+    report("inline", count, now_ns() - start, stalls);
+    return 0;
+}
+
+static int job_main(void *arg)
+{
+    bench_slot_t *slot = *(bench_slot_t **)arg;
+
+    slot->sig_len = sizeof(slot->sig);
+    return sign(slot->pkey, slot->digest, slot->sig, &slot->sig_len) == 0;
+}
+
+/* start or resume the slot's job, as h2o does when a handshake's wait fd turns readable */
+static int step(bench_slot_t *slot, EVP_PKEY *pkey, size_t *done, stalls_t *stalls)
+{
+    uint64_t t = now_ns();
+    int ret = 0, status = ASYNC_start_job(&slot->job, slot->wait_ctx, &ret, job_main, &slot, sizeof(slot));
+
+    add_stall(stalls, t);
+    if (status == ASYNC_PAUSE)
+        return 0;
+    if (status != ASYNC_FINISH || !ret || verify(pkey, slot->digest, slot->sig, slot->sig_len) != 0) {
+        fprintf(stderr, "pooled signature failed\n");
+        return -1;
+    }
+    slot->job = NULL;
+    slot->busy = 0;
+    ++*done;
+    return 0;
+}
+
+static int run_pooled(EVP_PKEY *pkey, EVP_PKEY *wrapped, size_t count, uint32_t threads, stalls_t *stalls)
+{
+    bench_slot_t slots[MAX_IN_FLIGHT] = {{0}};
+    struct pollfd fds[MAX_IN_FLIGHT];
+    size_t owners[MAX_IN_FLIGHT], started = 0, done = 0;
+    uint64_t start = now_ns();
+    int ret = -1;
+
+    for (size_t i = 0; i < MAX_IN_FLIGHT; i++) {
+        slots[i].pkey = wrapped;
+        if ((slots[i].wait_ctx = ASYNC_WAIT_CTX_new()) == NULL)
+            goto Exit;
+    }
+
+    while (done < count) {
+        size_t num_fds = 0;
+        for (size_t i = 0; i < MAX_IN_FLIGHT; i++) {
+            bench_slot_t *slot = slots + i;
+            if (!slot->busy && started < count) {
+                make_digest(slot->digest, started++);
+                slot->busy = 1;
+                if (step(slot, pkey, &done, stalls) != 0)
+                    goto Exit;
+            }
+            OSSL_ASYNC_FD fd;
+            size_t num = 1;
+            if (slot->busy && ASYNC_WAIT_CTX_get_all_fds(slot->wait_ctx, &fd, &num) && num == 1) {
+                fds[num_fds] = (struct pollfd){.fd = fd, .events = POLLIN};
+                owners[num_fds++] = i;
+            }
+        }
+        if (num_fds == 0)
+            continue;
+        if (poll(fds, num_fds, -1) < 0) {
+            perror("poll");
+            goto Exit;
+        }
+        for (size_t i = 0; i < num_fds; i++) {
+            if ((fds[i].revents & POLLIN) != 0 && step(slots + owners[i], pkey, &done, stalls) != 0)
+                goto Exit;
+        }
+    }
+
+    char name[32];
+    snprintf(name, sizeof(name), "pool, %u threads", threads);
+    report(name, count, now_ns() - start, stalls);
+    ret = 0;
+
+Exit:
+    for (size_t i = 0; i < MAX_IN_FLIGHT; i++)
+        ASYNC_WAIT_CTX_free(slots[i].wait_ctx);
+    return ret;
+}
+
+int main(int argc, char **argv)
+{
+    size_t count = argc > 1 ? strtoul(argv[1], NULL, 10) : 2000;
+    tls_config_t conf = tls_get_default_config();
+    SSL_CTX *ssl_ctx = SSL_CTX_new(TLS_server_method());
+    EVP_PKEY *pkey = EVP_PKEY_Q_keygen(NULL, NULL, "RSA", (size_t)2048), *wrapped;
+    uint64_t offloaded, inline_ops;
+    stalls_t stalls = {NULL, 0, 0};
+
+    if (argc > 2)
+        conf.crypto_threads = (uint32_t)strtoul(argv[2], NULL, 10);
+    if (count == 0 || conf.crypto_threads == 0) {
+        fprintf(stderr, "usage: %s [signatures] [threads]\n", argv[0]);
+        return 1;
+    }
+    conf.crypto_queue_max = MAX_IN_FLIGHT;
+    if (ssl_ctx == NULL || pkey == NULL || crypto_pool_init(ssl_ctx, &conf) != 0 ||
+        (wrapped = crypto_pool_wrap_key(pkey)) == NULL) {
+        fprintf(stderr, "failed to set up the key and the crypto pool\n");
+        return 1;
+    }
+    if (wrapped == pkey) {
+        fprintf(stderr, "offload is not available in this build (see crypto_pool.c)\n");
+        return 1;
+    }
+
+    /* a pooled signature takes two calls: the one that queues it and the one that picks up the result */
+    stalls.capacity = count * 2;
+    if ((stalls.ns = malloc(stalls.capacity * sizeof(*stalls.ns))) == NULL || run_inline(pkey, count, &stalls) != 0 ||
+        run_pooled(pkey, wrapped, count, conf.crypto_threads, &stalls) != 0)
+        return 1;
+    crypto_pool_get_stats(NULL, NULL, &offloaded, &inline_ops);
+    printf("pool counters: %llu offloaded, %llu inline\n", (unsigned long long)offloaded,
+           (unsigned long long)inline_ops);
+    return 0;
+}
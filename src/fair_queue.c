@@ -0,0 +1,362 @@
+#include "growtopia/fair_queue.h"
+#include "growtopia/response.h"
+#include "growtopia/sketch.h"
+#include <h2o.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define FQ_TABLE_SIZE 1024
+#define FQ_MAX_KEY_SIZE 7                // Family tag plus a /48
+
+/**
+ * Requests waiting from, or in flight for, one client prefix
+ */
+typedef struct fq_source {
+    struct fq_source *next;              // Next source in the bucket chain
+    h2o_linklist_t active;               // Link in g_active (round-robin order) while it can be dispatched from
+    h2o_linklist_t queue;                // Waiting entries, oldest first
+    uint32_t depth;
+    uint32_t in_flight;                  // Requests of the prefix holding a slot
+    int64_t deficit_ns;                  // Slot time the prefix may still use this round
+    uint64_t hash;
+    uint8_t key_len;
+    uint8_t key[FQ_MAX_KEY_SIZE];
+} fq_source_t;
+
+/**
+ * Lives in the request's memory pool; leaves the queue if the client goes away first
+ */
+typedef struct {
+    h2o_linklist_t link;                 // Link in source->queue
+    fq_source_t *source;                 // NULL once dispatched
+    h2o_req_t *req;
+    middleware_stage_t *stage;
+    uint64_t enqueued_at;
+} fq_entry_t;
+
+/**
+ * Lives in the request's memory pool; holds an in-flight slot until the response is done
+ */
+typedef struct {
+    fq_source_t *source;                 // NULL for requests without a prefix
+    uint64_t admitted_at;
+    uint32_t weight;
+} fq_ticket_t;
+
+static fair_queue_config_t g_config;
+static h2o_loop_t *g_loop = NULL;
+static h2o_timer_t g_run_timer;
+static h2o_linklist_t g_active;
+static fq_source_t *g_table[FQ_TABLE_SIZE];
+static fq_source_t *g_running = NULL;    // Source being dispatched from; freed after the dispatch, not under it
+static response_template_t *g_busy_response;
+
+static uint32_t g_in_flight = 0;
+static uint32_t g_waiting = 0;
+static uint32_t g_num_active = 0;
+
+/* statistics */
+static uint64_t g_admitted = 0;
+static uint64_t g_queued = 0;
+static uint64_t g_rejected = 0;
+static uint64_t g_abandoned = 0;
+static uint64_t g_wait_ns = 0;
+
+static void on_run(h2o_timer_t *timer);
+
+int fair_queue_init(h2o_context_t *ctx, const fair_queue_config_t *config)
+{
+    static const char busy[] = "Server busy. Please try again shortly.\n";
+
+    g_config = config ? *config : fair_queue_get_default_config();
+    if (g_config.quantum_us == 0)
+        g_config.quantum_us = 1;
+    if (g_config.prefix_in_flight == 0 || g_config.prefix_in_flight > g_config.max_in_flight)
+        g_config.prefix_in_flight = g_config.max_in_flight;
+
+    if ((g_busy_response = response_template_create(503, "Service Unavailable")) == NULL ||
+        response_template_add_header(g_busy_response, H2O_TOKEN_CONTENT_TYPE, H2O_STRLIT("text/plain")) != 0 ||
+        response_template_add_header(g_busy_response, H2O_TOKEN_RETRY_AFTER, H2O_STRLIT("1")) != 0 ||
+        response_template_set_body(g_busy_response, busy, sizeof(busy) - 1) != 0) {
+        fprintf(stderr, "Failed to build fair queue responses\n");
+        return -1;
+    }
+
+    g_loop = ctx->loop;
+    h2o_timer_init(&g_run_timer, on_run);
+    h2o_linklist_init_anchor(&g_active);
+
+    if (g_config.max_in_flight != 0)
+        printf("Fair queuing: %u requests in flight (%u per prefix), %u queued per prefix, %u us quantum\n",
+               g_config.max_in_flight, g_config.prefix_in_flight, g_config.queue_depth, g_config.quantum_us);
+    return 0;
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Queue key: family tag followed by the /24 (IPv4) or /48 (IPv6) prefix, as in the heavy-hitter sketch
+static size_t source_key(const struct sockaddr *addr, uint8_t *key)
+{
+    if (addr->sa_family == AF_INET) {
+        key[0] = 0x84;
+        memcpy(key + 1, &((const struct sockaddr_in *)addr)->sin_addr, 3);
+        return 4;
+    } else if (addr->sa_family == AF_INET6) {
+        key[0] = 0x86;
+        memcpy(key + 1, &((const struct sockaddr_in6 *)addr)->sin6_addr, 6);
+        return 7;
+    }
+    return 0;
+}
+
+static fq_source_t *get_source(const uint8_t *key, size_t key_len)
+{
+    uint64_t hash = sketch_hash(key, key_len);
+    fq_source_t **slot = &g_table[hash % FQ_TABLE_SIZE];
+
+    for (fq_source_t *source = *slot; source != NULL; source = source->next) {
+        if (source->hash == hash && source->key_len == key_len && memcmp(source->key, key, key_len) == 0)
+            return source;
+    }
+
+    fq_source_t *source = calloc(1, sizeof(*source));
+    if (source == NULL)
+        return NULL;
+    h2o_linklist_init_anchor(&source->queue);
+    source->hash = hash;
+    source->key_len = (uint8_t)key_len;
+    memcpy(source->key, key, key_len);
+    source->next = *slot;
+    *slot = source;
+    return source;
+}
+
+static void free_source(fq_source_t *source)
+{
+    fq_source_t **slot = &g_table[source->hash % FQ_TABLE_SIZE];
+
+    while (*slot != source)
+        slot = &(*slot)->next;
+    *slot = source->next;
+    free(source);
+}
+
+/**
+ * Keep a source in the round while it has requests waiting and a slot of its own left, and free it
+ * once nothing of it is waiting or in flight
+ */
+static void update_source(fq_source_t *source)
+{
+    int queued = !h2o_linklist_is_empty(&source->queue);
+    int runnable = queued && source->in_flight < g_config.prefix_in_flight;
+
+    /* an idle prefix keeps no credit into its next busy period; its debt lasts until its slots are back */
+    if (!queued && source->deficit_ns > 0)
+        source->deficit_ns = 0;
+    if (runnable && !h2o_linklist_is_linked(&source->active)) {
+        /* newcomers start at the end of the round */
+        h2o_linklist_insert(&g_active, &source->active);
+        g_num_active++;
+    } else if (!runnable && h2o_linklist_is_linked(&source->active)) {
+        h2o_linklist_unlink(&source->active);
+        g_num_active--;
+    }
+    if (!queued && source->in_flight == 0 && source != g_running)
+        free_source(source);
+}
+
+static void schedule_run(void)
+{
+    if (!h2o_timer_is_linked(&g_run_timer))
+        h2o_timer_link(g_loop, 0, &g_run_timer);
+}
+
+static void on_ticket_dispose(void *_ticket)
+{
+    fq_ticket_t *ticket = _ticket;
+    fq_source_t *source = ticket->source;
+
+    g_in_flight--;
+    /* the slot is charged for as long as it was held, slow clients included, not just for the handler's run */
+    if (source != NULL) {
+        source->deficit_ns -= (int64_t)((now_ns() - ticket->admitted_at) / ticket->weight);
+        source->in_flight--;
+        update_source(source);
+    }
+    if (!h2o_linklist_is_empty(&g_active))
+        schedule_run();
+}
+
+/* counts the request as in flight, for the server and for its prefix, until its memory pool is released */
+static void admit(h2o_req_t *req, fq_source_t *source, uint32_t weight)
+{
+    fq_ticket_t *ticket = h2o_mem_alloc_shared(&req->pool, sizeof(*ticket), on_ticket_dispose);
+
+    ticket->source = source;
+    ticket->admitted_at = now_ns();
+    ticket->weight = weight;
+    if (source != NULL)
+        source->in_flight++;
+    g_in_flight++;
+}
+
+static void on_entry_dispose(void *_entry)
+{
+    fq_entry_t *entry = _entry;
+
+    /* the client went away while waiting; an emptied source is dropped by the next run or slot release */
+    if (entry->source != NULL) {
+        h2o_linklist_unlink(&entry->link);
+        entry->source->depth--;
+        g_waiting--;
+        g_abandoned++;
+        schedule_run();
+    }
+}
+
+/**
+ * Skip ahead by as many rounds as the least indebted active source needs to get back into credit, so that
+ * debts of long responses are not paid off one quantum per rotation
+ */
+static void credit_rounds(void)
+{
+    int64_t quantum = (int64_t)g_config.quantum_us * 1000, rounds = INT64_MAX;
+    h2o_linklist_t *link;
+
+    for (link = g_active.next; link != &g_active; link = link->next) {
+        fq_source_t *source = H2O_STRUCT_FROM_MEMBER(fq_source_t, active, link);
+        int64_t needed = source->deficit_ns > 0 ? 0 : (quantum - source->deficit_ns) / quantum;
+        if (needed < rounds)
+            rounds = needed;
+    }
+    for (link = g_active.next; link != &g_active; link = link->next)
+        H2O_STRUCT_FROM_MEMBER(fq_source_t, active, link)->deficit_ns += rounds * quantum;
+}
+
+/**
+ * Deficit round robin over the active sources, dispatching until max_in_flight is reached
+ */
+static void on_run(h2o_timer_t *timer)
+{
+    uint32_t rotations = 0;
+
+    while (!h2o_linklist_is_empty(&g_active) && g_in_flight < g_config.max_in_flight) {
+        fq_source_t *source = H2O_STRUCT_FROM_MEMBER(fq_source_t, active, g_active.next);
+
+        /* emptied by abandoned requests */
+        if (h2o_linklist_is_empty(&source->queue)) {
+            update_source(source);
+            continue;
+        }
+        if (source->deficit_ns <= 0) {
+            if (++rotations > g_num_active) {
+                credit_rounds();
+                rotations = 0;
+                continue;
+            }
+            /* credit the next round and move to the back */
+            source->deficit_ns += (int64_t)g_config.quantum_us * 1000;
+            h2o_linklist_unlink(&source->active);
+            h2o_linklist_insert(&g_active, &source->active);
+            continue;
+        }
+        rotations = 0;
+
+        fq_entry_t *entry = H2O_STRUCT_FROM_MEMBER(fq_entry_t, link, source->queue.next);
+        h2o_req_t *req = entry->req;
+        middleware_stage_t *stage = entry->stage;
+
+        h2o_linklist_unlink(&entry->link);
+        entry->source = NULL;
+        source->depth--;
+        g_waiting--;
+        g_wait_ns += now_ns() - entry->enqueued_at;
+
+        /* the entry lives in the request's pool, which the handler may release; the ticket charges the source */
+        admit(req, source, (uint32_t)(uintptr_t)stage->data);
+        g_running = source;
+        middleware_resume(stage, req);
+        g_running = NULL;
+        update_source(source);
+    }
+}
+
+static int fair_queue_stage(middleware_stage_t *stage, h2o_req_t *req, const struct sockaddr *peer)
+{
+    uint32_t weight = (uint32_t)(uintptr_t)stage->data;
+    uint8_t key[FQ_MAX_KEY_SIZE];
+    size_t key_len;
+    fq_source_t *source;
+
+    if (g_loop == NULL || g_config.max_in_flight == 0)
+        return MIDDLEWARE_CONTINUE;
+
+    if (peer == NULL || (key_len = source_key(peer, key)) == 0) {
+        g_admitted++;
+        admit(req, NULL, weight);
+        return MIDDLEWARE_CONTINUE;
+    }
+    if ((source = get_source(key, key_len)) == NULL) {
+        g_rejected++;
+        response_template_send(g_busy_response, req);
+        return MIDDLEWARE_DONE;
+    }
+    if (g_waiting == 0 && g_in_flight < g_config.max_in_flight && source->in_flight < g_config.prefix_in_flight) {
+        g_admitted++;
+        admit(req, source, weight);
+        return MIDDLEWARE_CONTINUE;
+    }
+
+    if (g_waiting >= g_config.max_queued || source->depth >= g_config.queue_depth) {
+        g_rejected++;
+        update_source(source);
+        response_template_send(g_busy_response, req);
+        return MIDDLEWARE_DONE;
+    }
+
+    fq_entry_t *entry = h2o_mem_alloc_shared(&req->pool, sizeof(*entry), on_entry_dispose);
+    entry->source = source;
+    entry->req = req;
+    entry->stage = stage;
+    entry->enqueued_at = now_ns();
+    h2o_linklist_insert(&source->queue, &entry->link);
+    source->depth++;
+    g_waiting++;
+    g_queued++;
+
+    update_source(source);
+    schedule_run();
+    return MIDDLEWARE_DEFERRED;
+}
+
+int middleware_add_fair_queue(middleware_pipeline_t *pipeline, uint32_t weight)
+{
+    return middleware_add_stage(pipeline, "fair-queue", fair_queue_stage, (void *)(uintptr_t)(weight ? weight : 1));
+}
+
+void fair_queue_get_stats(uint64_t *admitted, uint64_t *queued, uint64_t *rejected, uint64_t *abandoned,
+                          uint64_t *wait_ns, uint32_t *in_flight, uint32_t *waiting)
+{
+    if (admitted)
+        *admitted = g_admitted;
+    if (queued)
+        *queued = g_queued;
+    if (rejected)
+        *rejected = g_rejected;
+    if (abandoned)
+        *abandoned = g_abandoned;
+    if (wait_ns)
+        *wait_ns = g_wait_ns;
+    if (in_flight)
+        *in_flight = g_in_flight;
+    if (waiting)
+        *waiting = g_waiting;
+}
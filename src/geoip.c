@@ -0,0 +1,561 @@
+#include "growtopia/geoip.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define METADATA_MARKER "\xAB\xCD\xEFMaxMind.com"
+#define METADATA_MARKER_LEN 14
+#define METADATA_MAX_SIZE (128 * 1024)  // The marker is searched for in this many trailing bytes
+#define DATA_SEPARATOR_LEN 16            // Zero bytes between the search tree and the data section
+#define MAX_DEPTH 32                     // Nesting limit while skipping values
+
+/* data section types (MaxMind DB format 2.0) */
+enum {
+    TYPE_EXTENDED = 0,
+    TYPE_POINTER = 1,
+    TYPE_STRING = 2,
+    TYPE_DOUBLE = 3,
+    TYPE_BYTES = 4,
+    TYPE_UINT16 = 5,
+    TYPE_UINT32 = 6,
+    TYPE_MAP = 7,
+    TYPE_INT32 = 8,
+    TYPE_UINT64 = 9,
+    TYPE_UINT128 = 10,
+    TYPE_ARRAY = 11,
+    TYPE_CONTAINER = 12,
+    TYPE_END_MARKER = 13,
+    TYPE_BOOLEAN = 14,
+    TYPE_FLOAT = 15
+};
+
+/**
+ * A mapped database; everything points into the mapping
+ */
+typedef struct {
+    const uint8_t *map;
+    size_t map_size;
+    const uint8_t *tree;
+    uint32_t node_count;
+    uint16_t record_size;                // Bits per record: 24, 28 or 32
+    uint16_t ip_version;
+    const uint8_t *data;                 // Data section (pointers are relative to it)
+    size_t data_size;
+    uint32_t ipv4_start;                 // Node reached after 96 zero bits in an IPv6 tree
+    uint64_t build_epoch;
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+} mmdb_t;
+
+/**
+ * A decoded control byte
+ */
+typedef struct {
+    int type;
+    uint32_t size;                       // Payload length, element count, or the target of a pointer
+    size_t payload;                      // Offset of the payload
+} mmdb_value_t;
+
+static geoip_config_t g_config;
+static h2o_loop_t *g_loop = NULL;
+static h2o_timer_t g_check_timer;
+static pthread_rwlock_t g_lock = PTHREAD_RWLOCK_INITIALIZER;
+static mmdb_t *g_asn = NULL;
+static mmdb_t *g_country = NULL;
+static uint32_t g_generation = 1;        // Bumped on every swap; invalidates the per-thread caches
+static volatile int g_loaded = 0;        // Set once any database has been loaded
+
+/* per-thread cache of the last answer */
+static _Thread_local struct {
+    uint32_t generation;
+    uint8_t key_len;
+    uint8_t key[16];
+    geoip_info_t info;
+} g_last;
+
+/* statistics */
+static uint64_t g_lookups = 0;
+static uint64_t g_cache_hits = 0;
+static uint64_t g_lookup_ns = 0;
+static uint64_t g_reloads = 0;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Decode the control byte(s) at off within a data section
+ * @return 0 on success, -1 if the value runs past the end
+ */
+static int read_control(const uint8_t *data, size_t data_size, size_t off, mmdb_value_t *value)
+{
+    if (off >= data_size)
+        return -1;
+    uint8_t ctrl = data[off++];
+    value->type = ctrl >> 5;
+
+    if (value->type == TYPE_POINTER) {
+        static const uint32_t bias[4] = {0, 2048, 526336, 0};
+        size_t n = ((ctrl >> 3) & 3) + 1;
+        if (off + n > data_size)
+            return -1;
+        uint32_t target = n == 4 ? 0 : ctrl & 7;
+        for (size_t i = 0; i < n; i++)
+            target = target << 8 | data[off++];
+        value->size = target + bias[n - 1];
+        value->payload = off;
+        return 0;
+    }
+
+    if (value->type == TYPE_EXTENDED) {
+        if (off >= data_size)
+            return -1;
+        value->type = 7 + data[off++];
+    }
+    value->size = ctrl & 0x1f;
+    if (value->size >= 29) {
+        size_t n = value->size - 28;
+        uint32_t extra = 0;
+        if (off + n > data_size)
+            return -1;
+        for (size_t i = 0; i < n; i++)
+            extra = extra << 8 | data[off++];
+        value->size = value->size == 29 ? 29 + extra : value->size == 30 ? 285 + extra : 65821 + extra;
+    }
+    value->payload = off;
+    return 0;
+}
+
+/**
+ * Decode the value at *off, following a pointer, and move *off past scalars and pointers
+ * (maps and arrays are left for the caller to walk or skip)
+ */
+static int read_value(const uint8_t *data, size_t data_size, size_t *off, mmdb_value_t *value)
+{
+    if (read_control(data, data_size, *off, value) != 0)
+        return -1;
+    if (value->type == TYPE_POINTER) {
+        *off = value->payload;
+        /* a pointer may not point to another pointer */
+        if (read_control(data, data_size, value->size, value) != 0 || value->type == TYPE_POINTER)
+            return -1;
+    } else if (value->type == TYPE_BOOLEAN) {
+        *off = value->payload;
+    } else if (value->type != TYPE_MAP && value->type != TYPE_ARRAY) {
+        *off = value->payload + value->size;
+    }
+
+    /* the size of a boolean is its value, and that of a container its element count */
+    if (value->type == TYPE_MAP || value->type == TYPE_ARRAY || value->type == TYPE_BOOLEAN)
+        return 0;
+    return value->payload + value->size <= data_size ? 0 : -1;
+}
+
+static int skip_value(const uint8_t *data, size_t data_size, size_t *off, int depth)
+{
+    mmdb_value_t value;
+
+    if (depth > MAX_DEPTH || read_control(data, data_size, *off, &value) != 0)
+        return -1;
+    switch (value.type) {
+    case TYPE_POINTER:
+        *off = value.payload;
+        return 0;
+    case TYPE_MAP:
+    case TYPE_ARRAY: {
+        uint64_t items = value.type == TYPE_MAP ? (uint64_t)value.size * 2 : value.size;
+        *off = value.payload;
+        for (uint64_t i = 0; i < items; i++) {
+            if (skip_value(data, data_size, off, depth + 1) != 0)
+                return -1;
+        }
+        return 0;
+    }
+    case TYPE_BOOLEAN:
+        *off = value.payload;
+        return 0;
+    default:
+        *off = value.payload + value.size;
+        return *off <= data_size ? 0 : -1;
+    }
+}
+
+/**
+ * Walk a path of map keys starting at the value at off
+ * @param path NULL-terminated list of keys
+ * @return 0 with the final value in *value, -1 if the path does not exist
+ */
+static int find_path(const uint8_t *data, size_t data_size, size_t off, const char *const *path, mmdb_value_t *value)
+{
+    for (; *path != NULL; path++) {
+        size_t key_len = strlen(*path);
+        int found = 0;
+
+        if (read_value(data, data_size, &off, value) != 0 || value->type != TYPE_MAP)
+            return -1;
+        off = value->payload;
+        for (uint32_t i = 0; i < value->size && !found; i++) {
+            mmdb_value_t key;
+            if (read_value(data, data_size, &off, &key) != 0 || key.type != TYPE_STRING)
+                return -1;
+            if (key.size == key_len && memcmp(data + key.payload, *path, key_len) == 0)
+                found = 1;
+            else if (skip_value(data, data_size, &off, 0) != 0)
+                return -1;
+        }
+        if (!found)
+            return -1;
+    }
+
+    return read_value(data, data_size, &off, value);
+}
+
+static int get_uint(const uint8_t *data, size_t data_size, size_t off, const char *const *path, uint64_t *out)
+{
+    mmdb_value_t value;
+
+    if (find_path(data, data_size, off, path, &value) != 0)
+        return -1;
+    if (value.type != TYPE_UINT16 && value.type != TYPE_UINT32 && value.type != TYPE_UINT64 && value.type != TYPE_INT32)
+        return -1;
+    if (value.size > 8)
+        return -1;
+    *out = 0;
+    for (uint32_t i = 0; i < value.size; i++)
+        *out = *out << 8 | data[value.payload + i];
+    return 0;
+}
+
+static uint32_t read_record(const mmdb_t *db, uint32_t node, int bit)
+{
+    const uint8_t *p = db->tree + (size_t)node * db->record_size / 4;
+
+    switch (db->record_size) {
+    case 24:
+        p += bit * 3;
+        return (uint32_t)p[0] << 16 | p[1] << 8 | p[2];
+    case 28:
+        if (bit)
+            return (uint32_t)(p[3] & 0x0f) << 24 | (uint32_t)p[4] << 16 | p[5] << 8 | p[6];
+        return (uint32_t)(p[3] & 0xf0) << 20 | (uint32_t)p[0] << 16 | p[1] << 8 | p[2];
+    default:
+        p += bit * 4;
+        return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | p[2] << 8 | p[3];
+    }
+}
+
+/**
+ * Search the tree for an address
+ * @return 0 with the offset of its record in *off, -1 if the address is not in the database
+ */
+static int search(const mmdb_t *db, const uint8_t *addr, size_t addr_len, size_t *off)
+{
+    uint32_t node = 0, bits = (uint32_t)addr_len * 8;
+
+    if (addr_len == 4 && db->ip_version == 6)
+        node = db->ipv4_start;
+    else if (addr_len == 16 && db->ip_version == 4)
+        return -1;
+
+    for (uint32_t i = 0; i < bits && node < db->node_count; i++)
+        node = read_record(db, node, (addr[i >> 3] >> (7 - (i & 7))) & 1);
+
+    if (node <= db->node_count)
+        return -1;  // Empty (== node_count) or ran out of bits inside the tree
+    *off = node - db->node_count - DATA_SEPARATOR_LEN;
+    return *off < db->data_size ? 0 : -1;
+}
+
+static void close_db(mmdb_t *db)
+{
+    if (db == NULL)
+        return;
+    if (db->map != NULL)
+        munmap((void *)db->map, db->map_size);
+    free(db);
+}
+
+static mmdb_t *open_db(const char *path)
+{
+    static const char *const node_count_path[] = {"node_count", NULL};
+    static const char *const record_size_path[] = {"record_size", NULL};
+    static const char *const ip_version_path[] = {"ip_version", NULL};
+    static const char *const build_epoch_path[] = {"build_epoch", NULL};
+    struct stat st;
+    mmdb_t *db = NULL;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1) {
+        fprintf(stderr, "geoip: failed to open %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+    if (fstat(fd, &st) != 0 || (db = calloc(1, sizeof(*db))) == NULL)
+        goto Error;
+    if (st.st_size < METADATA_MARKER_LEN) {
+        close(fd);
+        goto Invalid;
+    }
+
+    db->map_size = (size_t)st.st_size;
+    db->dev = st.st_dev;
+    db->ino = st.st_ino;
+    db->size = st.st_size;
+    db->mtime = st.st_mtim;
+#ifdef MAP_POPULATE
+    /* fault everything in now rather than on the accept path */
+    db->map = mmap(NULL, db->map_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+#else
+    db->map = mmap(NULL, db->map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+#endif
+    if (db->map == MAP_FAILED) {
+        db->map = NULL;
+        goto Error;
+    }
+    close(fd);
+    fd = -1;
+
+    /* the metadata map follows the last marker in the file */
+    size_t limit = db->map_size > METADATA_MAX_SIZE ? db->map_size - METADATA_MAX_SIZE : 0;
+    const uint8_t *marker = NULL;
+    for (size_t i = db->map_size - METADATA_MARKER_LEN + 1; i-- > limit;) {
+        if (db->map[i] == 0xAB && memcmp(db->map + i, METADATA_MARKER, METADATA_MARKER_LEN) == 0) {
+            marker = db->map + i;
+            break;
+        }
+    }
+    if (marker == NULL)
+        goto Invalid;
+
+    const uint8_t *meta = marker + METADATA_MARKER_LEN;
+    size_t meta_size = db->map + db->map_size - meta;
+    uint64_t node_count, record_size, ip_version;
+    if (get_uint(meta, meta_size, 0, node_count_path, &node_count) != 0 ||
+        get_uint(meta, meta_size, 0, record_size_path, &record_size) != 0 ||
+        get_uint(meta, meta_size, 0, ip_version_path, &ip_version) != 0)
+        goto Invalid;
+    if (get_uint(meta, meta_size, 0, build_epoch_path, &db->build_epoch) != 0)
+        db->build_epoch = 0;
+    if ((record_size != 24 && record_size != 28 && record_size != 32) || (ip_version != 4 && ip_version != 6) ||
+        node_count == 0 || node_count > UINT32_MAX)
+        goto Invalid;
+
+    size_t tree_size = (size_t)node_count * record_size / 4;
+    if (tree_size + DATA_SEPARATOR_LEN > (size_t)(marker - db->map))
+        goto Invalid;
+    db->tree = db->map;
+    db->node_count = (uint32_t)node_count;
+    db->record_size = (uint16_t)record_size;
+    db->ip_version = (uint16_t)ip_version;
+    db->data = db->map + tree_size + DATA_SEPARATOR_LEN;
+    db->data_size = marker - db->data;
+
+    /* IPv4 addresses live under ::/96 of an IPv6 tree */
+    if (db->ip_version == 6) {
+        uint32_t node = 0;
+        for (int i = 0; i < 96 && node < db->node_count; i++)
+            node = read_record(db, node, 0);
+        db->ipv4_start = node;
+    }
+
+    return db;
+
+Invalid:
+    fprintf(stderr, "geoip: %s is not a valid MaxMind DB file\n", path);
+    close_db(db);
+    return NULL;
+Error:
+    fprintf(stderr, "geoip: failed to map %s: %s\n", path, strerror(errno));
+    if (fd != -1)
+        close(fd);
+    if (db != NULL && db->map != NULL)
+        munmap((void *)db->map, db->map_size);
+    free(db);
+    return NULL;
+}
+
+/* 1 if path names a different file than the one loaded (or one appeared where there was none) */
+static int has_changed(const char *path, const mmdb_t *db)
+{
+    struct stat st;
+
+    if (path == NULL || stat(path, &st) != 0)
+        return 0;
+    return db == NULL || st.st_dev != db->dev || st.st_ino != db->ino || st.st_size != db->size ||
+           st.st_mtim.tv_sec != db->mtime.tv_sec || st.st_mtim.tv_nsec != db->mtime.tv_nsec;
+}
+
+/**
+ * Load the databases selected by the flags and swap them in
+ * @return Number of databases loaded, or -1 if one of them failed
+ */
+static int load(int asn, int country)
+{
+    mmdb_t *new_asn = NULL, *new_country = NULL;
+    int loaded = 0, failed = 0;
+
+    /* a file that is not there is skipped; one that does not load is an error */
+    if (asn && access(g_config.asn_database, F_OK) == 0) {
+        if ((new_asn = open_db(g_config.asn_database)) != NULL)
+            loaded++;
+        else
+            failed = 1;
+    }
+    if (country && access(g_config.country_database, F_OK) == 0) {
+        if ((new_country = open_db(g_config.country_database)) != NULL)
+            loaded++;
+        else
+            failed = 1;
+    }
+    if (loaded == 0)
+        return failed ? -1 : 0;
+
+    pthread_rwlock_wrlock(&g_lock);
+    mmdb_t *old_asn = g_asn, *old_country = g_country;
+    int swap = g_loaded;
+    if (new_asn != NULL)
+        g_asn = new_asn;
+    if (new_country != NULL)
+        g_country = new_country;
+    g_generation++;
+    g_loaded = 1;
+    pthread_rwlock_unlock(&g_lock);
+
+    /* no lookup can still be reading the old mappings once the write lock was granted */
+    if (new_asn != NULL)
+        close_db(old_asn);
+    if (new_country != NULL)
+        close_db(old_country);
+    if (swap)
+        g_reloads++;
+    return failed ? -1 : loaded;
+}
+
+static void on_check(h2o_timer_t *timer)
+{
+    int asn = g_config.asn_database != NULL && has_changed(g_config.asn_database, g_asn);
+    int country = g_config.country_database != NULL && has_changed(g_config.country_database, g_country);
+
+    if ((asn || country) && load(asn, country) > 0)
+        printf("geoip: loaded updated database\n");
+
+    h2o_timer_link(g_loop, (uint64_t)g_config.check_interval_seconds * 1000, timer);
+}
+
+int geoip_init(h2o_context_t *ctx, const geoip_config_t *config)
+{
+    g_config = config ? *config : geoip_get_default_config();
+    g_loop = ctx->loop;
+
+    if (load(g_config.asn_database != NULL, g_config.country_database != NULL) < 0)
+        return -1;
+    if (g_asn != NULL || g_country != NULL) {
+        printf("GeoIP: ASN database %s, country database %s\n", g_asn != NULL ? g_config.asn_database : "(none)",
+               g_country != NULL ? g_config.country_database : "(none)");
+    } else {
+        printf("GeoIP: no databases found; ASN and country policies are inactive until one appears\n");
+    }
+
+    if (g_config.check_interval_seconds != 0) {
+        h2o_timer_init(&g_check_timer, on_check);
+        h2o_timer_link(g_loop, (uint64_t)g_config.check_interval_seconds * 1000, &g_check_timer);
+    }
+    return 0;
+}
+
+int geoip_reload(void)
+{
+    return load(g_config.asn_database != NULL, g_config.country_database != NULL);
+}
+
+int geoip_lookup(const struct sockaddr *addr, geoip_info_t *info)
+{
+    static const char *const asn_path[] = {"autonomous_system_number", NULL};
+    static const char *const country_path[] = {"country", "iso_code", NULL};
+    static const char *const registered_path[] = {"registered_country", "iso_code", NULL};
+    const uint8_t *bytes;
+    size_t len;
+
+    memset(info, 0, sizeof(*info));
+    if (!g_loaded)
+        return 0;
+
+    if (addr->sa_family == AF_INET) {
+        bytes = (const uint8_t *)&((const struct sockaddr_in *)addr)->sin_addr;
+        len = 4;
+    } else if (addr->sa_family == AF_INET6) {
+        const struct in6_addr *addr6 = &((const struct sockaddr_in6 *)addr)->sin6_addr;
+        /* dual-stack sockets report IPv4 clients as ::ffff:a.b.c.d */
+        bytes = IN6_IS_ADDR_V4MAPPED(addr6) ? addr6->s6_addr + 12 : addr6->s6_addr;
+        len = IN6_IS_ADDR_V4MAPPED(addr6) ? 4 : 16;
+    } else {
+        return 0;
+    }
+
+    pthread_rwlock_rdlock(&g_lock);
+
+    if (g_last.generation == g_generation && g_last.key_len == len && memcmp(g_last.key, bytes, len) == 0) {
+        *info = g_last.info;
+        pthread_rwlock_unlock(&g_lock);
+        g_cache_hits++;
+        return info->asn != 0 || info->country[0] != '\0';
+    }
+
+    uint64_t start = now_ns();
+    size_t off;
+    uint64_t asn;
+    if (g_asn != NULL && search(g_asn, bytes, len, &off) == 0 &&
+        get_uint(g_asn->data, g_asn->data_size, off, asn_path, &asn) == 0 && asn <= UINT32_MAX)
+        info->asn = (uint32_t)asn;
+    if (g_country != NULL && search(g_country, bytes, len, &off) == 0) {
+        mmdb_value_t code;
+        if ((find_path(g_country->data, g_country->data_size, off, country_path, &code) == 0 ||
+             find_path(g_country->data, g_country->data_size, off, registered_path, &code) == 0) &&
+            code.type == TYPE_STRING && code.size == 2) {
+            memcpy(info->country, g_country->data + code.payload, 2);
+            info->country[2] = '\0';
+        }
+    }
+
+    g_last.generation = g_generation;
+    g_last.key_len = (uint8_t)len;
+    memcpy(g_last.key, bytes, len);
+    g_last.info = *info;
+    pthread_rwlock_unlock(&g_lock);
+
+    g_lookup_ns += now_ns() - start;
+    g_lookups++;
+    return info->asn != 0 || info->country[0] != '\0';
+}
+
+void geoip_get_stats(uint64_t *lookups, uint64_t *cache_hits, uint64_t *lookup_ns, uint64_t *reloads,
+                     uint64_t *asn_epoch, uint64_t *country_epoch)
+{
+    if (lookups)
+        *lookups = g_lookups;
+    if (cache_hits)
+        *cache_hits = g_cache_hits;
+    if (lookup_ns)
+        *lookup_ns = g_lookup_ns;
+    if (reloads)
+        *reloads = g_reloads;
+
+    pthread_rwlock_rdlock(&g_lock);
+    if (asn_epoch)
+        *asn_epoch = g_asn != NULL ? g_asn->build_epoch : 0;
+    if (country_epoch)
+        *country_epoch = g_country != NULL ? g_country->build_epoch : 0;
+    pthread_rwlock_unlock(&g_lock);
+}
@@ -1,105 +1,509 @@
 #include "growtopia/handlers.h"
+#include "growtopia/assets.h"
+#include "growtopia/bufpool.h"
+#include "growtopia/capture.h"
+#include "growtopia/certstore.h"
+#include "growtopia/challenge.h"
+#include "growtopia/coalesce.h"
+#include "growtopia/compress.h"
+#include "growtopia/crypto_pool.h"
+#include "growtopia/fair_queue.h"
+#include "growtopia/geoip.h"
+#include "growtopia/listener.h"
+#include "growtopia/middleware.h"
+#include "growtopia/profiler.h"
+#include "growtopia/proxy_protocol.h"
+#include "growtopia/response.h"
+#include "growtopia/router.h"
 #include "growtopia/security.h"
+#include "growtopia/stream.h"
+#include "growtopia/tls.h"
+#include "growtopia/trace.h"
+#include <arpa/inet.h>
 #include <h2o.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 
-typedef struct {
-    h2o_handler_t super;
-    h2o_handler_t *next;
-} security_filter_t;
+/* canned responses, built once by handlers_init() */
+static response_template_t *text_plain_response;
+static response_template_t *hello_world_response;
+static response_template_t *post_echo_response;
+static response_template_t *reproxy_response;
 
-static int security_filter_on_req(h2o_handler_t *_self, h2o_req_t *req)
+int handlers_init(void)
 {
-    security_filter_t *self = (security_filter_t *)_self;
-    
-    /* Get client address - h2o stores this in req->conn */
-    struct sockaddr_storage addr;
-    
-    /* Use h2o's get_peername callback to get client address */
-    if (req->conn->callbacks->get_peername != NULL) {
-        socklen_t addr_len = req->conn->callbacks->get_peername(req->conn, (struct sockaddr *)&addr);
-        
-        if (addr_len > 0) {
-            /* Check request rate limit */
-            if (!security_check_request((struct sockaddr *)&addr)) {
-                /* Rate limit exceeded, return 429 Too Many Requests */
-                static h2o_generator_t generator = {NULL, NULL};
-                req->res.status = 429;
-                req->res.reason = "Too Many Requests";
-                h2o_add_header(&req->pool, &req->res.headers, H2O_TOKEN_CONTENT_TYPE, NULL, H2O_STRLIT("text/plain"));
-                h2o_add_header(&req->pool, &req->res.headers, H2O_TOKEN_RETRY_AFTER, NULL, H2O_STRLIT("60"));
-                h2o_start_response(req, &generator);
-                h2o_send(req, &(h2o_iovec_t){H2O_STRLIT("Rate limit exceeded. Please try again later.\n")}, 1, H2O_SEND_STATE_FINAL);
-                return 0;
-            }
-        }
-    }
-
-    /* Pass to next handler */
-    if (self->next)
-        return self->next->on_req(self->next, req);
+    static const char hello_world[] = "hello world\n";
+    static const char reproxy_body[] = "you should never see this!\n";
+
+    if ((text_plain_response = response_template_create(200, "OK")) == NULL ||
+        response_template_add_header(text_plain_response, H2O_TOKEN_CONTENT_TYPE, H2O_STRLIT("text/plain")) != 0)
+        goto Error;
+
+    if ((hello_world_response = response_template_create(200, "OK")) == NULL ||
+        response_template_add_header(hello_world_response, H2O_TOKEN_CONTENT_TYPE, H2O_STRLIT("text/plain")) != 0 ||
+        response_template_set_body(hello_world_response, hello_world, sizeof(hello_world) - 1) != 0)
+        goto Error;
+
+    if ((post_echo_response = response_template_create(200, "OK")) == NULL ||
+        response_template_add_header(post_echo_response, H2O_TOKEN_CONTENT_TYPE, H2O_STRLIT("text/plain; charset=utf-8")) != 0)
+        goto Error;
+
+    if ((reproxy_response = response_template_create(200, "OK")) == NULL ||
+        response_template_add_header(reproxy_response, H2O_TOKEN_X_REPROXY_URL, H2O_STRLIT("http://www.ietf.org/")) != 0 ||
+        response_template_set_body(reproxy_response, reproxy_body, sizeof(reproxy_body) - 1) != 0)
+        goto Error;
+
+    return 0;
+Error:
+    fprintf(stderr, "Failed to build response templates\n");
     return -1;
 }
 
-h2o_handler_t *register_security_filter(h2o_pathconf_t *pathconf)
+#define STATS_TOP_TALKERS 10
+#define STATS_SECTION_SIZE 16384
+
+/* appends one "address/len  ~count" line per top talker, returns the bytes written */
+static size_t format_top_talkers(char *buf, size_t cap, const char *title, int prefixes)
+{
+    security_talker_t talkers[STATS_TOP_TALKERS];
+    size_t n = security_get_top_talkers(prefixes, talkers, STATS_TOP_TALKERS), len = 0;
+    int written;
+
+    if ((written = snprintf(buf, cap, "%s:%s\n", title, n == 0 ? " none" : "")) < 0 || (size_t)written >= cap)
+        return 0;
+    len = written;
+
+    for (size_t i = 0; i < n; i++) {
+        char ip_str[INET6_ADDRSTRLEN];
+        if (talkers[i].addr.ss_family == AF_INET)
+            inet_ntop(AF_INET, &((struct sockaddr_in *)&talkers[i].addr)->sin_addr, ip_str, sizeof(ip_str));
+        else
+            inet_ntop(AF_INET6, &((struct sockaddr_in6 *)&talkers[i].addr)->sin6_addr, ip_str, sizeof(ip_str));
+        written = snprintf(buf + len, cap - len, "  %s/%u  ~%u (+/- %u)\n", ip_str, talkers[i].prefix_len,
+                           talkers[i].count, talkers[i].error);
+        if (written < 0 || (size_t)written >= cap - len)
+            break;
+        len += written;
+    }
+
+    return len;
+}
+
+static size_t format_top_asns(char *buf, size_t cap)
+{
+    security_asn_info_t asns[STATS_TOP_TALKERS];
+    size_t n = security_get_top_asns(asns, STATS_TOP_TALKERS), len = 0;
+    int written;
+
+    if ((written = snprintf(buf, cap, "Top ASNs:%s\n", n == 0 ? " none" : "")) < 0 || (size_t)written >= cap)
+        return 0;
+    len = written;
+
+    for (size_t i = 0; i < n; i++) {
+        written = snprintf(buf + len, cap - len, "  AS%u  %llu requests, %u connections, %llu blocked%s\n", asns[i].asn,
+                           (unsigned long long)asns[i].total_requests, asns[i].connection_count,
+                           (unsigned long long)asns[i].blocked, asns[i].limited ? " (policy)" : "");
+        if (written < 0 || (size_t)written >= cap - len)
+            break;
+        len += written;
+    }
+
+    return len;
+}
+
+/* sections of the stats page, in page order */
+enum {
+    STATS_SECURITY,
+    STATS_ASSETS,
+    STATS_COMPRESSION,
+    STATS_PROFILER,
+    STATS_FAIR_QUEUE,
+    STATS_CHALLENGE,
+    STATS_CAPTURE,
+    STATS_GEO,
+    STATS_HEAVY_HITTERS,
+    STATS_MIDDLEWARE,
+    STATS_ROUTING,
+    STATS_STREAMING,
+    STATS_REQUEST_MEMORY,
+    NUM_STATS_SECTIONS
+};
+
+/* one section of the stats page into buf; sections that depend on traffic (top talkers, pipelines) are cut at cap */
+static size_t format_stats_section(int section, char *buf, size_t cap)
+{
+    size_t len = 0;
+
+#define APPEND(...)                                                                                                            \
+    do {                                                                                                                       \
+        if (len < cap) {                                                                                                       \
+            int n = snprintf(buf + len, cap - len, __VA_ARGS__);                                                               \
+            if (n > 0)                                                                                                         \
+                len += (size_t)n < cap - len ? (size_t)n : cap - len - 1;                                                      \
+        }                                                                                                                      \
+    } while (0)
+
+    switch (section) {
+    case STATS_SECURITY: {
+        uint64_t blocked_requests = 0;
+        uint64_t banned_ips = 0;
+        security_get_stats(&blocked_requests, &banned_ips);
+
+        uint32_t tracked_entries = 0;
+        uint64_t untracked_decisions = 0;
+        security_get_sketch_stats(&tracked_entries, &untracked_decisions);
+
+        uint64_t coalesce_leaders = 0, coalesce_followers = 0, coalesce_cache_hits = 0;
+        coalesce_get_stats(&coalesce_leaders, &coalesce_followers, &coalesce_cache_hits);
+
+        uint64_t ring_accepts = 0, ring_wakeups = 0;
+        listener_get_stats(&ring_accepts, &ring_wakeups);
+
+        uint64_t proxy_accepted = 0, proxy_rejected = 0, proxy_parse_ns = 0;
+        proxy_protocol_get_stats(&proxy_accepted, &proxy_rejected, &proxy_parse_ns);
+
+        uint64_t ktls_connections = 0, userspace_tls_connections = 0, ecdsa_handshakes = 0, rsa_handshakes = 0;
+        tls_get_stats(&ktls_connections, &userspace_tls_connections, &ecdsa_handshakes, &rsa_handshakes);
+
+        uint32_t cert_hosts = 0;
+        uint64_t ocsp_staples = 0, cert_reloads = 0;
+        certstore_get_stats(&cert_hosts, &ocsp_staples, &cert_reloads);
+
+        uint32_t crypto_queue_depth = 0, crypto_max_queue_depth = 0;
+        uint64_t crypto_offloaded = 0, crypto_inline = 0;
+        crypto_pool_get_stats(&crypto_queue_depth, &crypto_max_queue_depth, &crypto_offloaded, &crypto_inline);
+
+        APPEND(
+            "Security Statistics\n"
+            "===================\n"
+            "Blocked requests: %llu\n"
+            "Banned IPs: %llu\n"
+            "Tracked IPs: %u\n"
+            "Untracked decisions: %llu\n"
+            "\n"
+            "Request Coalescing\n"
+            "==================\n"
+            "Leaders: %llu\n"
+            "Followers: %llu\n"
+            "Cache hits: %llu\n"
+            "\n"
+            "Listener\n"
+            "========\n"
+            "Accept backend: %s\n"
+            "io_uring accepts: %llu\n"
+            "io_uring wakeups: %llu\n"
+            "PROXY headers: %llu (rejected %llu, avg parse %llu ns)\n"
+            "\n"
+            "TLS\n"
+            "===\n"
+            "kTLS connections: %llu\n"
+            "User-space TLS connections: %llu\n"
+            "ECDSA handshakes: %llu\n"
+            "RSA handshakes: %llu\n"
+            "Certificate hosts: %u (reloads %llu)\n"
+            "OCSP staples: %llu\n"
+            "Handshake queue depth: %u (max %u)\n"
+            "Private-key ops offloaded: %llu (inline %llu)\n",
+            (unsigned long long)blocked_requests,
+            (unsigned long long)banned_ips,
+            tracked_entries,
+            (unsigned long long)untracked_decisions,
+            (unsigned long long)coalesce_leaders,
+            (unsigned long long)coalesce_followers,
+            (unsigned long long)coalesce_cache_hits,
+            listener_backend_name(),
+            (unsigned long long)ring_accepts,
+            (unsigned long long)ring_wakeups,
+            (unsigned long long)proxy_accepted,
+            (unsigned long long)proxy_rejected,
+            (unsigned long long)(proxy_accepted != 0 ? proxy_parse_ns / proxy_accepted : 0),
+            (unsigned long long)ktls_connections,
+            (unsigned long long)userspace_tls_connections,
+            (unsigned long long)ecdsa_handshakes,
+            (unsigned long long)rsa_handshakes,
+            cert_hosts,
+            (unsigned long long)cert_reloads,
+            (unsigned long long)ocsp_staples,
+            crypto_queue_depth,
+            crypto_max_queue_depth,
+            (unsigned long long)crypto_offloaded,
+            (unsigned long long)crypto_inline);
+        break;
+    }
+    case STATS_ASSETS: {
+        uint64_t asset_full = 0, asset_ranges = 0, asset_deltas = 0, asset_not_modified = 0, asset_bytes = 0;
+        assets_get_stats(&asset_full, &asset_ranges, &asset_deltas, &asset_not_modified, &asset_bytes);
+        APPEND("\nAssets\n======\n"
+               "Full downloads: %llu\n"
+               "Range responses: %llu\n"
+               "Delta patches: %llu\n"
+               "Not modified: %llu\n"
+               "Bytes sent: %llu\n",
+               (unsigned long long)asset_full, (unsigned long long)asset_ranges, (unsigned long long)asset_deltas,
+               (unsigned long long)asset_not_modified, (unsigned long long)asset_bytes);
+        break;
+    }
+    case STATS_COMPRESSION: {
+        uint64_t gz_responses = 0, gz_in = 0, gz_out = 0, gz_ns = 0, gz_small = 0, gz_overload = 0, gz_contexts = 0;
+        compress_get_stats(&gz_responses, &gz_in, &gz_out, &gz_ns, &gz_small, &gz_overload, &gz_contexts);
+        APPEND("\nCompression\n===========\n"
+               "Compressed responses: %llu\n"
+               "Bytes in/out: %llu / %llu\n"
+               "Time per response: %llu us\n"
+               "Skipped (small/overload): %llu / %llu\n"
+               "Contexts created: %llu\n",
+               (unsigned long long)gz_responses, (unsigned long long)gz_in, (unsigned long long)gz_out,
+               (unsigned long long)(gz_responses ? gz_ns / gz_responses / 1000 : 0),
+               (unsigned long long)gz_small, (unsigned long long)gz_overload, (unsigned long long)gz_contexts);
+        break;
+    }
+    case STATS_PROFILER: {
+        uint64_t profiles = 0, profile_samples = 0, profile_dropped = 0, profile_sample_ns = 0;
+        profiler_get_stats(&profiles, &profile_samples, &profile_dropped, &profile_sample_ns);
+        APPEND("\nProfiler\n========\n"
+               "Profiles taken: %llu\n"
+               "Samples: %llu (dropped %llu)\n"
+               "Cost per sample: %llu ns\n",
+               (unsigned long long)profiles, (unsigned long long)profile_samples,
+               (unsigned long long)profile_dropped, (unsigned long long)profile_sample_ns);
+        break;
+    }
+    case STATS_FAIR_QUEUE: {
+        uint64_t fq_admitted = 0, fq_queued = 0, fq_rejected = 0, fq_abandoned = 0, fq_wait_ns = 0;
+        uint32_t fq_in_flight = 0, fq_waiting = 0;
+        fair_queue_get_stats(&fq_admitted, &fq_queued, &fq_rejected, &fq_abandoned, &fq_wait_ns, &fq_in_flight,
+                             &fq_waiting);
+        APPEND("\nFair Queuing\n============\n"
+               "In flight / waiting: %u / %u\n"
+               "Admitted directly: %llu\n"
+               "Queued: %llu (avg wait %llu us)\n"
+               "Refused (queue full): %llu\n"
+               "Abandoned while queued: %llu\n",
+               fq_in_flight, fq_waiting, (unsigned long long)fq_admitted, (unsigned long long)fq_queued,
+               (unsigned long long)(fq_queued ? fq_wait_ns / fq_queued / 1000 : 0),
+               (unsigned long long)fq_rejected, (unsigned long long)fq_abandoned);
+        break;
+    }
+    case STATS_CHALLENGE: {
+        uint64_t ch_issued = 0, ch_verified = 0, ch_invalid = 0, ch_activations = 0, ch_verify_ns = 0;
+        challenge_get_stats(&ch_issued, &ch_verified, &ch_invalid, &ch_activations, &ch_verify_ns);
+        APPEND("\nChallenge Mode\n==============\n"
+               "Active: %s (turned on %llu times)\n"
+               "Challenges sent: %llu\n"
+               "Verified requests: %llu\n"
+               "Invalid cookies: %llu\n"
+               "Average check: %llu ns\n",
+               challenge_active() ? "yes" : "no", (unsigned long long)ch_activations,
+               (unsigned long long)ch_issued, (unsigned long long)ch_verified, (unsigned long long)ch_invalid,
+               (unsigned long long)(ch_issued + ch_verified ? ch_verify_ns / (ch_issued + ch_verified) : 0));
+        break;
+    }
+    case STATS_CAPTURE: {
+        uint64_t cap_captures = 0, cap_requests = 0, cap_bytes = 0, cap_dropped = 0;
+        int cap_active = 0;
+        capture_get_stats(&cap_captures, &cap_requests, &cap_bytes, &cap_dropped, &cap_active);
+        APPEND("\nTraffic Capture\n===============\n"
+               "Running: %s\n"
+               "Captures: %llu\n"
+               "Requests captured: %llu (%llu bytes)\n"
+               "Dropped (writer behind): %llu\n",
+               cap_active ? "yes" : "no", (unsigned long long)cap_captures, (unsigned long long)cap_requests,
+               (unsigned long long)cap_bytes, (unsigned long long)cap_dropped);
+        break;
+    }
+    case STATS_GEO: {
+        uint64_t geo_lookups = 0, geo_cache_hits = 0, geo_lookup_ns = 0, geo_reloads = 0;
+        uint64_t asn_epoch = 0, country_epoch = 0, geo_blocked = 0;
+        uint32_t tracked_asns = 0;
+        geoip_get_stats(&geo_lookups, &geo_cache_hits, &geo_lookup_ns, &geo_reloads, &asn_epoch, &country_epoch);
+        security_get_geo_stats(&tracked_asns, &geo_blocked);
+        APPEND("\nASN / Geo\n=========\n"
+               "Lookups: %llu (avg %llu ns, %llu answered from cache)\n"
+               "Database reloads: %llu\n"
+               "ASN / country database built: %llu / %llu\n"
+               "Tracked ASNs: %u\n"
+               "Blocked by policy: %llu\n",
+               (unsigned long long)geo_lookups,
+               (unsigned long long)(geo_lookups ? geo_lookup_ns / geo_lookups : 0),
+               (unsigned long long)geo_cache_hits, (unsigned long long)geo_reloads,
+               (unsigned long long)asn_epoch, (unsigned long long)country_epoch, tracked_asns,
+               (unsigned long long)geo_blocked);
+        len += format_top_asns(buf + len, cap - len);
+        break;
+    }
+    case STATS_HEAVY_HITTERS: {
+        APPEND("\nHeavy Hitters\n=============\n");
+        len += format_top_talkers(buf + len, cap - len, "Top sources", 0);
+        len += format_top_talkers(buf + len, cap - len, "Top prefixes", 1);
+        break;
+    }
+    case STATS_MIDDLEWARE: {
+        APPEND("\nMiddleware\n==========\n");
+        len += middleware_format_stats(buf + len, cap - len);
+        break;
+    }
+    case STATS_ROUTING: {
+        uint32_t routes = 0;
+        uint64_t route_exact = 0, route_prefix = 0, route_fallbacks = 0;
+        router_get_stats(&routes, &route_exact, &route_prefix, &route_fallbacks);
+        APPEND("\nRouting\n=======\n"
+               "Routes: %u\n"
+               "Lookups: %llu exact, %llu prefix, %llu unmatched\n",
+               routes, (unsigned long long)route_exact, (unsigned long long)route_prefix,
+               (unsigned long long)route_fallbacks);
+        break;
+    }
+    case STATS_STREAMING: {
+        uint64_t streams_started = 0, streams_completed = 0, streams_canceled = 0, streams_failed = 0, stream_bytes = 0;
+        stream_get_stats(&streams_started, &streams_completed, &streams_canceled, &streams_failed, &stream_bytes);
+        APPEND("\nStreaming\n=========\n"
+               "Responses: %llu started, %llu completed, %llu canceled, %llu failed\n"
+               "Body bytes: %llu\n",
+               (unsigned long long)streams_started, (unsigned long long)streams_completed,
+               (unsigned long long)streams_canceled, (unsigned long long)streams_failed,
+               (unsigned long long)stream_bytes);
+        break;
+    }
+    case STATS_REQUEST_MEMORY: {
+        uint64_t pool_hits = 0, pool_misses = 0, pool_trimmed = 0, pool_cached = 0;
+        bufpool_get_stats(&pool_hits, &pool_misses, &pool_trimmed, &pool_cached);
+        APPEND("\nRequest Memory\n==============\n"
+               "Recycled buffers: %llu reused, %llu allocated, %llu freed over the cap\n"
+               "Cached: %llu KiB\n",
+               (unsigned long long)pool_hits, (unsigned long long)pool_misses,
+               (unsigned long long)pool_trimmed, (unsigned long long)(pool_cached / 1024));
+        len += bufpool_format_stats(buf + len, cap - len);
+        break;
+    }
+    }
+
+#undef APPEND
+
+    return len;
+}
+
+/* the page goes out one section at a time through a single buffer, so it has no overall size limit */
+typedef struct {
+    char *buf;                           // The section being sent
+    int section;                         // Next section to format
+} stats_page_t;
+
+static int next_stats_section(void *ctx, h2o_iovec_t *item)
 {
-    security_filter_t *filter = (security_filter_t *)h2o_create_handler(pathconf, sizeof(*filter));
-    filter->super.on_req = security_filter_on_req;
-    filter->next = NULL;
-    return &filter->super;
+    stats_page_t *page = ctx;
+
+    if (page->section == NUM_STATS_SECTIONS)
+        return 0;
+    *item = h2o_iovec_init(page->buf, format_stats_section(page->section++, page->buf, STATS_SECTION_SIZE));
+    return 1;
 }
 
 int security_stats_handler(h2o_handler_t *self, h2o_req_t *req)
 {
-    static h2o_generator_t generator = {NULL, NULL};
-    
     if (!h2o_memis(req->method.base, req->method.len, H2O_STRLIT("GET")))
         return -1;
 
-    uint64_t blocked_requests = 0;
-    uint64_t banned_ips = 0;
-    security_get_stats(&blocked_requests, &banned_ips);
-
-    char response[512];
-    int len = snprintf(response, sizeof(response),
-        "Security Statistics\n"
-        "===================\n"
-        "Blocked requests: %llu\n"
-        "Banned IPs: %llu\n",
-        (unsigned long long)blocked_requests,
-        (unsigned long long)banned_ips);
-
-    req->res.status = 200;
-    req->res.reason = "OK";
-    h2o_add_header(&req->pool, &req->res.headers, H2O_TOKEN_CONTENT_TYPE, NULL, H2O_STRLIT("text/plain"));
-    h2o_start_response(req, &generator);
-    h2o_iovec_t body = h2o_strdup(&req->pool, response, len);
-    h2o_send(req, &body, 1, H2O_SEND_STATE_FINAL);
+    stats_page_t *page = h2o_mem_alloc_pool(&req->pool, stats_page_t, 1);
+    page->buf = bufpool_alloc(req, STATS_SECTION_SIZE);
+    page->section = 0;
+    stream_start(req, text_plain_response, stream_iterator_producer(req, next_stats_section, page));
     return 0;
 }
 
+#if GROWTOPIA_USE_USDT
+typedef struct {
+    h2o_handler_t super;
+    const char *route;
+    int (*on_req)(h2o_handler_t *, h2o_req_t *);
+} traced_handler_t;
+
+typedef struct {
+    h2o_req_t *req;
+    const char *route;
+    uint64_t start_ns;
+} traced_request_t;
+
+static void on_traced_request_dispose(void *p)
+{
+    traced_request_t *traced = p;
+
+    GROWTOPIA_TRACE(request_done, traced->route, traced->req->res.status, (uint64_t)traced->req->bytes_sent,
+                    growtopia_trace_now_ns() - traced->start_ns);
+}
+
+/* fires handler_entry/handler_return around the real handler, and request_done when the request is disposed */
+static int on_traced_req(h2o_handler_t *_self, h2o_req_t *req)
+{
+    traced_handler_t *self = (traced_handler_t *)_self;
+    int ret;
+
+    if (!GROWTOPIA_TRACE_ENABLED(handler_entry) && !GROWTOPIA_TRACE_ENABLED(handler_return) &&
+        !GROWTOPIA_TRACE_ENABLED(request_done))
+        return self->on_req(_self, req);
+
+    uint64_t start = growtopia_trace_now_ns();
+    if (GROWTOPIA_TRACE_ENABLED(request_done)) {
+        traced_request_t *traced = h2o_mem_alloc_shared(&req->pool, sizeof(*traced), on_traced_request_dispose);
+        traced->req = req;
+        traced->route = self->route;
+        traced->start_ns = start;
+    }
+
+    GROWTOPIA_TRACE(handler_entry, self->route, req);
+    ret = self->on_req(_self, req);
+    GROWTOPIA_TRACE(handler_return, self->route, req, ret, growtopia_trace_now_ns() - start);
+    return ret;
+}
+#endif
+
 h2o_pathconf_t *register_handler(h2o_hostconf_t *hostconf, const char *path, int (*on_req)(h2o_handler_t *, h2o_req_t *))
 {
     h2o_pathconf_t *pathconf = h2o_config_register_path(hostconf, path, 0);
+#if GROWTOPIA_USE_USDT
+    traced_handler_t *handler = (traced_handler_t *)h2o_create_handler(pathconf, sizeof(*handler));
+    handler->super.on_req = on_traced_req;
+    handler->route = pathconf->path.base;
+    handler->on_req = on_req;
+#else
     h2o_handler_t *handler = h2o_create_handler(pathconf, sizeof(*handler));
     handler->on_req = on_req;
+#endif
     return pathconf;
 }
 
-int chunked_test(h2o_handler_t *self, h2o_req_t *req)
+h2o_handler_t *create_prepended_handler(h2o_pathconf_t *pathconf, size_t sz)
+{
+    h2o_handler_t *handler = h2o_create_handler(pathconf, sz);
+
+    /* h2o runs the handlers of a path in registration order; move the new one to the front */
+    memmove(pathconf->handlers.entries + 1, pathconf->handlers.entries,
+            (pathconf->handlers.size - 1) * sizeof(pathconf->handlers.entries[0]));
+    pathconf->handlers.entries[0] = handler;
+    return handler;
+}
+
+/* yields the template body once */
+static int next_hello_world(void *ctx, h2o_iovec_t *item)
 {
-    static h2o_generator_t generator = {NULL, NULL};
+    int *sent = ctx;
 
+    if (*sent)
+        return 0;
+    *sent = 1;
+    *item = hello_world_response->body;
+    return 1;
+}
+
+int chunked_test(h2o_handler_t *self, h2o_req_t *req)
+{
     if (!h2o_memis(req->method.base, req->method.len, H2O_STRLIT("GET")))
         return -1;
 
-    h2o_iovec_t body = h2o_strdup(&req->pool, "hello world\n", SIZE_MAX);
-    req->res.status = 200;
-    req->res.reason = "OK";
-    h2o_add_header(&req->pool, &req->res.headers, H2O_TOKEN_CONTENT_TYPE, NULL, H2O_STRLIT("text/plain"));
-    h2o_start_response(req, &generator);
-    h2o_send(req, &body, 1, 1);
+    /* no content-length, so the body goes out chunked */
+    int *sent = h2o_mem_alloc_pool(&req->pool, int, 1);
+    *sent = 0;
+    stream_start(req, hello_world_response, stream_iterator_producer(req, next_hello_world, sent));
 
     return 0;
 }
@@ -109,10 +513,7 @@ int reproxy_test(h2o_handler_t *self, h2o_req_t *req)
     if (!h2o_memis(req->method.base, req->method.len, H2O_STRLIT("GET")))
         return -1;
 
-    req->res.status = 200;
-    req->res.reason = "OK";
-    h2o_add_header(&req->pool, &req->res.headers, H2O_TOKEN_X_REPROXY_URL, NULL, H2O_STRLIT("http://www.ietf.org/"));
-    h2o_send_inline(req, H2O_STRLIT("you should never see this!\n"));
+    response_template_send(reproxy_response, req);
 
     return 0;
 }
@@ -122,10 +523,7 @@ int post_test(h2o_handler_t *self, h2o_req_t *req)
     if (h2o_memis(req->method.base, req->method.len, H2O_STRLIT("POST")) &&
         h2o_memis(req->path_normalized.base, req->path_normalized.len, H2O_STRLIT("/post-test/"))) {
         static h2o_generator_t generator = {NULL, NULL};
-        req->res.status = 200;
-        req->res.reason = "OK";
-        h2o_add_header(&req->pool, &req->res.headers, H2O_TOKEN_CONTENT_TYPE, NULL, H2O_STRLIT("text/plain; charset=utf-8"));
-        h2o_start_response(req, &generator);
+        response_template_start(post_echo_response, req, &generator);
         h2o_send(req, &req->entity, 1, 1);
         return 0;
     }
@@ -1,14 +1,157 @@
 #include "growtopia/listener.h"
+#include "growtopia/proxy_protocol.h"
 #include "growtopia/security.h"
+#include "growtopia/trace.h"
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <errno.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <sys/socket.h>
+#if GROWTOPIA_USE_IO_URING
+#include <liburing.h>
+#include <sys/eventfd.h>
+#endif
 
 static h2o_context_t *g_ctx = NULL;
 static h2o_accept_ctx_t *g_accept_ctx = NULL;
+static int g_use_io_uring = 1;
+
+#if GROWTOPIA_USE_IO_URING
+#define RING_ENTRIES 64
+
+static struct io_uring g_ring;
+static int g_ring_active = 0;
+static int g_ring_eventfd = -1;
+static int g_listen_fd = -1;
+static uint64_t g_ring_accepts = 0;
+static uint64_t g_ring_wakeups = 0;
+
+/* backend-specific halves, defined in the libuv / evloop sections below */
+static void on_ring_accept(int fd);
+static int ring_watch_eventfd(int fd);
+static void ring_unwatch_eventfd(void);
+static int start_fallback_accept(int fd);
+
+static int ring_arm_accept(void)
+{
+    struct io_uring_sqe *sqe = io_uring_get_sqe(&g_ring);
+
+    if (sqe == NULL)
+        return -1;
+    /* one submission keeps producing a completion per accepted connection */
+    io_uring_prep_multishot_accept(sqe, g_listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    return io_uring_submit(&g_ring) < 0 ? -1 : 0;
+}
+
+static void ring_teardown(void)
+{
+    /* also closes the eventfd */
+    ring_unwatch_eventfd();
+    g_ring_eventfd = -1;
+    io_uring_queue_exit(&g_ring);
+    g_ring_active = 0;
+}
+
+/**
+ * Try to accept connections on listen_fd through io_uring.
+ * Returns 0 on success, -1 if the kernel (or liburing) lacks support.
+ */
+static int ring_setup(int listen_fd)
+{
+    struct io_uring_params params;
+    struct io_uring_probe *probe;
+    int supported;
+
+    memset(&params, 0, sizeof(params));
+    if (io_uring_queue_init_params(RING_ENTRIES, &g_ring, &params) != 0)
+        return -1;
+
+    probe = io_uring_get_probe_ring(&g_ring);
+    supported = probe != NULL && io_uring_opcode_supported(probe, IORING_OP_ACCEPT);
+    if (probe != NULL)
+        io_uring_free_probe(probe);
+    if (!supported) {
+        io_uring_queue_exit(&g_ring);
+        return -1;
+    }
+
+    /* completions are signalled through an eventfd that the event loop watches */
+    if ((g_ring_eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1) {
+        io_uring_queue_exit(&g_ring);
+        return -1;
+    }
+    if (io_uring_register_eventfd(&g_ring, g_ring_eventfd) != 0 || ring_watch_eventfd(g_ring_eventfd) != 0) {
+        close(g_ring_eventfd);
+        g_ring_eventfd = -1;
+        io_uring_queue_exit(&g_ring);
+        return -1;
+    }
+    g_ring_active = 1;
+    g_listen_fd = listen_fd;
+
+    if (ring_arm_accept() != 0) {
+        ring_teardown();
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Reset the eventfd counter; it stays readable, and wakes the loop on every iteration, until it is read
+ */
+static void ring_clear_eventfd(void)
+{
+    uint64_t counter;
+
+    while (read(g_ring_eventfd, &counter, sizeof(counter)) == sizeof(counter) || errno == EINTR)
+        ;
+}
+
+/**
+ * Reap accept completions; called when the eventfd becomes readable
+ */
+static void ring_drain(void)
+{
+    struct io_uring_cqe *cqe;
+    unsigned head, seen = 0;
+    int rearm = 0, unsupported = 0;
+
+    ++g_ring_wakeups;
+    /* before reaping, so that a completion arriving meanwhile signals the eventfd again */
+    ring_clear_eventfd();
+
+    io_uring_for_each_cqe(&g_ring, head, cqe)
+    {
+        ++seen;
+        if (cqe->res >= 0) {
+            ++g_ring_accepts;
+            on_ring_accept(cqe->res);
+        } else if (cqe->res == -EINVAL && g_ring_accepts == 0) {
+            /* kernels before 5.19 reject multishot accept */
+            unsupported = 1;
+        }
+        if (!(cqe->flags & IORING_CQE_F_MORE))
+            rearm = 1;
+    }
+    io_uring_cq_advance(&g_ring, seen);
+
+    if (unsupported) {
+        fprintf(stderr, "io_uring multishot accept not supported; falling back to the event loop\n");
+        ring_teardown();
+        start_fallback_accept(g_listen_fd);
+        return;
+    }
+    if (rearm && ring_arm_accept() != 0) {
+        fprintf(stderr, "failed to re-arm io_uring accept; falling back to the event loop\n");
+        ring_teardown();
+        start_fallback_accept(g_listen_fd);
+    }
+}
+#endif
 
 int listener_init(h2o_context_t *ctx, h2o_accept_ctx_t *accept_ctx)
 {
@@ -17,50 +160,212 @@ int listener_init(h2o_context_t *ctx, h2o_accept_ctx_t *accept_ctx)
     return 0;
 }
 
-#ifdef H2O_USE_LIBUV
-static uv_tcp_t listener;
+void listener_set_io_uring(int use_io_uring)
+{
+    g_use_io_uring = use_io_uring;
+}
 
-static void on_accept_uv(uv_stream_t *listener_stream, int status)
+const char *listener_backend_name(void)
 {
-    uv_tcp_t *conn;
-    h2o_socket_t *sock;
-    struct sockaddr_storage addr;
-    int addr_len = sizeof(addr);
+#if GROWTOPIA_USE_IO_URING
+    if (g_ring_active)
+        return "io_uring";
+#endif
+#if H2O_USE_LIBUV
+    return "libuv";
+#else
+    return "evloop";
+#endif
+}
 
-    if (status != 0)
-        return;
+void listener_get_stats(uint64_t *ring_accepts, uint64_t *ring_wakeups)
+{
+#if GROWTOPIA_USE_IO_URING
+    if (ring_accepts)
+        *ring_accepts = g_ring_accepts;
+    if (ring_wakeups)
+        *ring_wakeups = g_ring_wakeups;
+#else
+    if (ring_accepts)
+        *ring_accepts = 0;
+    if (ring_wakeups)
+        *ring_wakeups = 0;
+#endif
+}
 
-    conn = h2o_mem_alloc(sizeof(*conn));
-    uv_tcp_init(listener_stream->loop, conn);
+static void on_tracked_close(void *conn)
+{
+    security_unregister_connection(conn);
+    free(conn);
+}
 
-    if (uv_accept(listener_stream, (uv_stream_t *)conn) != 0) {
-        uv_close((uv_handle_t *)conn, (uv_close_cb)free);
+/* count the connection against its IP, ASN and country until h2o closes the socket */
+static void track_connection(h2o_socket_t *sock, const struct sockaddr *addr)
+{
+    security_connection_t *conn;
+
+    /* not counted at all rather than counted and never released */
+    if ((conn = malloc(sizeof(*conn))) == NULL)
         return;
+    security_register_connection(addr, conn);
+    sock->on_close.cb = on_tracked_close;
+    sock->on_close.data = conn;
+}
+
+/* security check on the socket's peer name (the real client address for load-balanced connections) */
+static void admit_sock(h2o_socket_t *sock)
+{
+    struct sockaddr_storage addr;
+
+    /* PROXY LOCAL / UNKNOWN connections come back as AF_UNSPEC and have no source to check */
+    if (h2o_socket_getpeername(sock, (struct sockaddr *)&addr) != 0 &&
+        (addr.ss_family == AF_INET || addr.ss_family == AF_INET6)) {
+        if (!security_check_connection((struct sockaddr *)&addr)) {
+            h2o_socket_close(sock);
+            return;
+        }
+        track_connection(sock, (struct sockaddr *)&addr);
     }
 
+    h2o_accept(g_accept_ctx, sock);
+}
+
+#if H2O_USE_LIBUV
+static uv_tcp_t listener;
+
+static void accept_uv_conn(uv_tcp_t *conn)
+{
+    h2o_socket_t *sock;
+    struct sockaddr_storage addr;
+    int addr_len = sizeof(addr), tracked = 0;
+
     /* Get peer address for security checks */
     if (uv_tcp_getpeername(conn, (struct sockaddr *)&addr, &addr_len) == 0) {
+        int via_proxy = proxy_protocol_is_trusted((struct sockaddr *)&addr);
+        GROWTOPIA_TRACE(accept, &addr, via_proxy);
+        /* A trusted load balancer sends the client address first; check that one instead */
+        if (via_proxy) {
+            proxy_protocol_accept(h2o_uv_socket_create((uv_handle_t *)conn, (uv_close_cb)free), admit_sock);
+            return;
+        }
         /* Check if connection is allowed */
         if (!security_check_connection((struct sockaddr *)&addr)) {
             /* Connection blocked by security */
             uv_close((uv_handle_t *)conn, (uv_close_cb)free);
             return;
         }
-        /* Register the connection */
-        security_register_connection((struct sockaddr *)&addr);
+        tracked = 1;
     }
 
     sock = h2o_uv_socket_create((uv_handle_t *)conn, (uv_close_cb)free);
+    /* Register the connection */
+    if (tracked)
+        track_connection(sock, (struct sockaddr *)&addr);
     h2o_accept(g_accept_ctx, sock);
 }
 
+static void on_accept_uv(uv_stream_t *listener_stream, int status)
+{
+    uv_tcp_t *conn;
+
+    if (status != 0)
+        return;
+
+    conn = h2o_mem_alloc(sizeof(*conn));
+    uv_tcp_init(listener_stream->loop, conn);
+
+    if (uv_accept(listener_stream, (uv_stream_t *)conn) != 0) {
+        uv_close((uv_handle_t *)conn, (uv_close_cb)free);
+        return;
+    }
+
+    accept_uv_conn(conn);
+}
+
+#if GROWTOPIA_USE_IO_URING
+static uv_poll_t ring_poll;
+
+static void on_ring_poll(uv_poll_t *handle, int status, int events)
+{
+    ring_drain();
+}
+
+static int ring_watch_eventfd(int fd)
+{
+    if (uv_poll_init(g_ctx->loop, &ring_poll, fd) != 0)
+        return -1;
+    return uv_poll_start(&ring_poll, UV_READABLE, on_ring_poll);
+}
+
+static void ring_unwatch_eventfd(void)
+{
+    uv_poll_stop(&ring_poll);
+    uv_close((uv_handle_t *)&ring_poll, NULL);
+    close(g_ring_eventfd);
+}
+
+static void on_ring_accept(int fd)
+{
+    uv_tcp_t *conn = h2o_mem_alloc(sizeof(*conn));
+
+    uv_tcp_init(g_ctx->loop, conn);
+    if (uv_tcp_open(conn, fd) != 0) {
+        close(fd);
+        uv_close((uv_handle_t *)conn, (uv_close_cb)free);
+        return;
+    }
+
+    accept_uv_conn(conn);
+}
+
+static int create_listen_fd(const struct sockaddr *addr, socklen_t addr_len)
+{
+    int fd, reuseaddr_flag = 1;
+
+    if ((fd = socket(addr->sa_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) == -1)
+        return -1;
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuseaddr_flag, sizeof(reuseaddr_flag)) != 0 ||
+        bind(fd, addr, addr_len) != 0 || listen(fd, SOMAXCONN) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+static int start_fallback_accept(int fd)
+{
+    int r;
+
+    uv_tcp_init(g_ctx->loop, &listener);
+    if ((r = uv_tcp_open(&listener, fd)) != 0 || (r = uv_listen((uv_stream_t *)&listener, 128, on_accept_uv)) != 0) {
+        fprintf(stderr, "uv_listen:%s\n", uv_strerror(r));
+        return r;
+    }
+    return 0;
+}
+#endif
+
 static int create_listener_uv(void)
 {
     struct sockaddr_in addr;
     int r;
 
-    uv_tcp_init(g_ctx->loop, &listener);
     uv_ip4_addr("0.0.0.0", 8000, &addr);
+
+#if GROWTOPIA_USE_IO_URING
+    if (g_use_io_uring) {
+        int fd;
+        if ((fd = create_listen_fd((const struct sockaddr *)&addr, sizeof(addr))) == -1) {
+            fprintf(stderr, "bind:%s\n", strerror(errno));
+            return -1;
+        }
+        if (ring_setup(fd) == 0)
+            return 0;
+        return start_fallback_accept(fd);
+    }
+#endif
+
+    uv_tcp_init(g_ctx->loop, &listener);
     if ((r = uv_tcp_bind(&listener, (const struct sockaddr *)&addr, 0)) != 0) {
         fprintf(stderr, "uv_tcp_bind:%s\n", uv_strerror(r));
         goto Error;
@@ -83,11 +388,35 @@ int listener_start(void)
 
 void listener_stop(void)
 {
+#if GROWTOPIA_USE_IO_URING
+    if (g_ring_active) {
+        ring_teardown();
+        close(g_listen_fd);
+        return;
+    }
+#endif
     uv_close((uv_handle_t *)&listener, NULL);
 }
 
 #else /* libuv not used */
 
+static void accept_ev_sock(h2o_socket_t *sock)
+{
+    struct sockaddr_storage addr;
+
+    if (h2o_socket_getpeername(sock, (struct sockaddr *)&addr) != 0) {
+        int via_proxy = proxy_protocol_is_trusted((struct sockaddr *)&addr);
+        GROWTOPIA_TRACE(accept, &addr, via_proxy);
+        /* A trusted load balancer sends the client address first; check that one instead */
+        if (via_proxy) {
+            proxy_protocol_accept(sock, admit_sock);
+            return;
+        }
+    }
+
+    admit_sock(sock);
+}
+
 static void on_accept_ev(h2o_socket_t *listener, const char *err)
 {
     h2o_socket_t *sock;
@@ -96,14 +425,56 @@ static void on_accept_ev(h2o_socket_t *listener, const char *err)
 
     if ((sock = h2o_evloop_socket_accept(listener)) == NULL)
         return;
-    h2o_accept(g_accept_ctx, sock);
+    accept_ev_sock(sock);
+}
+
+#if GROWTOPIA_USE_IO_URING
+static h2o_socket_t *ring_sock = NULL;
+
+static void on_ring_readable(h2o_socket_t *sock, const char *err)
+{
+    if (err != NULL)
+        return;
+    /* H2O_SOCKET_FLAG_DONT_READ leaves the eventfd to ring_drain() */
+    ring_drain();
+}
+
+static int ring_watch_eventfd(int fd)
+{
+    ring_sock = h2o_evloop_socket_create(g_ctx->loop, fd, H2O_SOCKET_FLAG_DONT_READ);
+    h2o_socket_read_start(ring_sock, on_ring_readable);
+    return 0;
+}
+
+static void ring_unwatch_eventfd(void)
+{
+    /* h2o_socket_close() closes the eventfd as well */
+    h2o_socket_read_stop(ring_sock);
+    h2o_socket_close(ring_sock);
+    ring_sock = NULL;
+}
+
+static void on_ring_accept(int fd)
+{
+    int nodelay_flag = 1;
+
+    /* h2o_evloop_socket_accept() would have done this for us */
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay_flag, sizeof(nodelay_flag));
+    accept_ev_sock(h2o_evloop_socket_create(g_ctx->loop, fd, 0));
+}
+#endif
+
+static int start_fallback_accept(int fd)
+{
+    h2o_socket_t *sock = h2o_evloop_socket_create(g_ctx->loop, fd, H2O_SOCKET_FLAG_DONT_READ);
+    h2o_socket_read_start(sock, on_accept_ev);
+    return 0;
 }
 
 static int create_listener_ev(void)
 {
     struct sockaddr_in addr;
     int fd, reuseaddr_flag = 1;
-    h2o_socket_t *sock;
 
     memset(&addr, 0, sizeof(addr));
     addr.sin_family = AF_INET;
@@ -116,10 +487,12 @@ static int create_listener_ev(void)
         return -1;
     }
 
-    sock = h2o_evloop_socket_create(g_ctx->loop, fd, H2O_SOCKET_FLAG_DONT_READ);
-    h2o_socket_read_start(sock, on_accept_ev);
+#if GROWTOPIA_USE_IO_URING
+    if (g_use_io_uring && ring_setup(fd) == 0)
+        return 0;
+#endif
 
-    return 0;
+    return start_fallback_accept(fd);
 }
 
 int listener_start(void)
@@ -129,6 +502,12 @@ int listener_start(void)
 
 void listener_stop(void)
 {
+#if GROWTOPIA_USE_IO_URING
+    if (g_ring_active) {
+        ring_teardown();
+        close(g_listen_fd);
+    }
+#endif
     /* no-op for the simple implementation; cleanup happens on shutdown */
 }
 
@@ -35,10 +35,29 @@
 
 #define USE_HTTPS 1
 #define USE_MEMCACHED 0
-
+#define POST_TEST_BODY_SIZE (64 * 1024)
+#define ADMIN_BODY_SIZE (4 * 1024 * 1024)  // Largest body any route takes; h2o refuses bigger ones before buffering
+
+#include "growtopia/admin.h"
+#include "growtopia/assets.h"
+#include "growtopia/bufpool.h"
+#include "growtopia/capture.h"
+#include "growtopia/certstore.h"
+#include "growtopia/challenge.h"
+#include "growtopia/coalesce.h"
+#include "growtopia/compress.h"
+#include "growtopia/crypto_pool.h"
+#include "growtopia/fair_queue.h"
+#include "growtopia/geoip.h"
 #include "growtopia/handlers.h"
 #include "growtopia/listener.h"
+#include "growtopia/middleware.h"
+#include "growtopia/profiler.h"
+#include "growtopia/proxy_protocol.h"
+#include "growtopia/router.h"
 #include "growtopia/security.h"
+#include "growtopia/stream.h"
+#include "growtopia/tls.h"
 #include "growtopia/config/server.h"
 
 static h2o_globalconf_t config;
@@ -131,7 +150,7 @@ static int create_listener(void)
 
 #endif
 
-static int setup_ssl(const char *cert_file, const char *key_file, const char *ciphers)
+static int setup_ssl(const char *cert_file, const char *key_file, const char *ciphers, const tls_config_t *tls_config)
 {
     SSL_load_error_strings();
     SSL_library_init();
@@ -166,6 +185,17 @@ static int setup_ssl(const char *cert_file, const char *key_file, const char *ci
         return -1;
     }
 
+    if (tls_init(accept_ctx.ssl_ctx, tls_config) != 0)
+        return -1;
+
+    /* rebinds the loaded private key, so this goes after it */
+    if (crypto_pool_init(accept_ctx.ssl_ctx, tls_config) != 0)
+        return -1;
+
+    /* per-SNI ECDSA/RSA certificates; the file loaded above stays the default for unmatched names */
+    if (certstore_init(accept_ctx.ssl_ctx, tls_config) != 0)
+        return -1;
+
 /* setup protocol negotiation methods */
 #if H2O_USE_NPN
     h2o_ssl_register_npn_protocols(accept_ctx.ssl_ctx, h2o_http2_npn_protocols);
@@ -177,6 +207,41 @@ static int setup_ssl(const char *cert_file, const char *key_file, const char *ci
     return 0;
 }
 
+/* capture, challenge, admission, rate limit, fair queuing with the route's weight, optional body-size limit and
+ * metrics, in that order. A weight of 0 leaves out fair queuing: its slot is held until the response is sent, so
+ * streaming routes would let slow downloads fill max_in_flight and hold up everything else */
+static int attach_pipeline(h2o_pathconf_t *pathconf, const char *route, size_t max_body_size, uint32_t weight)
+{
+    middleware_pipeline_t *pipeline = middleware_pipeline_create(route);
+
+    if (pipeline == NULL || middleware_add_capture(pipeline) != 0 || middleware_add_challenge(pipeline) != 0 ||
+        middleware_add_ip_admission(pipeline) != 0 || middleware_add_rate_limit(pipeline) != 0 ||
+        (weight != 0 && middleware_add_fair_queue(pipeline, weight) != 0) ||
+        (max_body_size != 0 && middleware_add_body_limit(pipeline, max_body_size) != 0) ||
+        middleware_add_metrics(pipeline) != 0 || middleware_attach(pipeline, pathconf) == NULL ||
+        bufpool_register_route(pathconf, route) != 0) {
+        fprintf(stderr, "failed to set up the middleware pipeline for %s\n", route);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* admin endpoints only answer loopback clients, and only on their own path */
+static int attach_admin_pipeline(h2o_pathconf_t *pathconf, const char *route)
+{
+    middleware_pipeline_t *pipeline = middleware_pipeline_create(route);
+
+    if (pipeline == NULL || router_set_exact(pathconf) != 0 || middleware_add_loopback_only(pipeline) != 0 ||
+        middleware_add_body_limit(pipeline, ADMIN_BODY_SIZE) != 0 || middleware_add_metrics(pipeline) != 0 ||
+        middleware_attach(pipeline, pathconf) == NULL || bufpool_register_route(pathconf, route) != 0) {
+        fprintf(stderr, "failed to set up the middleware pipeline for %s\n", route);
+        return -1;
+    }
+
+    return 0;
+}
+
 int main(int argc, char **argv)
 {
     h2o_hostconf_t *hostconf;
@@ -185,24 +250,96 @@ int main(int argc, char **argv)
 
     signal(SIGPIPE, SIG_IGN);
 
+    if (handlers_init() != 0 || middleware_init() != 0 || admin_init() != 0)
+        return 1;
+
     h2o_config_init(&config);
+    /* h2o buffers a whole body before the handlers run; the body-limit stages only narrow this per route */
+    config.max_request_entity_size = ADMIN_BODY_SIZE;
     hostconf = h2o_config_register_host(&config, h2o_iovec_init(H2O_STRLIT("default")), 65535);
 
     /* Security statistics endpoint */
     pathconf = register_handler(hostconf, "/security-stats", security_stats_handler);
+    register_compressor(pathconf, NULL);
+    if (attach_pipeline(pathconf, "/security-stats", 0, 1) != 0 || router_set_exact(pathconf) != 0)
+        goto Error;
+    if (logfh != NULL)
+        h2o_access_log_register(pathconf, logfh);
+
+    /* Admin API: batch ban/unban/whitelist/inspect and tracker export */
+    pathconf = register_handler(hostconf, "/admin/ips", admin_ips_handler);
+    register_compressor(pathconf, NULL);
+    if (attach_admin_pipeline(pathconf, "/admin/ips") != 0)
+        goto Error;
+    if (logfh != NULL)
+        h2o_access_log_register(pathconf, logfh);
+
+    pathconf = register_handler(hostconf, "/admin/export", admin_export_handler);
+    register_compressor(pathconf, NULL);
+    if (attach_admin_pipeline(pathconf, "/admin/export") != 0)
+        goto Error;
+    if (logfh != NULL)
+        h2o_access_log_register(pathconf, logfh);
+
+    pathconf = register_handler(hostconf, "/admin/certs/reload", admin_certs_reload_handler);
+    if (attach_admin_pipeline(pathconf, "/admin/certs/reload") != 0)
+        goto Error;
     if (logfh != NULL)
         h2o_access_log_register(pathconf, logfh);
 
+    pathconf = register_handler(hostconf, "/admin/assets/reload", admin_assets_reload_handler);
+    if (attach_admin_pipeline(pathconf, "/admin/assets/reload") != 0)
+        goto Error;
+    if (logfh != NULL)
+        h2o_access_log_register(pathconf, logfh);
+
+    pathconf = register_handler(hostconf, "/admin/geoip/reload", admin_geoip_reload_handler);
+    if (attach_admin_pipeline(pathconf, "/admin/geoip/reload") != 0)
+        goto Error;
+    if (logfh != NULL)
+        h2o_access_log_register(pathconf, logfh);
+
+    pathconf = register_handler(hostconf, "/admin/capture", capture_handler);
+    if (attach_admin_pipeline(pathconf, "/admin/capture") != 0)
+        goto Error;
+    if (logfh != NULL)
+        h2o_access_log_register(pathconf, logfh);
+
+    pathconf = register_handler(hostconf, "/admin/profile", profiler_handler);
+    if (attach_admin_pipeline(pathconf, "/admin/profile") != 0)
+        goto Error;
+    if (logfh != NULL)
+        h2o_access_log_register(pathconf, logfh);
+
+    /* form logins get priority over bulk traffic when the server is busy */
     pathconf = register_handler(hostconf, "/post-test", post_test);
+    if (attach_pipeline(pathconf, "/post-test", POST_TEST_BODY_SIZE, 4) != 0)
+        goto Error;
     if (logfh != NULL)
         h2o_access_log_register(pathconf, logfh);
 
     pathconf = register_handler(hostconf, "/chunked-test", chunked_test);
+    /* identical concurrent requests share one response, which is kept for a short while */
+    coalesce_config_t coalesce = coalesce_get_default_config();
+    coalesce.cache_ttl_ms = 250;
+    register_coalescer(pathconf, &coalesce);
+    /* attached last so that it runs before the coalescer */
+    if (attach_pipeline(pathconf, "/chunked-test", 0, 1) != 0)
+        goto Error;
     if (logfh != NULL)
         h2o_access_log_register(pathconf, logfh);
 
     pathconf = register_handler(hostconf, "/reproxy-test", reproxy_test);
     h2o_reproxy_register(pathconf);
+    if (attach_pipeline(pathconf, "/reproxy-test", 0, 1) != 0)
+        goto Error;
+    if (logfh != NULL)
+        h2o_access_log_register(pathconf, logfh);
+
+    /* versioned game data: ranges, validators and patches instead of whole files from public/ */
+    pathconf = register_handler(hostconf, "/assets", assets_handler);
+    if (attach_pipeline(pathconf, "/assets", 0, 0) != 0)
+        goto Error;
     if (logfh != NULL)
         h2o_access_log_register(pathconf, logfh);
 
@@ -212,9 +349,15 @@ int main(int argc, char **argv)
         fprintf(stderr, "warning: public directory not found; create 'public/' with an index.html\n");
     }
     h2o_file_register(pathconf, "public", NULL, NULL, 0);
+    if (attach_pipeline(pathconf, "/", 0, 0) != 0)
+        goto Error;
     if (logfh != NULL)
         h2o_access_log_register(pathconf, logfh);
 
+    /* one lookup per request instead of h2o trying the paths above in turn */
+    if (router_install(hostconf) != 0)
+        goto Error;
+
 #if H2O_USE_LIBUV
     uv_loop_t loop;
     uv_loop_init(&loop);
@@ -225,18 +368,53 @@ int main(int argc, char **argv)
 
     /* Initialize DDoS/DoS security module */
     server_config_t srv_config = server_get_default_config();
-    
+
+    /* ASN and country lookups for the geo policies; missing databases only disable them */
+    if (geoip_init(&ctx, &srv_config.geoip) != 0)
+        goto Error;
+
     if (security_init(&ctx, &srv_config.security) != 0) {
         fprintf(stderr, "Failed to initialize security module\n");
         goto Error;
     }
     printf("DDoS/DoS protection enabled\n");
 
+    /* cookie challenge for unverified clients while the server is flooded */
+    if (challenge_init(&srv_config.challenge) != 0)
+        goto Error;
+
+    /* recycled response buffers for the routes registered above */
+    if (bufpool_init(&srv_config.bufpool) != 0)
+        goto Error;
+
+    /* chunk size for streamed bodies (/admin/export, /chunked-test) */
+    if (stream_init(&srv_config.stream) != 0)
+        goto Error;
+
+    /* sampled request capture for server-replay, started through /admin/capture */
+    if (capture_init(&srv_config.capture) != 0)
+        goto Error;
+
+    /* real client addresses from trusted load balancers (off unless trusted networks are configured) */
+    if (proxy_protocol_init(&ctx, &srv_config.proxy_protocol) != 0)
+        goto Error;
+
+    if (assets_init(&srv_config.assets) != 0)
+        goto Error;
+
+    if (fair_queue_init(&ctx, &srv_config.fair_queue) != 0)
+        goto Error;
+
+    /* sampled on demand through /admin/profile; the crypto pool registers its own threads */
+    if (profiler_init(&srv_config.profiler) != 0 || profiler_register_thread("loop") != 0)
+        goto Error;
+
     if (USE_MEMCACHED)
         h2o_multithread_register_receiver(ctx.queue, &libmemcached_receiver, h2o_memcached_receiver);
 
     if (USE_HTTPS && setup_ssl("certs/localhost.pem", "certs/localhost-key.pem",
-                               "DEFAULT:!MD5:!DSS:!DES:!RC4:!RC2:!SEED:!IDEA:!NULL:!ADH:!EXP:!SRP:!PSK") != 0)
+                               "DEFAULT:!MD5:!DSS:!DES:!RC4:!RC2:!SEED:!IDEA:!NULL:!ADH:!EXP:!SRP:!PSK",
+                               &srv_config.tls) != 0)
         goto Error;
 
     accept_ctx.ctx = &ctx;
@@ -244,15 +422,18 @@ int main(int argc, char **argv)
 
     /* init and start the listener (libuv or evloop variant is hidden inside the module) */
     listener_init(&ctx, &accept_ctx);
+    listener_set_io_uring(srv_config.enable_io_uring);
     if (listener_start() != 0) {
         fprintf(stderr, "failed to start listener:%s\n", strerror(errno));
         goto Error;
     }
+    printf("Accepting connections via %s\n", listener_backend_name());
 
 #if H2O_USE_LIBUV
     uv_run(ctx.loop, UV_RUN_DEFAULT);
 #else
-    while (h2o_evloop_run(ctx.loop, INT32_MAX) == 0)
+    /* epoll_wait is not restarted after a signal such as the profiler's SIGPROF */
+    while (h2o_evloop_run(ctx.loop, INT32_MAX) == 0 || errno == EINTR)
         ;
 #endif
 
@@ -0,0 +1,286 @@
+#include "growtopia/middleware.h"
+#include "growtopia/handlers.h"
+#include "growtopia/response.h"
+#include "growtopia/security.h"
+#include <h2o.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define MAX_STAGES 16
+
+struct middleware_pipeline {
+    const char *route;
+    size_t num_stages;
+    middleware_stage_t stages[MAX_STAGES];
+};
+
+typedef struct middleware_handler {
+    h2o_handler_t super;
+    const char *route;
+    struct middleware_handler *next;     // Next attached pipeline (statistics registry)
+    uint64_t body_bytes;                 // Request body bytes seen by the metrics stage
+    size_t num_stages;
+    middleware_stage_t stages[];         // Flat stage array, run in order
+} middleware_handler_t;
+
+static middleware_handler_t *g_pipelines = NULL;
+
+static response_template_t *forbidden_response;
+static response_template_t *rate_limited_response;
+static response_template_t *too_large_response;
+
+int middleware_init(void)
+{
+    static const char forbidden[] = "Forbidden\n";
+    static const char rate_limited[] = "Rate limit exceeded. Please try again later.\n";
+    static const char too_large[] = "Request entity too large\n";
+
+    if ((forbidden_response = response_template_create(403, "Forbidden")) == NULL ||
+        response_template_add_header(forbidden_response, H2O_TOKEN_CONTENT_TYPE, H2O_STRLIT("text/plain")) != 0 ||
+        response_template_set_body(forbidden_response, forbidden, sizeof(forbidden) - 1) != 0)
+        goto Error;
+
+    if ((rate_limited_response = response_template_create(429, "Too Many Requests")) == NULL ||
+        response_template_add_header(rate_limited_response, H2O_TOKEN_CONTENT_TYPE, H2O_STRLIT("text/plain")) != 0 ||
+        response_template_add_header(rate_limited_response, H2O_TOKEN_RETRY_AFTER, H2O_STRLIT("60")) != 0 ||
+        response_template_set_body(rate_limited_response, rate_limited, sizeof(rate_limited) - 1) != 0)
+        goto Error;
+
+    if ((too_large_response = response_template_create(413, "Payload Too Large")) == NULL ||
+        response_template_add_header(too_large_response, H2O_TOKEN_CONTENT_TYPE, H2O_STRLIT("text/plain")) != 0 ||
+        response_template_set_body(too_large_response, too_large, sizeof(too_large) - 1) != 0)
+        goto Error;
+
+    return 0;
+Error:
+    fprintf(stderr, "Failed to build middleware responses\n");
+    return -1;
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Run the stages from first on
+ * @return -1 if all of them let the request through, 0 otherwise
+ */
+static int run_stages(middleware_handler_t *self, size_t first, h2o_req_t *req)
+{
+    struct sockaddr_storage addr;
+    const struct sockaddr *peer = NULL;
+
+    /* resolve the peer once for all stages; unproxied PROXY connections (AF_UNSPEC) get none */
+    if (req->conn->callbacks->get_peername != NULL &&
+        req->conn->callbacks->get_peername(req->conn, (struct sockaddr *)&addr) > 0 &&
+        (addr.ss_family == AF_INET || addr.ss_family == AF_INET6))
+        peer = (const struct sockaddr *)&addr;
+
+    uint64_t start = now_ns();
+    for (size_t i = first; i < self->num_stages; i++) {
+        middleware_stage_t *stage = self->stages + i;
+        int result = stage->on_req(stage, req, peer);
+        uint64_t end = now_ns();
+        stage->calls++;
+        stage->total_ns += end - start;
+        start = end;
+        if (result != MIDDLEWARE_CONTINUE) {
+            if (result == MIDDLEWARE_DONE)
+                stage->rejected++;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+static int on_req(h2o_handler_t *_self, h2o_req_t *req)
+{
+    /* -1 lets h2o run the next handler of the path */
+    return run_stages((middleware_handler_t *)_self, 0, req);
+}
+
+void middleware_resume(middleware_stage_t *stage, h2o_req_t *req)
+{
+    middleware_handler_t *self = (middleware_handler_t *)stage->handler;
+
+    if (run_stages(self, (size_t)(stage - self->stages) + 1, req) != 0)
+        h2o_delegate_request(req);
+}
+
+middleware_pipeline_t *middleware_pipeline_create(const char *route)
+{
+    middleware_pipeline_t *pipeline = calloc(1, sizeof(*pipeline));
+    if (pipeline == NULL)
+        return NULL;
+
+    pipeline->route = route;
+    return pipeline;
+}
+
+int middleware_add_stage(middleware_pipeline_t *pipeline, const char *name, middleware_cb on_req, void *data)
+{
+    if (pipeline->num_stages == MAX_STAGES) {
+        fprintf(stderr, "Too many middleware stages for %s\n", pipeline->route);
+        return -1;
+    }
+
+    middleware_stage_t *stage = pipeline->stages + pipeline->num_stages++;
+    memset(stage, 0, sizeof(*stage));
+    stage->name = name;
+    stage->on_req = on_req;
+    stage->data = data;
+    return 0;
+}
+
+h2o_handler_t *middleware_attach(middleware_pipeline_t *pipeline, h2o_pathconf_t *pathconf)
+{
+    size_t stages_size = pipeline->num_stages * sizeof(middleware_stage_t);
+    middleware_handler_t *handler =
+        (middleware_handler_t *)create_prepended_handler(pathconf, sizeof(*handler) + stages_size);
+
+    handler->super.on_req = on_req;
+    handler->route = pipeline->route;
+    handler->num_stages = pipeline->num_stages;
+    memcpy(handler->stages, pipeline->stages, stages_size);
+
+    /* the metrics stage reports into the handler it ended up in */
+    for (size_t i = 0; i < handler->num_stages; i++) {
+        handler->stages[i].handler = &handler->super;
+        if (handler->stages[i].data == pipeline)
+            handler->stages[i].data = handler;
+    }
+
+    handler->next = g_pipelines;
+    g_pipelines = handler;
+
+    free(pipeline);
+    return &handler->super;
+}
+
+static int ip_admission_stage(middleware_stage_t *stage, h2o_req_t *req, const struct sockaddr *peer)
+{
+    if (peer == NULL || !security_is_banned(peer))
+        return MIDDLEWARE_CONTINUE;
+
+    response_template_send(forbidden_response, req);
+    return MIDDLEWARE_DONE;
+}
+
+static int rate_limit_stage(middleware_stage_t *stage, h2o_req_t *req, const struct sockaddr *peer)
+{
+    if (peer == NULL || security_check_request(peer))
+        return MIDDLEWARE_CONTINUE;
+
+    /* Rate limit exceeded, return 429 Too Many Requests */
+    response_template_send(rate_limited_response, req);
+    return MIDDLEWARE_DONE;
+}
+
+static int body_limit_stage(middleware_stage_t *stage, h2o_req_t *req, const struct sockaddr *peer)
+{
+    size_t max_bytes = (size_t)(uintptr_t)stage->data;
+
+    /* a declared length is enough to refuse, whatever has arrived so far */
+    if ((req->content_length == SIZE_MAX || req->content_length <= max_bytes) &&
+        (req->entity.base == NULL || req->entity.len <= max_bytes))
+        return MIDDLEWARE_CONTINUE;
+
+    response_template_send(too_large_response, req);
+    return MIDDLEWARE_DONE;
+}
+
+static int metrics_stage(middleware_stage_t *stage, h2o_req_t *req, const struct sockaddr *peer)
+{
+    middleware_handler_t *handler = stage->data;
+
+    if (req->entity.base != NULL)
+        handler->body_bytes += req->entity.len;
+    return MIDDLEWARE_CONTINUE;
+}
+
+static int is_loopback(const struct sockaddr *addr)
+{
+    if (addr->sa_family == AF_INET) {
+        const struct sockaddr_in *addr_in = (const struct sockaddr_in *)addr;
+        return (ntohl(addr_in->sin_addr.s_addr) >> 24) == 127;
+    } else if (addr->sa_family == AF_INET6) {
+        const struct sockaddr_in6 *addr_in6 = (const struct sockaddr_in6 *)addr;
+        if (IN6_IS_ADDR_LOOPBACK(&addr_in6->sin6_addr))
+            return 1;
+        return IN6_IS_ADDR_V4MAPPED(&addr_in6->sin6_addr) && addr_in6->sin6_addr.s6_addr[12] == 127;
+    }
+
+    return 0;
+}
+
+static int loopback_only_stage(middleware_stage_t *stage, h2o_req_t *req, const struct sockaddr *peer)
+{
+    if (peer != NULL && is_loopback(peer))
+        return MIDDLEWARE_CONTINUE;
+
+    response_template_send(forbidden_response, req);
+    return MIDDLEWARE_DONE;
+}
+
+int middleware_add_ip_admission(middleware_pipeline_t *pipeline)
+{
+    return middleware_add_stage(pipeline, "ip-admission", ip_admission_stage, NULL);
+}
+
+int middleware_add_rate_limit(middleware_pipeline_t *pipeline)
+{
+    return middleware_add_stage(pipeline, "rate-limit", rate_limit_stage, NULL);
+}
+
+int middleware_add_body_limit(middleware_pipeline_t *pipeline, size_t max_bytes)
+{
+    return middleware_add_stage(pipeline, "body-limit", body_limit_stage, (void *)(uintptr_t)max_bytes);
+}
+
+int middleware_add_metrics(middleware_pipeline_t *pipeline)
+{
+    /* rebound to the handler by middleware_attach() */
+    return middleware_add_stage(pipeline, "metrics", metrics_stage, pipeline);
+}
+
+int middleware_add_loopback_only(middleware_pipeline_t *pipeline)
+{
+    return middleware_add_stage(pipeline, "loopback-only", loopback_only_stage, NULL);
+}
+
+size_t middleware_format_stats(char *buf, size_t cap)
+{
+    size_t len = 0;
+
+#define APPEND(...)                                                                                                            \
+    do {                                                                                                                       \
+        if (len < cap) {                                                                                                       \
+            int n = snprintf(buf + len, cap - len, __VA_ARGS__);                                                               \
+            if (n > 0)                                                                                                         \
+                len += (size_t)n < cap - len ? (size_t)n : cap - len - 1;                                                      \
+        }                                                                                                                      \
+    } while (0)
+
+    for (middleware_handler_t *handler = g_pipelines; handler != NULL; handler = handler->next) {
+        uint64_t requests = handler->num_stages != 0 ? handler->stages[0].calls : 0;
+        APPEND("%s: %llu requests, %llu body bytes\n", handler->route, (unsigned long long)requests,
+               (unsigned long long)handler->body_bytes);
+        for (size_t i = 0; i < handler->num_stages; i++) {
+            middleware_stage_t *stage = handler->stages + i;
+            APPEND("  %-14s calls %llu, rejected %llu, avg %llu ns\n", stage->name, (unsigned long long)stage->calls,
+                   (unsigned long long)stage->rejected,
+                   (unsigned long long)(stage->calls != 0 ? stage->total_ns / stage->calls : 0));
+        }
+    }
+
+#undef APPEND
+
+    return len;
+}
@@ -0,0 +1,550 @@
+#define _GNU_SOURCE  // REG_RIP, pthread_getattr_np, dladdr
+#include "growtopia/profiler.h"
+#include "growtopia/response.h"
+#include <dlfcn.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+#define MAX_THREADS 64
+#define MAX_DEPTH 64               // Frames kept per sample, leaf first
+#define DEFAULT_SECONDS 10
+#define DEFAULT_HZ 99              // Off the round numbers so sampling does not lock step with periodic work
+#define SYMBOL_CACHE_SIZE 16384    // Distinct return addresses (and names) resolved once per profile
+#define SYMBOL_MAX 256
+
+typedef struct {
+    const char *name;
+    pid_t tid;
+    pthread_t thread;
+    uintptr_t stack_lo;            // Frame pointers outside [stack_lo, stack_hi) end the walk
+    uintptr_t stack_hi;
+    timer_t timer;
+    int armed;
+} profiled_thread_t;
+
+typedef struct {
+    uint16_t thread;
+    uint16_t depth;
+    uintptr_t pcs[MAX_DEPTH];
+} sample_t;
+
+typedef struct {
+    h2o_req_t *req;
+    h2o_timer_t timer;
+} profile_session_t;
+
+typedef struct {
+    uintptr_t *pcs;                // Return address -> interned name
+    const char **pc_names;
+    char **names;                  // Interned names, so frames of one function compare equal
+} symbol_table_t;
+
+static profiler_config_t g_config;
+static response_template_t *folded_response;
+
+static pthread_mutex_t g_threads_mutex = PTHREAD_MUTEX_INITIALIZER;
+static profiled_thread_t g_threads[MAX_THREADS];
+static atomic_uint g_num_threads;
+
+/* written by the signal handler on any registered thread while g_active is set */
+static sample_t *g_samples;
+static uint32_t g_capacity;
+static atomic_uint g_next;
+static atomic_int g_active;
+static atomic_int g_inflight;
+static atomic_uint_fast64_t g_dropped;
+static atomic_uint_fast64_t g_handler_ns;
+
+static profile_session_t *g_session;  // The running profile; loop thread only
+
+/* statistics */
+static uint64_t g_profiles = 0;
+static uint64_t g_total_samples = 0;
+static uint64_t g_total_dropped = 0;
+static uint64_t g_total_handler_ns = 0;
+
+/* walk the frame-pointer chain of the interrupted thread; only reads within its stack */
+static uint16_t unwind(const ucontext_t *uc, const profiled_thread_t *thread, uintptr_t *pcs)
+{
+    uintptr_t pc, fp;
+    uint16_t depth = 0;
+
+#if defined(__x86_64__)
+    pc = (uintptr_t)uc->uc_mcontext.gregs[REG_RIP];
+    fp = (uintptr_t)uc->uc_mcontext.gregs[REG_RBP];
+#elif defined(__aarch64__)
+    pc = (uintptr_t)uc->uc_mcontext.pc;
+    fp = (uintptr_t)uc->uc_mcontext.regs[29];
+#else
+    return 0;
+#endif
+
+    pcs[depth++] = pc;
+    /* each frame record holds the caller's frame pointer followed by the return address */
+    while (depth < MAX_DEPTH && fp >= thread->stack_lo && fp + 2 * sizeof(uintptr_t) <= thread->stack_hi &&
+           fp % sizeof(uintptr_t) == 0) {
+        const uintptr_t *frame = (const uintptr_t *)fp;
+        if (frame[1] == 0)
+            break;
+        pcs[depth++] = frame[1];
+        if (frame[0] <= fp)  // Stacks grow down, so callers live at higher addresses
+            break;
+        fp = frame[0];
+    }
+    return depth;
+}
+
+static void on_sigprof(int signo, siginfo_t *info, void *uc)
+{
+    int saved_errno = errno;
+    struct timespec start, end;
+
+    atomic_fetch_add(&g_inflight, 1);
+    if (!atomic_load(&g_active) || info->si_code != SI_TIMER)
+        goto Exit;
+
+    uint32_t index = (uint32_t)info->si_value.sival_int;
+    if (index >= atomic_load(&g_num_threads))
+        goto Exit;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    uint32_t slot = atomic_fetch_add(&g_next, 1);
+    if (slot < g_capacity) {
+        sample_t *sample = g_samples + slot;
+        sample->thread = (uint16_t)index;
+        sample->depth = unwind(uc, g_threads + index, sample->pcs);
+    } else {
+        atomic_fetch_add(&g_dropped, 1);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    atomic_fetch_add(&g_handler_ns, (uint64_t)(end.tv_sec - start.tv_sec) * 1000000000 + end.tv_nsec - start.tv_nsec);
+
+Exit:
+    atomic_fetch_sub(&g_inflight, 1);
+    errno = saved_errno;
+}
+
+int profiler_init(const profiler_config_t *config)
+{
+    struct sigaction sa;
+
+    g_config = config ? *config : profiler_get_default_config();
+
+    if ((folded_response = response_template_create(200, "OK")) == NULL ||
+        response_template_add_header(folded_response, H2O_TOKEN_CONTENT_TYPE, H2O_STRLIT("text/plain; charset=utf-8")) !=
+            0) {
+        fprintf(stderr, "Failed to build profiler responses\n");
+        return -1;
+    }
+
+    /* installed for good: a SIGPROF still pending after a profile must not terminate the process */
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = on_sigprof;
+    sa.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGPROF, &sa, NULL) != 0) {
+        fprintf(stderr, "profiler: cannot install SIGPROF handler: %s\n", strerror(errno));
+        return -1;
+    }
+
+    printf("Profiler available: up to %us at %u Hz per thread\n", g_config.max_seconds, g_config.max_hz);
+    return 0;
+}
+
+int profiler_register_thread(const char *name)
+{
+    pthread_attr_t attr;
+    void *stack;
+    size_t stack_size;
+
+    pthread_mutex_lock(&g_threads_mutex);
+
+    uint32_t index = atomic_load(&g_num_threads);
+    if (index == MAX_THREADS) {
+        pthread_mutex_unlock(&g_threads_mutex);
+        fprintf(stderr, "profiler: too many threads, %s will not be sampled\n", name);
+        return -1;
+    }
+
+    profiled_thread_t *thread = g_threads + index;
+    memset(thread, 0, sizeof(*thread));
+    thread->name = name;
+    thread->tid = (pid_t)syscall(SYS_gettid);
+    thread->thread = pthread_self();
+    if (pthread_getattr_np(thread->thread, &attr) == 0) {
+        if (pthread_attr_getstack(&attr, &stack, &stack_size) == 0) {
+            thread->stack_lo = (uintptr_t)stack;
+            thread->stack_hi = (uintptr_t)stack + stack_size;
+        }
+        pthread_attr_destroy(&attr);
+    }
+    atomic_store(&g_num_threads, index + 1);
+
+    pthread_mutex_unlock(&g_threads_mutex);
+    return 0;
+}
+
+static void stop_sampling(void)
+{
+    pthread_mutex_lock(&g_threads_mutex);
+    for (uint32_t i = 0; i < atomic_load(&g_num_threads); i++) {
+        if (g_threads[i].armed) {
+            timer_delete(g_threads[i].timer);
+            g_threads[i].armed = 0;
+        }
+    }
+    pthread_mutex_unlock(&g_threads_mutex);
+
+    /* a handler that saw g_active set finishes its sample before the buffer is read */
+    atomic_store(&g_active, 0);
+    while (atomic_load(&g_inflight) != 0)
+        sched_yield();
+}
+
+static int start_sampling(uint32_t hz, uint32_t seconds)
+{
+    uint32_t armed = 0;
+
+    uint64_t capacity = (uint64_t)hz * seconds * atomic_load(&g_num_threads);
+    g_capacity = capacity < g_config.max_samples ? (uint32_t)capacity : g_config.max_samples;
+    if ((g_samples = malloc((size_t)g_capacity * sizeof(*g_samples))) == NULL)
+        return -1;
+    atomic_store(&g_next, 0);
+    atomic_store(&g_dropped, 0);
+    atomic_store(&g_handler_ns, 0);
+    atomic_store(&g_active, 1);
+
+    /* one CPU-time timer per thread: idle threads are not sampled and busy ones get hz samples per CPU-second */
+    pthread_mutex_lock(&g_threads_mutex);
+    for (uint32_t i = 0; i < atomic_load(&g_num_threads); i++) {
+        profiled_thread_t *thread = g_threads + i;
+        struct sigevent sev;
+        clockid_t clock;
+
+        memset(&sev, 0, sizeof(sev));
+        sev.sigev_notify = SIGEV_THREAD_ID;
+        sev.sigev_signo = SIGPROF;
+        sev.sigev_value.sival_int = (int)i;
+        sev.sigev_notify_thread_id = thread->tid;
+        if (pthread_getcpuclockid(thread->thread, &clock) != 0 || timer_create(clock, &sev, &thread->timer) != 0) {
+            fprintf(stderr, "profiler: cannot create timer for %s: %s\n", thread->name, strerror(errno));
+            continue;
+        }
+
+        struct itimerspec its;
+        its.it_interval.tv_sec = hz == 1;
+        its.it_interval.tv_nsec = hz == 1 ? 0 : 1000000000 / hz;
+        its.it_value = its.it_interval;
+        if (timer_settime(thread->timer, 0, &its, NULL) != 0) {
+            timer_delete(thread->timer);
+            continue;
+        }
+        thread->armed = 1;
+        armed++;
+    }
+    pthread_mutex_unlock(&g_threads_mutex);
+
+    if (armed == 0) {
+        stop_sampling();
+        free(g_samples);
+        g_samples = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+static int compare_samples(const void *_a, const void *_b)
+{
+    const sample_t *a = *(const sample_t **)_a, *b = *(const sample_t **)_b;
+
+    if (a->thread != b->thread)
+        return a->thread < b->thread ? -1 : 1;
+    if (a->depth != b->depth)
+        return a->depth < b->depth ? -1 : 1;
+    return memcmp(a->pcs, b->pcs, a->depth * sizeof(a->pcs[0]));
+}
+
+static uint64_t hash_name(const char *name)
+{
+    uint64_t hash = 14695981039346656037ULL;  // FNV-1a
+
+    for (; *name != '\0'; name++)
+        hash = (hash ^ (unsigned char)*name) * 1099511628211ULL;
+    return hash;
+}
+
+static const char *intern(symbol_table_t *symbols, const char *name)
+{
+    size_t slot = hash_name(name) & (SYMBOL_CACHE_SIZE - 1);
+
+    for (size_t probes = 0; probes < SYMBOL_CACHE_SIZE; probes++) {
+        if (symbols->names[slot] == NULL)
+            return (symbols->names[slot] = strdup(name)) != NULL ? symbols->names[slot] : "[unknown]";
+        if (strcmp(symbols->names[slot], name) == 0)
+            return symbols->names[slot];
+        slot = (slot + 1) & (SYMBOL_CACHE_SIZE - 1);
+    }
+    return "[unknown]";  // Table full; only reachable with pathological profiles
+}
+
+/* names come from the dynamic symbol table; anything else is reported as object+offset for addr2line */
+static const char *symbolize(symbol_table_t *symbols, uintptr_t pc, int leaf)
+{
+    char name[SYMBOL_MAX];
+    Dl_info info;
+    size_t slot = (pc * 0x9e3779b97f4a7c15ULL >> 32) & (SYMBOL_CACHE_SIZE - 1);
+    size_t probes;
+
+    for (probes = 0; probes < SYMBOL_CACHE_SIZE && symbols->pc_names[slot] != NULL; probes++) {
+        if (symbols->pcs[slot] == pc)
+            return symbols->pc_names[slot];
+        slot = (slot + 1) & (SYMBOL_CACHE_SIZE - 1);
+    }
+
+    /* return addresses point past the call; look up the call itself */
+    uintptr_t addr = leaf ? pc : pc - 1;
+    if (dladdr((void *)addr, &info) != 0 && info.dli_sname != NULL) {
+        snprintf(name, sizeof(name), "%s", info.dli_sname);
+    } else if (info.dli_fname != NULL) {
+        const char *base = strrchr(info.dli_fname, '/');
+        snprintf(name, sizeof(name), "%s+0x%" PRIxPTR, base ? base + 1 : info.dli_fname, addr - (uintptr_t)info.dli_fbase);
+    } else {
+        snprintf(name, sizeof(name), "0x%" PRIxPTR, addr);
+    }
+
+    const char *interned = intern(symbols, name);
+    if (probes < SYMBOL_CACHE_SIZE) {
+        symbols->pcs[slot] = pc;
+        symbols->pc_names[slot] = interned;
+    }
+    return interned;
+}
+
+static int append(char **buf, size_t *size, size_t *capacity, const char *s, size_t len)
+{
+    if (*size + len > *capacity) {
+        size_t new_capacity = *capacity ? *capacity * 2 : 64 * 1024;
+        while (new_capacity < *size + len)
+            new_capacity *= 2;
+        char *grown = realloc(*buf, new_capacity);
+        if (grown == NULL)
+            return -1;
+        *buf = grown;
+        *capacity = new_capacity;
+    }
+    memcpy(*buf + *size, s, len);
+    *size += len;
+    return 0;
+}
+
+/* one "thread;outer;...;leaf count" line per distinct stack */
+static int fold_samples(uint32_t count, char **out, size_t *out_len)
+{
+    sample_t **order = malloc((count ? count : 1) * sizeof(*order));
+    symbol_table_t symbols = {calloc(SYMBOL_CACHE_SIZE, sizeof(uintptr_t)), calloc(SYMBOL_CACHE_SIZE, sizeof(char *)),
+                              calloc(SYMBOL_CACHE_SIZE, sizeof(char *))};
+    char *buf = NULL, line_end[32];
+    size_t size = 0, capacity = 0;
+    int ret = -1;
+
+    if (order == NULL || symbols.pcs == NULL || symbols.pc_names == NULL || symbols.names == NULL)
+        goto Exit;
+
+    /* replace addresses by interned names in place, so that stacks differing only in offsets merge */
+    for (uint32_t i = 0; i < count; i++) {
+        sample_t *sample = g_samples + i;
+        for (uint16_t d = 0; d < sample->depth; d++)
+            sample->pcs[d] = (uintptr_t)symbolize(&symbols, sample->pcs[d], d == 0);
+        order[i] = sample;
+    }
+    qsort(order, count, sizeof(*order), compare_samples);
+
+    for (uint32_t i = 0, run; i < count; i += run) {
+        const sample_t *sample = order[i];
+        for (run = 1; i + run < count && compare_samples(&order[i], &order[i + run]) == 0; run++)
+            ;
+        const char *thread = g_threads[sample->thread].name;
+        if (append(&buf, &size, &capacity, thread, strlen(thread)) != 0)
+            goto Exit;
+        for (uint16_t d = sample->depth; d-- > 0;) {
+            const char *frame = (const char *)sample->pcs[d];
+            if (append(&buf, &size, &capacity, ";", 1) != 0 || append(&buf, &size, &capacity, frame, strlen(frame)) != 0)
+                goto Exit;
+        }
+        int len = snprintf(line_end, sizeof(line_end), " %u\n", run);
+        if (append(&buf, &size, &capacity, line_end, len) != 0)
+            goto Exit;
+    }
+
+    *out = buf;
+    *out_len = size;
+    buf = NULL;
+    ret = 0;
+
+Exit:
+    if (symbols.names != NULL) {
+        for (size_t i = 0; i < SYMBOL_CACHE_SIZE; i++)
+            free(symbols.names[i]);
+    }
+    free(symbols.names);
+    free(symbols.pc_names);
+    free(symbols.pcs);
+    free(order);
+    free(buf);
+    return ret;
+}
+
+static void finish_session(void)
+{
+    stop_sampling();
+
+    uint32_t recorded = atomic_load(&g_next);
+    if (recorded > g_capacity)
+        recorded = g_capacity;
+    g_profiles++;
+    g_total_samples += recorded;
+    g_total_dropped += atomic_load(&g_dropped);
+    g_total_handler_ns += atomic_load(&g_handler_ns);
+    g_session = NULL;
+}
+
+static void on_session_dispose(void *p)
+{
+    profile_session_t *session = p;
+
+    /* the client went away before the profile was done */
+    if (g_session == session) {
+        h2o_timer_unlink(&session->timer);
+        finish_session();
+        free(g_samples);
+        g_samples = NULL;
+    }
+}
+
+static void add_number_header(h2o_req_t *req, const char *name, size_t name_len, uint64_t value)
+{
+    char *buf = h2o_mem_alloc_pool(&req->pool, char, 24);
+    int len = snprintf(buf, 24, "%" PRIu64, value);
+    h2o_add_header_by_str(&req->pool, &req->res.headers, name, name_len, 0, NULL, buf, len);
+}
+
+static void on_session_done(h2o_timer_t *timer)
+{
+    static h2o_generator_t generator = {NULL, NULL};
+    profile_session_t *session = H2O_STRUCT_FROM_MEMBER(profile_session_t, timer, timer);
+    h2o_req_t *req = session->req;
+    char *folded = NULL;
+    size_t len = 0;
+
+    finish_session();
+
+    uint32_t recorded = atomic_load(&g_next) < g_capacity ? atomic_load(&g_next) : g_capacity;
+    int ret = fold_samples(recorded, &folded, &len);
+    free(g_samples);
+    g_samples = NULL;
+    if (ret != 0) {
+        h2o_send_error_500(req, "Internal Server Error", "out of memory while folding stacks\n", 0);
+        return;
+    }
+
+    /* the cost of sampling itself, so overhead can be judged next to the profile */
+    uint64_t dropped = atomic_load(&g_dropped);
+    add_number_header(req, H2O_STRLIT("x-profile-samples"), recorded);
+    add_number_header(req, H2O_STRLIT("x-profile-dropped"), dropped);
+    add_number_header(req, H2O_STRLIT("x-profile-sample-ns"),
+                      recorded + dropped ? atomic_load(&g_handler_ns) / (recorded + dropped) : 0);
+
+    h2o_iovec_t body = h2o_iovec_init(h2o_mem_alloc_pool(&req->pool, char, len ? len : 1), len);
+    memcpy(body.base, folded, len);
+    free(folded);
+    req->res.content_length = body.len;
+    response_template_start(folded_response, req, &generator);
+    h2o_send(req, &body, 1, H2O_SEND_STATE_FINAL);
+}
+
+static int parse_param(h2o_iovec_t query, const char *name, uint32_t *value)
+{
+    size_t name_len = strlen(name);
+    const char *p = query.base, *end = query.base + query.len;
+
+    while (p < end) {
+        const char *amp = memchr(p, '&', end - p);
+        const char *param_end = amp ? amp : end;
+        if ((size_t)(param_end - p) > name_len && memcmp(p, name, name_len) == 0 && p[name_len] == '=') {
+            uint64_t v = 0;
+            const char *digit = p + name_len + 1;
+            if (digit == param_end)
+                return -1;
+            for (; digit < param_end; digit++) {
+                if (*digit < '0' || *digit > '9' || (v = v * 10 + (*digit - '0')) > UINT32_MAX)
+                    return -1;
+            }
+            *value = (uint32_t)v;
+            return 0;
+        }
+        p = param_end + 1;
+    }
+    return 0;  // Absent; keep the default
+}
+
+int profiler_handler(h2o_handler_t *self, h2o_req_t *req)
+{
+    h2o_iovec_t query = h2o_iovec_init(NULL, 0);
+    uint32_t seconds = DEFAULT_SECONDS, hz = DEFAULT_HZ;
+
+    if (!h2o_memis(req->method.base, req->method.len, H2O_STRLIT("GET")))
+        return -1;
+
+    if (req->query_at != SIZE_MAX)
+        query = h2o_iovec_init(req->path.base + req->query_at + 1, req->path.len - req->query_at - 1);
+    if (parse_param(query, "seconds", &seconds) != 0 || parse_param(query, "hz", &hz) != 0 || seconds == 0 ||
+        hz == 0 || seconds > g_config.max_seconds || hz > g_config.max_hz) {
+        char *msg = h2o_mem_alloc_pool(&req->pool, char, 128);
+        snprintf(msg, 128, "seconds must be 1-%u and hz 1-%u\n", g_config.max_seconds, g_config.max_hz);
+        h2o_send_error_400(req, "Bad Request", msg, 0);
+        return 0;
+    }
+
+    if (g_session != NULL) {
+        h2o_send_error_generic(req, 409, "Conflict", "a profile is already running\n", 0);
+        return 0;
+    }
+    if (atomic_load(&g_num_threads) == 0 || start_sampling(hz, seconds) != 0) {
+        h2o_send_error_503(req, "Service Unavailable", "profiler could not start; see server log\n", 0);
+        return 0;
+    }
+
+    profile_session_t *session = h2o_mem_alloc_shared(&req->pool, sizeof(*session), on_session_dispose);
+    session->req = req;
+    h2o_timer_init(&session->timer, on_session_done);
+    h2o_timer_link(req->conn->ctx->loop, (uint64_t)seconds * 1000, &session->timer);
+    g_session = session;
+    return 0;
+}
+
+void profiler_get_stats(uint64_t *profiles, uint64_t *samples, uint64_t *dropped, uint64_t *sample_ns)
+{
+    if (profiles)
+        *profiles = g_profiles;
+    if (samples)
+        *samples = g_total_samples;
+    if (dropped)
+        *dropped = g_total_dropped;
+    if (sample_ns)
+        *sample_ns = g_total_samples + g_total_dropped ? g_total_handler_ns / (g_total_samples + g_total_dropped) : 0;
+}
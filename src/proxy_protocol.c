@@ -0,0 +1,347 @@
+#include "growtopia/proxy_protocol.h"
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define V1_MAX_LENGTH 107          // Longest v1 header, including CRLF
+#define V2_HEADER_LENGTH 16        // Signature, version/command, family, length
+#define V2_MAX_LENGTH 1024         // Longest v2 header accepted (addresses plus TLVs)
+
+typedef struct {
+    int family;
+    uint8_t addr[16];
+    uint8_t prefix_len;
+} trusted_cidr_t;
+
+typedef struct {
+    h2o_timer_t timeout;
+    h2o_socket_t *sock;
+    void (*on_ready)(h2o_socket_t *sock);
+} proxy_wait_t;
+
+static const char v2_signature[12] = {'\r', '\n', '\r', '\n', '\0', '\r', '\n', 'Q', 'U', 'I', 'T', '\n'};
+
+static h2o_context_t *g_ctx = NULL;
+static trusted_cidr_t *g_trusted = NULL;
+static size_t g_num_trusted = 0;
+static uint32_t g_header_timeout_ms = 3000;
+static uint64_t g_accepted = 0;
+static uint64_t g_rejected = 0;
+static uint64_t g_parse_ns = 0;
+
+static int parse_cidr(const char *str, trusted_cidr_t *cidr)
+{
+    char buf[INET6_ADDRSTRLEN + 4];
+    const char *slash = strchr(str, '/');
+    size_t len = slash != NULL ? (size_t)(slash - str) : strlen(str);
+
+    if (len >= sizeof(buf))
+        return -1;
+    memcpy(buf, str, len);
+    buf[len] = '\0';
+
+    memset(cidr, 0, sizeof(*cidr));
+    if (inet_pton(AF_INET, buf, cidr->addr) == 1) {
+        cidr->family = AF_INET;
+        cidr->prefix_len = 32;
+    } else if (inet_pton(AF_INET6, buf, cidr->addr) == 1) {
+        cidr->family = AF_INET6;
+        cidr->prefix_len = 128;
+    } else {
+        return -1;
+    }
+
+    if (slash != NULL) {
+        char *end;
+        long prefix_len = strtol(slash + 1, &end, 10);
+        if (*end != '\0' || end == slash + 1 || prefix_len < 0 || prefix_len > cidr->prefix_len)
+            return -1;
+        cidr->prefix_len = (uint8_t)prefix_len;
+    }
+
+    return 0;
+}
+
+int proxy_protocol_init(h2o_context_t *ctx, const proxy_protocol_config_t *config)
+{
+    g_ctx = ctx;
+    if (config == NULL || config->num_trusted_cidrs == 0)
+        return 0;
+
+    g_trusted = calloc(config->num_trusted_cidrs, sizeof(*g_trusted));
+    if (g_trusted == NULL) {
+        fprintf(stderr, "Failed to allocate PROXY protocol trusted networks\n");
+        return -1;
+    }
+    for (size_t i = 0; i < config->num_trusted_cidrs; i++) {
+        if (parse_cidr(config->trusted_cidrs[i], &g_trusted[i]) != 0) {
+            fprintf(stderr, "Invalid PROXY protocol trusted network: %s\n", config->trusted_cidrs[i]);
+            free(g_trusted);
+            g_trusted = NULL;
+            return -1;
+        }
+    }
+    g_num_trusted = config->num_trusted_cidrs;
+    if (config->header_timeout_ms != 0)
+        g_header_timeout_ms = config->header_timeout_ms;
+
+    printf("PROXY protocol enabled for %zu trusted network(s)\n", g_num_trusted);
+    return 0;
+}
+
+static int prefix_matches(const uint8_t *addr, const uint8_t *network, uint8_t prefix_len)
+{
+    size_t bytes = prefix_len / 8;
+    uint8_t bits = prefix_len % 8;
+
+    if (memcmp(addr, network, bytes) != 0)
+        return 0;
+    return bits == 0 || ((addr[bytes] ^ network[bytes]) & (uint8_t)(0xff << (8 - bits))) == 0;
+}
+
+int proxy_protocol_is_trusted(const struct sockaddr *peer)
+{
+    const uint8_t *addr;
+
+    if (g_num_trusted == 0)
+        return 0;
+
+    if (peer->sa_family == AF_INET)
+        addr = (const uint8_t *)&((const struct sockaddr_in *)peer)->sin_addr;
+    else if (peer->sa_family == AF_INET6)
+        addr = (const uint8_t *)&((const struct sockaddr_in6 *)peer)->sin6_addr;
+    else
+        return 0;
+
+    for (size_t i = 0; i < g_num_trusted; i++) {
+        if (g_trusted[i].family == peer->sa_family && prefix_matches(addr, g_trusted[i].addr, g_trusted[i].prefix_len))
+            return 1;
+    }
+    return 0;
+}
+
+/* copies the next space-terminated token of a v1 header into a NUL-terminated buffer */
+static const char *next_token(const char *p, const char *end, char *out, size_t cap)
+{
+    size_t len = 0;
+
+    while (p < end && *p != ' ' && *p != '\r') {
+        if (len + 1 >= cap)
+            return NULL;
+        out[len++] = *p++;
+    }
+    out[len] = '\0';
+    return len != 0 ? p : NULL;
+}
+
+static ssize_t parse_v1(const char *buf, size_t len, struct sockaddr_storage *addr, socklen_t *addr_len)
+{
+    const char *eol = memchr(buf, '\n', len < V1_MAX_LENGTH ? len : V1_MAX_LENGTH);
+    char family[8], src[INET6_ADDRSTRLEN], dst[INET6_ADDRSTRLEN], sport[8], dport[8];
+    const char *p = buf + 6, *end;
+
+    if (eol == NULL)
+        return len < V1_MAX_LENGTH ? PROXY_PROTOCOL_INCOMPLETE : PROXY_PROTOCOL_INVALID;
+    if (eol == buf || eol[-1] != '\r')
+        return PROXY_PROTOCOL_INVALID;
+    end = eol - 1;
+
+    if ((p = next_token(p, end, family, sizeof(family))) == NULL)
+        return PROXY_PROTOCOL_INVALID;
+    if (strcmp(family, "UNKNOWN") == 0) {
+        /* the balancer could not tell; keep the connection's own address */
+        addr->ss_family = AF_UNSPEC;
+        *addr_len = 0;
+        return eol + 1 - buf;
+    }
+
+    if (*p++ != ' ' || (p = next_token(p, end, src, sizeof(src))) == NULL || *p++ != ' ' ||
+        (p = next_token(p, end, dst, sizeof(dst))) == NULL || *p++ != ' ' ||
+        (p = next_token(p, end, sport, sizeof(sport))) == NULL || *p++ != ' ' ||
+        (p = next_token(p, end, dport, sizeof(dport))) == NULL || p != end)
+        return PROXY_PROTOCOL_INVALID;
+
+    char *port_end;
+    long port = strtol(sport, &port_end, 10);
+    if (*port_end != '\0' || port < 0 || port > 65535)
+        return PROXY_PROTOCOL_INVALID;
+
+    memset(addr, 0, sizeof(*addr));
+    if (strcmp(family, "TCP4") == 0) {
+        struct sockaddr_in *sin = (struct sockaddr_in *)addr;
+        if (inet_pton(AF_INET, src, &sin->sin_addr) != 1)
+            return PROXY_PROTOCOL_INVALID;
+        sin->sin_family = AF_INET;
+        sin->sin_port = htons((uint16_t)port);
+        *addr_len = sizeof(*sin);
+    } else if (strcmp(family, "TCP6") == 0) {
+        struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)addr;
+        if (inet_pton(AF_INET6, src, &sin6->sin6_addr) != 1)
+            return PROXY_PROTOCOL_INVALID;
+        sin6->sin6_family = AF_INET6;
+        sin6->sin6_port = htons((uint16_t)port);
+        *addr_len = sizeof(*sin6);
+    } else {
+        return PROXY_PROTOCOL_INVALID;
+    }
+
+    return eol + 1 - buf;
+}
+
+static ssize_t parse_v2(const uint8_t *buf, size_t len, struct sockaddr_storage *addr, socklen_t *addr_len)
+{
+    if (len < V2_HEADER_LENGTH)
+        return PROXY_PROTOCOL_INCOMPLETE;
+    if ((buf[12] & 0xf0) != 0x20)
+        return PROXY_PROTOCOL_INVALID;
+
+    size_t total = V2_HEADER_LENGTH + ((size_t)buf[14] << 8 | buf[15]);
+    if (total > V2_MAX_LENGTH)
+        return PROXY_PROTOCOL_INVALID;
+    if (len < total)
+        return PROXY_PROTOCOL_INCOMPLETE;
+
+    const uint8_t *body = buf + V2_HEADER_LENGTH;
+    uint8_t command = buf[12] & 0x0f, family = buf[13];
+
+    addr->ss_family = AF_UNSPEC;
+    *addr_len = 0;
+    if (command == 0x0)
+        return total;  /* LOCAL: health check from the balancer itself */
+    if (command != 0x1)
+        return PROXY_PROTOCOL_INVALID;
+
+    /* read straight out of the receive buffer; TLVs after the addresses are skipped */
+    if (family == 0x11 && total - V2_HEADER_LENGTH >= 12) {
+        struct sockaddr_in *sin = (struct sockaddr_in *)addr;
+        memset(sin, 0, sizeof(*sin));
+        sin->sin_family = AF_INET;
+        memcpy(&sin->sin_addr, body, 4);
+        memcpy(&sin->sin_port, body + 8, 2);
+        *addr_len = sizeof(*sin);
+    } else if (family == 0x21 && total - V2_HEADER_LENGTH >= 36) {
+        struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)addr;
+        memset(sin6, 0, sizeof(*sin6));
+        sin6->sin6_family = AF_INET6;
+        memcpy(&sin6->sin6_addr, body, 16);
+        memcpy(&sin6->sin6_port, body + 32, 2);
+        *addr_len = sizeof(*sin6);
+    } else if (family == 0x11 || family == 0x21) {
+        return PROXY_PROTOCOL_INVALID;
+    }
+    /* other families (UNIX, UDP, UNSPEC) carry no client address; the connection is treated as unproxied */
+
+    return total;
+}
+
+ssize_t proxy_protocol_parse(const char *buf, size_t len, struct sockaddr_storage *addr, socklen_t *addr_len)
+{
+    size_t cmp = len < sizeof(v2_signature) ? len : sizeof(v2_signature);
+
+    if (memcmp(buf, v2_signature, cmp) == 0)
+        return cmp < sizeof(v2_signature) ? PROXY_PROTOCOL_INCOMPLETE
+                                          : parse_v2((const uint8_t *)buf, len, addr, addr_len);
+
+    cmp = len < 6 ? len : 6;
+    if (memcmp(buf, "PROXY ", cmp) == 0)
+        return cmp < 6 ? PROXY_PROTOCOL_INCOMPLETE : parse_v1(buf, len, addr, addr_len);
+
+    return PROXY_PROTOCOL_INVALID;
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void finish_wait(proxy_wait_t *wait)
+{
+    h2o_timer_unlink(&wait->timeout);
+    wait->sock->data = NULL;
+    free(wait);
+}
+
+static void reject(proxy_wait_t *wait)
+{
+    h2o_socket_t *sock = wait->sock;
+
+    g_rejected++;
+    finish_wait(wait);
+    h2o_socket_close(sock);
+}
+
+static void on_header_timeout(h2o_timer_t *timer)
+{
+    reject(H2O_STRUCT_FROM_MEMBER(proxy_wait_t, timeout, timer));
+}
+
+static void on_header_read(h2o_socket_t *sock, const char *err)
+{
+    proxy_wait_t *wait = sock->data;
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+
+    if (err != NULL) {
+        reject(wait);
+        return;
+    }
+
+    uint64_t start = now_ns();
+    ssize_t header_len = proxy_protocol_parse(sock->input->bytes, sock->input->size, &addr, &addr_len);
+    g_parse_ns += now_ns() - start;
+
+    if (header_len == PROXY_PROTOCOL_INCOMPLETE)
+        return;  /* wait for the rest */
+    if (header_len < 0) {
+        reject(wait);
+        return;
+    }
+
+    /* drop the header; anything after it (e.g. the TLS ClientHello) stays for h2o */
+    h2o_buffer_consume(&sock->input, header_len);
+    if (addr.ss_family == AF_UNSPEC) {
+        /* LOCAL / UNKNOWN: hide the balancer's address so it is neither loopback nor a per-IP source */
+        struct sockaddr unspec = {.sa_family = AF_UNSPEC};
+        h2o_socket_setpeername(sock, &unspec, sizeof(unspec));
+    } else {
+        h2o_socket_setpeername(sock, (struct sockaddr *)&addr, addr_len);
+    }
+    g_accepted++;
+
+    void (*on_ready)(h2o_socket_t *) = wait->on_ready;
+    h2o_socket_read_stop(sock);
+    finish_wait(wait);
+    on_ready(sock);
+}
+
+void proxy_protocol_accept(h2o_socket_t *sock, void (*on_ready)(h2o_socket_t *sock))
+{
+    proxy_wait_t *wait = malloc(sizeof(*wait));
+
+    if (wait == NULL) {
+        g_rejected++;
+        h2o_socket_close(sock);
+        return;
+    }
+
+    wait->sock = sock;
+    wait->on_ready = on_ready;
+    sock->data = wait;
+    h2o_timer_init(&wait->timeout, on_header_timeout);
+    h2o_timer_link(g_ctx->loop, g_header_timeout_ms, &wait->timeout);
+    h2o_socket_read_start(sock, on_header_read);
+}
+
+void proxy_protocol_get_stats(uint64_t *accepted, uint64_t *rejected, uint64_t *parse_ns)
+{
+    if (accepted)
+        *accepted = g_accepted;
+    if (rejected)
+        *rejected = g_rejected;
+    if (parse_ns)
+        *parse_ns = g_parse_ns;
+}
@@ -0,0 +1,865 @@
+/*
+ * server-replay: re-issue a traffic capture (see capture_log.h) against a running server.
+ *
+ * Requests captured on the same connection are sent in order over one keep-alive connection, each no
+ * earlier than its capture time divided by the speed-up. The connection closes after its last
+ * request, so connection churn is kept as well. With --tls, connections captured as resumed try to
+ * resume the most recent session. HTTP/2 and HTTP/3 connections are replayed as HTTP/1.1.
+ */
+#include "growtopia/capture_log.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define READ_CHUNK 16384
+#define DEFAULT_TIMEOUT_MS 10000
+
+typedef enum {
+    CONN_PENDING,                        // Not opened yet
+    CONN_CONNECTING,
+    CONN_HANDSHAKE,
+    CONN_IDLE,                           // Connected, waiting for the next request to be due
+    CONN_SENDING,
+    CONN_READING,
+    CONN_DONE
+} conn_state_t;
+
+typedef enum {
+    BODY_NONE,
+    BODY_LENGTH,
+    BODY_CHUNKED,
+    BODY_UNTIL_CLOSE
+} body_mode_t;
+
+typedef struct {
+    capture_record_t record;
+    size_t conn;                         // Index into g_conns
+    uint64_t due_ns;                     // Scheduled send time, relative to the start of the replay
+    uint64_t latency_ns;
+    int status;                          // HTTP status, 0 if not sent yet, -1 on error
+} replay_request_t;
+
+typedef struct {
+    uint64_t id;                         // Captured connection id
+    uint8_t flags;                       // CAPTURE_FLAG_* of the captured connection
+    size_t *requests;                    // Indices into g_requests, in capture order
+    size_t num_requests;
+    size_t next;                         // Next request to send
+    conn_state_t state;
+    int fd;
+    SSL *ssl;
+    char *out;                           // Serialized request
+    size_t out_len, out_sent;
+    char *in;                            // Response bytes not consumed yet
+    size_t in_len, in_cap;
+    int headers_done;
+    body_mode_t body_mode;
+    uint64_t body_left;                  // Bytes of the body (or current chunk) still to come
+    int chunk_state;                     // 0 size line, 1 data, 2 CRLF after data, 3 trailers
+    int keep_alive;
+    uint64_t sent_at;                    // When the first byte of the current request was written
+} replay_conn_t;
+
+static struct {
+    const char *host;
+    const char *port;
+    double speed;
+    int tls;
+    uint32_t timeout_ms;
+    const char *output;
+    const char *baseline;
+} g_options = {"127.0.0.1", "8000", 1.0, 0, DEFAULT_TIMEOUT_MS, NULL, NULL};
+
+static replay_request_t *g_requests;
+static size_t g_num_requests;
+static replay_conn_t *g_conns;
+static size_t g_num_conns;
+static struct addrinfo *g_addr;
+static SSL_CTX *g_ssl_ctx;
+static SSL_SESSION *g_session;           // Most recent session handed out by the server
+static uint64_t g_resume_attempts, g_resumed;
+static uint64_t g_connects, g_errors;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void usage(const char *cmd)
+{
+    fprintf(stderr,
+            "Usage: %s [options] CAPTURE\n"
+            "  -H, --host HOST         server address (default 127.0.0.1)\n"
+            "  -p, --port PORT         server port (default 8000)\n"
+            "  -s, --speed N           replay N times faster than captured (default 1)\n"
+            "  -t, --tls               connect with TLS and resume sessions where the capture did\n"
+            "  -T, --timeout MS        per-request timeout (default %d)\n"
+            "  -o, --output FILE       write per-request status and latency for a later --baseline\n"
+            "  -b, --baseline FILE     compare latencies with the --output of an earlier run\n",
+            cmd, DEFAULT_TIMEOUT_MS);
+}
+
+static void *read_file(const char *path, size_t *len)
+{
+    FILE *fp = fopen(path, "rb");
+    struct stat st;
+    char *buf = NULL;
+
+    if (fp == NULL || fstat(fileno(fp), &st) != 0 || (buf = malloc(st.st_size ? st.st_size : 1)) == NULL ||
+        fread(buf, 1, st.st_size, fp) != (size_t)st.st_size) {
+        fprintf(stderr, "failed to read %s: %s\n", path, strerror(errno));
+        free(buf);
+        buf = NULL;
+    } else {
+        *len = st.st_size;
+    }
+    if (fp != NULL)
+        fclose(fp);
+    return buf;
+}
+
+static int compare_conn_id(const void *a, const void *b)
+{
+    const replay_request_t *x = g_requests + *(const size_t *)a, *y = g_requests + *(const size_t *)b;
+
+    if (x->record.connection != y->record.connection)
+        return x->record.connection < y->record.connection ? -1 : 1;
+    return *(const size_t *)a < *(const size_t *)b ? -1 : 1;
+}
+
+static int compare_first_due(const void *a, const void *b)
+{
+    uint64_t x = g_requests[((const replay_conn_t *)a)->requests[0]].due_ns;
+    uint64_t y = g_requests[((const replay_conn_t *)b)->requests[0]].due_ns;
+
+    return x < y ? -1 : x > y;
+}
+
+/* decodes the capture and groups its requests by connection, connections in order of first request */
+static int load_capture(const uint8_t *data, size_t len)
+{
+    uint64_t start;
+    size_t cap = 0, off = CAPTURE_FILE_HEADER_SIZE;
+
+    if (capture_decode_file_header(data, len, &start) != 0) {
+        fprintf(stderr, "not a capture file\n");
+        return -1;
+    }
+    while (off < len) {
+        capture_record_t record;
+        ssize_t used = capture_decode_record(data + off, len - off, &record);
+        if (used <= 0) {
+            fprintf(stderr, "capture is %s at byte %zu; replaying the %zu requests before it\n",
+                    used == 0 ? "truncated" : "corrupt", off, g_num_requests);
+            break;
+        }
+        if (g_num_requests == cap) {
+            cap = cap ? cap * 2 : 1024;
+            if ((g_requests = realloc(g_requests, cap * sizeof(*g_requests))) == NULL)
+                return -1;
+        }
+        memset(g_requests + g_num_requests, 0, sizeof(*g_requests));
+        g_requests[g_num_requests].record = record;
+        g_requests[g_num_requests].due_ns = (uint64_t)(record.offset_ns / g_options.speed);
+        g_num_requests++;
+        off += used;
+    }
+    if (g_num_requests == 0) {
+        fprintf(stderr, "capture holds no requests\n");
+        return -1;
+    }
+
+    size_t *order = malloc(g_num_requests * sizeof(*order));
+    if (order == NULL || (g_conns = calloc(g_num_requests, sizeof(*g_conns))) == NULL)
+        return -1;
+    for (size_t i = 0; i < g_num_requests; i++)
+        order[i] = i;
+    qsort(order, g_num_requests, sizeof(*order), compare_conn_id);
+    for (size_t i = 0; i < g_num_requests; i++) {
+        if (i == 0 || g_requests[order[i]].record.connection != g_requests[order[i - 1]].record.connection) {
+            replay_conn_t *conn = g_conns + g_num_conns++;
+            conn->id = g_requests[order[i]].record.connection;
+            conn->flags = g_requests[order[i]].record.flags;
+            conn->requests = order + i;
+            conn->fd = -1;
+        }
+        g_conns[g_num_conns - 1].num_requests++;
+    }
+    qsort(g_conns, g_num_conns, sizeof(*g_conns), compare_first_due);
+    for (size_t c = 0; c < g_num_conns; c++) {
+        for (size_t i = 0; i < g_conns[c].num_requests; i++)
+            g_requests[g_conns[c].requests[i]].conn = c;
+    }
+    return 0;
+}
+
+static int on_new_session(SSL *ssl, SSL_SESSION *session)
+{
+    if (g_session != NULL)
+        SSL_SESSION_free(g_session);
+    g_session = session;
+    return 1;  // Keep the reference
+}
+
+static int setup_tls(void)
+{
+    if ((g_ssl_ctx = SSL_CTX_new(TLS_client_method())) == NULL)
+        return -1;
+    SSL_CTX_set_verify(g_ssl_ctx, SSL_VERIFY_NONE, NULL);
+    SSL_CTX_set_session_cache_mode(g_ssl_ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(g_ssl_ctx, on_new_session);
+    static const unsigned char alpn[] = "\x08http/1.1";
+    SSL_CTX_set_alpn_protos(g_ssl_ctx, alpn, sizeof(alpn) - 1);
+    return 0;
+}
+
+static void close_conn(replay_conn_t *conn)
+{
+    if (conn->ssl != NULL) {
+        SSL_shutdown(conn->ssl);
+        SSL_free(conn->ssl);
+        conn->ssl = NULL;
+    }
+    if (conn->fd != -1) {
+        close(conn->fd);
+        conn->fd = -1;
+    }
+    conn->in_len = 0;
+}
+
+static void finish_request(replay_conn_t *conn, int status, uint64_t now)
+{
+    replay_request_t *request = g_requests + conn->requests[conn->next];
+
+    request->status = status;
+    request->latency_ns = now - conn->sent_at;
+    if (status < 0)
+        g_errors++;
+    conn->next++;
+    free(conn->out);
+    conn->out = NULL;
+
+    if (status < 0 || !conn->keep_alive || conn->next == conn->num_requests)
+        close_conn(conn);
+    if (conn->next == conn->num_requests)
+        conn->state = CONN_DONE;
+    else
+        conn->state = conn->fd == -1 ? CONN_PENDING : CONN_IDLE;
+}
+
+static int open_conn(replay_conn_t *conn, uint64_t now)
+{
+    int on = 1;
+
+    if ((conn->fd = socket(g_addr->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) == -1)
+        return -1;
+    setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    g_connects++;
+    if (connect(conn->fd, g_addr->ai_addr, g_addr->ai_addrlen) != 0 && errno != EINPROGRESS)
+        return -1;
+    conn->state = CONN_CONNECTING;
+    conn->sent_at = now;  // Connecting counts against the timeout of the first request
+    return 0;
+}
+
+static int is_hop_header(capture_str_t name)
+{
+    static const char *const skip[] = {"host", "connection", "keep-alive", "content-length", "transfer-encoding",
+                                       "te", "upgrade", "http2-settings", "proxy-connection"};
+
+    for (size_t i = 0; i < sizeof(skip) / sizeof(skip[0]); i++) {
+        if (name.len == strlen(skip[i]) && strncasecmp(name.base, skip[i], name.len) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+static int build_request(replay_conn_t *conn)
+{
+    const capture_record_t *r = &g_requests[conn->requests[conn->next]].record;
+    size_t cap = r->method.len + r->path.len + r->authority.len + r->body.len + 128;
+    int has_body = r->body.len != 0 || (r->method.len == 4 && memcmp(r->method.base, "POST", 4) == 0) ||
+                   (r->method.len == 3 && memcmp(r->method.base, "PUT", 3) == 0);
+    char *p;
+
+    for (size_t i = 0; i < r->num_headers; i++)
+        cap += r->header_names[i].len + r->header_values[i].len + 4;
+    if ((conn->out = p = malloc(cap)) == NULL)
+        return -1;
+
+    p += sprintf(p, "%.*s %.*s HTTP/1.1\r\nhost: %.*s\r\n", (int)r->method.len, r->method.base, (int)r->path.len,
+                 r->path.base, (int)(r->authority.len ? r->authority.len : strlen(g_options.host)),
+                 r->authority.len ? r->authority.base : g_options.host);
+    for (size_t i = 0; i < r->num_headers; i++) {
+        if (is_hop_header(r->header_names[i]))
+            continue;
+        p += sprintf(p, "%.*s: %.*s\r\n", (int)r->header_names[i].len, r->header_names[i].base,
+                     (int)r->header_values[i].len, r->header_values[i].base);
+    }
+    /* a truncated body goes out as captured, with a matching length */
+    if (has_body)
+        p += sprintf(p, "content-length: %zu\r\n", r->body.len);
+    memcpy(p, "\r\n", 2);
+    p += 2;
+    memcpy(p, r->body.base, r->body.len);
+    p += r->body.len;
+
+    conn->out_len = p - conn->out;
+    conn->out_sent = 0;
+    conn->headers_done = 0;
+    conn->in_len = 0;
+    return 0;
+}
+
+/* reads or writes through TLS when the connection has it; returns -2 when the call would block */
+static ssize_t conn_io(replay_conn_t *conn, int write, void *buf, size_t len)
+{
+    if (conn->ssl == NULL) {
+        ssize_t ret = write ? send(conn->fd, buf, len, MSG_NOSIGNAL) : recv(conn->fd, buf, len, 0);
+        return ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK) ? -2 : ret;
+    }
+    int ret = write ? SSL_write(conn->ssl, buf, (int)len) : SSL_read(conn->ssl, buf, (int)len);
+    if (ret > 0)
+        return ret;
+    switch (SSL_get_error(conn->ssl, ret)) {
+    case SSL_ERROR_WANT_READ:
+    case SSL_ERROR_WANT_WRITE:
+        return -2;
+    case SSL_ERROR_ZERO_RETURN:
+        return 0;
+    default:
+        return -1;
+    }
+}
+
+static const char *find_header_end(const char *p, size_t len)
+{
+    for (size_t i = 0; i + 3 < len; i++) {
+        if (p[i] == '\r' && p[i + 1] == '\n' && p[i + 2] == '\r' && p[i + 3] == '\n')
+            return p + i + 4;
+    }
+    return NULL;
+}
+
+static int header_is(const char *line, size_t len, const char *name, const char **value)
+{
+    size_t name_len = strlen(name);
+
+    if (len <= name_len || strncasecmp(line, name, name_len) != 0 || line[name_len] != ':')
+        return 0;
+    for (*value = line + name_len + 1; *value < line + len && **value == ' '; (*value)++)
+        ;
+    return 1;
+}
+
+/* parses the status line and headers; returns the status, or -1 if malformed */
+static int parse_response_head(replay_conn_t *conn, const char *head, size_t len)
+{
+    const replay_request_t *request = g_requests + conn->requests[conn->next];
+    int status, minor;
+
+    if (sscanf(head, "HTTP/1.%d %d", &minor, &status) != 2)
+        return -1;
+    conn->keep_alive = minor >= 1;
+    conn->body_mode = BODY_UNTIL_CLOSE;
+    conn->chunk_state = 0;
+
+    const char *line = memchr(head, '\n', len) + 1, *end = head + len;
+    while (line < end) {
+        const char *eol = memchr(line, '\n', end - line), *value;
+        size_t line_len = (eol ? eol : end) - line;
+        if (line_len > 0 && line[line_len - 1] == '\r')
+            line_len--;
+        if (header_is(line, line_len, "content-length", &value)) {
+            conn->body_mode = BODY_LENGTH;
+            conn->body_left = strtoull(value, NULL, 10);
+        } else if (header_is(line, line_len, "transfer-encoding", &value) && strncasecmp(value, "chunked", 7) == 0) {
+            conn->body_mode = BODY_CHUNKED;
+        } else if (header_is(line, line_len, "connection", &value)) {
+            if (strncasecmp(value, "close", 5) == 0)
+                conn->keep_alive = 0;
+            else if (strncasecmp(value, "keep-alive", 10) == 0)
+                conn->keep_alive = 1;
+        }
+        if (eol == NULL)
+            break;
+        line = eol + 1;
+    }
+
+    if ((request->record.method.len == 4 && memcmp(request->record.method.base, "HEAD", 4) == 0) ||
+        status == 204 || status == 304 || status < 200)
+        conn->body_mode = BODY_NONE;
+    if (conn->body_mode == BODY_UNTIL_CLOSE)
+        conn->keep_alive = 0;
+    return status;
+}
+
+/* consumes body bytes from conn->in; returns 1 once the body is complete, -1 if malformed */
+static int consume_body(replay_conn_t *conn)
+{
+    size_t off = 0;
+    int done = 0;
+
+    while (!done && off < conn->in_len) {
+        char *p = conn->in + off;
+        size_t avail = conn->in_len - off;
+        switch (conn->body_mode) {
+        case BODY_NONE:
+            done = 1;
+            break;
+        case BODY_UNTIL_CLOSE:
+            off = conn->in_len;
+            break;
+        case BODY_LENGTH: {
+            size_t n = avail < conn->body_left ? avail : conn->body_left;
+            off += n;
+            conn->body_left -= n;
+            break;
+        }
+        case BODY_CHUNKED:
+            if (conn->chunk_state == 1) {
+                size_t n = avail < conn->body_left ? avail : conn->body_left;
+                off += n;
+                if ((conn->body_left -= n) == 0)
+                    conn->chunk_state = 2;
+                break;
+            }
+            char *eol = memchr(p, '\n', avail);
+            if (eol == NULL)
+                goto Partial;
+            off += eol - p + 1;
+            if (conn->chunk_state == 0) {
+                char *digits_end;
+                conn->body_left = strtoull(p, &digits_end, 16);
+                if (digits_end == p)
+                    return -1;
+                conn->chunk_state = conn->body_left ? 1 : 3;
+            } else if (conn->chunk_state == 2) {
+                conn->chunk_state = 0;
+            } else if (eol == p || (eol == p + 1 && *p == '\r')) {
+                done = 1;  // Empty line after the last chunk
+            }
+            break;
+        }
+        if (conn->body_mode == BODY_LENGTH && conn->body_left == 0)
+            done = 1;
+    }
+    if (conn->body_mode == BODY_NONE || (conn->body_mode == BODY_LENGTH && conn->body_left == 0))
+        done = 1;
+
+Partial:
+    memmove(conn->in, conn->in + off, conn->in_len - off);
+    conn->in_len -= off;
+    return done;
+}
+
+static void on_readable(replay_conn_t *conn, uint64_t now)
+{
+    for (;;) {
+        if (conn->in_cap - conn->in_len < READ_CHUNK) {
+            conn->in_cap = conn->in_len + READ_CHUNK * 2;
+            if ((conn->in = realloc(conn->in, conn->in_cap)) == NULL) {
+                perror("realloc");
+                exit(1);
+            }
+        }
+        ssize_t n = conn_io(conn, 0, conn->in + conn->in_len, conn->in_cap - conn->in_len);
+        if (n == -2)
+            return;
+        if (n <= 0) {
+            /* the server closing the connection ends a body that runs until close */
+            int complete = n == 0 && conn->headers_done && conn->body_mode == BODY_UNTIL_CLOSE;
+            conn->keep_alive = 0;
+            finish_request(conn, complete ? g_requests[conn->requests[conn->next]].status : -1, now);
+            return;
+        }
+        conn->in_len += n;
+
+        if (!conn->headers_done) {
+            const char *body = find_header_end(conn->in, conn->in_len);
+            if (body == NULL)
+                continue;
+            int status = parse_response_head(conn, conn->in, body - conn->in);
+            if (status < 0) {
+                finish_request(conn, -1, now);
+                return;
+            }
+            g_requests[conn->requests[conn->next]].status = status;
+            conn->headers_done = 1;
+            conn->in_len -= body - conn->in;
+            memmove(conn->in, body, conn->in_len);
+        }
+        int done = consume_body(conn);
+        if (done != 0) {
+            finish_request(conn, done < 0 ? -1 : g_requests[conn->requests[conn->next]].status, now);
+            return;
+        }
+    }
+}
+
+static void on_writable(replay_conn_t *conn, uint64_t now)
+{
+    while (conn->out_sent < conn->out_len) {
+        ssize_t n = conn_io(conn, 1, conn->out + conn->out_sent, conn->out_len - conn->out_sent);
+        if (n == -2)
+            return;
+        if (n <= 0) {
+            finish_request(conn, -1, now);
+            return;
+        }
+        conn->out_sent += n;
+    }
+    conn->state = CONN_READING;
+}
+
+static void start_request(replay_conn_t *conn, uint64_t now)
+{
+    if (build_request(conn) != 0) {
+        perror("malloc");
+        exit(1);
+    }
+    conn->sent_at = now;
+    conn->state = CONN_SENDING;
+    on_writable(conn, now);
+}
+
+static void on_handshake(replay_conn_t *conn, uint64_t now)
+{
+    int ret = SSL_connect(conn->ssl);
+
+    if (ret == 1) {
+        if (SSL_session_reused(conn->ssl))
+            g_resumed++;
+        conn->state = CONN_IDLE;
+        return;
+    }
+    int err = SSL_get_error(conn->ssl, ret);
+    if (err != SSL_ERROR_WANT_READ && err != SSL_ERROR_WANT_WRITE) {
+        conn->sent_at = now;
+        finish_request(conn, -1, now);
+    }
+}
+
+static void on_connected(replay_conn_t *conn, uint64_t now)
+{
+    int err = 0;
+    socklen_t err_len = sizeof(err);
+
+    if (getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &err, &err_len) != 0 || err != 0) {
+        conn->sent_at = now;
+        finish_request(conn, -1, now);
+        return;
+    }
+    if (!g_options.tls) {
+        conn->state = CONN_IDLE;
+        return;
+    }
+    conn->ssl = SSL_new(g_ssl_ctx);
+    SSL_set_fd(conn->ssl, conn->fd);
+    SSL_set_tlsext_host_name(conn->ssl, g_options.host);
+    if ((conn->flags & CAPTURE_FLAG_TLS_RESUMED) && g_session != NULL) {
+        SSL_set_session(conn->ssl, g_session);
+        g_resume_attempts++;
+    }
+    conn->state = CONN_HANDSHAKE;
+    on_handshake(conn, now);
+}
+
+static uint64_t next_due(const replay_conn_t *conn)
+{
+    return g_requests[conn->requests[conn->next]].due_ns;
+}
+
+static void run(void)
+{
+    replay_conn_t **active = malloc(g_num_conns * sizeof(*active));
+    struct pollfd *fds = malloc(g_num_conns * sizeof(*fds));
+    size_t num_active = 0, pending = 0;
+    uint64_t start = now_ns(), timeout_ns = (uint64_t)g_options.timeout_ms * 1000000;
+
+    if (active == NULL || fds == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+
+    while (pending < g_num_conns || num_active > 0) {
+        uint64_t now = now_ns() - start, wake = UINT64_MAX;
+
+        /* open connections whose first request is due */
+        while (pending < g_num_conns && next_due(g_conns + pending) <= now) {
+            replay_conn_t *conn = g_conns + pending++;
+            active[num_active++] = conn;
+        }
+        if (pending < g_num_conns)
+            wake = next_due(g_conns + pending);
+
+        size_t nfds = 0;
+        for (size_t i = 0; i < num_active; i++) {
+            replay_conn_t *conn = active[i];
+            if (conn->state == CONN_PENDING && next_due(conn) <= now && open_conn(conn, now) != 0) {
+                conn->sent_at = now;
+                finish_request(conn, -1, now);
+            }
+            if (conn->state == CONN_IDLE && next_due(conn) <= now)
+                start_request(conn, now);
+            if (conn->state != CONN_PENDING && conn->state != CONN_IDLE && conn->state != CONN_DONE &&
+                now - conn->sent_at > timeout_ns)
+                finish_request(conn, -1, now);
+
+            if (conn->state == CONN_DONE) {
+                active[i--] = active[--num_active];
+                continue;
+            }
+            if (conn->state == CONN_PENDING || conn->state == CONN_IDLE) {
+                uint64_t due = next_due(conn);
+                if (due < wake)
+                    wake = due;
+                if (conn->state == CONN_PENDING)
+                    continue;
+            } else if (conn->sent_at + timeout_ns < wake) {
+                wake = conn->sent_at + timeout_ns;
+            }
+            short events = POLLIN;
+            if (conn->state == CONN_CONNECTING || conn->state == CONN_SENDING ||
+                (conn->state == CONN_HANDSHAKE && SSL_want_write(conn->ssl)))
+                events = POLLOUT;
+            fds[nfds++] = (struct pollfd){conn->fd, events, 0};
+        }
+
+        if (nfds == 0 && wake == UINT64_MAX)
+            break;  // Every connection is done
+        int wait_ms = wake == UINT64_MAX ? -1 : wake <= now ? 0 : (int)((wake - now + 999999) / 1000000);
+        if (poll(fds, nfds, wait_ms) <= 0)
+            continue;
+
+        now = now_ns() - start;
+        for (size_t i = 0, f = 0; i < num_active && f < nfds; i++) {
+            replay_conn_t *conn = active[i];
+            if (conn->fd != fds[f].fd)
+                continue;
+            short revents = fds[f++].revents;
+            if (revents == 0)
+                continue;
+            switch (conn->state) {
+            case CONN_CONNECTING:
+                on_connected(conn, now);
+                break;
+            case CONN_HANDSHAKE:
+                on_handshake(conn, now);
+                break;
+            case CONN_SENDING:
+                on_writable(conn, now);
+                break;
+            case CONN_READING:
+                on_readable(conn, now);
+                break;
+            case CONN_IDLE:
+                /* the server closed an idle keep-alive connection; reconnect for the next request */
+                close_conn(conn);
+                conn->state = CONN_PENDING;
+                break;
+            default:
+                break;
+            }
+        }
+    }
+
+    free(active);
+    free(fds);
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile_us(const uint64_t *sorted, size_t n, double p)
+{
+    return n ? sorted[(size_t)(p * (n - 1))] / 1000.0 : 0;
+}
+
+static void print_latencies(const char *title, uint64_t *values, size_t n)
+{
+    qsort(values, n, sizeof(*values), compare_u64);
+    printf("%-10s p50 %9.1f us  p90 %9.1f us  p99 %9.1f us  p99.9 %9.1f us  max %9.1f us\n", title,
+           percentile_us(values, n, 0.5), percentile_us(values, n, 0.9), percentile_us(values, n, 0.99),
+           percentile_us(values, n, 0.999), percentile_us(values, n, 1.0));
+}
+
+static void report(double elapsed)
+{
+    uint64_t *latencies = malloc(g_num_requests * sizeof(*latencies)), classes[6] = {0};
+    size_t n = 0;
+
+    for (size_t i = 0; i < g_num_requests; i++) {
+        if (g_requests[i].status > 0) {
+            latencies[n++] = g_requests[i].latency_ns;
+            classes[g_requests[i].status / 100 < 6 ? g_requests[i].status / 100 : 0]++;
+        }
+    }
+
+    printf("%zu requests on %zu connections in %.2fs (%.0f requests/s, %llu connects)\n", g_num_requests,
+           g_num_conns, elapsed, g_num_requests / elapsed, (unsigned long long)g_connects);
+    printf("status 2xx %llu, 3xx %llu, 4xx %llu, 5xx %llu, errors %llu\n", (unsigned long long)classes[2],
+           (unsigned long long)classes[3], (unsigned long long)classes[4], (unsigned long long)classes[5],
+           (unsigned long long)g_errors);
+    if (g_options.tls)
+        printf("TLS sessions resumed %llu of %llu attempted\n", (unsigned long long)g_resumed,
+               (unsigned long long)g_resume_attempts);
+    print_latencies("latency", latencies, n);
+    free(latencies);
+}
+
+static int write_output(const char *path)
+{
+    FILE *fp = fopen(path, "w");
+
+    if (fp == NULL) {
+        fprintf(stderr, "failed to open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    for (size_t i = 0; i < g_num_requests; i++)
+        fprintf(fp, "%zu %d %llu\n", i, g_requests[i].status, (unsigned long long)g_requests[i].latency_ns);
+    return fclose(fp);
+}
+
+/* pairs requests by capture index with an earlier run, so the deltas are per request */
+static int compare_baseline(const char *path)
+{
+    FILE *fp = fopen(path, "r");
+    uint64_t *base = malloc(g_num_requests * sizeof(*base)), *cur = malloc(g_num_requests * sizeof(*cur));
+    uint64_t *faster = malloc(g_num_requests * sizeof(*faster)), *slower = malloc(g_num_requests * sizeof(*slower));
+    size_t index, paired = 0, num_faster = 0, num_slower = 0;
+    unsigned long long latency;
+    int status;
+
+    if (fp == NULL || base == NULL || cur == NULL || faster == NULL || slower == NULL) {
+        fprintf(stderr, "failed to read baseline %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    while (fscanf(fp, "%zu %d %llu", &index, &status, &latency) == 3) {
+        if (index >= g_num_requests || status <= 0 || g_requests[index].status <= 0)
+            continue;
+        base[paired] = latency;
+        cur[paired] = g_requests[index].latency_ns;
+        if (cur[paired] < latency)
+            faster[num_faster++] = latency - cur[paired];
+        else
+            slower[num_slower++] = cur[paired] - latency;
+        paired++;
+    }
+    fclose(fp);
+
+    printf("\ncompared with %s (%zu requests paired)\n", path, paired);
+    print_latencies("baseline", base, paired);
+    print_latencies("this run", cur, paired);
+    for (int i = 0; i < 5; i++) {
+        static const double points[] = {0.5, 0.9, 0.99, 0.999, 1.0};
+        static const char *const names[] = {"p50", "p90", "p99", "p99.9", "max"};
+        double b = percentile_us(base, paired, points[i]), c = percentile_us(cur, paired, points[i]);
+        printf("%-6s %+9.1f us (%+.1f%%)\n", names[i], c - b, b > 0 ? (c - b) * 100 / b : 0);
+    }
+    printf("per request: %zu faster (median by %.1f us), %zu slower (median by %.1f us)\n", num_faster,
+           (qsort(faster, num_faster, sizeof(*faster), compare_u64), percentile_us(faster, num_faster, 0.5)),
+           num_slower, (qsort(slower, num_slower, sizeof(*slower), compare_u64), percentile_us(slower, num_slower, 0.5)));
+
+    free(base);
+    free(cur);
+    free(faster);
+    free(slower);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    static const struct option longopts[] = {{"host", required_argument, NULL, 'H'},
+                                             {"port", required_argument, NULL, 'p'},
+                                             {"speed", required_argument, NULL, 's'},
+                                             {"tls", no_argument, NULL, 't'},
+                                             {"timeout", required_argument, NULL, 'T'},
+                                             {"output", required_argument, NULL, 'o'},
+                                             {"baseline", required_argument, NULL, 'b'},
+                                             {NULL}};
+    struct addrinfo hints = {.ai_socktype = SOCK_STREAM};
+    int ch, ret;
+
+    while ((ch = getopt_long(argc, argv, "H:p:s:tT:o:b:", longopts, NULL)) != -1) {
+        switch (ch) {
+        case 'H':
+            g_options.host = optarg;
+            break;
+        case 'p':
+            g_options.port = optarg;
+            break;
+        case 's':
+            if ((g_options.speed = strtod(optarg, NULL)) <= 0) {
+                fprintf(stderr, "speed must be positive\n");
+                return 1;
+            }
+            break;
+        case 't':
+            g_options.tls = 1;
+            break;
+        case 'T':
+            g_options.timeout_ms = (uint32_t)strtoul(optarg, NULL, 10);
+            break;
+        case 'o':
+            g_options.output = optarg;
+            break;
+        case 'b':
+            g_options.baseline = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind + 1 != argc) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    size_t len;
+    uint8_t *data = read_file(argv[optind], &len);
+    if (data == NULL || load_capture(data, len) != 0)
+        return 1;
+    if ((ret = getaddrinfo(g_options.host, g_options.port, &hints, &g_addr)) != 0) {
+        fprintf(stderr, "failed to resolve %s:%s: %s\n", g_options.host, g_options.port, gai_strerror(ret));
+        return 1;
+    }
+    if (g_options.tls && setup_tls() != 0) {
+        fprintf(stderr, "failed to set up TLS\n");
+        ERR_print_errors_fp(stderr);
+        return 1;
+    }
+
+    printf("replaying %zu requests on %zu connections at %gx against %s:%s%s\n", g_num_requests, g_num_conns,
+           g_options.speed, g_options.host, g_options.port, g_options.tls ? " (TLS)" : "");
+    uint64_t start = now_ns();
+    run();
+    report((now_ns() - start) / 1e9);
+
+    if (g_options.output != NULL && write_output(g_options.output) != 0)
+        return 1;
+    if (g_options.baseline != NULL && compare_baseline(g_options.baseline) != 0)
+        return 1;
+    return 0;
+}
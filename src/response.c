@@ -0,0 +1,94 @@
+#include "growtopia/response.h"
+#include <h2o.h>
+#include <stdlib.h>
+#include <string.h>
+
+response_template_t *response_template_create(int status, const char *reason)
+{
+    response_template_t *tmpl = calloc(1, sizeof(*tmpl));
+    if (tmpl == NULL)
+        return NULL;
+
+    tmpl->status = status;
+    tmpl->reason = reason;
+    return tmpl;
+}
+
+int response_template_add_header(response_template_t *tmpl, const h2o_token_t *token, const char *value, size_t value_len)
+{
+    if (tmpl->num_headers == tmpl->capacity) {
+        size_t new_capacity = tmpl->capacity != 0 ? tmpl->capacity * 2 : 4;
+        h2o_header_t *new_headers = realloc(tmpl->headers, new_capacity * sizeof(*new_headers));
+        if (new_headers == NULL)
+            return -1;
+        tmpl->headers = new_headers;
+        tmpl->capacity = new_capacity;
+    }
+
+    char *interned = malloc(value_len + 1);
+    if (interned == NULL)
+        return -1;
+    memcpy(interned, value, value_len);
+    interned[value_len] = '\0';
+
+    h2o_header_t *header = tmpl->headers + tmpl->num_headers++;
+    memset(header, 0, sizeof(*header));
+    header->name = (h2o_iovec_t *)&token->buf;
+    header->value = h2o_iovec_init(interned, value_len);
+    return 0;
+}
+
+int response_template_set_body(response_template_t *tmpl, const char *body, size_t len)
+{
+    char *interned = malloc(len + 1);
+    if (interned == NULL)
+        return -1;
+    memcpy(interned, body, len);
+    interned[len] = '\0';
+
+    free(tmpl->body.base);
+    tmpl->body = h2o_iovec_init(interned, len);
+    return 0;
+}
+
+void response_template_start(const response_template_t *tmpl, h2o_req_t *req, h2o_generator_t *generator)
+{
+    req->res.status = tmpl->status;
+    req->res.reason = tmpl->reason;
+
+    /* only the header array is copied; names and values keep pointing into the template */
+    if (tmpl->num_headers != 0) {
+        h2o_vector_reserve(&req->pool, &req->res.headers, req->res.headers.size + tmpl->num_headers);
+        memcpy(req->res.headers.entries + req->res.headers.size, tmpl->headers, tmpl->num_headers * sizeof(h2o_header_t));
+        req->res.headers.size += tmpl->num_headers;
+    }
+
+    h2o_start_response(req, generator);
+}
+
+void response_template_send(const response_template_t *tmpl, h2o_req_t *req)
+{
+    static h2o_generator_t generator = {NULL, NULL};
+
+    req->res.content_length = tmpl->body.len;
+    response_template_start(tmpl, req, &generator);
+
+    if (h2o_memis(req->method.base, req->method.len, H2O_STRLIT("HEAD"))) {
+        h2o_send(req, NULL, 0, H2O_SEND_STATE_FINAL);
+    } else {
+        h2o_iovec_t body = tmpl->body;
+        h2o_send(req, &body, 1, H2O_SEND_STATE_FINAL);
+    }
+}
+
+void response_template_free(response_template_t *tmpl)
+{
+    if (tmpl == NULL)
+        return;
+
+    for (size_t i = 0; i < tmpl->num_headers; i++)
+        free(tmpl->headers[i].value.base);
+    free(tmpl->headers);
+    free(tmpl->body.base);
+    free(tmpl);
+}
@@ -0,0 +1,568 @@
+#include "growtopia/router.h"
+#include <h2o.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define MAX_DISPLACEMENT 65536           // Seeds tried per bucket before the slot table is doubled
+
+typedef struct {
+    h2o_pathconf_t *pathconf;
+    h2o_iovec_t key;                     // Path as h2o compares it: a prefix route's trailing '/' is dropped
+    uint64_t hash;
+    int exact;                           // Only matches the whole path
+} route_t;
+
+/* children of a node are stored next to each other, sorted by the first byte of their label */
+typedef struct {
+    uint32_t label;                      // Offset of the edge label in labels
+    uint32_t label_len;
+    uint32_t first_child;
+    uint16_t num_children;
+    uint8_t first_byte;                  // labels[label], kept here for the child search
+    int32_t route;                       // Prefix route ending at this node, -1 if none
+} trie_node_t;
+
+struct route_table {
+    route_t *routes;
+    size_t num_routes;
+    /* hash and displace: a route's bucket picks the seed that places it in slots without collisions */
+    uint32_t *displacements;
+    size_t bucket_mask;
+    int32_t *slots;
+    size_t slot_mask;
+    /* radix trie of the prefix routes */
+    trie_node_t *nodes;
+    size_t num_nodes;
+    char *labels;
+};
+
+typedef struct router_handler {
+    h2o_handler_t super;
+    h2o_hostconf_t *hostconf;
+    h2o_pathconf_t *pathconf;            // The dispatcher's own path, left out of the table
+    route_table_t *table;
+    struct router_handler *next;
+} router_handler_t;
+
+static router_handler_t *g_dispatchers = NULL;
+static h2o_pathconf_t **g_exact = NULL;  // Sorted by address once a table is built
+static size_t g_num_exact = 0;
+
+/* statistics */
+static uint64_t g_exact_hits = 0;
+static uint64_t g_prefix_hits = 0;
+static uint64_t g_fallbacks = 0;
+
+static uint64_t mix64(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+static uint64_t hash_path(const char *path, size_t len)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+
+    for (size_t i = 0; i < len; i++) {
+        h ^= (uint8_t)path[i];
+        h *= 0x100000001b3ULL;
+    }
+    return mix64(h ^ len);
+}
+
+static size_t slot_of(uint64_t hash, uint32_t displacement, size_t mask)
+{
+    return mix64(hash + displacement * 0x9e3779b97f4a7c15ULL) & mask;
+}
+
+static size_t round_up_pow2(size_t n)
+{
+    size_t v = 1;
+    while (v < n)
+        v <<= 1;
+    return v;
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int compare_pointers(const void *a, const void *b)
+{
+    uintptr_t x = (uintptr_t) * (h2o_pathconf_t *const *)a, y = (uintptr_t) * (h2o_pathconf_t *const *)b;
+    return x < y ? -1 : x > y;
+}
+
+int router_set_exact(h2o_pathconf_t *pathconf)
+{
+    h2o_pathconf_t **exact = realloc(g_exact, (g_num_exact + 1) * sizeof(*exact));
+
+    if (exact == NULL)
+        return -1;
+    g_exact = exact;
+    g_exact[g_num_exact++] = pathconf;
+    qsort(g_exact, g_num_exact, sizeof(*g_exact), compare_pointers);
+    return 0;
+}
+
+static int is_exact(h2o_pathconf_t *pathconf)
+{
+    return g_num_exact != 0 && bsearch(&pathconf, g_exact, g_num_exact, sizeof(*g_exact), compare_pointers) != NULL;
+}
+
+/* h2o matches /foo/ like /foo: the path itself, or the path followed by '/' */
+static h2o_iovec_t route_key(h2o_pathconf_t *pathconf, int exact)
+{
+    h2o_iovec_t key = pathconf->path;
+
+    if (!exact && key.len != 0 && key.base[key.len - 1] == '/')
+        key.len--;
+    return key;
+}
+
+/* sorts by key, then by position, so that the first registration of a key comes first */
+static int compare_routes(const void *a, const void *b)
+{
+    const route_t *x = a, *y = b;
+    size_t len = x->key.len < y->key.len ? x->key.len : y->key.len;
+    int cmp = memcmp(x->key.base, y->key.base, len);
+
+    if (cmp != 0)
+        return cmp;
+    if (x->key.len != y->key.len)
+        return x->key.len < y->key.len ? -1 : 1;
+    return x->hash < y->hash ? -1 : x->hash > y->hash;  // hash holds the position until the table is built
+}
+
+/* tries to place every route with a slot table of the given size */
+static int place_routes(route_table_t *table, const size_t *bucket_start, const uint32_t *members, size_t num_buckets,
+                        size_t max_bucket)
+{
+    for (size_t i = 0; i <= table->slot_mask; i++)
+        table->slots[i] = -1;
+
+    /* largest buckets first, while the table is emptiest */
+    for (size_t size = max_bucket; size != 0; size--) {
+        for (size_t b = 0; b < num_buckets; b++) {
+            if (bucket_start[b + 1] - bucket_start[b] != size)
+                continue;
+            const uint32_t *keys = members + bucket_start[b];
+            uint32_t d;
+            for (d = 0; d < MAX_DISPLACEMENT; d++) {
+                size_t placed = 0;
+                for (; placed < size; placed++) {
+                    size_t slot = slot_of(table->routes[keys[placed]].hash, d, table->slot_mask);
+                    if (table->slots[slot] != -1)
+                        break;
+                    table->slots[slot] = (int32_t)keys[placed];
+                }
+                if (placed == size)
+                    break;
+                while (placed-- != 0)
+                    table->slots[slot_of(table->routes[keys[placed]].hash, d, table->slot_mask)] = -1;
+            }
+            if (d == MAX_DISPLACEMENT)
+                return -1;
+            table->displacements[b] = d;
+        }
+    }
+    return 0;
+}
+
+static int build_hash(route_table_t *table)
+{
+    size_t n = table->num_routes, num_buckets = round_up_pow2(n / 4 + 1), max_bucket = 0;
+    size_t *bucket_start = calloc(num_buckets + 1, sizeof(*bucket_start));
+    uint32_t *members = malloc((n ? n : 1) * sizeof(*members));
+    int ret = -1;
+
+    table->bucket_mask = num_buckets - 1;
+    if (bucket_start == NULL || members == NULL ||
+        (table->displacements = calloc(num_buckets, sizeof(*table->displacements))) == NULL)
+        goto Exit;
+
+    /* group the routes by bucket: count, turn the counts into bucket ends, then fill each bucket backwards */
+    for (size_t i = 0; i < n; i++)
+        bucket_start[table->routes[i].hash & table->bucket_mask]++;
+    for (size_t b = 0; b < num_buckets; b++) {
+        if (bucket_start[b] > max_bucket)
+            max_bucket = bucket_start[b];
+        bucket_start[b] += b != 0 ? bucket_start[b - 1] : 0;
+    }
+    for (size_t i = n; i-- != 0;)
+        members[--bucket_start[table->routes[i].hash & table->bucket_mask]] = (uint32_t)i;
+    bucket_start[num_buckets] = n;
+
+    /* about 80% full to start with; doubled until every bucket finds a seed */
+    for (size_t num_slots = round_up_pow2(n + n / 4 + 1);; num_slots *= 2) {
+        free(table->slots);
+        table->slot_mask = num_slots - 1;
+        if ((table->slots = malloc(num_slots * sizeof(*table->slots))) == NULL)
+            goto Exit;
+        if (place_routes(table, bucket_start, members, num_buckets, max_bucket) == 0)
+            break;
+    }
+    ret = 0;
+
+Exit:
+    free(bucket_start);
+    free(members);
+    return ret;
+}
+
+typedef struct build_node {
+    const char *label;
+    size_t label_len;
+    struct build_node **children;        // Sorted by first byte
+    size_t num_children;
+    int32_t route;
+} build_node_t;
+
+static build_node_t *new_build_node(const char *label, size_t label_len, int32_t route)
+{
+    build_node_t *node = calloc(1, sizeof(*node));
+
+    if (node != NULL) {
+        node->label = label;
+        node->label_len = label_len;
+        node->route = route;
+    }
+    return node;
+}
+
+static int add_child(build_node_t *parent, size_t at, build_node_t *child)
+{
+    build_node_t **children = realloc(parent->children, (parent->num_children + 1) * sizeof(*children));
+
+    if (children == NULL)
+        return -1;
+    memmove(children + at + 1, children + at, (parent->num_children - at) * sizeof(*children));
+    children[at] = child;
+    parent->children = children;
+    parent->num_children++;
+    return 0;
+}
+
+static int trie_insert(build_node_t *node, const char *key, size_t len, int32_t route)
+{
+    size_t pos = 0;
+
+    for (;;) {
+        if (pos == len) {
+            if (node->route == -1)
+                node->route = route;
+            return 0;
+        }
+
+        size_t at = 0;
+        while (at < node->num_children && (uint8_t)node->children[at]->label[0] < (uint8_t)key[pos])
+            at++;
+        if (at == node->num_children || node->children[at]->label[0] != key[pos]) {
+            build_node_t *leaf = new_build_node(key + pos, len - pos, route);
+            if (leaf == NULL || add_child(node, at, leaf) != 0) {
+                free(leaf);
+                return -1;
+            }
+            return 0;
+        }
+
+        build_node_t *child = node->children[at];
+        size_t common = 0;
+        while (common < child->label_len && pos + common < len && child->label[common] == key[pos + common])
+            common++;
+        if (common < child->label_len) {
+            /* split the edge where the new key leaves it */
+            build_node_t *mid = new_build_node(child->label, common, -1);
+            if (mid == NULL || (mid->children = malloc(sizeof(*mid->children))) == NULL) {
+                free(mid);
+                return -1;
+            }
+            child->label += common;
+            child->label_len -= common;
+            mid->children[0] = child;
+            mid->num_children = 1;
+            node->children[at] = mid;
+            child = mid;
+        }
+        node = child;
+        pos += common;
+    }
+}
+
+static void free_build_node(build_node_t *node)
+{
+    for (size_t i = 0; i < node->num_children; i++)
+        free_build_node(node->children[i]);
+    free(node->children);
+    free(node);
+}
+
+static void count_build_nodes(const build_node_t *node, size_t *nodes, size_t *label_bytes)
+{
+    (*nodes)++;
+    *label_bytes += node->label_len;
+    for (size_t i = 0; i < node->num_children; i++)
+        count_build_nodes(node->children[i], nodes, label_bytes);
+}
+
+/* lays the trie out breadth first, so the children of a node end up next to each other */
+static int flatten_trie(route_table_t *table, build_node_t *root)
+{
+    size_t num_nodes = 0, label_bytes = 0, label_off = 0, next = 1;
+    build_node_t **queue;
+
+    count_build_nodes(root, &num_nodes, &label_bytes);
+    table->nodes = malloc(num_nodes * sizeof(*table->nodes));
+    table->labels = malloc(label_bytes ? label_bytes : 1);
+    queue = malloc(num_nodes * sizeof(*queue));
+    if (table->nodes == NULL || table->labels == NULL || queue == NULL) {
+        free(queue);
+        return -1;
+    }
+
+    queue[0] = root;
+    for (size_t i = 0; i < num_nodes; i++) {
+        build_node_t *node = queue[i];
+        trie_node_t *out = table->nodes + i;
+        memcpy(table->labels + label_off, node->label, node->label_len);
+        out->label = (uint32_t)label_off;
+        out->label_len = (uint32_t)node->label_len;
+        out->first_byte = node->label_len != 0 ? (uint8_t)node->label[0] : 0;
+        out->route = node->route;
+        out->first_child = (uint32_t)next;
+        out->num_children = (uint16_t)node->num_children;
+        label_off += node->label_len;
+        for (size_t c = 0; c < node->num_children; c++)
+            queue[next++] = node->children[c];
+    }
+    table->num_nodes = num_nodes;
+    free(queue);
+    return 0;
+}
+
+static int build_trie(route_table_t *table)
+{
+    build_node_t *root = new_build_node("", 0, -1);
+    int ret = -1;
+
+    if (root == NULL)
+        return -1;
+    for (size_t i = 0; i < table->num_routes; i++) {
+        const route_t *route = table->routes + i;
+        if (!route->exact && trie_insert(root, route->key.base, route->key.len, (int32_t)i) != 0)
+            goto Exit;
+    }
+    ret = flatten_trie(table, root);
+
+Exit:
+    free_build_node(root);
+    return ret;
+}
+
+route_table_t *route_table_build(h2o_pathconf_t *const *pathconfs, size_t count)
+{
+    route_table_t *table = calloc(1, sizeof(*table));
+
+    if (table == NULL || (table->routes = malloc((count ? count : 1) * sizeof(*table->routes))) == NULL)
+        goto Error;
+
+    for (size_t i = 0; i < count; i++) {
+        int exact = is_exact(pathconfs[i]);
+        table->routes[i] = (route_t){pathconfs[i], route_key(pathconfs[i], exact), i, exact};
+    }
+    qsort(table->routes, count, sizeof(*table->routes), compare_routes);
+    /* of /foo and /foo/, only the first registered is ever reached, as in h2o's scan */
+    for (size_t i = 0; i < count; i++) {
+        h2o_iovec_t key = table->routes[i].key;
+        if (table->num_routes != 0 &&
+            h2o_memis(key.base, key.len, table->routes[table->num_routes - 1].key.base,
+                      table->routes[table->num_routes - 1].key.len))
+            continue;
+        table->routes[table->num_routes] = table->routes[i];
+        table->routes[table->num_routes].hash = hash_path(key.base, key.len);
+        table->num_routes++;
+    }
+
+    if (build_hash(table) != 0 || build_trie(table) != 0)
+        goto Error;
+    return table;
+
+Error:
+    route_table_free(table);
+    return NULL;
+}
+
+void route_table_free(route_table_t *table)
+{
+    if (table == NULL)
+        return;
+    free(table->routes);
+    free(table->displacements);
+    free(table->slots);
+    free(table->nodes);
+    free(table->labels);
+    free(table);
+}
+
+static int32_t lookup_exact(const route_table_t *table, const char *path, size_t len)
+{
+    uint64_t hash = hash_path(path, len);
+    int32_t route = table->slots[slot_of(hash, table->displacements[hash & table->bucket_mask], table->slot_mask)];
+
+    if (route < 0 || table->routes[route].hash != hash)
+        return -1;
+    h2o_iovec_t candidate = table->routes[route].key;
+    return h2o_memis(candidate.base, candidate.len, path, len) ? route : -1;
+}
+
+/* longest prefix route whose key ends on a segment boundary of the path: at a '/' or at the end */
+static int32_t lookup_prefix(const route_table_t *table, const char *path, size_t len)
+{
+    const trie_node_t *node = table->nodes;
+    size_t pos = 0;
+    int32_t best = -1;
+
+    for (;;) {
+        if (node->route >= 0 && (pos == len || path[pos] == '/'))
+            best = node->route;
+        if (pos == len)
+            break;
+
+        size_t lo = node->first_child, hi = lo + node->num_children;
+        uint8_t c = (uint8_t)path[pos];
+        while (lo < hi) {
+            size_t mid = (lo + hi) / 2;
+            if (table->nodes[mid].first_byte < c)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        if (lo == node->first_child + node->num_children || table->nodes[lo].first_byte != c)
+            break;
+
+        const trie_node_t *child = table->nodes + lo;
+        if (child->label_len > len - pos || memcmp(table->labels + child->label, path + pos, child->label_len) != 0)
+            break;
+        pos += child->label_len;
+        node = child;
+    }
+    return best;
+}
+
+h2o_pathconf_t *route_table_lookup(const route_table_t *table, const char *path, size_t len)
+{
+    int32_t route = lookup_exact(table, path, len);
+
+    if (route < 0)
+        route = lookup_prefix(table, path, len);
+    return route >= 0 ? table->routes[route].pathconf : NULL;
+}
+
+static int on_dispatch(h2o_handler_t *_self, h2o_req_t *req)
+{
+    router_handler_t *self = (router_handler_t *)_self;
+    const route_table_t *table = self->table;
+    h2o_pathconf_t *pathconf;
+    int32_t route;
+
+    if ((route = lookup_exact(table, req->path_normalized.base, req->path_normalized.len)) >= 0) {
+        g_exact_hits++;
+    } else if ((route = lookup_prefix(table, req->path_normalized.base, req->path_normalized.len)) >= 0) {
+        g_prefix_hits++;
+    } else {
+        g_fallbacks++;
+    }
+    pathconf = route >= 0 ? table->routes[route].pathconf : &self->hostconf->fallback_path;
+
+    /* what h2o does once it has picked a path: bind its filters and loggers, then run its handlers */
+    h2o_req_bind_conf(req, self->hostconf, pathconf);
+    for (size_t i = 0; i < pathconf->handlers.size; i++) {
+        h2o_handler_t *handler = pathconf->handlers.entries[i];
+        req->handler = handler;
+        if (handler->on_req(handler, req) == 0)
+            return 0;
+    }
+    h2o_send_error_404(req, "File Not Found", "not found", 0);
+    return 0;
+}
+
+static router_handler_t *create_dispatcher(h2o_hostconf_t *hostconf)
+{
+    h2o_pathconf_t *pathconf = h2o_config_register_path(hostconf, "/", 0);
+    router_handler_t *self = (router_handler_t *)h2o_create_handler(pathconf, sizeof(*self));
+    size_t at = 0;
+
+    self->super.on_req = on_dispatch;
+    self->hostconf = hostconf;
+    self->pathconf = pathconf;
+
+    /* h2o takes the first path that matches, and "/" matches every request */
+    while (hostconf->paths.entries[at] != pathconf)
+        at++;
+    memmove(hostconf->paths.entries + 1, hostconf->paths.entries, at * sizeof(hostconf->paths.entries[0]));
+    hostconf->paths.entries[0] = pathconf;
+
+    self->next = g_dispatchers;
+    g_dispatchers = self;
+    return self;
+}
+
+int router_install(h2o_hostconf_t *hostconf)
+{
+    router_handler_t *self = g_dispatchers;
+    h2o_pathconf_t **pathconfs;
+    size_t count = 0, num_exact = 0;
+
+    while (self != NULL && self->hostconf != hostconf)
+        self = self->next;
+    if (self == NULL)
+        self = create_dispatcher(hostconf);
+
+    if ((pathconfs = malloc(hostconf->paths.size * sizeof(*pathconfs))) == NULL)
+        return -1;
+    for (size_t i = 0; i < hostconf->paths.size; i++) {
+        if (hostconf->paths.entries[i] != self->pathconf)
+            pathconfs[count++] = hostconf->paths.entries[i];
+    }
+
+    uint64_t start = now_ns();
+    route_table_t *table = route_table_build(pathconfs, count);
+    free(pathconfs);
+    if (table == NULL) {
+        fprintf(stderr, "failed to compile the route table\n");
+        return -1;
+    }
+    for (size_t i = 0; i < table->num_routes; i++)
+        num_exact += table->routes[i].exact;
+
+    route_table_free(self->table);
+    self->table = table;
+    printf("Route table: %zu routes (%zu exact), %zu trie nodes, %zu hash slots, built in %llu us\n",
+           table->num_routes, num_exact, table->num_nodes, table->slot_mask + 1,
+           (unsigned long long)((now_ns() - start) / 1000));
+    return 0;
+}
+
+void router_get_stats(uint32_t *routes, uint64_t *exact_hits, uint64_t *prefix_hits, uint64_t *fallbacks)
+{
+    if (routes) {
+        *routes = 0;
+        for (router_handler_t *self = g_dispatchers; self != NULL; self = self->next)
+            *routes += self->table != NULL ? (uint32_t)self->table->num_routes : 0;
+    }
+    if (exact_hits)
+        *exact_hits = g_exact_hits;
+    if (prefix_hits)
+        *prefix_hits = g_prefix_hits;
+    if (fallbacks)
+        *fallbacks = g_fallbacks;
+}
@@ -0,0 +1,143 @@
+/*
+ * Compares route_table_lookup() with the linear path scan h2o does without it.
+ *
+ *   router-bench [lookups]
+ *
+ * For 10 to 10000 routes, half of them exact and half prefixes, it times lookups of paths hitting an
+ * exact route, a path below a prefix route, and no route at all. Every lookup is checked against the
+ * scan, so a wrong answer fails the run.
+ */
+#include "growtopia/router.h"
+#include <h2o.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static volatile uintptr_t g_sink;        // Keeps the timed lookups from being optimized out
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* the match h2o applies to each path of a host in turn (lib/core/request.c); the first one that matches wins */
+static int path_matches(const h2o_pathconf_t *pathconf, int exact, const char *path, size_t len)
+{
+    const h2o_iovec_t *p = &pathconf->path;
+
+    if (exact)
+        return h2o_memis(p->base, p->len, path, len);
+    size_t confpath_wo_slash = p->len - (p->base[p->len - 1] == '/');
+    if (len < confpath_wo_slash || memcmp(p->base, path, confpath_wo_slash) != 0)
+        return 0;
+    return len == confpath_wo_slash || path[confpath_wo_slash] == '/';
+}
+
+static h2o_pathconf_t *scan(h2o_pathconf_t **pathconfs, const int *exact, size_t count, const char *path, size_t len)
+{
+    for (size_t i = 0; i < count; i++) {
+        if (path_matches(pathconfs[i], exact[i], path, len))
+            return pathconfs[i];
+    }
+    return NULL;
+}
+
+static int run(size_t num_routes, size_t num_lookups)
+{
+    h2o_pathconf_t **pathconfs = calloc(num_routes, sizeof(*pathconfs));
+    int *exact = calloc(num_routes, sizeof(*exact));
+    char **paths = calloc(num_lookups, sizeof(*paths));
+    size_t *lens = calloc(num_lookups, sizeof(*lens));
+    char buf[128];
+    int ret = -1;
+
+    /* no route is a prefix of another, so the scan's first match is also the longest; half the bundles end in '/' */
+    for (size_t i = 0; i < num_routes; i++) {
+        int len = i % 2 == 0 ? snprintf(buf, sizeof(buf), "/api/v%zu/resource-%zu/show", i % 3 + 1, i)
+                             : snprintf(buf, sizeof(buf), i % 4 == 1 ? "/static/bundle-%zu/" : "/static/bundle-%zu", i);
+        pathconfs[i] = calloc(1, sizeof(*pathconfs[i]));
+        pathconfs[i]->path = h2o_strdup(NULL, buf, len);
+        exact[i] = i % 2 == 0;
+        if (exact[i] && router_set_exact(pathconfs[i]) != 0)
+            goto Exit;
+    }
+    srand(42);
+    for (size_t i = 0; i < num_lookups; i++) {
+        size_t r = (size_t)rand() % num_routes;
+        int len;
+        switch (i % 3) {
+        case 0:
+            /* a route's own path; bundles ending in '/' are also asked for without it */
+            len = snprintf(buf, sizeof(buf), "%s", pathconfs[r]->path.base);
+            if (i % 2 != 0 && buf[len - 1] == '/')
+                buf[--len] = '\0';
+            break;
+        case 1:
+            len = snprintf(buf, sizeof(buf), "/static/bundle-%zu/js/app.%zu.js", r | 1, i);
+            break;
+        default:
+            len = snprintf(buf, sizeof(buf), "/api/v%zu/unknown-%zu", r % 3 + 1, r);
+            break;
+        }
+        paths[i] = strdup(buf);
+        lens[i] = (size_t)len;
+    }
+
+    uint64_t start = now_ns();
+    route_table_t *table = route_table_build(pathconfs, num_routes);
+    uint64_t build_ns = now_ns() - start;
+    if (table == NULL) {
+        fprintf(stderr, "failed to build a table of %zu routes\n", num_routes);
+        goto Exit;
+    }
+
+    start = now_ns();
+    for (size_t i = 0; i < num_lookups; i++)
+        g_sink += (uintptr_t)route_table_lookup(table, paths[i], lens[i]);
+    uint64_t table_ns = now_ns() - start;
+    start = now_ns();
+    for (size_t i = 0; i < num_lookups; i++)
+        g_sink += (uintptr_t)scan(pathconfs, exact, num_routes, paths[i], lens[i]);
+    uint64_t scan_ns = now_ns() - start;
+
+    for (size_t i = 0; i < num_lookups; i++) {
+        if (route_table_lookup(table, paths[i], lens[i]) != scan(pathconfs, exact, num_routes, paths[i], lens[i])) {
+            fprintf(stderr, "%zu routes: table and scan disagree on %s\n", num_routes, paths[i]);
+            route_table_free(table);
+            goto Exit;
+        }
+    }
+    printf("%6zu routes  build %8.1f us  table %7.1f ns/lookup  scan %9.1f ns/lookup\n", num_routes,
+           build_ns / 1000.0, (double)table_ns / num_lookups, (double)scan_ns / num_lookups);
+    route_table_free(table);
+    ret = 0;
+
+Exit:
+    /* the paths are kept: router_set_exact() remembers them, and a reused address would turn a prefix exact */
+    for (size_t i = 0; i < num_lookups; i++)
+        free(paths[i]);
+    free(pathconfs);
+    free(exact);
+    free(paths);
+    free(lens);
+    return ret;
+}
+
+int main(int argc, char **argv)
+{
+    static const size_t route_counts[] = {10, 100, 1000, 10000};
+    size_t num_lookups = argc > 1 ? strtoul(argv[1], NULL, 10) : 30000;
+
+    if (num_lookups == 0) {
+        fprintf(stderr, "usage: %s [lookups]\n", argv[0]);
+        return 1;
+    }
+    for (size_t i = 0; i < sizeof(route_counts) / sizeof(route_counts[0]); i++) {
+        if (run(route_counts[i], num_lookups) != 0)
+            return 1;
+    }
+    return 0;
+}
@@ -1,4 +1,6 @@
 #include "growtopia/security.h"
+#include "growtopia/geoip.h"
+#include "growtopia/trace.h"
 #include <arpa/inet.h>
 #include <pthread.h>
 #include <stdio.h>
@@ -6,18 +8,57 @@
 #include <string.h>
 
 #define DEFAULT_TABLE_SIZE 1024
-#define CLEANUP_INTERVAL_MS 60000  // Run cleanup every 60 seconds
+#define SWEEP_INTERVAL_MS 100      // Run an incremental cleanup step every 100 ms
+#define SWEEP_PERIOD_MS 60000      // Visit every bucket once per minute
+#define SWEEP_MAX_ENTRIES 1024     // Upper bound on entries examined per step
+#define MAX_LOAD_FACTOR 2          // Double the IP table once it holds this many entries per bucket
+#define MAX_TABLE_SIZE (1u << 22)  // Buckets the IP table grows to at most
+#define MIGRATE_STEP_ENTRIES 64    // Entries moved to a grown table per insert (and per cleanup step)
 #define ENTRY_TIMEOUT_SECONDS 300  // Remove inactive entries after 5 minutes
+#define SKETCH_DEPTH 4             // Count-Min rows
+#define SKETCH_WIDTH 65536         // Count-Min counters per row (1 MiB per sketch)
+#define SKETCH_TOP_N 32            // Talkers kept by each Space-Saving summary
+#define SKETCH_KEY_CONNECTION 0x40 // Tag bit: the source key counts connections rather than requests
+#define SNAPSHOT_MAX_BUCKETS 4096  // Upper bound on buckets walked per export step
+#define ASN_TABLE_SIZE 4096        // Hash buckets for per-ASN counters
+#define MAX_ASN_COUNTERS 65536     // ASNs counted at once; ASNs with a policy are always counted
+#define COUNTRY_SLOTS (26 * 26)    // One counter per two-letter country code
+
+/**
+ * Export snapshot state; entries the export has not reached yet are copied before they change
+ */
+struct security_snapshot {
+    uint32_t epoch;                      // Epoch the snapshot was taken in
+    uint32_t cursor;                     // Next bucket to emit; buckets below it are done
+    ip_tracker_entry_t *preserved;       // Pre-change copies of entries in buckets not yet emitted
+};
 
 static security_context_t *g_security_ctx = NULL;
 static pthread_mutex_t g_security_mutex = PTHREAD_MUTEX_INITIALIZER;
+static time_t (*g_clock)(void) = NULL;   // Replaces time(NULL) when set (simulations)
 
 // Forward declarations
 static uint32_t hash_sockaddr(const struct sockaddr *addr);
+static ip_tracker_entry_t *find_entry(const struct sockaddr *addr);
+static ip_tracker_entry_t *create_entry(const struct sockaddr *addr);
 static ip_tracker_entry_t *find_or_create_entry(const struct sockaddr *addr);
+static int sketch_observe(const struct sockaddr *addr, int connection, uint32_t *estimate);
 static void cleanup_expired_entries(h2o_timer_t *timer);
+static uint32_t sweep_buckets_per_step(uint32_t table_size);
 static int sockaddr_equals(const struct sockaddr_storage *a, const struct sockaddr *b);
 static void remove_entry(const struct sockaddr *addr);
+static void entry_will_change(ip_tracker_entry_t *entry);
+static int country_index(const char *code);
+
+static time_t now_seconds(void)
+{
+    return g_clock != NULL ? g_clock() : time(NULL);
+}
+
+void security_set_clock(time_t (*clock)(void))
+{
+    g_clock = clock;
+}
 
 int security_init(h2o_context_t *ctx, const security_config_t *config)
 {
@@ -33,29 +74,82 @@ int security_init(h2o_context_t *ctx, const security_config_t *config)
     }
 
     g_security_ctx->config = config ? *config : security_get_default_config();
-    g_security_ctx->table_size = DEFAULT_TABLE_SIZE;
+    g_security_ctx->table_size = g_security_ctx->config.ip_table_size ? g_security_ctx->config.ip_table_size : DEFAULT_TABLE_SIZE;
+    g_security_ctx->sweep_buckets_per_step = sweep_buckets_per_step(g_security_ctx->table_size);
     g_security_ctx->h2o_ctx = ctx;
     g_security_ctx->total_blocked_requests = 0;
     g_security_ctx->total_banned_ips = 0;
 
+    for (size_t i = 0; i < g_security_ctx->config.num_geo_policies; i++) {
+        const geo_policy_t *policy = g_security_ctx->config.geo_policies + i;
+        if (policy->asn == 0 && country_index(policy->country) < 0) {
+            fprintf(stderr, "Geo policy %zu: invalid country code \"%s\"\n", i,
+                    policy->country ? policy->country : "(null)");
+            free(g_security_ctx);
+            g_security_ctx = NULL;
+            return -1;
+        }
+    }
+
     g_security_ctx->ip_table = calloc(g_security_ctx->table_size, sizeof(ip_tracker_entry_t *));
-    if (g_security_ctx->ip_table == NULL) {
+    g_security_ctx->asn_table = calloc(ASN_TABLE_SIZE, sizeof(geo_counter_t *));
+    g_security_ctx->countries = calloc(COUNTRY_SLOTS, sizeof(geo_counter_t));
+    if (g_security_ctx->ip_table == NULL || g_security_ctx->asn_table == NULL || g_security_ctx->countries == NULL) {
         fprintf(stderr, "Failed to allocate IP tracking table\n");
+        free(g_security_ctx->ip_table);
+        free(g_security_ctx->asn_table);
+        free(g_security_ctx->countries);
         free(g_security_ctx);
         g_security_ctx = NULL;
         return -1;
     }
 
-    // Setup periodic cleanup timer
+    // Country policies live in their slot; ASN policies are attached when the ASN's counter is created
+    for (size_t i = 0; i < g_security_ctx->config.num_geo_policies; i++) {
+        const geo_policy_t *policy = g_security_ctx->config.geo_policies + i;
+        if (policy->asn == 0)
+            g_security_ctx->countries[country_index(policy->country)].policy = policy;
+    }
+
+    // Sketches in front of the exact table; only suspected heavy hitters get tracker entries
+    if (g_security_ctx->config.sketch_source_threshold > 0) {
+        if (count_min_init(&g_security_ctx->source_sketch, SKETCH_DEPTH, SKETCH_WIDTH) != 0 ||
+            count_min_init(&g_security_ctx->prefix_sketch, SKETCH_DEPTH, SKETCH_WIDTH) != 0 ||
+            space_saving_init(&g_security_ctx->top_sources, SKETCH_TOP_N) != 0 ||
+            space_saving_init(&g_security_ctx->top_prefixes, SKETCH_TOP_N) != 0) {
+            fprintf(stderr, "Failed to allocate heavy-hitter sketches\n");
+            count_min_free(&g_security_ctx->source_sketch);
+            count_min_free(&g_security_ctx->prefix_sketch);
+            space_saving_free(&g_security_ctx->top_sources);
+            space_saving_free(&g_security_ctx->top_prefixes);
+            free(g_security_ctx->ip_table);
+            free(g_security_ctx->asn_table);
+            free(g_security_ctx->countries);
+            free(g_security_ctx);
+            g_security_ctx = NULL;
+            return -1;
+        }
+        g_security_ctx->sketch_window_start = now_seconds();
+    }
+
+    // Setup incremental cleanup timer; without a context the caller steps the cleanup with security_tick()
     h2o_timer_init(&g_security_ctx->cleanup_timer, cleanup_expired_entries);
-    h2o_timer_link(ctx->loop, CLEANUP_INTERVAL_MS, &g_security_ctx->cleanup_timer);
+    if (ctx != NULL)
+        h2o_timer_link(ctx->loop, SWEEP_INTERVAL_MS, &g_security_ctx->cleanup_timer);
 
     printf("Security module initialized:\n");
+    printf("  IP table buckets: %u\n", g_security_ctx->table_size);
     printf("  Max connections per IP: %u\n", g_security_ctx->config.max_connections_per_ip);
     printf("  Max requests per second: %u\n", g_security_ctx->config.max_requests_per_second);
     printf("  Ban duration: %u seconds\n", g_security_ctx->config.ban_duration_seconds);
     printf("  Rate limiting: %s\n", g_security_ctx->config.enable_rate_limiting ? "enabled" : "disabled");
     printf("  Auto-ban: %s\n", g_security_ctx->config.enable_auto_ban ? "enabled" : "disabled");
+    if (g_security_ctx->config.sketch_source_threshold > 0)
+        printf("  Heavy-hitter sketch: source >= %u, prefix >= %u events per window\n",
+               g_security_ctx->config.sketch_source_threshold, g_security_ctx->config.sketch_prefix_threshold);
+    else
+        printf("  Heavy-hitter sketch: disabled (every source is tracked)\n");
+    printf("  Geo policies: %zu\n", g_security_ctx->config.num_geo_policies);
 
     return 0;
 }
@@ -65,11 +159,13 @@ void security_cleanup(void)
     if (g_security_ctx == NULL)
         return;
 
-    h2o_timer_unlink(&g_security_ctx->cleanup_timer);
+    if (g_security_ctx->h2o_ctx != NULL)
+        h2o_timer_unlink(&g_security_ctx->cleanup_timer);
 
-    // Free all entries
-    for (uint32_t i = 0; i < g_security_ctx->table_size; i++) {
-        ip_tracker_entry_t *entry = g_security_ctx->ip_table[i];
+    // Free all entries, including those a growth has not moved yet
+    for (uint32_t i = 0; i < g_security_ctx->table_size + g_security_ctx->old_table_size; i++) {
+        ip_tracker_entry_t *entry = i < g_security_ctx->table_size ? g_security_ctx->ip_table[i]
+                                                                   : g_security_ctx->old_table[i - g_security_ctx->table_size];
         while (entry != NULL) {
             ip_tracker_entry_t *next = entry->next;
             free(entry);
@@ -77,7 +173,26 @@ void security_cleanup(void)
         }
     }
 
+    for (uint32_t i = 0; i < ASN_TABLE_SIZE; i++) {
+        geo_counter_t *counter = g_security_ctx->asn_table[i];
+        while (counter != NULL) {
+            geo_counter_t *next = counter->next;
+            free(counter);
+            counter = next;
+        }
+    }
+
+    if (g_security_ctx->snapshot != NULL)
+        security_snapshot_end(g_security_ctx->snapshot);
+
+    count_min_free(&g_security_ctx->source_sketch);
+    count_min_free(&g_security_ctx->prefix_sketch);
+    space_saving_free(&g_security_ctx->top_sources);
+    space_saving_free(&g_security_ctx->top_prefixes);
     free(g_security_ctx->ip_table);
+    free(g_security_ctx->old_table);
+    free(g_security_ctx->asn_table);
+    free(g_security_ctx->countries);
     free(g_security_ctx);
     g_security_ctx = NULL;
 }
@@ -95,7 +210,14 @@ static uint32_t hash_sockaddr(const struct sockaddr *addr)
         hash = words[0] ^ words[1] ^ words[2] ^ words[3];
     }
 
-    return hash % g_security_ctx->table_size;
+    // Mix all bits (murmur3 finalizer); the raw address would put whole /16s into one bucket
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6b;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35;
+    hash ^= hash >> 16;
+
+    return hash;  // Reduced modulo the table size by the caller
 }
 
 static int sockaddr_equals(const struct sockaddr_storage *a, const struct sockaddr *b)
@@ -116,67 +238,355 @@ static int sockaddr_equals(const struct sockaddr_storage *a, const struct sockad
     return 0;
 }
 
-static ip_tracker_entry_t *find_or_create_entry(const struct sockaddr *addr)
+static ip_tracker_entry_t *find_in_chain(ip_tracker_entry_t *entry, const struct sockaddr *addr)
 {
-    uint32_t hash = hash_sockaddr(addr);
-    ip_tracker_entry_t *entry = g_security_ctx->ip_table[hash];
-
-    // Search for existing entry
     while (entry != NULL) {
         if (sockaddr_equals(&entry->addr, addr))
             return entry;
         entry = entry->next;
     }
 
-    // Create new entry
-    entry = calloc(1, sizeof(ip_tracker_entry_t));
+    return NULL;
+}
+
+static ip_tracker_entry_t *find_entry(const struct sockaddr *addr)
+{
+    uint32_t hash = hash_sockaddr(addr);
+    ip_tracker_entry_t *entry = find_in_chain(g_security_ctx->ip_table[hash % g_security_ctx->table_size], addr);
+
+    // While the table grows, entries not moved yet are still in the old one
+    if (entry == NULL && g_security_ctx->old_table != NULL)
+        entry = find_in_chain(g_security_ctx->old_table[hash % g_security_ctx->old_table_size], addr);
+    return entry;
+}
+
+// Spread one full pass over SWEEP_PERIOD_MS worth of steps
+static uint32_t sweep_buckets_per_step(uint32_t table_size)
+{
+    return (uint32_t)(((uint64_t)table_size * SWEEP_INTERVAL_MS + SWEEP_PERIOD_MS - 1) / SWEEP_PERIOD_MS);
+}
+
+// Move up to max entries from the old table into the grown one; frees the old table once it is empty
+static void migrate_entries(uint32_t max)
+{
+    while (g_security_ctx->old_table != NULL && max > 0) {
+        ip_tracker_entry_t **slot = &g_security_ctx->old_table[g_security_ctx->migrate_cursor];
+
+        for (; *slot != NULL && max > 0; max--) {
+            ip_tracker_entry_t *entry = *slot;
+            *slot = entry->next;
+            entry->bucket = hash_sockaddr((struct sockaddr *)&entry->addr) % g_security_ctx->table_size;
+            entry->next = g_security_ctx->ip_table[entry->bucket];
+            g_security_ctx->ip_table[entry->bucket] = entry;
+        }
+        if (*slot == NULL && ++g_security_ctx->migrate_cursor == g_security_ctx->old_table_size) {
+            free(g_security_ctx->old_table);
+            g_security_ctx->old_table = NULL;
+            g_security_ctx->old_table_size = 0;
+        }
+    }
+}
+
+// Double the table so chains stay short as more sources are tracked. Entries move over a few at a time, so
+// no single insert pays for the whole table. Not while an export runs, since its cursor is a bucket index.
+static void grow_table(void)
+{
+    ip_tracker_entry_t **table = calloc((size_t)g_security_ctx->table_size * 2, sizeof(*table));
+
+    if (table == NULL)
+        return;  // Keep the longer chains
+
+    g_security_ctx->old_table = g_security_ctx->ip_table;
+    g_security_ctx->old_table_size = g_security_ctx->table_size;
+    g_security_ctx->migrate_cursor = 0;
+    g_security_ctx->ip_table = table;
+    g_security_ctx->table_size *= 2;
+
+    // The sweep carries on at the same bucket index of the new table, from the head of its chain
+    g_security_ctx->sweep_position = 0;
+    g_security_ctx->sweep_buckets_per_step = sweep_buckets_per_step(g_security_ctx->table_size);
+    printf("Security: growing the IP table to %u buckets for %u entries\n", g_security_ctx->table_size,
+           g_security_ctx->tracked_entries);
+}
+
+static ip_tracker_entry_t *create_entry(const struct sockaddr *addr)
+{
+    // Each insert moves more entries than it adds, so a growth is over long before the next one is due
+    if (g_security_ctx->old_table != NULL)
+        migrate_entries(MIGRATE_STEP_ENTRIES);
+    else if (g_security_ctx->tracked_entries >= (uint64_t)g_security_ctx->table_size * MAX_LOAD_FACTOR &&
+             g_security_ctx->table_size <= MAX_TABLE_SIZE / 2 && g_security_ctx->snapshot == NULL)
+        grow_table();
+
+    uint32_t hash = hash_sockaddr(addr) % g_security_ctx->table_size;
+    ip_tracker_entry_t *entry = calloc(1, sizeof(ip_tracker_entry_t));
     if (entry == NULL)
         return NULL;
 
-    memcpy(&entry->addr, addr, sizeof(struct sockaddr_storage));
+    memcpy(&entry->addr, addr, addr->sa_family == AF_INET6 ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in));
     entry->connection_count = 0;
     entry->request_count = 0;
-    entry->window_start = time(NULL);
+    entry->window_start = now_seconds();
     entry->ban_until = 0;
     entry->strike_count = 0;
+    entry->bucket = hash;
+    entry->created_epoch = g_security_ctx->epoch;
 
     // Insert at head of list
     entry->next = g_security_ctx->ip_table[hash];
     g_security_ctx->ip_table[hash] = entry;
+    g_security_ctx->tracked_entries++;
 
     return entry;
 }
 
+static ip_tracker_entry_t *find_or_create_entry(const struct sockaddr *addr)
+{
+    ip_tracker_entry_t *entry = find_entry(addr);
+    return entry != NULL ? entry : create_entry(addr);
+}
+
+// Sketch key: family tag followed by the address, or by its /24 (IPv4) or /48 (IPv6) prefix
+static size_t sketch_key(const struct sockaddr *addr, int prefix, uint8_t *key)
+{
+    if (addr->sa_family == AF_INET) {
+        key[0] = prefix ? 0x84 : 0x04;
+        memcpy(key + 1, &((const struct sockaddr_in *)addr)->sin_addr, prefix ? 3 : 4);
+        return prefix ? 4 : 5;
+    } else if (addr->sa_family == AF_INET6) {
+        key[0] = prefix ? 0x86 : 0x06;
+        memcpy(key + 1, &((const struct sockaddr_in6 *)addr)->sin6_addr, prefix ? 6 : 16);
+        return prefix ? 7 : 17;
+    }
+
+    return 0;
+}
+
+// Count one connection or request for the source and its prefix; returns 1 if the source should be tracked
+// exactly. Connections and requests are counted under separate source keys, so estimate only ever counts
+// events of the given kind.
+static int sketch_observe(const struct sockaddr *addr, int connection, uint32_t *estimate)
+{
+    uint8_t key[SKETCH_MAX_KEY];
+    size_t len;
+    uint64_t hash;
+    uint32_t source_threshold = g_security_ctx->config.sketch_source_threshold;
+    uint32_t prefix_threshold = g_security_ctx->config.sketch_prefix_threshold;
+
+    *estimate = 0;
+    if (source_threshold == 0)
+        return 1;  // Sketch layer disabled
+
+    if ((len = sketch_key(addr, 0, key)) == 0)
+        return 1;
+    if (connection)
+        key[0] |= SKETCH_KEY_CONNECTION;
+    hash = sketch_hash(key, len);
+    *estimate = count_min_add(&g_security_ctx->source_sketch, hash, 1);
+    // Only keys past half the threshold compete for a top-N slot, so one-off sources cannot churn the summary.
+    // The summary ranks sources by both kinds of events, under the untagged key.
+    if (*estimate >= source_threshold / 2) {
+        if (connection) {
+            key[0] &= ~SKETCH_KEY_CONNECTION;
+            hash = sketch_hash(key, len);
+        }
+        space_saving_add(&g_security_ctx->top_sources, hash, key, len, 1);
+    }
+
+    len = sketch_key(addr, 1, key);
+    hash = sketch_hash(key, len);
+    uint32_t prefix_estimate = count_min_add(&g_security_ctx->prefix_sketch, hash, 1);
+    if (prefix_estimate >= (prefix_threshold > 0 ? prefix_threshold : source_threshold) / 2)
+        space_saving_add(&g_security_ctx->top_prefixes, hash, key, len, 1);
+
+    return *estimate >= source_threshold || (prefix_threshold > 0 && prefix_estimate >= prefix_threshold);
+}
+
+// Copy-on-write for a running export: keep the current state of an entry the export has not reached yet
+static void entry_will_change(ip_tracker_entry_t *entry)
+{
+    security_snapshot_t *snapshot = g_security_ctx->snapshot;
+
+    if (snapshot == NULL || entry->bucket < snapshot->cursor || entry->created_epoch == snapshot->epoch ||
+        entry->cow_epoch == snapshot->epoch)
+        return;
+
+    ip_tracker_entry_t *copy = malloc(sizeof(*copy));
+    if (copy == NULL)
+        return;  // The export will see the changed entry instead
+
+    *copy = *entry;
+    copy->next = snapshot->preserved;
+    snapshot->preserved = copy;
+    entry->cow_epoch = snapshot->epoch;
+}
+
 static void remove_entry(const struct sockaddr *addr)
 {
     uint32_t hash = hash_sockaddr(addr);
-    ip_tracker_entry_t **entry_ptr = &g_security_ctx->ip_table[hash];
+    ip_tracker_entry_t **entry_ptr = &g_security_ctx->ip_table[hash % g_security_ctx->table_size];
 
-    while (*entry_ptr != NULL) {
-        if (sockaddr_equals(&(*entry_ptr)->addr, addr)) {
-            ip_tracker_entry_t *to_remove = *entry_ptr;
-            *entry_ptr = to_remove->next;
-            free(to_remove);
+    for (int table = 0; table < 2; table++) {
+        while (*entry_ptr != NULL) {
+            if (sockaddr_equals(&(*entry_ptr)->addr, addr)) {
+                ip_tracker_entry_t *to_remove = *entry_ptr;
+                entry_will_change(to_remove);
+                *entry_ptr = to_remove->next;
+                free(to_remove);
+                g_security_ctx->tracked_entries--;
+                return;
+            }
+            entry_ptr = &(*entry_ptr)->next;
+        }
+        if (g_security_ctx->old_table == NULL)
             return;
+        entry_ptr = &g_security_ctx->old_table[hash % g_security_ctx->old_table_size];
+    }
+}
+
+static int country_index(const char *code)
+{
+    if (code == NULL || code[0] < 'A' || code[0] > 'Z' || code[1] < 'A' || code[1] > 'Z' || code[2] != '\0')
+        return -1;
+    return (code[0] - 'A') * 26 + (code[1] - 'A');
+}
+
+static geo_counter_t *find_asn_counter(uint32_t asn, int create)
+{
+    geo_counter_t **slot = &g_security_ctx->asn_table[(asn * 0x9e3779b1u) >> 20];
+    const geo_policy_t *policy = NULL;
+
+    for (geo_counter_t *counter = *slot; counter != NULL; counter = counter->next) {
+        if (counter->asn == asn)
+            return counter;
+    }
+    if (!create)
+        return NULL;
+
+    for (size_t i = 0; i < g_security_ctx->config.num_geo_policies; i++) {
+        if (g_security_ctx->config.geo_policies[i].asn == asn) {
+            policy = g_security_ctx->config.geo_policies + i;
+            break;
         }
-        entry_ptr = &(*entry_ptr)->next;
     }
+    // Past the cap only ASNs with a policy get a counter, so a spray of ASNs cannot exhaust memory
+    if (policy == NULL && g_security_ctx->asn_entries >= MAX_ASN_COUNTERS)
+        return NULL;
+
+    geo_counter_t *counter = calloc(1, sizeof(*counter));
+    if (counter == NULL)
+        return NULL;
+    counter->asn = asn;
+    counter->policy = policy;
+    counter->window_start = now_seconds();
+    counter->next = *slot;
+    *slot = counter;
+    g_security_ctx->asn_entries++;
+    return counter;
 }
 
-int security_check_connection(const struct sockaddr *addr)
+// Counters of the peer's ASN and country; either is NULL when unknown
+static void find_geo_counters(const geoip_info_t *geo, int create, geo_counter_t **counters)
 {
+    int country = country_index(geo->country);
+
+    counters[0] = geo->asn != 0 ? find_asn_counter(geo->asn, create) : NULL;
+    counters[1] = country >= 0 ? &g_security_ctx->countries[country] : NULL;
+}
+
+static int geo_admit_connection(const geoip_info_t *geo)
+{
+    geo_counter_t *counters[2];
+    int allowed = 1;
+
+    find_geo_counters(geo, 1, counters);
+    for (int i = 0; i < 2; i++) {
+        geo_counter_t *counter = counters[i];
+        if (counter != NULL && counter->policy != NULL && counter->policy->max_connections != 0 &&
+            counter->connection_count >= counter->policy->max_connections) {
+            counter->blocked++;
+            allowed = 0;
+        }
+    }
+    if (!allowed)
+        g_security_ctx->geo_blocked++;
+    return allowed;
+}
+
+static int geo_admit_request(const geoip_info_t *geo, time_t now)
+{
+    geo_counter_t *counters[2];
+    int allowed = 1;
+
+    find_geo_counters(geo, 1, counters);
+    for (int i = 0; i < 2; i++) {
+        geo_counter_t *counter = counters[i];
+        if (counter == NULL)
+            continue;
+        if (now - counter->window_start >= g_security_ctx->config.request_window_seconds) {
+            counter->window_start = now;
+            counter->request_count = 0;
+        }
+        counter->request_count++;
+        counter->total_requests++;
+        if (counter->policy != NULL && counter->policy->max_requests_per_second != 0 &&
+            counter->request_count > counter->policy->max_requests_per_second) {
+            counter->blocked++;
+            allowed = 0;
+        }
+    }
+    if (!allowed)
+        g_security_ctx->geo_blocked++;
+    return allowed;
+}
+
+static void geo_count_connection(const geoip_info_t *geo, int delta)
+{
+    geo_counter_t *counters[2];
+
+    find_geo_counters(geo, delta > 0, counters);
+    for (int i = 0; i < 2; i++) {
+        // Counters with open connections are never swept, but may have been reset since the connection was counted
+        if (counters[i] != NULL && (delta > 0 || counters[i]->connection_count > 0))
+            counters[i]->connection_count += delta;
+    }
+}
+
+static int check_connection(const struct sockaddr *addr)
+{
+    geoip_info_t geo;
+
     if (g_security_ctx == NULL)
         return 1;  // Allow if security not initialized
 
+    // Looked up before taking the lock; the lookup has its own
+    int located = geoip_lookup(addr, &geo);
+
     pthread_mutex_lock(&g_security_mutex);
 
-    ip_tracker_entry_t *entry = find_or_create_entry(addr);
+    // Aggregate limits cover every source, including the light ones the sketch does not track
+    if (located && !geo_admit_connection(&geo)) {
+        g_security_ctx->total_blocked_requests++;
+        pthread_mutex_unlock(&g_security_mutex);
+        return 0;  // Blocked
+    }
+
+    uint32_t estimate;
+    int heavy = sketch_observe(addr, 1, &estimate);
+    // No state for sources that have not proven they are real while challenge mode is on
+    int create = heavy && !g_security_ctx->challenge_mode;
+    ip_tracker_entry_t *entry = create ? find_or_create_entry(addr) : find_entry(addr);
     if (entry == NULL) {
+        if (!heavy)
+            g_security_ctx->untracked_decisions++;
         pthread_mutex_unlock(&g_security_mutex);
-        return 1;  // Allow on allocation failure
+        return 1;  // Light sources without open connections are not tracked; also allow on allocation failure
     }
 
-    time_t now = time(NULL);
+    entry_will_change(entry);
+    if (heavy)
+        entry->connection_only = 0;
+    time_t now = now_seconds();
 
     // Check if IP is banned
     if (entry->ban_until > 0 && now < entry->ban_until) {
@@ -210,6 +620,7 @@ int security_check_connection(const struct sockaddr *addr)
             }
             printf("Auto-banned IP %s for %u seconds (connection limit exceeded)\n",
                    ip_str, g_security_ctx->config.ban_duration_seconds);
+            GROWTOPIA_TRACE(ban, addr, g_security_ctx->config.ban_duration_seconds, 0);
         }
         
         g_security_ctx->total_blocked_requests++;
@@ -221,60 +632,139 @@ int security_check_connection(const struct sockaddr *addr)
     return 1;  // Allowed
 }
 
-int security_register_connection(const struct sockaddr *addr)
+int security_check_connection(const struct sockaddr *addr)
+{
+    if (!GROWTOPIA_TRACE_ENABLED(connection_check))
+        return check_connection(addr);
+
+    uint64_t start = growtopia_trace_now_ns();
+    int allowed = check_connection(addr);
+    GROWTOPIA_TRACE(connection_check, addr, allowed, growtopia_trace_now_ns() - start);
+    return allowed;
+}
+
+int security_register_connection(const struct sockaddr *addr, security_connection_t *conn)
 {
+    memset(conn, 0, sizeof(*conn));
+    memcpy(&conn->addr, addr, addr->sa_family == AF_INET6 ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in));
+
     if (g_security_ctx == NULL)
         return 0;
 
+    geoip_lookup(addr, &conn->geo);
+
     pthread_mutex_lock(&g_security_mutex);
 
-    ip_tracker_entry_t *entry = find_or_create_entry(addr);
+    geo_count_connection(&conn->geo, 1);
+
+    // With the connection limit on, every source with open connections has an entry, so the limit also applies
+    // to sources the sketch has not promoted. Entries made here for them go away with their last connection.
+    // Otherwise only the entries of promoted sources count connections, so the table holds heavy hitters alone.
+    // Challenge mode keeps no state for unverified sources.
+    ip_tracker_entry_t *entry = find_entry(addr);
+    if (entry == NULL && g_security_ctx->config.enable_connection_limit && !g_security_ctx->challenge_mode) {
+        if ((entry = create_entry(addr)) == NULL) {
+            pthread_mutex_unlock(&g_security_mutex);
+            return -1;
+        }
+        entry->connection_only = g_security_ctx->config.sketch_source_threshold > 0;
+    }
     if (entry == NULL) {
         pthread_mutex_unlock(&g_security_mutex);
-        return -1;
+        return 0;
     }
 
+    entry_will_change(entry);
     entry->connection_count++;
     pthread_mutex_unlock(&g_security_mutex);
     return 0;
 }
 
-void security_unregister_connection(const struct sockaddr *addr)
+void security_unregister_connection(const security_connection_t *conn)
 {
+    const struct sockaddr *addr = (const struct sockaddr *)&conn->addr;
+
     if (g_security_ctx == NULL)
         return;
 
     pthread_mutex_lock(&g_security_mutex);
 
-    ip_tracker_entry_t *entry = find_or_create_entry(addr);
+    // Released from the counters found at registration, not from a fresh lookup that may disagree after a reload
+    geo_count_connection(&conn->geo, -1);
+
+    ip_tracker_entry_t *entry = find_entry(addr);
     if (entry == NULL) {
         pthread_mutex_unlock(&g_security_mutex);
         return;
     }
 
-    if (entry->connection_count > 0)
+    if (entry->connection_count > 0) {
+        entry_will_change(entry);
         entry->connection_count--;
-    
+    }
+    if (entry->connection_only && entry->connection_count == 0 && entry->ban_until == 0 && entry->strike_count == 0)
+        remove_entry(addr);
+
     pthread_mutex_unlock(&g_security_mutex);
 }
 
-int security_check_request(const struct sockaddr *addr)
+static int check_request(const struct sockaddr *addr)
 {
-    if (g_security_ctx == NULL || !g_security_ctx->config.enable_rate_limiting)
+    geoip_info_t geo;
+
+    if (g_security_ctx == NULL)
+        return 1;
+
+    int located = geoip_lookup(addr, &geo);
+    if (!located && !g_security_ctx->config.enable_rate_limiting)
         return 1;  // Allow if rate limiting disabled
 
-    ip_tracker_entry_t *entry = find_or_create_entry(addr);
-    if (entry == NULL)
-        return 1;  // Allow on allocation failure
+    pthread_mutex_lock(&g_security_mutex);
 
-    time_t now = time(NULL);
+    time_t now = now_seconds();
+
+    // ASN and country requests are counted, and their policies enforced, even with per-IP limiting off
+    if (located && !geo_admit_request(&geo, now)) {
+        g_security_ctx->total_blocked_requests++;
+        pthread_mutex_unlock(&g_security_mutex);
+        return 0;  // Blocked
+    }
+    if (!g_security_ctx->config.enable_rate_limiting) {
+        pthread_mutex_unlock(&g_security_mutex);
+        return 1;
+    }
+
+    uint32_t estimate;
+    int heavy = sketch_observe(addr, 0, &estimate);
+    ip_tracker_entry_t *entry = find_entry(addr);
+    // An entry that only counts connections leaves the requests to the sketch until the source is promoted
+    int untracked = entry == NULL || (entry->connection_only && entry->ban_until == 0);
+    if (untracked && !heavy) {
+        g_security_ctx->untracked_decisions++;
+        pthread_mutex_unlock(&g_security_mutex);
+        return 1;  // Light source, no exact state needed
+    }
+    if (entry == NULL && (entry = create_entry(addr)) == NULL) {
+        pthread_mutex_unlock(&g_security_mutex);
+        return 1;  // Allow on allocation failure
+    }
+    if (untracked) {
+        // Carry over the requests the sketch already counted in this window
+        entry_will_change(entry);
+        entry->connection_only = 0;
+        entry->window_start = now;
+        entry->request_count = estimate > 0 ? estimate - 1 : 0;
+    }
 
     // Check if IP is banned
     if (entry->ban_until > 0 && now < entry->ban_until) {
         g_security_ctx->total_blocked_requests++;
+        pthread_mutex_unlock(&g_security_mutex);
         return 0;  // Blocked
     }
 
+    entry_will_change(entry);
+
     // Reset window if expired
     if (now - entry->window_start >= g_security_ctx->config.request_window_seconds) {
         entry->window_start = now;
@@ -301,28 +791,79 @@ int security_check_request(const struct sockaddr *addr)
             }
             printf("Auto-banned IP %s for %u seconds (rate limit exceeded)\n",
                    ip_str, g_security_ctx->config.ban_duration_seconds);
+            GROWTOPIA_TRACE(ban, addr, g_security_ctx->config.ban_duration_seconds, 0);
         }
         
         g_security_ctx->total_blocked_requests++;
+        pthread_mutex_unlock(&g_security_mutex);
         return 0;  // Blocked
     }
 
+    pthread_mutex_unlock(&g_security_mutex);
     return 1;  // Allowed
 }
 
-int security_ban_ip(const struct sockaddr *addr, uint32_t duration_seconds)
+int security_check_request(const struct sockaddr *addr)
 {
-    if (g_security_ctx == NULL)
-        return -1;
+    if (!GROWTOPIA_TRACE_ENABLED(request_check))
+        return check_request(addr);
 
+    uint64_t start = growtopia_trace_now_ns();
+    int allowed = check_request(addr);
+    GROWTOPIA_TRACE(request_check, addr, allowed, growtopia_trace_now_ns() - start);
+    return allowed;
+}
+
+// The *_locked helpers expect g_security_mutex to be held
+static int ban_locked(const struct sockaddr *addr, uint32_t duration_seconds, time_t now)
+{
     ip_tracker_entry_t *entry = find_or_create_entry(addr);
     if (entry == NULL)
         return -1;
 
-    time_t now = time(NULL);
+    entry_will_change(entry);
     entry->ban_until = duration_seconds > 0 ? now + duration_seconds : UINT32_MAX;
     g_security_ctx->total_banned_ips++;
+    GROWTOPIA_TRACE(ban, addr, duration_seconds, 1);
+    return 0;
+}
 
+static int unban_locked(const struct sockaddr *addr)
+{
+    ip_tracker_entry_t *entry = find_entry(addr);
+    if (entry == NULL)
+        return 0;  // Not tracked, so not banned
+
+    entry_will_change(entry);
+    entry->ban_until = 0;
+    entry->strike_count = 0;
+    return 0;
+}
+
+static int inspect_locked(const struct sockaddr *addr, security_entry_info_t *info)
+{
+    ip_tracker_entry_t *entry = find_entry(addr);
+
+    memset(info, 0, sizeof(*info));
+    memcpy(&info->addr, addr, addr->sa_family == AF_INET6 ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in));
+    if (g_security_ctx->config.sketch_source_threshold > 0) {
+        uint8_t key[SKETCH_MAX_KEY];
+        size_t len = sketch_key(addr, 0, key);
+        if (len != 0)
+            info->estimate = count_min_estimate(&g_security_ctx->source_sketch, sketch_hash(key, len));
+    }
+    if (entry == NULL)
+        return 0;
+
+    info->connection_count = entry->connection_count;
+    info->request_count = entry->request_count;
+    info->strike_count = entry->strike_count;
+    info->ban_until = entry->ban_until;
+    return 1;
+}
+
+static void log_manual_ban(const struct sockaddr *addr, uint32_t duration_seconds)
+{
     char ip_str[INET6_ADDRSTRLEN];
     if (addr->sa_family == AF_INET) {
         inet_ntop(AF_INET, &((struct sockaddr_in *)addr)->sin_addr, ip_str, sizeof(ip_str));
@@ -330,8 +871,20 @@ int security_ban_ip(const struct sockaddr *addr, uint32_t duration_seconds)
         inet_ntop(AF_INET6, &((struct sockaddr_in6 *)addr)->sin6_addr, ip_str, sizeof(ip_str));
     }
     printf("Manually banned IP %s for %u seconds\n", ip_str, duration_seconds);
+}
 
-    return 0;
+int security_ban_ip(const struct sockaddr *addr, uint32_t duration_seconds)
+{
+    if (g_security_ctx == NULL)
+        return -1;
+
+    pthread_mutex_lock(&g_security_mutex);
+    int ret = ban_locked(addr, duration_seconds, now_seconds());
+    pthread_mutex_unlock(&g_security_mutex);
+
+    if (ret == 0)
+        log_manual_ban(addr, duration_seconds);
+    return ret;
 }
 
 int security_unban_ip(const struct sockaddr *addr)
@@ -339,44 +892,179 @@ int security_unban_ip(const struct sockaddr *addr)
     if (g_security_ctx == NULL)
         return -1;
 
-    ip_tracker_entry_t *entry = find_or_create_entry(addr);
-    if (entry == NULL)
-        return -1;
+    pthread_mutex_lock(&g_security_mutex);
+    int ret = unban_locked(addr);
+    pthread_mutex_unlock(&g_security_mutex);
+    return ret;
+}
 
-    entry->ban_until = 0;
-    entry->strike_count = 0;
+int security_is_banned(const struct sockaddr *addr)
+{
+    if (g_security_ctx == NULL)
+        return 0;
 
-    return 0;
+    pthread_mutex_lock(&g_security_mutex);
+    ip_tracker_entry_t *entry = find_entry(addr);
+    int banned = entry != NULL && entry->ban_until > 0 && now_seconds() < entry->ban_until;
+    pthread_mutex_unlock(&g_security_mutex);
+    return banned;
 }
 
-int security_is_banned(const struct sockaddr *addr)
+int security_whitelist_ip(const struct sockaddr *addr)
 {
     if (g_security_ctx == NULL)
+        return -1;
+
+    // No exemption flag yet; whitelisting clears any ban and strikes
+    return security_unban_ip(addr);
+}
+
+int security_inspect_ip(const struct sockaddr *addr, security_entry_info_t *info)
+{
+    if (g_security_ctx == NULL) {
+        memset(info, 0, sizeof(*info));
         return 0;
+    }
 
-    ip_tracker_entry_t *entry = find_or_create_entry(addr);
-    if (entry == NULL)
+    pthread_mutex_lock(&g_security_mutex);
+    int tracked = inspect_locked(addr, info);
+    pthread_mutex_unlock(&g_security_mutex);
+    return tracked;
+}
+
+size_t security_apply_batch(security_op_t *ops, size_t count)
+{
+    size_t bans = 0, applied = 0;
+
+    if (g_security_ctx == NULL) {
+        for (size_t i = 0; i < count; i++)
+            ops[i].result = -1;
         return 0;
+    }
+
+    // One lock for the whole batch, so thousands of bans cost one acquisition
+    pthread_mutex_lock(&g_security_mutex);
+    time_t now = now_seconds();
+    for (size_t i = 0; i < count; i++) {
+        security_op_t *op = ops + i;
+        const struct sockaddr *addr = (const struct sockaddr *)&op->addr;
+        switch (op->type) {
+        case SECURITY_OP_BAN:
+            if ((op->result = ban_locked(addr, op->duration_seconds, now)) == 0)
+                bans++;
+            break;
+        case SECURITY_OP_UNBAN:
+        case SECURITY_OP_WHITELIST:
+            op->result = unban_locked(addr);
+            break;
+        case SECURITY_OP_INSPECT:
+            op->result = inspect_locked(addr, &op->info);
+            break;
+        default:
+            op->result = -1;
+            break;
+        }
+        if (op->result >= 0)
+            applied++;
+    }
+    pthread_mutex_unlock(&g_security_mutex);
 
-    time_t now = time(NULL);
-    return (entry->ban_until > 0 && now < entry->ban_until);
+    if (bans > 0)
+        printf("Manually banned %zu IPs (batch)\n", bans);
+    return applied;
 }
 
-int security_whitelist_ip(const struct sockaddr *addr)
+security_snapshot_t *security_snapshot_begin(void)
 {
+    security_snapshot_t *snapshot;
+
     if (g_security_ctx == NULL)
-        return -1;
+        return NULL;
 
-    ip_tracker_entry_t *entry = find_or_create_entry(addr);
-    if (entry == NULL)
-        return -1;
+    pthread_mutex_lock(&g_security_mutex);
+    if (g_security_ctx->snapshot != NULL || (snapshot = calloc(1, sizeof(*snapshot))) == NULL) {
+        pthread_mutex_unlock(&g_security_mutex);
+        return NULL;
+    }
+    // The export walks one table by bucket index, so a growth in progress is completed first
+    migrate_entries(UINT32_MAX);
+    // Entries created from here on carry the new epoch and are left out of this snapshot
+    snapshot->epoch = ++g_security_ctx->epoch;
+    g_security_ctx->snapshot = snapshot;
+    pthread_mutex_unlock(&g_security_mutex);
 
-    // Set very high limits for whitelisted IPs
-    entry->ban_until = 0;
-    entry->strike_count = 0;
-    // Could add a flag to mark as whitelisted for complete exemption
+    return snapshot;
+}
 
-    return 0;
+static void emit_entry(const ip_tracker_entry_t *entry, security_entry_cb cb, void *data)
+{
+    security_entry_info_t info = {0};
+
+    info.addr = entry->addr;
+    info.connection_count = entry->connection_count;
+    info.request_count = entry->request_count;
+    info.strike_count = entry->strike_count;
+    info.ban_until = entry->ban_until;
+    cb(&info, data);
+}
+
+int security_snapshot_next(security_snapshot_t *snapshot, size_t max_entries, security_entry_cb cb, void *data)
+{
+    size_t emitted = 0;
+    uint32_t buckets = 0;
+
+    pthread_mutex_lock(&g_security_mutex);
+
+    // Whole buckets at a time, so the cursor cleanly separates emitted and pending entries
+    while (emitted < max_entries && buckets++ < SNAPSHOT_MAX_BUCKETS &&
+           snapshot->cursor < g_security_ctx->table_size) {
+        for (ip_tracker_entry_t *entry = g_security_ctx->ip_table[snapshot->cursor]; entry != NULL; entry = entry->next) {
+            if (entry->created_epoch == snapshot->epoch || entry->cow_epoch == snapshot->epoch)
+                continue;  // Created after the snapshot, or its snapshot state was preserved
+            emit_entry(entry, cb, data);
+            emitted++;
+        }
+        snapshot->cursor++;
+    }
+
+    // Then the copies of entries that changed or went away before the cursor reached them
+    while (emitted < max_entries && snapshot->cursor == g_security_ctx->table_size && snapshot->preserved != NULL) {
+        ip_tracker_entry_t *copy = snapshot->preserved;
+        snapshot->preserved = copy->next;
+        emit_entry(copy, cb, data);
+        free(copy);
+        emitted++;
+    }
+
+    int done = snapshot->cursor == g_security_ctx->table_size && snapshot->preserved == NULL;
+    pthread_mutex_unlock(&g_security_mutex);
+
+    return done;
+}
+
+void security_snapshot_end(security_snapshot_t *snapshot)
+{
+    pthread_mutex_lock(&g_security_mutex);
+    if (g_security_ctx != NULL && g_security_ctx->snapshot == snapshot)
+        g_security_ctx->snapshot = NULL;
+    pthread_mutex_unlock(&g_security_mutex);
+
+    while (snapshot->preserved != NULL) {
+        ip_tracker_entry_t *copy = snapshot->preserved;
+        snapshot->preserved = copy->next;
+        free(copy);
+    }
+    free(snapshot);
+}
+
+void security_set_challenge_mode(int enabled)
+{
+    if (g_security_ctx == NULL)
+        return;
+
+    pthread_mutex_lock(&g_security_mutex);
+    g_security_ctx->challenge_mode = enabled != 0;
+    pthread_mutex_unlock(&g_security_mutex);
 }
 
 void security_get_stats(uint64_t *blocked_requests, uint64_t *banned_ips)
@@ -393,46 +1081,185 @@ void security_get_stats(uint64_t *blocked_requests, uint64_t *banned_ips)
         *banned_ips = g_security_ctx->total_banned_ips;
 }
 
-static void cleanup_expired_entries(h2o_timer_t *timer)
+void security_get_sketch_stats(uint32_t *tracked_entries, uint64_t *untracked_decisions)
+{
+    if (tracked_entries)
+        *tracked_entries = g_security_ctx != NULL ? g_security_ctx->tracked_entries : 0;
+    if (untracked_decisions)
+        *untracked_decisions = g_security_ctx != NULL ? g_security_ctx->untracked_decisions : 0;
+}
+
+size_t security_get_top_talkers(int prefixes, security_talker_t *out, size_t max)
+{
+    space_saving_item_t items[SKETCH_TOP_N];
+    size_t n;
+
+    if (g_security_ctx == NULL || g_security_ctx->config.sketch_source_threshold == 0)
+        return 0;
+
+    pthread_mutex_lock(&g_security_mutex);
+    n = space_saving_top(prefixes ? &g_security_ctx->top_prefixes : &g_security_ctx->top_sources, items,
+                         max < SKETCH_TOP_N ? max : SKETCH_TOP_N);
+    pthread_mutex_unlock(&g_security_mutex);
+
+    // Turn sketch keys back into addresses
+    for (size_t i = 0; i < n; i++) {
+        security_talker_t *talker = out + i;
+        memset(talker, 0, sizeof(*talker));
+        if ((items[i].key[0] & 0x7f) == 0x04) {
+            struct sockaddr_in *sin = (struct sockaddr_in *)&talker->addr;
+            sin->sin_family = AF_INET;
+            memcpy(&sin->sin_addr, items[i].key + 1, items[i].key_len - 1);
+            talker->prefix_len = prefixes ? 24 : 32;
+        } else {
+            struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&talker->addr;
+            sin6->sin6_family = AF_INET6;
+            memcpy(&sin6->sin6_addr, items[i].key + 1, items[i].key_len - 1);
+            talker->prefix_len = prefixes ? 48 : 128;
+        }
+        talker->count = items[i].count;
+        talker->error = items[i].error;
+    }
+
+    return n;
+}
+
+size_t security_get_top_asns(security_asn_info_t *out, size_t max)
+{
+    size_t n = 0;
+
+    if (g_security_ctx == NULL || max == 0)
+        return 0;
+
+    pthread_mutex_lock(&g_security_mutex);
+    // Insertion into the sorted output; max is small
+    for (uint32_t i = 0; i < ASN_TABLE_SIZE; i++) {
+        for (const geo_counter_t *counter = g_security_ctx->asn_table[i]; counter != NULL; counter = counter->next) {
+            size_t pos = n;
+            while (pos > 0 && out[pos - 1].total_requests < counter->total_requests)
+                pos--;
+            if (pos == max)
+                continue;
+            memmove(out + pos + 1, out + pos, ((n < max ? n : max - 1) - pos) * sizeof(*out));
+            out[pos].asn = counter->asn;
+            out[pos].connection_count = counter->connection_count;
+            out[pos].request_count = counter->request_count;
+            out[pos].total_requests = counter->total_requests;
+            out[pos].blocked = counter->blocked;
+            out[pos].limited = counter->policy != NULL;
+            if (n < max)
+                n++;
+        }
+    }
+    pthread_mutex_unlock(&g_security_mutex);
+
+    return n;
+}
+
+void security_get_geo_stats(uint32_t *tracked_asns, uint64_t *blocked)
+{
+    if (tracked_asns)
+        *tracked_asns = g_security_ctx != NULL ? g_security_ctx->asn_entries : 0;
+    if (blocked)
+        *blocked = g_security_ctx != NULL ? g_security_ctx->geo_blocked : 0;
+}
+
+void security_tick(void)
 {
     if (g_security_ctx == NULL)
         return;
 
     pthread_mutex_lock(&g_security_mutex);
 
-    time_t now = time(NULL);
-    uint32_t removed_count = 0;
+    time_t now = now_seconds();
+    uint32_t examined = 0;
 
-    for (uint32_t i = 0; i < g_security_ctx->table_size; i++) {
-        ip_tracker_entry_t **entry_ptr = &g_security_ctx->ip_table[i];
+    // Keep a growth moving while no new sources arrive; the sweep only walks the new table
+    migrate_entries(SWEEP_MAX_ENTRIES);
 
-        while (*entry_ptr != NULL) {
+    // Visit a bounded slice of buckets per step so the mutex is never held for a full-table walk. The budget
+    // may run out inside a chain; the next step resumes after the entries this one kept.
+    for (uint32_t n = 0; n < g_security_ctx->sweep_buckets_per_step && examined < SWEEP_MAX_ENTRIES;) {
+        ip_tracker_entry_t **entry_ptr = &g_security_ctx->ip_table[g_security_ctx->sweep_cursor];
+
+        for (uint32_t i = 0; i < g_security_ctx->sweep_position && *entry_ptr != NULL; i++)
+            entry_ptr = &(*entry_ptr)->next;
+
+        while (*entry_ptr != NULL && examined < SWEEP_MAX_ENTRIES) {
             ip_tracker_entry_t *entry = *entry_ptr;
+            examined++;
 
-            // Remove entries that are inactive and not banned
-            int should_remove = 0;
-            if (entry->ban_until == 0 && entry->connection_count == 0) {
-                if (now - entry->window_start > ENTRY_TIMEOUT_SECONDS) {
-                    should_remove = 1;
-                }
+            // Lift expired bans so the entry can age out
+            if (entry->ban_until > 0 && now >= entry->ban_until) {
+                entry_will_change(entry);
+                entry->ban_until = 0;
+                entry->strike_count = 0;
             }
 
-            if (should_remove) {
+            // Remove entries that are inactive and not banned
+            if (entry->ban_until == 0 && entry->connection_count == 0 &&
+                now - entry->window_start > ENTRY_TIMEOUT_SECONDS) {
+                entry_will_change(entry);
                 *entry_ptr = entry->next;
                 free(entry);
-                removed_count++;
+                g_security_ctx->tracked_entries--;
+                g_security_ctx->sweep_removed++;
             } else {
                 entry_ptr = &entry->next;
+                g_security_ctx->sweep_position++;
+            }
+        }
+        if (*entry_ptr != NULL)
+            break;
+
+        n++;
+        g_security_ctx->sweep_position = 0;
+        if (++g_security_ctx->sweep_cursor == g_security_ctx->table_size) {
+            g_security_ctx->sweep_cursor = 0;
+            if (g_security_ctx->sweep_removed > 0) {
+                printf("Security cleanup: removed %u inactive IP entries\n", g_security_ctx->sweep_removed);
+                g_security_ctx->sweep_removed = 0;
+            }
+        }
+    }
+
+    // Idle ASN counters age out like tracker entries, at the same pace through their own table
+    for (uint32_t n = 0; n < (ASN_TABLE_SIZE * SWEEP_INTERVAL_MS + SWEEP_PERIOD_MS - 1) / SWEEP_PERIOD_MS; n++) {
+        geo_counter_t **counter_ptr = &g_security_ctx->asn_table[g_security_ctx->asn_sweep_cursor];
+
+        while (*counter_ptr != NULL) {
+            geo_counter_t *counter = *counter_ptr;
+            if (counter->connection_count == 0 && now - counter->window_start > ENTRY_TIMEOUT_SECONDS) {
+                *counter_ptr = counter->next;
+                free(counter);
+                g_security_ctx->asn_entries--;
+            } else {
+                counter_ptr = &counter->next;
             }
         }
+        g_security_ctx->asn_sweep_cursor = (g_security_ctx->asn_sweep_cursor + 1) % ASN_TABLE_SIZE;
     }
 
-    if (removed_count > 0) {
-        printf("Security cleanup: removed %u inactive IP entries\n", removed_count);
+    // Start a new sketch window; the top-N summaries decay instead of resetting so they stay readable
+    if (g_security_ctx->config.sketch_source_threshold > 0 &&
+        now - g_security_ctx->sketch_window_start >= g_security_ctx->config.request_window_seconds) {
+        count_min_clear(&g_security_ctx->source_sketch);
+        count_min_clear(&g_security_ctx->prefix_sketch);
+        space_saving_decay(&g_security_ctx->top_sources);
+        space_saving_decay(&g_security_ctx->top_prefixes);
+        g_security_ctx->sketch_window_start = now;
     }
 
     pthread_mutex_unlock(&g_security_mutex);
+}
+
+static void cleanup_expired_entries(h2o_timer_t *timer)
+{
+    if (g_security_ctx == NULL)
+        return;
+
+    security_tick();
 
     // Re-arm timer
-    h2o_timer_link(g_security_ctx->h2o_ctx->loop, CLEANUP_INTERVAL_MS, timer);
+    h2o_timer_link(g_security_ctx->h2o_ctx->loop, SWEEP_INTERVAL_MS, timer);
 }
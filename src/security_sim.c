@@ -0,0 +1,539 @@
+/*
+ * Drives the security module with synthetic traffic on a virtual clock.
+ *
+ *   security-sim [-p ramp|pulse|rotate] [-t seconds] [-l legit] [-b bots] [-r rate] [-k threshold] [-T buckets]
+ *                [-s seed] [-i interval] [-v]
+ *
+ * Legitimate clients visit at a human pace; one address in twenty is a NAT gateway carrying forty users.
+ * Bots send -r requests per second each, with one of these profiles:
+ *
+ *   ramp    bots join one after another over the first half of the run (botnet ramp-up)
+ *   pulse   all bots flood for 10 s out of every 40 s, so bans expire and are earned again
+ *   rotate  every bot connection comes from a fresh IPv6 address in the bot's /48
+ *
+ * Virtual time advances in 10 ms steps and the cleanup runs every 100 ms of it, so an hour of traffic
+ * takes seconds. The report covers decisions per second, heap growth of the module, legitimate clients
+ * that were blocked or banned (false positives) and the latency of each operation.
+ */
+#include "growtopia/security.h"
+#include <arpa/inet.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+#define STEP_MS 10
+#define TICK_MS 100                      // The interval of the module's cleanup timer
+#define SIM_EPOCH 1700000000             // Virtual time starts here, in seconds
+#define NAT_EVERY 20                     // One legitimate address in this many is a NAT gateway
+#define NAT_USERS 40                     // Users behind each NAT gateway
+#define VISITS_PER_USER_SECOND 0.2
+#define LEGIT_HOLD_MS 5000               // How long a legitimate connection stays open
+#define BOT_HOLD_MS 20000                // How long a bot connection stays open (rotate: one step)
+#define BOT_REQUESTS_PER_CONNECTION 10
+#define PULSE_PERIOD_S 40
+#define PULSE_ON_S 10
+#define LATENCY_BUCKETS 64
+
+typedef enum { PROFILE_RAMP, PROFILE_PULSE, PROFILE_ROTATE } profile_t;
+
+typedef enum { OP_CONNECTION, OP_REQUEST, OP_TICK, NUM_OPS } op_t;
+
+typedef union {
+    struct sockaddr sa;
+    struct sockaddr_in sin;
+    struct sockaddr_in6 sin6;
+} sim_addr_t;
+
+/* connections closing in one step */
+typedef struct {
+    security_connection_t *conns;
+    size_t size;
+    size_t capacity;
+} close_slot_t;
+
+typedef struct {
+    uint64_t count;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    uint64_t buckets[LATENCY_BUCKETS];   // Bucket i counts operations taking under 2^i ns
+} latency_t;
+
+static struct {
+    profile_t profile;
+    uint32_t seconds;
+    uint32_t legit;
+    uint32_t bots;
+    uint32_t rate;
+    uint32_t sketch_threshold;
+    uint32_t table_size;
+    uint64_t seed;
+    uint32_t interval;
+    int verbose;
+} g_options = {PROFILE_RAMP, 120, 10000, 1000, 200, 20, 65536, 1, 10, 0};
+
+static const char *const g_profile_names[] = {"ramp", "pulse", "rotate"};
+static const char *const g_op_names[] = {"connection check", "request check", "cleanup step"};
+
+static uint64_t g_now_ms = 0;
+static uint64_t g_rng;
+static close_slot_t *g_close_wheel;
+static size_t g_close_slots;
+static size_t g_sim_bytes = 0;           // Heap used by the simulator itself, left out of the module's growth
+static latency_t g_latency[NUM_OPS];
+static uint8_t *g_legit_blocked;         // Per legitimate address: 1 if blocked, 2 if also banned
+
+/* totals */
+static uint64_t g_decisions = 0;
+static uint64_t g_legit_visits = 0;
+static uint64_t g_legit_denied = 0;
+static uint64_t g_bot_visits = 0;
+static uint64_t g_bot_denied = 0;
+
+static time_t sim_clock(void)
+{
+    return (time_t)(SIM_EPOCH + g_now_ms / 1000);
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t next_random(void)
+{
+    g_rng ^= g_rng >> 12;
+    g_rng ^= g_rng << 25;
+    g_rng ^= g_rng >> 27;
+    return g_rng * 0x2545f4914f6cdd1dULL;
+}
+
+static double random_unit(void)
+{
+    return (next_random() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/* events in one step for a mean of expected: the whole part, plus one more with the fraction's odds */
+static uint64_t events_in_step(double expected)
+{
+    uint64_t n = (uint64_t)expected;
+    return n + (random_unit() < expected - (double)n);
+}
+
+static size_t heap_in_use(void)
+{
+#ifdef __GLIBC__
+    return mallinfo2().uordblks;
+#else
+    return 0;
+#endif
+}
+
+/* heap grown since base, leaving out what the simulator allocated for itself */
+static double heap_growth_mib(size_t base)
+{
+    return ((double)heap_in_use() - (double)g_sim_bytes - (double)base) / (1 << 20);
+}
+
+static void record_latency(op_t op, uint64_t ns)
+{
+    latency_t *latency = g_latency + op;
+    unsigned bucket = ns == 0 ? 0 : 64 - __builtin_clzll(ns);
+
+    latency->count++;
+    latency->total_ns += ns;
+    if (ns > latency->max_ns)
+        latency->max_ns = ns;
+    latency->buckets[bucket < LATENCY_BUCKETS ? bucket : LATENCY_BUCKETS - 1]++;
+}
+
+/* upper bound of the bucket holding the given share of operations, so within a factor of two */
+static uint64_t latency_percentile(const latency_t *latency, double share)
+{
+    uint64_t seen = 0, target = (uint64_t)(latency->count * share);
+
+    for (unsigned i = 0; i < LATENCY_BUCKETS - 1; i++) {
+        seen += latency->buckets[i];
+        if (seen > target) {
+            uint64_t bound = i == 0 ? 0 : (uint64_t)1 << i;
+            return bound < latency->max_ns ? bound : latency->max_ns;
+        }
+    }
+    return latency->max_ns;
+}
+
+static int check_connection(const sim_addr_t *addr)
+{
+    uint64_t start = now_ns();
+    int allowed = security_check_connection(&addr->sa);
+    record_latency(OP_CONNECTION, now_ns() - start);
+    return allowed;
+}
+
+static int check_request(const sim_addr_t *addr)
+{
+    uint64_t start = now_ns();
+    int allowed = security_check_request(&addr->sa);
+    record_latency(OP_REQUEST, now_ns() - start);
+    return allowed;
+}
+
+/* reserve the connection's place in the slot it closes in */
+static security_connection_t *schedule_close(uint32_t hold_ms)
+{
+    close_slot_t *slot = g_close_wheel + (g_now_ms + hold_ms) / STEP_MS % g_close_slots;
+
+    if (slot->size == slot->capacity) {
+        size_t capacity = slot->capacity * 2 + 16;
+        security_connection_t *conns = realloc(slot->conns, capacity * sizeof(*conns));
+        if (conns == NULL)
+            return NULL;
+        g_sim_bytes += (capacity - slot->capacity) * sizeof(*conns);
+        slot->conns = conns;
+        slot->capacity = capacity;
+    }
+    return slot->conns + slot->size++;
+}
+
+static void close_due_connections(void)
+{
+    close_slot_t *slot = g_close_wheel + g_now_ms / STEP_MS % g_close_slots;
+
+    for (size_t i = 0; i < slot->size; i++)
+        security_unregister_connection(slot->conns + i);
+    slot->size = 0;
+}
+
+/* one connection: the accept check, then requests until one is refused */
+static int visit(const sim_addr_t *addr, uint32_t requests, uint32_t hold_ms, int legit)
+{
+    int denied = 0;
+
+    g_decisions++;
+    if (!check_connection(addr)) {
+        denied = 1;
+    } else {
+        security_connection_t *conn = schedule_close(hold_ms);
+        if (conn == NULL)
+            return -1;
+        security_register_connection(&addr->sa, conn);
+        for (uint32_t i = 0; i < requests; i++) {
+            g_decisions++;
+            if (!check_request(addr)) {
+                denied = 1;
+                break;
+            }
+        }
+    }
+
+    if (legit) {
+        g_legit_visits++;
+        g_legit_denied += denied;
+    } else {
+        g_bot_visits++;
+        g_bot_denied += denied;
+    }
+    return denied;
+}
+
+static void legit_addr(uint32_t client, sim_addr_t *addr)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->sin.sin_family = AF_INET;
+    addr->sin.sin_addr.s_addr = htonl(0x0a000000 | (client + 1));  // 10.0.0.0/8
+}
+
+static void bot_addr(uint32_t bot, sim_addr_t *addr)
+{
+    memset(addr, 0, sizeof(*addr));
+    if (g_options.profile != PROFILE_ROTATE) {
+        addr->sin.sin_family = AF_INET;
+        addr->sin.sin_addr.s_addr = htonl(0x64400000 | (bot + 1));  // 100.64.0.0/10
+        return;
+    }
+
+    /* 2001:db8:BBBB::/48 per bot, anything below it per connection */
+    uint8_t *bytes = addr->sin6.sin6_addr.s6_addr;
+    uint64_t host = next_random(), subnet = next_random();
+    addr->sin6.sin6_family = AF_INET6;
+    bytes[0] = 0x20;
+    bytes[1] = 0x01;
+    bytes[2] = 0x0d;
+    bytes[3] = 0xb8;
+    bytes[4] = (uint8_t)(bot >> 8);
+    bytes[5] = (uint8_t)bot;
+    memcpy(bytes + 6, &subnet, 2);
+    memcpy(bytes + 8, &host, 8);
+}
+
+static uint32_t active_bots(void)
+{
+    uint64_t ramp_ms = (uint64_t)g_options.seconds * 1000 / 2;
+
+    switch (g_options.profile) {
+    case PROFILE_RAMP:
+        return g_now_ms >= ramp_ms ? g_options.bots : (uint32_t)((uint64_t)g_options.bots * g_now_ms / ramp_ms) + 1;
+    case PROFILE_PULSE:
+        return g_now_ms / 1000 % PULSE_PERIOD_S < PULSE_ON_S ? g_options.bots : 0;
+    default:
+        return g_options.bots;
+    }
+}
+
+static int run_step(void)
+{
+    uint64_t nat_users = (uint64_t)(g_options.legit + NAT_EVERY - 1) / NAT_EVERY * (NAT_USERS - 1);
+    uint64_t users = g_options.legit + nat_users;
+    sim_addr_t addr;
+
+    close_due_connections();
+
+    /* a user picked at random; users past the first legit belong to a NAT gateway */
+    for (uint64_t n = events_in_step(users * VISITS_PER_USER_SECOND * STEP_MS / 1000); n != 0; n--) {
+        uint64_t user = next_random() % users;
+        uint32_t client = user < g_options.legit ? (uint32_t)user : (uint32_t)((user - g_options.legit) / (NAT_USERS - 1)) * NAT_EVERY;
+        legit_addr(client, &addr);
+        int denied = visit(&addr, 1 + next_random() % 8, LEGIT_HOLD_MS, 1);
+        if (denied < 0)
+            return -1;
+        if (denied && g_legit_blocked[client] < 2)
+            g_legit_blocked[client] = security_is_banned(&addr.sa) ? 2 : 1;
+    }
+
+    uint32_t bots = active_bots();
+    double connections = (double)bots * g_options.rate / BOT_REQUESTS_PER_CONNECTION * STEP_MS / 1000;
+    for (uint64_t n = events_in_step(connections); n != 0; n--) {
+        bot_addr((uint32_t)(next_random() % bots), &addr);
+        if (visit(&addr, BOT_REQUESTS_PER_CONNECTION, g_options.profile == PROFILE_ROTATE ? STEP_MS : BOT_HOLD_MS, 0) < 0)
+            return -1;
+    }
+
+    g_now_ms += STEP_MS;
+    if (g_now_ms % TICK_MS == 0) {
+        uint64_t start = now_ns();
+        security_tick();
+        record_latency(OP_TICK, now_ns() - start);
+    }
+    return 0;
+}
+
+static void count_legit_blocked(uint32_t *blocked, uint32_t *banned)
+{
+    *blocked = *banned = 0;
+    for (uint32_t i = 0; i < g_options.legit; i++) {
+        *blocked += g_legit_blocked[i] != 0;
+        *banned += g_legit_blocked[i] == 2;
+    }
+}
+
+static double share(uint64_t part, uint64_t whole)
+{
+    return whole != 0 ? 100.0 * part / whole : 0;
+}
+
+static void usage(const char *cmd)
+{
+    fprintf(stderr,
+            "usage: %s [options]\n"
+            "  -p, --profile NAME    ramp, pulse or rotate (default ramp)\n"
+            "  -t, --seconds N       virtual seconds to simulate (default 120)\n"
+            "  -l, --legit N         legitimate client addresses (default 10000)\n"
+            "  -b, --bots N          attacking bots (default 1000)\n"
+            "  -r, --rate N          requests per second per bot (default 200)\n"
+            "  -k, --sketch N        sketch source threshold, 0 tracks every address (default 20)\n"
+            "  -T, --table-size N    initial tracker hash buckets (default 65536)\n"
+            "  -s, --seed N          random seed (default 1)\n"
+            "  -i, --interval N      virtual seconds between progress lines (default 10)\n"
+            "  -v, --verbose         keep the module's log lines\n",
+            cmd);
+}
+
+static int parse_options(int argc, char **argv)
+{
+    static const struct option longopts[] = {{"profile", required_argument, NULL, 'p'},
+                                             {"seconds", required_argument, NULL, 't'},
+                                             {"legit", required_argument, NULL, 'l'},
+                                             {"bots", required_argument, NULL, 'b'},
+                                             {"rate", required_argument, NULL, 'r'},
+                                             {"sketch", required_argument, NULL, 'k'},
+                                             {"table-size", required_argument, NULL, 'T'},
+                                             {"seed", required_argument, NULL, 's'},
+                                             {"interval", required_argument, NULL, 'i'},
+                                             {"verbose", no_argument, NULL, 'v'},
+                                             {NULL, 0, NULL, 0}};
+    int ch;
+
+    while ((ch = getopt_long(argc, argv, "p:t:l:b:r:k:T:s:i:v", longopts, NULL)) != -1) {
+        switch (ch) {
+        case 'p':
+            for (g_options.profile = 0; g_options.profile <= PROFILE_ROTATE; g_options.profile++) {
+                if (strcmp(optarg, g_profile_names[g_options.profile]) == 0)
+                    break;
+            }
+            if (g_options.profile > PROFILE_ROTATE) {
+                fprintf(stderr, "unknown profile: %s\n", optarg);
+                return -1;
+            }
+            break;
+        case 't':
+            g_options.seconds = (uint32_t)strtoul(optarg, NULL, 10);
+            break;
+        case 'l':
+            g_options.legit = (uint32_t)strtoul(optarg, NULL, 10);
+            break;
+        case 'b':
+            g_options.bots = (uint32_t)strtoul(optarg, NULL, 10);
+            break;
+        case 'r':
+            g_options.rate = (uint32_t)strtoul(optarg, NULL, 10);
+            break;
+        case 'k':
+            g_options.sketch_threshold = (uint32_t)strtoul(optarg, NULL, 10);
+            break;
+        case 'T':
+            g_options.table_size = (uint32_t)strtoul(optarg, NULL, 10);
+            break;
+        case 's':
+            g_options.seed = strtoull(optarg, NULL, 10);
+            break;
+        case 'i':
+            g_options.interval = (uint32_t)strtoul(optarg, NULL, 10);
+            break;
+        case 'v':
+            g_options.verbose = 1;
+            break;
+        default:
+            usage(argv[0]);
+            return -1;
+        }
+    }
+    if (g_options.seconds == 0 || g_options.legit == 0 || g_options.bots == 0 || g_options.bots > 65536 ||
+        g_options.interval == 0) {
+        usage(argv[0]);
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    FILE *report = stdout;
+
+    if (parse_options(argc, argv) != 0)
+        return 1;
+    g_rng = g_options.seed * 0x9e3779b97f4a7c15ULL + 1;
+
+    /* the module logs every ban; keep the report readable unless asked */
+    if (!g_options.verbose) {
+        int fd = dup(STDOUT_FILENO);
+        if (fd < 0 || (report = fdopen(fd, "w")) == NULL || freopen("/dev/null", "w", stdout) == NULL) {
+            perror("failed to redirect stdout");
+            return 1;
+        }
+    }
+
+    security_config_t config = security_get_default_config();
+    config.enable_rate_limiting = 1;
+    config.enable_auto_ban = 1;
+    config.enable_connection_limit = 1;
+    config.ip_table_size = g_options.table_size;
+    config.sketch_source_threshold = g_options.sketch_threshold;
+    if (g_options.sketch_threshold == 0)
+        config.sketch_prefix_threshold = 0;
+
+    g_close_slots = BOT_HOLD_MS / STEP_MS + 1;
+    g_close_wheel = calloc(g_close_slots, sizeof(*g_close_wheel));
+    g_legit_blocked = calloc(g_options.legit, 1);
+    if (g_close_wheel == NULL || g_legit_blocked == NULL) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+
+    security_set_clock(sim_clock);
+    if (security_init(NULL, &config) != 0)
+        return 1;
+
+    fprintf(report, "profile %s: %u legit addresses, %u bots at %u requests/s, %u s virtual\n",
+            g_profile_names[g_options.profile], g_options.legit, g_options.bots, g_options.rate, g_options.seconds);
+    fprintf(report, "limits: %u requests/s, %u connections per address, ban after %u strikes for %u s\n",
+            config.max_requests_per_second, config.max_connections_per_ip, config.strike_threshold,
+            config.ban_duration_seconds);
+
+    size_t heap_base = heap_in_use();
+    double heap_peak = 0;
+    uint64_t wall_start = now_ns();
+    uint32_t tracked_peak = 0;
+
+    while (g_now_ms < (uint64_t)g_options.seconds * 1000) {
+        if (run_step() != 0) {
+            fprintf(stderr, "out of memory\n");
+            return 1;
+        }
+
+        double heap = heap_growth_mib(heap_base);
+        if (heap > heap_peak)
+            heap_peak = heap;
+        if (g_now_ms % ((uint64_t)g_options.interval * 1000) == 0) {
+            uint64_t banned_ips;
+            uint32_t tracked, blocked, banned;
+            security_get_stats(NULL, &banned_ips);
+            security_get_sketch_stats(&tracked, NULL);
+            count_legit_blocked(&blocked, &banned);
+            if (tracked > tracked_peak)
+                tracked_peak = tracked;
+            fprintf(report,
+                    "t=%5llus  decisions %10llu  bots denied %5.1f%%  tracked %8u  bans %8llu  legit blocked %u  "
+                    "heap %+8.1f MiB\n",
+                    (unsigned long long)(g_now_ms / 1000), (unsigned long long)g_decisions,
+                    share(g_bot_denied, g_bot_visits), tracked,
+                    (unsigned long long)banned_ips, blocked, heap);
+        }
+    }
+
+    double wall_s = (now_ns() - wall_start) / 1e9;
+    uint64_t busy_ns = g_latency[OP_CONNECTION].total_ns + g_latency[OP_REQUEST].total_ns;
+    uint64_t banned_ips;
+    uint32_t tracked, blocked, banned;
+    security_get_stats(NULL, &banned_ips);
+    security_get_sketch_stats(&tracked, NULL);
+    count_legit_blocked(&blocked, &banned);
+    double heap_end = heap_growth_mib(heap_base);
+
+    fprintf(report, "\nDecisions: %llu in %.2f s wall (%.0f/s; %.0f/s counting only time in the module)\n",
+            (unsigned long long)g_decisions, wall_s, g_decisions / wall_s, busy_ns ? g_decisions / (busy_ns / 1e9) : 0);
+    fprintf(report, "Bot connections denied: %.1f%% of %llu\n", share(g_bot_denied, g_bot_visits),
+            (unsigned long long)g_bot_visits);
+    fprintf(report, "Bans: %llu; tracked addresses: %u now, %u at most\n", (unsigned long long)banned_ips, tracked,
+            tracked > tracked_peak ? tracked : tracked_peak);
+    fprintf(report, "False positives: %u of %u legit addresses blocked (%u banned), %llu of %llu legit visits denied\n",
+            blocked, g_options.legit, banned, (unsigned long long)g_legit_denied, (unsigned long long)g_legit_visits);
+#ifdef __GLIBC__
+    fprintf(report, "Heap growth: %+.1f MiB at most, %+.1f MiB at the end\n", heap_peak, heap_end);
+#endif
+    fprintf(report, "\n%-18s %12s %9s %9s %9s %9s %11s\n", "Latency (ns)", "count", "mean", "p50", "p99", "p99.9",
+            "max");
+    for (int op = 0; op < NUM_OPS; op++) {
+        const latency_t *latency = g_latency + op;
+        fprintf(report, "%-18s %12llu %9llu %9llu %9llu %9llu %11llu\n", g_op_names[op],
+                (unsigned long long)latency->count,
+                (unsigned long long)(latency->count ? latency->total_ns / latency->count : 0),
+                (unsigned long long)latency_percentile(latency, 0.5),
+                (unsigned long long)latency_percentile(latency, 0.99),
+                (unsigned long long)latency_percentile(latency, 0.999), (unsigned long long)latency->max_ns);
+    }
+
+    security_cleanup();
+    for (size_t i = 0; i < g_close_slots; i++)
+        free(g_close_wheel[i].conns);
+    free(g_close_wheel);
+    free(g_legit_blocked);
+    fclose(report);
+    return 0;
+}
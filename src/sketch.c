@@ -0,0 +1,171 @@
+#include "growtopia/sketch.h"
+#include <stdlib.h>
+#include <string.h>
+
+uint64_t sketch_hash(const void *key, size_t len)
+{
+    const unsigned char *p = key;
+    uint64_t hash = 14695981039346656037ULL;  // FNV-1a
+
+    for (size_t i = 0; i < len; i++) {
+        hash ^= p[i];
+        hash *= 1099511628211ULL;
+    }
+
+    // Final avalanche (splitmix64) so that both halves are usable as independent hashes
+    hash ^= hash >> 30;
+    hash *= 0xbf58476d1ce4e5b9ULL;
+    hash ^= hash >> 27;
+    hash *= 0x94d049bb133111ebULL;
+    hash ^= hash >> 31;
+    return hash;
+}
+
+int count_min_init(count_min_t *cms, uint32_t depth, uint32_t width)
+{
+    uint32_t rounded = 1;
+
+    while (rounded < width)
+        rounded <<= 1;
+
+    cms->depth = depth;
+    cms->width = rounded;
+    cms->counters = calloc((size_t)depth * rounded, sizeof(uint32_t));
+    return cms->counters != NULL ? 0 : -1;
+}
+
+void count_min_free(count_min_t *cms)
+{
+    free(cms->counters);
+    cms->counters = NULL;
+}
+
+// Row i uses h1 + i * h2 (Kirsch-Mitzenmacher double hashing)
+static inline uint32_t cms_index(const count_min_t *cms, uint64_t hash, uint32_t row)
+{
+    uint32_t h1 = (uint32_t)hash, h2 = (uint32_t)(hash >> 32) | 1;
+    return row * cms->width + ((h1 + row * h2) & (cms->width - 1));
+}
+
+uint32_t count_min_estimate(const count_min_t *cms, uint64_t hash)
+{
+    uint32_t estimate = UINT32_MAX;
+
+    for (uint32_t row = 0; row < cms->depth; row++) {
+        uint32_t value = cms->counters[cms_index(cms, hash, row)];
+        if (value < estimate)
+            estimate = value;
+    }
+
+    return estimate;
+}
+
+uint32_t count_min_add(count_min_t *cms, uint64_t hash, uint32_t n)
+{
+    uint32_t estimate = count_min_estimate(cms, hash);
+    uint32_t target = estimate > UINT32_MAX - n ? UINT32_MAX : estimate + n;
+
+    // Conservative update: only raise counters that are below the new estimate
+    for (uint32_t row = 0; row < cms->depth; row++) {
+        uint32_t *counter = &cms->counters[cms_index(cms, hash, row)];
+        if (*counter < target)
+            *counter = target;
+    }
+
+    return target;
+}
+
+void count_min_clear(count_min_t *cms)
+{
+    memset(cms->counters, 0, (size_t)cms->depth * cms->width * sizeof(uint32_t));
+}
+
+int space_saving_init(space_saving_t *ss, uint32_t capacity)
+{
+    ss->items = calloc(capacity, sizeof(space_saving_item_t));
+    ss->capacity = capacity;
+    ss->size = 0;
+    return ss->items != NULL ? 0 : -1;
+}
+
+void space_saving_free(space_saving_t *ss)
+{
+    free(ss->items);
+    ss->items = NULL;
+    ss->capacity = ss->size = 0;
+}
+
+void space_saving_add(space_saving_t *ss, uint64_t hash, const void *key, size_t len, uint32_t n)
+{
+    space_saving_item_t *min_item = NULL;
+
+    if (len > SKETCH_MAX_KEY)
+        len = SKETCH_MAX_KEY;
+
+    for (uint32_t i = 0; i < ss->size; i++) {
+        space_saving_item_t *item = ss->items + i;
+        if (item->hash == hash && item->key_len == len && memcmp(item->key, key, len) == 0) {
+            item->count += n;
+            return;
+        }
+        if (min_item == NULL || item->count < min_item->count)
+            min_item = item;
+    }
+
+    space_saving_item_t *slot;
+    uint32_t inherited = 0;
+    if (ss->size < ss->capacity) {
+        slot = ss->items + ss->size++;
+    } else {
+        // Replace the least frequent key; the newcomer inherits its count as error
+        slot = min_item;
+        inherited = min_item->count;
+    }
+
+    slot->hash = hash;
+    memcpy(slot->key, key, len);
+    slot->key_len = (uint8_t)len;
+    slot->count = inherited + n;
+    slot->error = inherited;
+}
+
+void space_saving_decay(space_saving_t *ss)
+{
+    uint32_t kept = 0;
+
+    for (uint32_t i = 0; i < ss->size; i++) {
+        space_saving_item_t *item = ss->items + i;
+        item->count /= 2;
+        item->error /= 2;
+        if (item->count != 0)
+            ss->items[kept++] = *item;
+    }
+
+    ss->size = kept;
+}
+
+static int compare_items(const void *a, const void *b)
+{
+    const space_saving_item_t *x = a, *y = b;
+    return x->count < y->count ? 1 : x->count > y->count ? -1 : 0;
+}
+
+size_t space_saving_top(const space_saving_t *ss, space_saving_item_t *out, size_t max)
+{
+    size_t n = ss->size;
+
+    if (n == 0 || max == 0)
+        return 0;
+
+    space_saving_item_t *sorted = malloc(n * sizeof(*sorted));
+    if (sorted == NULL)
+        return 0;
+    memcpy(sorted, ss->items, n * sizeof(*sorted));
+    qsort(sorted, n, sizeof(*sorted), compare_items);
+
+    if (n > max)
+        n = max;
+    memcpy(out, sorted, n * sizeof(*out));
+    free(sorted);
+    return n;
+}
@@ -0,0 +1,320 @@
+#include "growtopia/stream.h"
+#include "growtopia/bufpool.h"
+#include <errno.h>
+#include <h2o.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define MIN_CHUNK_SIZE 1024
+
+enum {
+    STREAM_SENDING,                      // h2o holds the chunk buffer until it calls proceed
+    STREAM_WAITING,                      // The producer had nothing ready; stream_resume() reads it again
+    STREAM_DONE                          // The producer has been closed
+};
+
+struct stream {
+    h2o_generator_t super;
+    h2o_req_t *req;
+    stream_producer_t *producer;
+    char *buf;                           // The only body memory a stream holds, reused for every chunk
+    size_t cap;
+    int state;
+};
+
+typedef struct {
+    stream_producer_t super;
+    int fd;
+    off_t off;
+    size_t remaining;
+} file_producer_t;
+
+typedef struct {
+    stream_producer_t super;
+    int (*next)(void *ctx, h2o_iovec_t *item);
+    void *ctx;
+    h2o_iovec_t item;                    // Current item, copied out from off
+    size_t off;
+} iterator_producer_t;
+
+/* shared by the writer and the stream; freed when both have let go */
+struct stream_ring {
+    stream_producer_t super;
+    stream_t *stream;                    // NULL once the response has ended
+    void (*on_writable)(void *ctx);
+    void *ctx;
+    char *data;
+    size_t capacity;
+    size_t head;                         // Next byte to read
+    size_t size;
+    int refs;
+    int writer_closed;
+    int error;
+    int want_writable;                   // A write was refused for lack of space
+};
+
+static stream_config_t g_config;
+
+/* statistics */
+static uint64_t g_started = 0;
+static uint64_t g_completed = 0;
+static uint64_t g_canceled = 0;
+static uint64_t g_failed = 0;
+static uint64_t g_bytes = 0;
+
+int stream_init(const stream_config_t *config)
+{
+    g_config = config ? *config : stream_get_default_config();
+    if (g_config.chunk_size < MIN_CHUNK_SIZE)
+        g_config.chunk_size = MIN_CHUNK_SIZE;
+
+    printf("Streaming: %u KiB chunks\n", g_config.chunk_size / 1024);
+    return 0;
+}
+
+static void end_stream(stream_t *stream, int completed)
+{
+    stream->state = STREAM_DONE;
+    if (stream->producer->close != NULL)
+        stream->producer->close(stream->producer, completed);
+}
+
+static void send_next(stream_t *stream)
+{
+    h2o_req_t *req = stream->req;
+    int eos = 0;
+    ssize_t len = stream->producer->read(stream->producer, stream->buf, stream->cap, &eos);
+
+    if (len < 0) {
+        g_failed++;
+        end_stream(stream, 0);
+        h2o_send(req, NULL, 0, H2O_SEND_STATE_ERROR);
+        return;
+    }
+    if (len == 0 && !eos) {
+        stream->state = STREAM_WAITING;
+        return;
+    }
+
+    g_bytes += len;
+    if (eos) {
+        g_completed++;
+        end_stream(stream, 1);
+    } else {
+        stream->state = STREAM_SENDING;
+    }
+    h2o_iovec_t chunk = h2o_iovec_init(stream->buf, len);
+    h2o_send(req, &chunk, len != 0, eos ? H2O_SEND_STATE_FINAL : H2O_SEND_STATE_IN_PROGRESS);
+}
+
+/* h2o has written out the previous chunk and the peer can take more */
+static void on_proceed(h2o_generator_t *self, h2o_req_t *req)
+{
+    stream_t *stream = (stream_t *)self;
+
+    if (stream->state == STREAM_SENDING)
+        send_next(stream);
+}
+
+/* the client went away before the body was complete */
+static void on_stop(h2o_generator_t *self, h2o_req_t *req)
+{
+    stream_t *stream = (stream_t *)self;
+
+    if (stream->state != STREAM_DONE) {
+        g_canceled++;
+        end_stream(stream, 0);
+    }
+}
+
+static void on_dispose(void *_stream)
+{
+    on_stop(_stream, NULL);
+}
+
+stream_t *stream_start(h2o_req_t *req, const response_template_t *tmpl, stream_producer_t *producer)
+{
+    stream_t *stream = h2o_mem_alloc_shared(&req->pool, sizeof(*stream), on_dispose);
+
+    stream->super.proceed = on_proceed;
+    stream->super.stop = on_stop;
+    stream->req = req;
+    stream->producer = producer;
+    stream->cap = g_config.chunk_size != 0 ? g_config.chunk_size : MIN_CHUNK_SIZE;
+    stream->buf = bufpool_alloc(req, stream->cap);
+    stream->state = STREAM_SENDING;
+    g_started++;
+
+    response_template_start(tmpl, req, &stream->super);
+    send_next(stream);
+    return stream;
+}
+
+void stream_resume(stream_t *stream)
+{
+    if (stream->state == STREAM_WAITING)
+        send_next(stream);
+}
+
+static ssize_t read_file(stream_producer_t *_self, char *buf, size_t cap, int *eos)
+{
+    file_producer_t *self = (file_producer_t *)_self;
+    size_t len = self->remaining < cap ? self->remaining : cap;
+    ssize_t rret;
+
+    while ((rret = pread(self->fd, buf, len, self->off)) == -1 && errno == EINTR)
+        ;
+    if (rret < 0 || (rret == 0 && len != 0))
+        return -1;                       // The file shrank under us
+    self->off += rret;
+    self->remaining -= rret;
+    *eos = self->remaining == 0;
+    return rret;
+}
+
+static void close_file(stream_producer_t *_self, int completed)
+{
+    close(((file_producer_t *)_self)->fd);
+}
+
+stream_producer_t *stream_file_producer(h2o_req_t *req, int fd, off_t off, size_t len)
+{
+    file_producer_t *self = h2o_mem_alloc_pool(&req->pool, file_producer_t, 1);
+
+    *self = (file_producer_t){{read_file, close_file}, fd, off, len};
+    return &self->super;
+}
+
+static ssize_t read_iterator(stream_producer_t *_self, char *buf, size_t cap, int *eos)
+{
+    iterator_producer_t *self = (iterator_producer_t *)_self;
+    size_t len = 0;
+
+    while (len < cap) {
+        if (self->off == self->item.len) {
+            int ret = self->next(self->ctx, &self->item);
+            if (ret < 0)
+                return -1;
+            if (ret == 0) {
+                *eos = 1;
+                break;
+            }
+            self->off = 0;
+            continue;
+        }
+        size_t n = self->item.len - self->off < cap - len ? self->item.len - self->off : cap - len;
+        memcpy(buf + len, self->item.base + self->off, n);
+        self->off += n;
+        len += n;
+    }
+    return len;
+}
+
+stream_producer_t *stream_iterator_producer(h2o_req_t *req, int (*next)(void *ctx, h2o_iovec_t *item), void *ctx)
+{
+    iterator_producer_t *self = h2o_mem_alloc_pool(&req->pool, iterator_producer_t, 1);
+
+    *self = (iterator_producer_t){{read_iterator, NULL}, next, ctx};
+    return &self->super;
+}
+
+static void release_ring(stream_ring_t *ring)
+{
+    if (--ring->refs == 0)
+        free(ring);
+}
+
+static ssize_t read_ring(stream_producer_t *_self, char *buf, size_t cap, int *eos)
+{
+    stream_ring_t *ring = (stream_ring_t *)_self;
+    size_t len = ring->size < cap ? ring->size : cap, first = ring->capacity - ring->head;
+
+    if (ring->error)
+        return -1;
+    if (first > len)
+        first = len;
+    memcpy(buf, ring->data + ring->head, first);
+    memcpy(buf + first, ring->data, len - first);
+    ring->head = (ring->head + len) % ring->capacity;
+    ring->size -= len;
+    *eos = ring->writer_closed && ring->size == 0;
+
+    if (len != 0 && ring->want_writable && !ring->writer_closed) {
+        ring->want_writable = 0;
+        if (ring->on_writable != NULL)
+            ring->on_writable(ring->ctx);
+    }
+    return len;
+}
+
+static void close_ring(stream_producer_t *_self, int completed)
+{
+    stream_ring_t *ring = (stream_ring_t *)_self;
+
+    ring->stream = NULL;
+    /* a writer waiting for space would wait forever; its next write fails and it closes the ring */
+    if (!completed && !ring->writer_closed && ring->on_writable != NULL)
+        ring->on_writable(ring->ctx);
+    release_ring(ring);
+}
+
+stream_ring_t *stream_start_ring(h2o_req_t *req, const response_template_t *tmpl, size_t capacity,
+                                 void (*on_writable)(void *ctx), void *ctx)
+{
+    stream_ring_t *ring;
+
+    if (capacity == 0 || (ring = malloc(sizeof(*ring) + capacity)) == NULL)
+        return NULL;
+    *ring = (stream_ring_t){{read_ring, close_ring}, NULL, on_writable, ctx, (char *)(ring + 1), capacity};
+    ring->refs = 2;
+
+    /* the first read finds nothing and leaves the stream waiting for the writer */
+    ring->stream = stream_start(req, tmpl, &ring->super);
+    return ring;
+}
+
+ssize_t stream_ring_write(stream_ring_t *ring, const void *data, size_t len)
+{
+    if (ring->stream == NULL)
+        return -1;
+
+    size_t tail = (ring->head + ring->size) % ring->capacity, n = ring->capacity - ring->size, first;
+    if (n > len)
+        n = len;
+    first = ring->capacity - tail < n ? ring->capacity - tail : n;
+    memcpy(ring->data + tail, data, first);
+    memcpy(ring->data, (const char *)data + first, n - first);
+    ring->size += n;
+
+    if (n != 0)
+        stream_resume(ring->stream);
+    /* set after resuming, so that a read it triggers does not call back into this write */
+    if (n < len)
+        ring->want_writable = 1;
+    return n;
+}
+
+void stream_ring_close(stream_ring_t *ring, int error)
+{
+    ring->writer_closed = 1;
+    ring->error = error;
+    if (ring->stream != NULL)
+        stream_resume(ring->stream);
+    release_ring(ring);
+}
+
+void stream_get_stats(uint64_t *started, uint64_t *completed, uint64_t *canceled, uint64_t *failed, uint64_t *bytes)
+{
+    if (started)
+        *started = g_started;
+    if (completed)
+        *completed = g_completed;
+    if (canceled)
+        *canceled = g_canceled;
+    if (failed)
+        *failed = g_failed;
+    if (bytes)
+        *bytes = g_bytes;
+}
@@ -0,0 +1,121 @@
+#include "growtopia/tls.h"
+#include "growtopia/trace.h"
+#include <openssl/bio.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static int g_counted_index = -1;         // SSL ex_data slot marking connections already counted
+static int g_start_index = -1;           // SSL ex_data slot holding the handshake start time while traced
+static uint64_t g_ktls_connections = 0;
+static uint64_t g_userspace_connections = 0;
+static uint64_t g_ecdsa_handshakes = 0;
+static uint64_t g_rsa_handshakes = 0;
+
+static int kernel_supports_ktls(void)
+{
+    char ulps[256];
+    FILE *fp = fopen("/proc/sys/net/ipv4/tcp_available_ulp", "r");
+    int found = 0;
+
+    if (fp == NULL)
+        return 0;
+    if (fgets(ulps, sizeof(ulps), fp) != NULL) {
+        for (char *tok = strtok(ulps, " \n"); tok != NULL; tok = strtok(NULL, " \n")) {
+            if (strcmp(tok, "tls") == 0)
+                found = 1;
+        }
+    }
+    fclose(fp);
+    return found;
+}
+
+static void on_ssl_info(const SSL *ssl, int where, int ret)
+{
+    if ((where & SSL_CB_HANDSHAKE_START) != 0 && GROWTOPIA_TRACE_ENABLED(handshake_done) &&
+        SSL_get_ex_data(ssl, g_start_index) == NULL) {
+        SSL_set_ex_data((SSL *)ssl, g_start_index, (void *)(uintptr_t)growtopia_trace_now_ns());
+        return;
+    }
+    if ((where & SSL_CB_HANDSHAKE_DONE) == 0 || SSL_get_ex_data(ssl, g_counted_index) != NULL)
+        return;
+    SSL_set_ex_data((SSL *)ssl, g_counted_index, (void *)1);
+
+    /* resumed sessions present no certificate */
+    int resumed = SSL_session_reused(ssl), cert_type = GROWTOPIA_TRACE_CERT_OTHER, ktls = 0;
+    EVP_PKEY *key = resumed ? NULL : X509_get0_pubkey(SSL_get_certificate(ssl));
+    if (key != NULL && EVP_PKEY_get_base_id(key) == EVP_PKEY_EC) {
+        g_ecdsa_handshakes++;
+        cert_type = GROWTOPIA_TRACE_CERT_ECDSA;
+    } else if (key != NULL && EVP_PKEY_get_base_id(key) == EVP_PKEY_RSA) {
+        g_rsa_handshakes++;
+        cert_type = GROWTOPIA_TRACE_CERT_RSA;
+    }
+
+#ifdef BIO_get_ktls_send
+    ktls = BIO_get_ktls_send(SSL_get_wbio(ssl)) != 0;
+#endif
+    if (ktls)
+        g_ktls_connections++;
+    else
+        g_userspace_connections++;
+
+    /* handshakes already running when the probe was attached have no start time */
+    if (GROWTOPIA_TRACE_ENABLED(handshake_done)) {
+        uintptr_t start = (uintptr_t)SSL_get_ex_data(ssl, g_start_index);
+        if (start != 0)
+            GROWTOPIA_TRACE(handshake_done, ssl, cert_type, ktls, resumed, growtopia_trace_now_ns() - start);
+    }
+}
+
+static int enable_ktls(SSL_CTX *ssl_ctx)
+{
+#ifdef SSL_OP_ENABLE_KTLS
+    if (!kernel_supports_ktls()) {
+        fprintf(stderr, "kTLS requested but the kernel tls module is not available; using user-space TLS\n");
+        return -1;
+    }
+    /* the configured ciphers stay; OpenSSL only offloads connections that negotiate a suite the kernel has */
+    SSL_CTX_set_options(ssl_ctx, SSL_OP_ENABLE_KTLS);
+    return 0;
+#else
+    fprintf(stderr, "kTLS requested but OpenSSL was built without it; using user-space TLS\n");
+    return -1;
+#endif
+}
+
+int tls_init(SSL_CTX *ssl_ctx, const tls_config_t *config)
+{
+    tls_config_t conf = config ? *config : tls_get_default_config();
+
+    if (g_counted_index == -1 && (g_counted_index = SSL_get_ex_new_index(0, NULL, NULL, NULL, NULL)) == -1) {
+        fprintf(stderr, "Failed to allocate SSL ex_data index\n");
+        return -1;
+    }
+    if (g_start_index == -1 && (g_start_index = SSL_get_ex_new_index(0, NULL, NULL, NULL, NULL)) == -1) {
+        fprintf(stderr, "Failed to allocate SSL ex_data index\n");
+        return -1;
+    }
+    SSL_CTX_set_info_callback(ssl_ctx, on_ssl_info);
+
+    /* OpenSSL only installs kernel keys on a socket BIO it owns, and h2o drives TLS through its own BIO, so the
+     * option cannot take effect under h2o today; the kTLS counter on /security-stats is what tells */
+    if (conf.enable_ktls && enable_ktls(ssl_ctx) == 0)
+        printf("kTLS requested: SSL_OP_ENABLE_KTLS set, but it has no effect under h2o's TLS layer; "
+               "connections stay in user space (see the kTLS counter on /security-stats)\n");
+
+    return 0;
+}
+
+void tls_get_stats(uint64_t *ktls_connections, uint64_t *userspace_connections, uint64_t *ecdsa_handshakes,
+                   uint64_t *rsa_handshakes)
+{
+    if (ktls_connections)
+        *ktls_connections = g_ktls_connections;
+    if (userspace_connections)
+        *userspace_connections = g_userspace_connections;
+    if (ecdsa_handshakes)
+        *ecdsa_handshakes = g_ecdsa_handshakes;
+    if (rsa_handshakes)
+        *rsa_handshakes = g_rsa_handshakes;
+}
@@ -0,0 +1,14 @@
+#include "growtopia/trace.h"
+
+#if GROWTOPIA_USE_USDT
+
+/*
+ * Semaphores for the probes in trace.h. They live in .probes so the tracer can find them through
+ * the stapsdt notes and raise them while attached.
+ */
+#define GROWTOPIA_DEFINE_SEMAPHORE(name)                                                                               \
+    unsigned short growtopia_##name##_semaphore __attribute__((unused, section(".probes")));
+GROWTOPIA_PROBES(GROWTOPIA_DEFINE_SEMAPHORE)
+#undef GROWTOPIA_DEFINE_SEMAPHORE
+
+#endif